@@ -27,6 +27,11 @@
 # include <stdlib.h>
 # include <string.h>
 # include <math.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
 # include "3ds.h"
 # include "loadTexture.h"
 
@@ -38,37 +43,207 @@
 // that is stored in that chunk.  If you do not want to read that information,
 // you read past it.  You know how many bytes to read past the chunk because
 // every chunk stores the length in bytes of that chunk.
+//
+// The whole file is mapped into memory and read through a tReader, which
+// never lets a read go past the end of the chunk it is reading.  There
+// is no other state, so any number of files can be read at once from
+// different threads, and a bad or truncated file is an error return
+// rather than the end of the program.
+
+# if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || \
+     defined(__i386__) || defined(__x86_64__)
+/* the file's byte order - arrays can be copied straight out of it */
+# define LITTLE_ENDIAN_HOST
+# endif
+
+/*
+  Where we are in a chunk of the mapped file
+*/
+struct tReader {
+  const unsigned char *p;                 // the next byte to read
+  const unsigned char *end;               // the end of the chunk
+  const char *file;                       // the file, for messages
+};
 
 /* forward definitions */
-static void ProcessNextChunk(struct t3DModel *pModel, struct tChunk *pPreviousChunk);
-static void ProcessNextObjectChunk(struct t3DModel *pModel, struct t3DObject *pObject,
-				   struct tChunk *pPreviousChunk);
-static void ProcessNextMaterialChunk(struct t3DModel *pModel, struct tChunk *pPreviousChunk);
-static void ReadChunk(struct tChunk *pChunk);
-static int GetString(char *pBuffer);
-static void ReadColorChunk(struct tMaterialInfo *pMaterial, struct tChunk *pChunk);
-static void ReadUVCoordinates(struct t3DObject *pObject, struct tChunk *pPreviousChunk);
-static void ReadVertexIndices(struct t3DObject *pObject, struct tChunk *pPreviousChunk);
-static void ReadVertices(struct t3DObject *pObject, struct tChunk *pPreviousChunk);
-static void ReadObjectMaterial (struct t3DModel *pModel, struct t3DObject *pObject,
-				struct tChunk *pPreviousChunk);
-static void ComputeNormals (struct t3DModel *pModel);
+static int ReadMain(struct t3DModel *pModel, struct tReader *r);
+static int ReadMaterial(struct t3DModel *pModel, struct tMaterialInfo *pMaterial,
+			struct tReader *r);
+static int ReadObject(struct t3DModel *pModel, struct t3DObject *pObject, struct tReader *r);
+static int BuildMesh(struct t3DModel *pModel, struct t3DObject *pObject, float cosCrease);
 static void ScaleAndCenter (struct t3DModel *pModel );
 
-static int read_int(unsigned int *v);
-static int read_short(unsigned short *v);
-static int read_float(float *v);
+static int Fail(struct tReader *r, const char *what)
+{
+  fprintf(stderr,"Import3DS: %s: %s\n", r->file, what);
+  return -1;
+}
 
+static int get_short(struct tReader *r, unsigned short *v)
+{
+  if(r->end - r->p < 2)
+    return -1;
+  *v = r->p[0] | (r->p[1] << 8);
+  r->p += 2;
+  return 0;
+}
+
+static int get_int(struct tReader *r, unsigned int *v)
+{
+  if(r->end - r->p < 4)
+    return -1;
+  *v = r->p[0] | (r->p[1] << 8) | (r->p[2] << 16) | ((unsigned int)r->p[3] << 24);
+  r->p += 4;
+  return 0;
+}
 
-static unsigned char *buffer = (unsigned char *)NULL; 
-static FILE *m_FilePointer;
+/*
+  n 4 byte values (floats or ints) in one go
+*/
+static int get_array32(struct tReader *r, void *v, int n)
+{
+  if(n < 0 || (r->end - r->p) / 4 < n)
+    return -1;
+# ifdef LITTLE_ENDIAN_HOST
+  memcpy(v, r->p, 4 * (size_t)n);
+  r->p += 4 * (size_t)n;
+# else
+  {
+    unsigned int *u = (unsigned int *)v;
+    int i;
+    for(i = 0; i < n; i++, r->p += 4)
+      u[i] = r->p[0] | (r->p[1] << 8) | (r->p[2] << 16) | ((unsigned int)r->p[3] << 24);
+  }
+# endif
+  return 0;
+}
+
+/*
+  A NUL terminated string, cut short if it does not fit in size bytes
+*/
+static int get_string(struct tReader *r, char *s, int size)
+{
+  const unsigned char *q;
+  int n;
+
+  if((q = (const unsigned char *)memchr(r->p, 0, r->end - r->p)) == NULL)
+    return -1;
+  n = q - r->p;
+  if(n >= size)
+    n = size - 1;
+  memcpy(s, r->p, n);
+  s[n] = '\0';
+  r->p = q + 1;
+  return 0;
+}
+
+/*
+  The header of the next chunk - its ID and a reader for what is in it.
+  A chunk that claims to run past the end of the one it is in (a
+  truncated file, usually) is cut short there.
+*/
+static int get_chunk(struct tReader *r, unsigned short *id, struct tReader *sub)
+{
+  unsigned int len;
+
+  if(get_short(r, id) < 0 || get_int(r, &len) < 0 || len < 6)
+    return -1;
+  sub->p = r->p;
+  sub->file = r->file;
+  if(len - 6 > (unsigned int)(r->end - r->p))
+    sub->end = r->end;
+  else
+    sub->end = r->p + (len - 6);
+  r->p = sub->end;
+  return 0;
+}
+
+/*
+  Empty the model, freeing everything in it
+*/
+void Free3DS (struct t3DModel *pModel)
+{
+  struct t3DObject *pObject;
+  struct tMaterialInfo *p;
+
+  while((pObject = pModel->pObject) != (struct t3DObject *)NULL) {
+    pModel->pObject = pObject->next;
+    free(pObject->pVerts);
+    free(pObject->pNormals);
+    free(pObject->pTexVerts);
+    free(pObject->pFaces);
+    free(pObject->pSmooth);
+    if(pObject->pMesh != (struct tMesh *)NULL) {
+      free(pObject->pMesh->pData);
+      free(pObject->pMesh->pIndices);
+      free(pObject->pMesh->pBatches);
+      free(pObject->pMesh);
+    }
+    free(pObject);
+  }
+  while((p = pModel->pMaterials) != (struct tMaterialInfo *)NULL) {
+    pModel->pMaterials = p->next;
+    free(p);
+  }
+  pModel->numOfObjects = 0;
+  pModel->numOfMaterials = 0;
+}
 
 int Import3DS (struct t3DModel *pModel,  char * root, char * strFileName)
 {
-  char buf[512];
-  struct tChunk * m_CurrentChunk;
+  return Import3DSSmooth(pModel, root, strFileName, DEFAULT_CREASE_ANGLE);
+}
+
+/*
+  As Import3DS(), but for objects without smoothing groups, faces
+  meeting at more than creaseAngle degrees get separate normals (0 for
+  a faceted look, 180 to smooth everything).
+*/
+int Import3DSSmooth (struct t3DModel *pModel,  char * root, char * strFileName,
+		     float creaseAngle)
+{
   struct tMaterialInfo *p;
-  int i;
+
+  if(Parse3DS(pModel, root, strFileName, creaseAngle) < 0)
+    return -1;
+
+  /*
+    Load the textures and bind them appropriately
+  */
+  for(p=pModel->pMaterials;p!= (struct tMaterialInfo *)NULL;p=p->next) {
+# ifdef DEBUG
+    fprintf(stderr,"Import3DS: Processing texture %s\n",p->strName);
+    if(*(p->strFile))
+      fprintf(stderr, "Import3DS: Its a texture in %s\n",p->strFile);
+    else
+      fprintf(stderr, "Import3DS: Its colour 0x%x 0x%x 0x%x\n",p->color[0], p->color[1], p->color[2]);
+# endif
+    if(*(p->strFile))
+      p->id = loadTexture(root, p->strFile);
+# ifdef DEBUG
+    fprintf(stderr, "Import3DS: Processed\n");
+# endif
+  }
+  return 1;
+}
+
+/*
+  Everything Import3DSSmooth() does but load the textures (the id of
+  every material is 0).  It uses no GL, txm or other shared state, so
+  it can be called from any thread.  Returns 1, or -1 with the model
+  empty if the file cannot be read.
+*/
+int Parse3DS (struct t3DModel *pModel, char * root, char * strFileName, float creaseAngle)
+{
+  char buf[1024];
+  const unsigned char *data;
+  struct tReader r, primary;
+  struct t3DObject *pObject;
+  struct stat st;
+  unsigned short id;
+  size_t size, got;
+  ssize_t n;
+  int fd, mapped = 1, ok;
 
 # ifdef DEBUG
   fprintf(stderr,"Import3DS called with filename %s\n", strFileName);
@@ -80,637 +255,386 @@ int Import3DS (struct t3DModel *pModel,  char * root, char * strFileName)
   pModel->pObject = (struct t3DObject *)NULL;
   pModel->pMaterials = (struct tMaterialInfo *)NULL;
 
-  /* and lets start processing the file */
-  sprintf(buf, "%s/%s",root, strFileName);
-  if((m_FilePointer = fopen(buf, "r")) == (FILE *)NULL) {
+  /* map the file */
+  snprintf(buf, sizeof(buf), "%s/%s",root, strFileName);
+  if((fd = open(buf, O_RDONLY)) < 0) {
     fprintf(stderr,"Import3DS: Opening of |%s| failed\n",buf);
     return(-1);
   }
-
-  /*
-    Once we have the file open, we need to read the very first data chunk
-    to see if it's a 3DS file.  That way we don't read an invalid file.
-    
-    If it is a 3DS file, then the first chunk ID will be equal to PRIMARY (some hex num)
-    Read the first chuck of the file to see if it's a 3DS file
-  */
-  if((m_CurrentChunk = (struct tChunk *) malloc(sizeof(struct tChunk))) == (struct tChunk *)NULL) {
-    fprintf(stderr,"Out of memory in Import3DS?\n");
+  if(fstat(fd, &st) < 0 || st.st_size < 6) {
+    fprintf(stderr,"Import3DS: |%s| is not a 3DS file\n",buf);
+    close(fd);
     return(-1);
   }
-# ifdef DEBUG
-  fprintf(stderr,"Import3DS reading first chunk\n");
-# endif
-  ReadChunk( m_CurrentChunk );
-    
-  /* Make sure this is a 3DS file */
-  if (m_CurrentChunk->ID != PRIMARY ) return -1;
-# ifdef DEBUG
-  fprintf(stderr,"Import3DS primary header found\n");
+  size = st.st_size;
+  data = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(data == (const unsigned char *)MAP_FAILED) {
+    /* some file systems cannot be mapped - read it instead */
+    mapped = 0;
+    if((data = (const unsigned char *)malloc(size)) != NULL) {
+      for(got = 0; got < size && (n = read(fd, (void *)(data + got), size - got)) > 0; got += n)
+	;
+      if(got < size) {
+	free((void *)data);
+	data = NULL;
+      }
+    }
+    if(data == NULL) {
+      fprintf(stderr,"Import3DS: Reading of |%s| failed\n",buf);
+      close(fd);
+      return(-1);
+    }
+  }
+# ifdef MADV_SEQUENTIAL
+  else
+    madvise((void *)data, size, MADV_SEQUENTIAL);
 # endif
+  close(fd);
 
   /*
-    Now we actually start reading in the data.  ProcessNextChunk() is recursive
-    Begin loading objects, by calling this recursive function
+    The very first chunk must be PRIMARY (some hex num) if it is a 3DS file,
+    and everything else is in it.
   */
-  ProcessNextChunk(pModel, m_CurrentChunk);
+  r.p = data;
+  r.end = data + size;
+  r.file = buf;
+  if(get_chunk(&r, &id, &primary) < 0 || id != PRIMARY)
+    ok = Fail(&r, "not a 3DS file");
+  else {
+    // the length of PRIMARY is the length of the file
+    if(data[2] + (data[3] << 8) + (data[4] << 16) + ((size_t)data[5] << 24) > size)
+      fprintf(stderr,"Import3DS: %s: file is shorter than it says (truncated?)\n", buf);
+    ok = ReadMain(pModel, &primary);
+  }
+  if(mapped)
+    munmap((void *)data, size);
+  else
+    free((void *)data);
+  if(ok < 0) {
+    Free3DS(pModel);
+    return -1;
+  }
 # ifdef DEBUG
   fprintf(stderr,"Import3DS File processed\n");
 # endif
-  (void) free(m_CurrentChunk);
-  fclose (m_FilePointer);
 
-  /* After we have read the whole 3DS file, we want to calculate our own vertex normals. */
-  ComputeNormals ( pModel );
+  /*
+    After we have read the whole 3DS file, we want to calculate our own vertex normals,
+    and build the vertices and indices that are actually drawn.
+  */
+  for(pObject=pModel->pObject; pObject != (struct t3DObject *)NULL; pObject=pObject->next)
+    BuildMesh(pModel, pObject, (float) cos(creaseAngle * M_PI / 180.0));
     
   /*
     Added by Colossus: let's calculate the scale and the center coordinates to let the object
     fit in the center of the window
   */
   ScaleAndCenter (pModel);
-    
-  /*
-    Load the textures and bind them appropriately
-  */
-
-  for(p=pModel->pMaterials;p!= (struct tMaterialInfo *)NULL;p=p->next) {
-# ifdef DEBUG
-    fprintf(stderr,"Import3DS: Processing texture %s\n",p->strName);
-    if(*(p->strFile))
-      fprintf(stderr, "Import3DS: Its a texture in %s\n",p->strFile);
-    else
-      fprintf(stderr, "Import3DS: Its colour 0x%x 0x%x 0x%x\n",p->color[0], p->color[1], p->color[2]);
-# endif
-    if(*(p->strFile))
-      p->id = loadTexture(root, p->strFile);
-# ifdef DEBUG
-    fprintf(stderr, "Import3DS: Processed\n");
-# endif
-  }
   return 1;
 }
 
 /*
-  This function reads the main sections of the .3DS file, then dives deeper with recursion
+  The main sections of the file - the contents of PRIMARY and OBJECTINFO
 */
-static void ProcessNextChunk(struct t3DModel *pModel, struct tChunk *pPreviousChunk)
+static int ReadMain(struct t3DModel *pModel, struct tReader *r)
 {
-  struct t3DObject *newObject;			// This is used to add to our object list
-  struct tMaterialInfo *newTexture;		// This is used to add to our material list
-  struct tChunk *m_CurrentChunk;                 // out next chunk
-  struct tChunk *m_TempChunk;                    // a temporary chunk
-  unsigned int version = 0;			// This will hold the file version
-
-  if((m_CurrentChunk = (struct tChunk *) malloc(sizeof(struct tChunk))) == (struct tChunk *)NULL) {
-    fprintf(stderr,"Out of memory in ProcessNextChunk?\n");
-    exit(1);
-  }
-  if((m_TempChunk = (struct tChunk *) malloc(sizeof(struct tChunk))) == (struct tChunk *)NULL) {
-    fprintf(stderr,"Out of memory in ProcessNextChunk?\n");
-    exit(1);
-  }
-
+  struct tReader c;
+  struct t3DObject *newObject;
+  struct tMaterialInfo *newTexture;
+  unsigned short id;
+  unsigned int version;
+
+  while(r->p < r->end) {
+    if(get_chunk(r, &id, &c) < 0)
+      return Fail(r, "bad chunk header");
 # ifdef DEBUG
-  fprintf(stderr,"ProcessNextChunk: processing a chunk\n");
+    fprintf(stderr,"ReadMain: got chunk 0x%x len %d\n", id, (int)(c.end - c.p));
 # endif
-
-  // Below we check our chunk ID each time we read a new chunk.  Then, if
-  // we want to extract the information from that chunk, we do so.
-  // If we don't want a chunk, we just read past it.  
-	
-  // Continue to read the sub chunks until we have reached the length.
-  // After we read ANYTHING we add the bytes read to the chunk and then check
-  // check against the length.
-	
-  while (pPreviousChunk->bytesRead < pPreviousChunk->length){
-    // Read next Chunk
-    ReadChunk(m_CurrentChunk);
-    // Check the chunk ID
-# ifdef DEBUG
-    fprintf(stderr,"ProcessNextChunk: got chunk 0x%x len %d read %d\n", m_CurrentChunk->ID,
-	    m_CurrentChunk->length, m_CurrentChunk->bytesRead);
-# endif
-    switch (m_CurrentChunk->ID) {
+    switch (id) {
     case VERSION:   // This holds the version of the file
-# ifdef DEBUG
-      fprintf(stderr,"ProcessNextChunk: processing VERSION len %d read %d\n",
-	      m_CurrentChunk->length, m_CurrentChunk->bytesRead);
-# endif
-      // This chunk has an unsigned short that holds the file version.
-      // Since there might be new additions to the 3DS file format in 4.0,
-      // we give a warning to that problem.
-
-      // Read the file version and add the bytes read to our bytesRead variable
-      if((m_CurrentChunk->length - m_CurrentChunk->bytesRead) !=  4) {
-	fprintf(stderr,"ProcessNextChunk: version chunk incorrect format\n");
-	exit(1);
-      }
-      m_CurrentChunk->bytesRead += read_int(&version);
-                	
       // If the file version is over 3, give a warning that there could be a problem
+      if(get_int(&c, &version) < 0)
+	return Fail(&c, "version chunk incorrect format");
       if (version > 0x03)
 	fprintf (stderr, "This 3DS file is over version 3(%d) so it may load incorrectly\n", version);
       break;
-    case OBJECTINFO:   // This holds the version of the mesh
-# ifdef DEBUG
-    fprintf(stderr,"ProcessNextChunk: processing OBJECTINFO\n");
-# endif
-      // This chunk holds the version of the mesh.  It is also the head of the MATERIAL
-      // and OBJECT chunks.  From here on we start reading in the material and object info.
-
-      // Read the next chunk
-      ReadChunk(m_TempChunk);
-
-      // Get the version of the mesh
-      m_TempChunk->bytesRead += read_int(&version);
-      
-      // Increase the bytesRead by the bytes read from the last chunk
-      m_CurrentChunk->bytesRead += m_TempChunk->bytesRead;
-
-      // Go to the next chunk, which if the object has a texture, it should be MATERIAL, then OBJECT.
-      ProcessNextChunk(pModel, m_CurrentChunk);
+    case OBJECTINFO:   // This holds the version of the mesh, then the materials and objects
+      if(ReadMain(pModel, &c) < 0)
+	return -1;
       break;
-    case MATERIAL:                          // This holds the material information
-# ifdef DEBUG
-    fprintf(stderr,"ProcessNextChunk: processing MATERIAL\n");
-# endif
-      // This chunk is the header for the material info chunks
-      // Increase the number of materials
-      pModel->numOfMaterials++;
-
-      // create a newTexture
-      if((newTexture = (struct tMaterialInfo *)malloc(sizeof(struct tMaterialInfo))) ==
-	 (struct tMaterialInfo *)NULL) {
-	fprintf(stderr,"Out of memory in ProcessNextChunk?\n");
-	exit(1);
-      }
+    case MATERIAL:     // This holds the material information
+      if((newTexture = (struct tMaterialInfo *)calloc(1, sizeof(struct tMaterialInfo))) ==
+	 (struct tMaterialInfo *)NULL)
+	return Fail(r, "out of memory");
+      newTexture->uTile = newTexture->vTile = 1.0;
       newTexture->next = pModel->pMaterials;
-      newTexture->strName[0] = '\0';
-      newTexture->strFile[0] ='\0';
       pModel->pMaterials = newTexture;
-      ProcessNextMaterialChunk(pModel, m_CurrentChunk);
+      pModel->numOfMaterials++;
+      if(ReadMaterial(pModel, newTexture, &c) < 0)
+	return -1;
       break;
-    case OBJECT:                            // This holds the name of the object being read
-# ifdef DEBUG
-    fprintf(stderr,"ProcessNextChunk: processing OBJECT\n");
-# endif
-      // This chunk is the header for the object info chunks.  It also
-      // holds the name of the object.
-       
-      // Add a new tObject node to our list of objects (like a link list)
-      if((newObject = (struct t3DObject *)malloc(sizeof(struct t3DObject))) ==
-	 (struct t3DObject *)NULL) {
-	fprintf(stderr,"Out of memory in ProcessNextChunk?\n");
-	exit(1);
-      }
-
-      /* create an empty object */
-      newObject->numOfVerts = 0;
-      newObject->numOfFaces = 0;
-      newObject->numTexVertex = 0;
-      newObject->strName[0] = '\0';
-      newObject->pVerts = (struct CVector3 *)NULL;
-      newObject->pNormals = (struct CVector3 *)NULL;
-      newObject->pTexVerts = (struct CVector2 *)NULL;
+    case OBJECT:       // This holds the name of the object, then what it is
+      if((newObject = (struct t3DObject *)calloc(1, sizeof(struct t3DObject))) ==
+	 (struct t3DObject *)NULL)
+	return Fail(r, "out of memory");
       newObject->next = pModel->pObject;
       pModel->pObject = newObject;
-
-      // Get the name of the object and store it, then add the read bytes to our byte counter.
-      m_CurrentChunk->bytesRead += GetString(newObject->strName);
-
+      if(get_string(&c, newObject->strName, sizeof(newObject->strName)) < 0)
+	return Fail(&c, "bad object name");
 # ifdef DEBUG
       fprintf(stderr,"We have just created an object %s\n",newObject->strName);
 # endif
-            
-      // Now proceed to read in the rest of the object information
-      ProcessNextObjectChunk(pModel, newObject, m_CurrentChunk);
+      if(ReadObject(pModel, newObject, &c) < 0)
+	return -1;
+      // Lights and cameras are objects too - we only want the meshes.
+      if(newObject->pVerts == (struct CVector3 *)NULL) {
+	pModel->pObject = newObject->next;
+	free(newObject);
+      } else
+	pModel->numOfObjects++;
+      break;
+    default:
+      // If we didn't care about a chunk, then we get here - it was skipped already.
       break;
-    default: 
-# ifdef DEBUG
-    fprintf(stderr,"ProcessNextChunk: skipping unsupported\n");
-# endif
-      // If we didn't care about a chunk, then we get here.  We still need
-      // to read past the unknown or ignored chunk and add the bytes read to the byte counter.
-      if(buffer != (unsigned char *)NULL)
-        free(buffer);
-      if((buffer = malloc(m_CurrentChunk->length - m_CurrentChunk->bytesRead)) == (unsigned char *)NULL) {
-        fprintf(stderr,"3ds: Out of memory (die)\n");
-        exit(1);
-      }
-      m_CurrentChunk->bytesRead += fread(buffer, 1, m_CurrentChunk->length - m_CurrentChunk->bytesRead,
-					 m_FilePointer);
     }
-# ifdef DEBUG
-    fprintf(stderr,"ProcessNextChunk: chunk logic completed\n");
-# endif
-    // Add the bytes read from the last chunk to the previous chunk passed in.
-    pPreviousChunk->bytesRead += m_CurrentChunk->bytesRead;
   }
-  /* Free the current chunk and set it back to the previous chunk (since it started that way) */
-  (void) free(m_CurrentChunk);
-  (void) free(m_TempChunk);
+  return 0;
 }
 
 /*
-  This function handles all the information about the objects in the file
+  The RGB colour of a material - as bytes or as floats
 */
-static void ProcessNextObjectChunk(struct t3DModel *pModel, struct t3DObject *pObject,
-				   struct tChunk *pPreviousChunk)
+static int ReadColor(struct tMaterialInfo *pMaterial, struct tReader *r)
 {
-  struct tChunk * m_CurrentChunk;
-
-  if((m_CurrentChunk = (struct tChunk *) malloc(sizeof(struct tChunk))) == (struct tChunk *)NULL) {
-    fprintf(stderr,"Out of memory in ProcessNextChunk?\n");
-    exit(1);
-  }
+  struct tReader c;
+  unsigned short id;
+  float f[3];
+  int i;
 
-  // Continue to read these chunks until we read the end of this sub chunk
-  while (pPreviousChunk->bytesRead < pPreviousChunk->length)  {
-# ifdef DEBUG
-    fprintf(stderr, "ProcessNextObjectChunk: Processing subchunk read %d length %d\n",
-	    pPreviousChunk->bytesRead, pPreviousChunk->length);
-# endif
-    // Read the next chunk
-    ReadChunk(m_CurrentChunk);
-    // Check which chunk we just read
-    switch (m_CurrentChunk->ID)    {
-    case OBJECT_MESH:                   // This lets us know that we are reading a new object
-# ifdef DEBUG
-      fprintf(stderr, "ProcessNextObjectChunk: OBJECT_MESH\n");
-# endif
-      // Increase the object count
-      pModel->numOfObjects++;
-      // We found a new object, so let's read in it's info using recursion
-      ProcessNextObjectChunk(pModel, pObject, m_CurrentChunk);
-      break;
-    case OBJECT_VERTICES:               // This is the objects vertices
-# ifdef DEBUG
-      fprintf(stderr, "ProcessNextObjectChunk: OBJECT_VERTICES\n");
-# endif
-      ReadVertices(pObject, m_CurrentChunk);
-      break;
-    case OBJECT_FACES:                  // This is the objects face information
-# ifdef DEBUG
-      fprintf(stderr, "ProcessNextObjectChunk: OBJECT_FACES\n");
-# endif
-      ReadVertexIndices(pObject, m_CurrentChunk);
-      break;
-    case OBJECT_MATERIAL:               // This holds the material name that the object has
-# ifdef DEBUG
-      fprintf(stderr, "ProcessNextObjectChunk: OBJECT_MATERIAL\n");
-# endif
-      // This chunk holds the name of the material that the object has assigned to it.
-      // This could either be just a color or a texture map.  This chunk also holds
-      // the faces that the texture is assigned to (In the case that there is multiple
-      // textures assigned to one object, or it just has a texture on a part of the object.
-      // Since most of my game objects just have the texture around the whole object, and 
-      // they aren't multitextured, I just want the material name.
-
-      // We now will read the name of the material assigned to this object
-      ReadObjectMaterial(pModel, pObject, m_CurrentChunk);            
-      break;
-    case OBJECT_UV:                     // This holds the UV texture coordinates for the object
-# ifdef DEBUG
-      fprintf(stderr, "ProcessNextObjectChunk: OBJECT_UV\n");
-# endif
-      // This chunk holds all of the UV coordinates for our object.  Let's read them in.
-      ReadUVCoordinates(pObject, m_CurrentChunk);
-      break;
-    default:  
-# ifdef DEBUG
-      fprintf(stderr, "ProcessNextObjectChunk: Unsupported Chunk\n");
-# endif
-      // Read past the ignored or unknown chunks
-      if(buffer != (unsigned char *)NULL)
-        free(buffer);
-      if((buffer = malloc(m_CurrentChunk->length - m_CurrentChunk->bytesRead)) == (unsigned char *)NULL) {
-        fprintf(stderr,"3ds: Out of memory (die)\n");
-        exit(1);
-      }
-      m_CurrentChunk->bytesRead += fread(buffer, 1, m_CurrentChunk->length - m_CurrentChunk->bytesRead,
-					 m_FilePointer);
-      break;
+  while(r->p < r->end) {
+    if(get_chunk(r, &id, &c) < 0)
+      return Fail(r, "bad colour chunk");
+    if((id == 0x0011 || id == 0x0012) && c.end - c.p >= 3) {
+      memcpy(pMaterial->color, c.p, 3);
+      return 0;
+    }
+    if((id == 0x0010 || id == 0x0013) && get_array32(&c, f, 3) == 0) {
+      for(i = 0; i < 3; i++)
+	pMaterial->color[i] = f[i] <= 0.0 ? 0 : f[i] >= 1.0 ? 255 : (BYTE)(f[i] * 255.0 + 0.5);
+      return 0;
     }
-# ifdef DEBUG
-      fprintf(stderr, "ProcessNextObjectChunk: End of Chunk logic\n");
-# endif
-    
-    // Add the bytes read from the last chunk to the previous chunk passed in.
-    pPreviousChunk->bytesRead += m_CurrentChunk->bytesRead;
   }
-
-  // Free the current chunk and set it back to the previous chunk (since it started that way)
-  (void) free(m_CurrentChunk);
+  return 0;
 }
 
 /*
   This function handles all the information about the material (Texture)
 */
-static void ProcessNextMaterialChunk(struct t3DModel *pModel, struct tChunk *pPreviousChunk)
+static int ReadMaterial(struct t3DModel *pModel, struct tMaterialInfo *pMaterial,
+			struct tReader *r)
 {
-  struct tChunk *m_CurrentChunk;
+  struct tReader c;
+  unsigned short id;
 
-  if((m_CurrentChunk = (struct tChunk *) malloc(sizeof(struct tChunk))) == (struct tChunk *)NULL) {
-    fprintf(stderr,"Out of memory in ProcessNextChunk?\n");
-    exit(1);
-  }
-
-  // Continue to read these chunks until we read the end of this sub chunk
-  while (pPreviousChunk->bytesRead < pPreviousChunk->length)  {
-    // Read the next chunk
-    ReadChunk(m_CurrentChunk);
-    // Check which chunk we just read in
-    switch (m_CurrentChunk->ID)  {
+  while(r->p < r->end) {
+    if(get_chunk(r, &id, &c) < 0)
+      return Fail(r, "bad material chunk");
+    switch (id) {
     case MATNAME:                           // This chunk holds the name of the material
-      // Here we read in the material name
-      //printf ("numOfMaterials : %d\n" , pModel->numOfMaterials);
-      m_CurrentChunk->bytesRead += fread(pModel->pMaterials->strName, 1,
-					 m_CurrentChunk->length - m_CurrentChunk->bytesRead,
-					 m_FilePointer);
+      if(get_string(&c, pMaterial->strName, sizeof(pMaterial->strName)) < 0)
+	return Fail(&c, "bad material name");
       break;
     case MATDIFFUSE:                        // This holds the R G B color of our object
-      ReadColorChunk(pModel->pMaterials, m_CurrentChunk);
+      if(ReadColor(pMaterial, &c) < 0)
+	return -1;
       break;
     case MATMAP:                            // This is the header for the texture info
-      // Proceed to read in the material information
-      ProcessNextMaterialChunk(pModel, m_CurrentChunk);
+      if(ReadMaterial(pModel, pMaterial, &c) < 0)
+	return -1;
       break;
     case MATMAPFILE:                        // This stores the file name of the material
-      // Here we read in the material's file name
-      m_CurrentChunk->bytesRead += fread (pModel->pMaterials->strFile, 1,
-					  m_CurrentChunk->length - m_CurrentChunk->bytesRead,
-					  m_FilePointer);
+      if(get_string(&c, pMaterial->strFile, sizeof(pMaterial->strFile)) < 0)
+	return Fail(&c, "bad texture file name");
       break;
-    default:  
-      // Read past the ignored or unknown chunks
-      if(buffer != (unsigned char *)NULL)
-        free(buffer);
-      if((buffer = malloc(m_CurrentChunk->length - m_CurrentChunk->bytesRead)) == (unsigned char *)NULL) {
-        fprintf(stderr,"3ds: Out of memory (die)\n");
-        exit(1);
-      }
-      m_CurrentChunk->bytesRead += fread(buffer, 1, m_CurrentChunk->length - m_CurrentChunk->bytesRead,
-					 m_FilePointer);
-      break;
-    }
-
-    // Add the bytes read from the last chunk to the previous chunk passed in.
-    pPreviousChunk->bytesRead += m_CurrentChunk->bytesRead;
     }
-
-  // Free the current chunk and set it back to the previous chunk (since it started that way)
-  (void) free(m_CurrentChunk);
-}
-
-/*
-  This function reads in a chunk ID and it's length in bytes. A total of 6 bytes.
-  Note: 3ds files are stored in little indian order.
-*/
-static void ReadChunk(struct tChunk *pChunk)
-{
-
-  pChunk->bytesRead = read_short(&(pChunk->ID));
-  pChunk->bytesRead += read_int(&(pChunk->length));
+  }
+  return 0;
 }
 
 /*
-  This function reads in a string of characters
+  This function reads in the vertices for the object
 */
-
-static int GetString(char *pBuffer)
+static int ReadVertices(struct t3DObject *pObject, struct tReader *r)
 {
-  int index = 0;
-
-  // Read 1 byte of data which is the first letter of the string
-  if(fread(pBuffer, 1, 1, m_FilePointer) != 1) {
-    fprintf(stderr,"GetString: unexpected end of file\n");
-    exit(1);
-  }
-
-  // Loop until we get NULL
-  while (*(pBuffer + index++) != 0) {
-    // Read in a character at a time until we hit NULL.
-    if(fread(pBuffer + index, 1, 1, m_FilePointer) != 1) {
-      fprintf(stderr, "GetString: unexpected end of file\n");
-      exit(1);
-    }
-  }
+  unsigned short n;
+  float t;
+  int i;
 
+  if(pObject->pVerts != (struct CVector3 *)NULL)
+    return Fail(r, "more than one vertex list in an object");
+  if(get_short(r, &n) < 0 ||
+     (pObject->pVerts = (struct CVector3 *)malloc(sizeof(struct CVector3) * (n + 1))) ==
+     (struct CVector3 *)NULL ||
+     get_array32(r, pObject->pVerts, 3 * n) < 0)
+    return Fail(r, "bad vertex list");
+  pObject->numOfVerts = n;
 # ifdef DEBUG
-  fprintf(stderr,"GetString: Recovered |%s|\n", pBuffer);
+  fprintf(stderr,"ReadVertices: read %d verticies\n", pObject->numOfVerts);
 # endif
 
-  // Return the string length, which is how many bytes we read in (including the NULL)
-  return strlen(pBuffer) + 1;
+  // Because 3D Studio Max Models with the Z-Axis pointing up (strange and ugly I know!),
+  // we need to flip the y values with the z values in our vertices.  That way it
+  // will be normal, with Y pointing up.  Also, because we swap the Y and Z
+  // we need to negate the Z to make it come out correctly.
+  for(i = 0; i < n; i++) {
+    t = pObject->pVerts[i].y;
+    pObject->pVerts[i].y = pObject->pVerts[i].z;
+    pObject->pVerts[i].z = -t;
+  }
+  return 0;
 }
 
-
 /*
-  This function reads in the RGB color data
+  This function reads in the UV coordinates for the object
 */
-static void ReadColorChunk(struct tMaterialInfo *pMaterial, struct tChunk *pChunk)
+static int ReadUVCoordinates(struct t3DObject *pObject, struct tReader *r)
 {
-  struct tChunk * m_TempChunk;
-
-  if((m_TempChunk = (struct tChunk *) malloc(sizeof(struct tChunk))) == (struct tChunk *)NULL) {
-    fprintf(stderr,"Out of memory in ProcessNextChunk?\n");
-    exit(1);
-  }
-  // Read the color chunk info
-  ReadChunk(m_TempChunk);
-  // Read in the R G B color (3 bytes - 0 through 255)
-  m_TempChunk->bytesRead += fread(pMaterial->color, 1, m_TempChunk->length - m_TempChunk->bytesRead,
-				  m_FilePointer);
-
-  // Add the bytes read to our chunk
-  pChunk->bytesRead += m_TempChunk->bytesRead;
-
-  (void) free(m_TempChunk);
+  unsigned short n;
+
+  free(pObject->pTexVerts);
+  if(get_short(r, &n) < 0 ||
+     (pObject->pTexVerts = (struct CVector2 *)malloc(sizeof(struct CVector2) * (n + 1))) ==
+     (struct CVector2 *)NULL ||
+     get_array32(r, pObject->pTexVerts, 2 * n) < 0)
+    return Fail(r, "bad UV list");
+  pObject->numTexVertex = n;
+  return 0;
 }
 
 /*
-  This function reads in the indices for the vertex array
+  This function reads in the indices for the vertex array, then the
+  materials and smoothing groups of the faces that follow them
 */
-static void ReadVertexIndices(struct t3DObject *pObject, struct tChunk *pPreviousChunk)
+static int ReadVertexIndices(struct t3DModel *pModel, struct t3DObject *pObject,
+			     struct tReader *r)
 {
+  const unsigned char *b;
+  unsigned short n;
   int i, j;
-  unsigned short index = 0;                   // This is used to read in the current face index
-
-  // In order to read in the vertex indices for the object, we need to first
-  // read in the number of them, then read them in.  Remember,
-  // we only want 3 of the 4 values read in for each face.  The fourth is
-  // a visibility flag for 3D Studio Max that doesn't mean anything to us.
-  
-  // Read in the number of faces that are in this object (int)
-  pPreviousChunk->bytesRead += read_short(&(pObject->numOfFaces));
-# ifdef DEBUG
-  fprintf(stderr,"ReadVertexIndices: there are %d faces\n",pObject->numOfFaces);
-# endif
 
-  // Alloc enough memory for the faces and initialize the structure
-  pObject->pFaces = (struct tFace *)malloc(sizeof(struct tFace) * pObject->numOfFaces);
-
-  // Go through all of the faces in this object
-  for(i = 0; i < pObject->numOfFaces; i++)  {
-    // Next, we read in the A then B then C index for the face, but ignore the 4th value.
-    // The fourth value is a visibility flag for 3D Studio Max, we don't care about this.
-    for(j = 0; j < 4; j++) {
-      // Read the first vertice index for the current face 
-      pPreviousChunk->bytesRead += read_short(&index);
-      if(j < 3)  {
-	// Store the index in our face structure.
-	pObject->pFaces[i].vertIndex[j] = index;
-	pObject->pFaces[i].coordIndex[j] = 0;
-      }
+  if(pObject->pFaces != (struct tFace *)NULL)
+    return Fail(r, "more than one face list in an object");
+  if(get_short(r, &n) < 0 || (r->end - r->p) / 8 < n ||
+     (pObject->pFaces = (struct tFace *)malloc(sizeof(struct tFace) * (n + 1))) ==
+     (struct tFace *)NULL)
+    return Fail(r, "bad face list");
+  pObject->numOfFaces = n;
+
+  // Each face is the A, B and C indices then a visibility flag for 3D Studio Max,
+  // which we don't care about.
+  for(i = 0, b = r->p; i < n; i++, b += 8) {
+    for(j = 0; j < 3; j++) {
+      pObject->pFaces[i].vertIndex[j] = b[2*j] | (b[2*j+1] << 8);
+      // a 3ds file has one UV for each vertex
+      pObject->pFaces[i].coordIndex[j] = pObject->pFaces[i].vertIndex[j];
     }
+    // no material unless an OBJECT_MATERIAL chunk says otherwise
+    pObject->pFaces[i].mat = (struct tMaterialInfo *)NULL;
   }
+  r->p = b;
+# ifdef DEBUG
+  fprintf(stderr,"ReadVertexIndices: there are %d faces\n",pObject->numOfFaces);
+# endif
+  return ReadObject(pModel, pObject, r);
 }
 
 /*
-  This function reads in the UV coordinates for the object
+  This function reads in the material name assigned to some faces of the object
 */
-static void ReadUVCoordinates(struct t3DObject *pObject, struct tChunk *pPreviousChunk)
+static int ReadObjectMaterial (struct t3DModel *pModel, struct t3DObject *pObject,
+			       struct tReader *r)
 {
-  int i;
-
-  // In order to read in the UV indices for the object, we need to first
-  // read in the amount there are, then read them in.
-
-  // Read in the number of UV coordinates there are (int)
-  pPreviousChunk->bytesRead += read_short(&pObject->numTexVertex);
+  char strMaterial[255];
+  struct tMaterialInfo *p;
+  unsigned short n, face;
+  int i, bad = 0;
+
+  if(get_string(r, strMaterial, sizeof(strMaterial)) < 0 || get_short(r, &n) < 0 ||
+     (r->end - r->p) / 2 < n)
+    return Fail(r, "bad object material");
+  for(p=pModel->pMaterials;p != (struct tMaterialInfo *)NULL;p=p->next)
+    if (!strcmp(strMaterial, p->strName))
+      break;
 # ifdef DEBUG
-  fprintf(stderr,"ReadUVCoordinates: Reading %d coordinates\n",pObject->numTexVertex);
+  fprintf(stderr,"ReadObjectMaterial for object %s: %s on %d faces\n",
+	  pObject->strName, strMaterial, n);
 # endif
-
-  // Allocate memory to hold the UV coordinates
-  pObject->pTexVerts = (struct CVector2 *)malloc(sizeof(struct CVector2) * pObject->numTexVertex);
-
-  // Read in the texture coodinates (an array 2 float)
-  for(i=0;i<pObject->numTexVertex;i++) {
-    pPreviousChunk->bytesRead += read_float(&(pObject->pTexVerts[i].x));
-    pPreviousChunk->bytesRead += read_float(&(pObject->pTexVerts[i].y));
+  for(i = 0; i < n; i++) {
+    if(get_short(r, &face) == 0 && face < pObject->numOfFaces &&
+       pObject->pFaces != (struct tFace *)NULL)
+      pObject->pFaces[face].mat = p;
+    else
+      bad++;
   }
+  if(bad)
+    fprintf(stderr,"Import3DS: %s: material %s given to %d invalid faces of %s\n",
+	    r->file, strMaterial, bad, pObject->strName);
+  return 0;
 }
 
 /*
-  This function reads in the vertices for the object
+  This function reads in the smoothing groups of the faces - a bit mask for each
 */
-static void ReadVertices(struct t3DObject *pObject, struct tChunk *pPreviousChunk)
+static int ReadSmoothingGroups(struct t3DObject *pObject, struct tReader *r)
 {
-  int i;
-  // Like most chunks, before we read in the actual vertices, we need
-  // to find out how many there are to read in.  Once we have that number
-  // we then fread() them into our vertice array.
-
-  // Read in the number of vertices (int)
-  pPreviousChunk->bytesRead += read_short(&(pObject->numOfVerts));
-# ifdef DEBUG
-  fprintf(stderr,"ReadVertices: reading %d verticies\n", pObject->numOfVerts);
-# endif
-
-  // Allocate the memory for the verts and initialize the structure
-  pObject->pVerts = (struct CVector3 *)malloc(sizeof(struct CVector3) * pObject->numOfVerts);
-
-  // Read in the array of vertices (an array of 3 floats)
-  for(i=0;i<pObject->numOfVerts;i++) {
-    pPreviousChunk->bytesRead += read_float(&(pObject->pVerts[i].x));
-    pPreviousChunk->bytesRead += read_float(&(pObject->pVerts[i].y));
-    pPreviousChunk->bytesRead += read_float(&(pObject->pVerts[i].z));
-  }
-
-  // Now we should have all of the vertices read in.  Because 3D Studio Max
-  // Models with the Z-Axis pointing up (strange and ugly I know!), we need
-  // to flip the y values with the z values in our vertices.  That way it
-  // will be normal, with Y pointing up.  If you prefer to work with Z pointing
-  // up, then just delete this next loop.  Also, because we swap the Y and Z
-  // we need to negate the Z to make it come out correctly.
-
-  // Go through all of the vertices that we just read and swap the Y and Z values
-  for(i = 0; i < pObject->numOfVerts; i++)  {
-    // Store off the Y value
-    float fTempY = pObject->pVerts[i].y;
-
-    // Set the Y value to the Z value
-    pObject->pVerts[i].y = pObject->pVerts[i].z;
-
-    // Set the Z value to the Y value, 
-    // but negative Z because 3D Studio max does the opposite.
-    pObject->pVerts[i].z = -fTempY;
+  // There is one for every face, so the faces must have been read in already.
+  if(pObject->pFaces == (struct tFace *)NULL || pObject->pSmooth != (unsigned int *)NULL ||
+     r->end - r->p != 4 * pObject->numOfFaces) {
+    fprintf(stderr,"Import3DS: %s: smoothing groups do not match the faces of %s\n",
+	    r->file, pObject->strName);
+    return 0;
   }
+  if((pObject->pSmooth = (unsigned int *)malloc(sizeof(unsigned int) * (pObject->numOfFaces + 1))) ==
+     (unsigned int *)NULL)
+    return Fail(r, "out of memory");
+  return get_array32(r, pObject->pSmooth, pObject->numOfFaces);
 }
 
 /*
-  This function reads in the material name assigned to the object and sets the material 'mat'
+  This function handles all the information about the objects in the file
 */
-static void ReadObjectMaterial (struct t3DModel *pModel, struct t3DObject *pObject,
-				struct tChunk *pPreviousChunk)
+static int ReadObject(struct t3DModel *pModel, struct t3DObject *pObject, struct tReader *r)
 {
-  int i;
-  struct tMaterialInfo *p;
-  char strMaterial[255] = {0};            // This is used to hold the objects material name
-  unsigned short len, index;
-
-  // *What is a material?*  - A material is either the color or the texture map of the object.
-  // It can also hold other information like the brightness, shine, etc... Stuff we don't
-  // really care about.  We just want the color, or the texture map file name really.
-
-  // Here we read the material name that is assigned to the current object.
-  // strMaterial should now have a string of the material name, like "Material #2" etc..
-  pPreviousChunk->bytesRead += GetString(strMaterial);
-
-  // Now that we have a material name, we need to go through all of the materials
-  // and check the name against each material.  When we find a material in our material
-  // list that matches this name we just read in, then we assign the materialID
-  // of the object to that material index.  You will notice that we passed in the
-  // model to this function.  This is because we need the number of textures.
-  // Yes though, we could have just passed in the model and not the object too.
-
-  // Go through all of the textures
-# ifdef DEBUG
-  fprintf(stderr,"ReadObjectMaterial for %s\n",strMaterial);
-# endif
-  for(p=pModel->pMaterials;p != (struct tMaterialInfo *)NULL;p=p->next) {
-    // If the material we just read in matches the current material name
-    if (!strcmp(strMaterial, p->strName))  {
-# ifdef DEBUG
-      fprintf(stderr, "ReadObjectMaterial for object %s (%d faces) %s\n",
-	      pObject->strName, pObject->numOfFaces,strMaterial);
-# endif
+  struct tReader c;
+  unsigned short id;
+  int ok = 0;
+
+  while(ok == 0 && r->p < r->end) {
+    if(get_chunk(r, &id, &c) < 0)
+      return Fail(r, "bad object chunk");
+    switch (id) {
+    case OBJECT_MESH:                   // This lets us know that we are reading a new object
+      ok = ReadObject(pModel, pObject, &c);
+      break;
+    case OBJECT_VERTICES:               // This is the objects vertices
+      ok = ReadVertices(pObject, &c);
+      break;
+    case OBJECT_FACES:                  // This is the objects face information
+      ok = ReadVertexIndices(pModel, pObject, &c);
+      break;
+    case OBJECT_MATERIAL:               // This holds the material name that the object has
+      ok = ReadObjectMaterial(pModel, pObject, &c);
+      break;
+    case OBJECT_UV:                     // This holds the UV texture coordinates for the object
+      ok = ReadUVCoordinates(pObject, &c);
+      break;
+    case OBJECT_SMOOTH:                 // This holds the smoothing groups of the faces
+      ok = ReadSmoothingGroups(pObject, &c);
       break;
     }
   }
-
-# ifdef DEBUG
-  fprintf(stderr,"there are %d bytes left in the chunk\n",pPreviousChunk->length-pPreviousChunk->bytesRead);
-# endif
-  pPreviousChunk->bytesRead += read_short(&len);
-
-# ifdef DEBUG
-  fprintf(stderr,"there are %d verticies to colour this colour\n",len);
-# endif
-  for(i=0;i<len;i++) {
-    pPreviousChunk->bytesRead += read_short(&index);
-    if(index >= pObject->numOfFaces) {
-      fprintf(stderr,"ReadObjectMaterial: trying to define material for invalid face\n",index);
-      exit(1);
-    }
-    pObject->pFaces[index].mat = p;
-  }
-  if(pPreviousChunk->length != pPreviousChunk->bytesRead) {
-    fprintf(stderr,"ReadObjectMaterial: chunk format invalid (extra bytes)\n");
-
-    // Read past the rest of the chunk since we don't care about shared vertices
-    // You will notice we subtract the bytes already read in this chunk from the total length.
-    if(buffer != (unsigned char *)NULL)
-      free(buffer);
-    if((buffer = malloc(pPreviousChunk->length - pPreviousChunk->bytesRead)) == (unsigned char *)NULL) {
-      fprintf(stderr,"3ds: Out of memory (die)\n");
-      exit(1);
-    }
-    pPreviousChunk->bytesRead += fread(buffer, 1, pPreviousChunk->length - pPreviousChunk->bytesRead,
-				       m_FilePointer);
-  }
-}           
+  return ok;
+}
 
 static void makeNormal(struct CVector3 *n, struct CVector3 *p, struct CVector3 *q, struct CVector3 *r)
 {
@@ -737,43 +661,298 @@ static void Normalize(struct CVector3 *v)
   }
 }
 
-static void ComputeNormals (struct t3DModel *pModel)
+/*
+  Hash of n floats by their bit patterns, for finding identical vertices
+*/
+static unsigned int hashFloats(const float *f, int n)
 {
-  struct CVector3 n;
-  int index[3], i, j;
-  struct t3DObject *pObject;
+  unsigned int h = 2166136261u, b;
+  int i;
 
-  for(pObject=pModel->pObject; pObject != (struct t3DObject *)NULL; pObject=pObject->next) {
-# ifdef DEBUG
-    fprintf(stderr,"Compute Normals: Processing object %s (%d verticies)\n",pObject->strName,
-	    pObject->numOfVerts);
-# endif
+  for(i = 0; i < n; i++) {
+    memcpy(&b, f + i, sizeof(b));
+    h = (h ^ b) * 16777619u;
+  }
+  return h ^ (h >> 15);
+}
 
-    /* create the list of normals */
-    pObject->pNormals = (struct CVector3 *)malloc(sizeof(struct CVector3) * pObject->numOfVerts);
-    for(i=0;i<pObject->numOfVerts;i++) {
-      pObject->pNormals[i].x = 0.0;
-      pObject->pNormals[i].y = 0.0;
-      pObject->pNormals[i].z = 0.0;
+/*
+  The index of the n floats f among the *count entries of n floats in
+  data, adding them at the end if they are not there yet.  table is an
+  open-addressed hash table (mask+1 entries, -1 when empty) of the
+  indices in data.
+*/
+static int findOrAdd(float *data, int n, int *count, int *table, unsigned int mask,
+		     const float *f)
+{
+  unsigned int h = hashFloats(f, n) & mask;
+  int k;
+
+  while((k = table[h]) >= 0) {
+    if(memcmp(data + k*n, f, n * sizeof(float)) == 0)
+      return k;
+    h = (h + 1) & mask;
+  }
+  k = (*count)++;
+  memcpy(data + k*n, f, n * sizeof(float));
+  table[h] = k;
+  return k;
+}
+
+/*
+  Position of a material in the model's list, so that batches come
+  out in the same order in every object and the material only changes
+  when it has to between objects.  No material sorts first.
+*/
+static int materialRank(struct t3DModel *pModel, struct tMaterialInfo *mat)
+{
+  struct tMaterialInfo *p;
+  int k;
+
+  if(mat == (struct tMaterialInfo *)NULL)
+    return 0;
+  for(k=1,p=pModel->pMaterials;p != (struct tMaterialInfo *)NULL;p=p->next,k++)
+    if(p == mat)
+      return k;
+  return k;
+}
+
+/*
+  Sort the triangles (given as vertex indices in face order) into one
+  batch per material and store them in the mesh.
+*/
+static int BuildBatches(struct t3DModel *pModel, struct t3DObject *pObject, struct tMesh *m,
+			int *tri, int *faceOf, int ntri)
+{
+  struct tMaterialInfo **mats, *tm;
+  int *count, *rank, nmats, i, j, k, at, tc, tr;
+  unsigned short *sidx;
+  unsigned int *iidx;
+
+  mats = (struct tMaterialInfo **)malloc(sizeof(struct tMaterialInfo *) * (ntri + 1));
+  count = (int *)malloc(sizeof(int) * (ntri + 1));
+  rank = (int *)malloc(sizeof(int) * (ntri + 1));
+  m->numOfIndices = 3 * ntri;
+  m->indexSize = m->numOfVerts <= 65536 ? sizeof(unsigned short) : sizeof(unsigned int);
+  m->pIndices = malloc(m->indexSize * (m->numOfIndices + 1));
+  m->pBatches = (struct tBatch *)malloc(sizeof(struct tBatch) * (ntri + 1));
+  if(!mats || !count || !rank || !m->pIndices || !m->pBatches) {
+    free(mats); free(count); free(rank);
+    return -1;
+  }
+
+  /* the distinct materials, in model order */
+  nmats = 0;
+  for(j = 0; j < ntri; j++) {
+    tm = pObject->pFaces[faceOf[j]].mat;
+    for(k = 0; k < nmats && mats[k] != tm; k++)
+      ;
+    if(k == nmats) {
+      mats[nmats] = tm;
+      rank[nmats] = materialRank(pModel, tm);
+      count[nmats++] = 0;
     }
+    count[k]++;
+  }
+  for(i = 1; i < nmats; i++) {
+    /* insertion sort - there are only ever a few of them */
+    tm = mats[i]; tc = count[i]; tr = rank[i];
+    for(k = i; k > 0 && rank[k-1] > tr; k--) {
+      mats[k] = mats[k-1]; count[k] = count[k-1]; rank[k] = rank[k-1];
+    }
+    mats[k] = tm; count[k] = tc; rank[k] = tr;
+  }
+  m->numOfBatches = nmats;
+  for(at = 0, k = 0; k < nmats; k++) {
+    m->pBatches[k].mat = mats[k];
+    m->pBatches[k].first = at;
+    m->pBatches[k].count = 3 * count[k];
+    count[k] = at;
+    at += m->pBatches[k].count;
+  }
 
-    /* process every face */
-    for (j = 0; j < pObject->numOfFaces; j++ ) {
-      index[0] = pObject->pFaces[j].vertIndex[0];
-      index[1] = pObject->pFaces[j].vertIndex[1];
-      index[2] = pObject->pFaces[j].vertIndex[2];
-      makeNormal(&n, &(pObject->pVerts[index[0]]), &(pObject->pVerts[index[1]]),
-                 &(pObject->pVerts[index[2]]));
-      for(i=0;i<3;i++) 	{
-        pObject->pNormals[index[i]].x += n.x;
-	pObject->pNormals[index[i]].y += n.y;
-	pObject->pNormals[index[i]].z += n.z;
+  /* scatter the triangles into their batches, keeping their order */
+  sidx = (unsigned short *)m->pIndices;
+  iidx = (unsigned int *)m->pIndices;
+  for(j = 0; j < ntri; j++) {
+    tm = pObject->pFaces[faceOf[j]].mat;
+    for(k = 0; mats[k] != tm; k++)
+      ;
+    for(i = 0; i < 3; i++) {
+      if(m->indexSize == sizeof(unsigned short))
+	sidx[count[k]++] = tri[3*j+i];
+      else
+	iidx[count[k]++] = tri[3*j+i];
+    }
+  }
+  free(mats); free(count); free(rank);
+  return 0;
+}
+
+/*
+  Do faces f and g (which share a corner) share the normal there?  With
+  smoothing groups they do if they have a group in common, otherwise if
+  they meet at less than the crease angle.
+*/
+static int shareNormal(struct t3DObject *pObject, float *fn, float *flen, int f, int g,
+		       float cosCrease)
+{
+  if(f == g)
+    return 1;
+  if(pObject->pSmooth != (unsigned int *)NULL)
+    return (pObject->pSmooth[f] & pObject->pSmooth[g]) != 0;
+  return fn[3*f]*fn[3*g] + fn[3*f+1]*fn[3*g+1] + fn[3*f+2]*fn[3*g+2] >=
+    cosCrease * flen[f] * flen[g];
+}
+
+/*
+  Build the mesh that is drawn for an object.  Vertices at the same
+  position are welded, so that normals are smooth across the seams
+  where a 3ds file repeats a vertex for different UVs.  The normal of
+  each corner of a face is the sum of the (area weighted) normals of
+  the faces around that position it shares a normal with, normalised
+  once - so it does not depend on the order of the faces.  The
+  vertices that come out are each distinct (position, normal, UV).
+  Also sets pNormals, the normals smoothed over all faces.
+*/
+static int BuildMesh(struct t3DModel *pModel, struct t3DObject *pObject, float cosCrease)
+{
+  int nv = pObject->numOfVerts, nf = pObject->numOfFaces, np = 0, ntri = 0;
+  int *weld, *table, *start, *adj, *tri, *faceOf, i, j, c, g, k, vi, ci;
+  float *pos, *fn, *flen, *data, v[8], len;
+  unsigned int size, mask;
+  struct tFace *f;
+  struct tMesh *m;
+
+  for(size = 16; size < 2 * (unsigned)(nv > 3*nf ? nv : 3*nf); size <<= 1)
+    ;
+  mask = size - 1;
+  weld = (int *)malloc(sizeof(int) * (nv + 1));
+  pos = (float *)malloc(sizeof(float) * 3 * (nv + 1));
+  table = (int *)malloc(sizeof(int) * size);
+  fn = (float *)malloc(sizeof(float) * 3 * (nf + 1));
+  flen = (float *)malloc(sizeof(float) * (nf + 1));
+  start = (int *)calloc(nv + 2, sizeof(int));
+  adj = (int *)malloc(sizeof(int) * 3 * (nf + 1));
+  tri = (int *)malloc(sizeof(int) * 3 * (nf + 1));
+  faceOf = (int *)malloc(sizeof(int) * (nf + 1));
+  data = (float *)malloc(sizeof(float) * 8 * (3*nf + 1));
+  m = (struct tMesh *)calloc(1, sizeof(struct tMesh));
+  pObject->pNormals = (struct CVector3 *)calloc(nv + 1, sizeof(struct CVector3));
+  if(!weld || !pos || !table || !fn || !flen || !start || !adj || !tri || !faceOf ||
+     !data || !m || !pObject->pNormals) {
+    fprintf(stderr,"BuildMesh: out of memory for object %s\n", pObject->strName);
+    free(data); free(m);
+    m = (struct tMesh *)NULL;
+    goto done;
+  }
+
+  /* weld the positions */
+  for(k = 0; k < size; k++)
+    table[k] = -1;
+  for(i = 0; i < nv; i++) {
+    v[0] = pObject->pVerts[i].x + 0.0f;   /* no -0 */
+    v[1] = pObject->pVerts[i].y + 0.0f;
+    v[2] = pObject->pVerts[i].z + 0.0f;
+    weld[i] = findOrAdd(pos, 3, &np, table, mask, v);
+  }
+
+  /* face normals (length is twice the area), and the faces around
+     each position */
+  for(j = 0; j < nf; j++) {
+    f = &pObject->pFaces[j];
+    fn[3*j] = fn[3*j+1] = fn[3*j+2] = flen[j] = 0.0;
+    if(f->vertIndex[0] >= nv || f->vertIndex[1] >= nv || f->vertIndex[2] >= nv)
+      continue;
+    makeNormal((struct CVector3 *)(fn + 3*j), &pObject->pVerts[f->vertIndex[0]],
+	       &pObject->pVerts[f->vertIndex[1]], &pObject->pVerts[f->vertIndex[2]]);
+    flen[j] = sqrt(fn[3*j]*fn[3*j] + fn[3*j+1]*fn[3*j+1] + fn[3*j+2]*fn[3*j+2]);
+    for(c = 0; c < 3; c++)
+      start[weld[f->vertIndex[c]] + 2]++;
+    faceOf[ntri++] = j;
+  }
+  for(k = 2; k <= np + 1; k++)
+    start[k] += start[k-1];
+  for(i = 0; i < ntri; i++) {
+    f = &pObject->pFaces[faceOf[i]];
+    for(c = 0; c < 3; c++)
+      adj[start[weld[f->vertIndex[c]] + 1]++] = faceOf[i];
+  }
+  /* now faces around position p are adj[start[p]] to adj[start[p+1]-1] */
+
+  for(i = 0; i < nv; i++) {
+    struct CVector3 *n = &pObject->pNormals[i];
+    for(k = start[weld[i]]; k < start[weld[i]+1]; k++) {
+      n->x += fn[3*adj[k]];
+      n->y += fn[3*adj[k]+1];
+      n->z += fn[3*adj[k]+2];
+    }
+    Normalize(n);
+  }
+
+  /* the corners of every face */
+  for(k = 0; k < size; k++)
+    table[k] = -1;
+  for(i = 0; i < ntri; i++) {
+    j = faceOf[i];
+    f = &pObject->pFaces[j];
+    for(c = 0; c < 3; c++) {
+      vi = f->vertIndex[c];
+      ci = f->coordIndex[c];
+      if(pObject->pTexVerts != (struct CVector2 *)NULL && ci < pObject->numTexVertex) {
+	v[0] = pObject->pTexVerts[ci].x;
+	v[1] = pObject->pTexVerts[ci].y;
+      } else
+	v[0] = v[1] = 0.0;
+      v[2] = v[3] = v[4] = 0.0;
+      for(k = start[weld[vi]]; k < start[weld[vi]+1]; k++) {
+	g = adj[k];
+	if(shareNormal(pObject, fn, flen, j, g, cosCrease)) {
+	  v[2] += fn[3*g];
+	  v[3] += fn[3*g+1];
+	  v[4] += fn[3*g+2];
+	}
       }
-      Normalize (&(pObject->pNormals[index[0]]));
-      Normalize (&(pObject->pNormals[index[1]]));
-      Normalize (&(pObject->pNormals[index[2]]));
+      if((len = sqrt(v[2]*v[2] + v[3]*v[3] + v[4]*v[4])) > 0.0) {
+	v[2] /= len; v[3] /= len; v[4] /= len;
+      } else {
+	v[2] = pObject->pNormals[vi].x;
+	v[3] = pObject->pNormals[vi].y;
+	v[4] = pObject->pNormals[vi].z;
+      }
+      v[5] = pos[3*weld[vi]];
+      v[6] = pos[3*weld[vi]+1];
+      v[7] = pos[3*weld[vi]+2];
+      tri[3*i+c] = findOrAdd(data, 8, &m->numOfVerts, table, mask, v);
     }
   }
+  /* only the distinct vertices are kept */
+  if((m->pData = (float *)malloc(sizeof(float) * 8 * (m->numOfVerts + 1))) ==
+     (float *)NULL) {
+    fprintf(stderr,"BuildMesh: out of memory for object %s\n", pObject->strName);
+    free(data); free(m);
+    m = (struct tMesh *)NULL;
+    goto done;
+  }
+  memcpy(m->pData, data, sizeof(float) * 8 * m->numOfVerts);
+  free(data);
+
+  if(BuildBatches(pModel, pObject, m, tri, faceOf, ntri) < 0) {
+    fprintf(stderr,"BuildMesh: out of memory for object %s\n", pObject->strName);
+    free(m->pData); free(m->pIndices); free(m->pBatches); free(m);
+    m = (struct tMesh *)NULL;
+  }
+# ifdef DEBUG
+  else
+    fprintf(stderr,"BuildMesh: object %s: %d verts (%d positions) -> %d, %d faces, %d batches\n",
+	    pObject->strName, nv, np, m->numOfVerts, ntri, m->numOfBatches);
+# endif
+
+ done:
+  pObject->pMesh = m;
+  free(weld); free(pos); free(table); free(fn); free(flen);
+  free(start); free(adj); free(tri); free(faceOf);
+  return m != (struct tMesh *)NULL ? 0 : -1;
 }
 
 static void ScaleAndCenter (struct t3DModel *pModel )
@@ -803,6 +982,7 @@ static void ScaleAndCenter (struct t3DModel *pModel )
     for (j = 0; j < pObject->numOfFaces; j++ ) {
       for (Vertex = 0; Vertex < 3; Vertex++ ) {
 	int index = pObject->pFaces[j].vertIndex[Vertex];
+	if ( index >= pObject->numOfVerts) continue;      // a bad face - BuildMesh() skips it
 	if ( pObject->pVerts[ index ].x > max_x) max_x = pObject->pVerts[ index ].x;
 	if ( pObject->pVerts[ index ].y > max_y) max_y = pObject->pVerts[ index ].y;
 	if ( pObject->pVerts[ index ].z > max_z) max_z = pObject->pVerts[ index ].z;
@@ -830,39 +1010,6 @@ static void ScaleAndCenter (struct t3DModel *pModel )
   pModel->center_z = (min_z + sz/2.f) * pModel->scale;
 }
 
-static int read_float(float *f) 
-{
-  unsigned char b[4];
-  if(fread(b, 1, 4, m_FilePointer) != 4) {
-    fprintf(stderr, "read_int: Unexpected end of file\n");
-    exit(1);
-  }
-  
-  *((unsigned int *)f) = (b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
-  return 4;
-}
-static int read_int(unsigned int *v) 
-{
-  unsigned char b[4];
-  if(fread(b, 1, 4, m_FilePointer) != 4) {
-    fprintf(stderr, "read_int: Unexpected end of file\n");
-    exit(1);
-  }
-  *v = (b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
-  return 4;
-}
-
-static int read_short(unsigned short *v) 
-{
-  unsigned char b[2];
-  if(fread(b, 1, 2, m_FilePointer) != 2) {
-    fprintf(stderr, "read_int: Unexpected end of file\n");
-    exit(1);
-  }
-  *v = (b[1] << 8) | b[0];
-  return 2;
-}
-
 /////////////////////////////////////////////////////////////////////////////////
 //
 // * QUICK NOTES * 
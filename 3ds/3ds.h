@@ -26,6 +26,13 @@
 #define OBJECT_FACES	0x4120          // The objects faces
 #define OBJECT_MATERIAL	0x4130          // This is found if the object has a material, either texture map or color
 #define OBJECT_UV	0x4140          // The UV texture coordinates
+#define OBJECT_SMOOTH	0x4150          // The smoothing groups of the faces
+
+/*
+  Faces of an object that has no smoothing groups share vertex normals
+  where they meet at less than this angle (degrees) - see Import3DSSmooth()
+*/
+#define DEFAULT_CREASE_ANGLE 60.0
 
 typedef unsigned char BYTE;
 
@@ -82,6 +89,41 @@ struct tMaterialInfo {
 } ;
 
 	
+/*
+  A run of triangles in a tMesh that share a material, drawn with a
+  single indexed draw call.
+*/
+struct tBatch {
+  struct tMaterialInfo *mat;  // material for the run (NULL = none)
+  int first;                  // first index of the run in pIndices
+  int count;                  // number of indices in the run
+};
+
+/*
+  The number of GL contexts (as txmContextId() numbers them) that can
+  have buffer objects for a mesh - others draw it from client memory.
+*/
+#define MESH_CONTEXTS 16
+
+/*
+  The form of an object that is drawn, built by Import3DS() - each
+  distinct (position, normal, UV) once, interleaved in the order of
+  GL_T2F_N3F_V3F (u v nx ny nz x y z), and triangle indices sorted into
+  one batch per material.  Compile3DS() puts it into buffer objects,
+  separately in each GL context that draws it.
+*/
+struct tMesh {
+  int numOfVerts;             // number of vertices in pData
+  int numOfIndices;           // number of indices in pIndices
+  int numOfBatches;           // number of batches in pBatches
+  int indexSize;              // 2 (unsigned short) or 4 (unsigned int)
+  float *pData;               // numOfVerts * 8 floats
+  void *pIndices;             // numOfIndices indices of indexSize bytes
+  struct tBatch *pBatches;    // the per-material runs
+  unsigned int vbo[MESH_CONTEXTS]; // buffer objects in each context,
+  unsigned int ibo[MESH_CONTEXTS]; // 0 until Compile3DS() there
+};
+
 /*
   This holds all the information for our model/scene.
 */
@@ -94,6 +136,8 @@ struct t3DObject {
   struct CVector3  *pNormals;	// The object's normals
   struct CVector2  *pTexVerts;	// The texture's UV coordinates
   struct tFace *pFaces;		// The faces information of the object
+  unsigned int *pSmooth;	// smoothing groups of the faces (NULL if none)
+  struct tMesh *pMesh;		// what is drawn (NULL if it could not be built)
   struct t3DObject *next;       // next object in the list of objects
 };
 	
@@ -111,4 +155,12 @@ struct t3DModel  {                       // This reads the objects vertices
 
 /* This is the function that you call to load the 3DS */
 int Import3DS (struct t3DModel *pModel, char * root, char * strFileName );
+/* ... and with a crease angle other than DEFAULT_CREASE_ANGLE */
+int Import3DSSmooth (struct t3DModel *pModel, char * root, char * strFileName,
+		     float creaseAngle );
+/* ... without loading the textures - safe in any thread (see 3ds.c) */
+int Parse3DS (struct t3DModel *pModel, char * root, char * strFileName,
+	      float creaseAngle );
+/* Free everything a model holds (but not its buffer objects) */
+void Free3DS (struct t3DModel *pModel );
 #endif
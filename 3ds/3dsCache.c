@@ -0,0 +1,218 @@
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <limits.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <ve.h>
+# include "3ds.h"
+# include "3dsLoader.h"
+# include "3dsCache.h"
+
+/* # define DEBUG */
+
+/*
+ * Models shared between windows and instances.  Acquire3DS() loads a
+ * file the first time it is asked for and after that hands out the
+ * same model until every user has Release3DS()'d it - so a scene with
+ * the same model in it five times, on a wall of six windows, reads it
+ * and keeps it once.  A model is shared, so it must not be changed:
+ * where and how big each instance is drawn is up to the application
+ * (scale and center_* are the model's own, as from Import3DS()).
+ *
+ * Models are known by the real path of the file and when it was last
+ * changed, so a file that is changed while the program runs is read
+ * again (users of the old model keep it until they release it).
+ *
+ * Only the model itself is shared, not any GL objects: each window
+ * Compile3DS()'s the model into its own context (and should
+ * Uncompile3DS() it there before the last Release3DS()).
+ *
+ * Call Acquire3DS() and Release3DS() from the thread that owns txm -
+ * the render thread, e.g. in the window setup callback.  Prefetch3DS()
+ * can be called from anywhere (but the first call into the cache
+ * must not race another - calling Prefetch3DS() from main() takes
+ * care of that).
+ */
+
+struct tCached {
+  char path[PATH_MAX];                    // the real path of the file
+  time_t mtime;                           // ... and when it was last changed
+  off_t size;
+  int refs;                               // Acquire3DS()'s not yet released
+  struct t3DSLoad *pLoad;                 // loading, from Prefetch3DS()
+  struct t3DModel model;                  // once loaded
+  struct tCached *next;
+};
+
+static VeThrMutex *cacheLock = (VeThrMutex *)NULL;
+static struct tCached *cached = (struct tCached *)NULL;
+
+/*
+ * What the cache knows the file as.  Returns 0, or -1 if there is no such file.
+ */
+static int fileKey(char *root, char *strFileName, char *path, time_t *mtime, off_t *size)
+{
+  char buf[1024];
+  struct stat st;
+
+  snprintf(buf, sizeof(buf), "%s/%s", root, strFileName);
+  if(realpath(buf, path) == (char *)NULL || stat(path, &st) < 0)
+    return -1;
+  *mtime = st.st_mtime;
+  *size = st.st_size;
+  return 0;
+}
+
+/*
+ * The entry for a file, or NULL if there is none (call with cacheLock held)
+ */
+static struct tCached *lookup(char *path, time_t mtime, off_t size)
+{
+  struct tCached *c;
+
+  for(c = cached; c != (struct tCached *)NULL; c = c->next)
+    if(c->mtime == mtime && c->size == size && strcmp(c->path, path) == 0)
+      return c;
+  return (struct tCached *)NULL;
+}
+
+static void forget(struct tCached *c)
+{
+  struct tCached **pc;
+
+  for(pc = &cached; *pc != c; pc = &(*pc)->next)
+    ;
+  *pc = c->next;
+}
+
+/*
+ * Collect and drop any prefetch of an older version of a file - no one
+ * can ask for it any more, and the load would otherwise never be
+ * waited for (call with cacheLock held)
+ */
+static void discardStale(char *path, time_t mtime, off_t size)
+{
+  struct t3DModel model;
+  struct tCached *c, *next;
+
+  for(c = cached; c != (struct tCached *)NULL; c = next) {
+    next = c->next;
+    if(c->pLoad != (struct t3DSLoad *)NULL && strcmp(c->path, path) == 0 &&
+       (c->mtime != mtime || c->size != size)) {
+      if(Wait3DS(c->pLoad, &model) >= 0)
+        Free3DS(&model);
+      forget(c);
+      free(c);
+    }
+  }
+}
+
+/*
+ * A new entry for a file, at the head of the list (call with cacheLock held)
+ */
+static struct tCached *enter(char *path, time_t mtime, off_t size)
+{
+  struct tCached *c;
+
+  if((c = (struct tCached *)calloc(1, sizeof(struct tCached))) == (struct tCached *)NULL) {
+    fprintf(stderr,"Acquire3DS: out of memory loading %s\n", path);
+    exit(1);
+  }
+  snprintf(c->path, sizeof(c->path), "%s", path);
+  c->mtime = mtime;
+  c->size = size;
+  c->next = cached;
+  cached = c;
+  return c;
+}
+
+/*
+ * Start loading a model in the background, so that it is ready (or
+ * nearly) when Acquire3DS() asks for it.  Does nothing if the cache
+ * has it already.
+ */
+void Prefetch3DS (char * root, char * strFileName)
+{
+  char path[PATH_MAX];
+  time_t mtime;
+  off_t size;
+
+  if(cacheLock == (VeThrMutex *)NULL)
+    cacheLock = veThrMutexCreate();
+  if(fileKey(root, strFileName, path, &mtime, &size) < 0)
+    return;                               // Acquire3DS() will say so
+  veThrMutexLock(cacheLock);
+  if(lookup(path, mtime, size) == (struct tCached *)NULL)
+    enter(path, mtime, size)->pLoad = Load3DS(root, strFileName);
+  veThrMutexUnlock(cacheLock);
+}
+
+/*
+ * The model in a file - loaded, or shared with everyone else who has
+ * asked for it.  NULL if it cannot be loaded.
+ */
+struct t3DModel *Acquire3DS (char * root, char * strFileName)
+{
+  struct t3DModel *pModel = (struct t3DModel *)NULL;
+  struct tCached *c;
+  char path[PATH_MAX];
+  time_t mtime;
+  off_t size;
+  int ok;
+
+  if(cacheLock == (VeThrMutex *)NULL)
+    cacheLock = veThrMutexCreate();
+  if(fileKey(root, strFileName, path, &mtime, &size) < 0) {
+    fprintf(stderr,"Import3DS: Opening of |%s/%s| failed\n", root, strFileName);
+    return (struct t3DModel *)NULL;
+  }
+
+  /* the lock is held while loading, so that a model is only loaded once */
+  veThrMutexLock(cacheLock);
+  discardStale(path, mtime, size);
+  if((c = lookup(path, mtime, size)) == (struct tCached *)NULL) {
+    c = enter(path, mtime, size);
+    ok = Import3DS(&c->model, root, strFileName);
+  } else if(c->pLoad != (struct t3DSLoad *)NULL) {
+    ok = Wait3DS(c->pLoad, &c->model);
+    c->pLoad = (struct t3DSLoad *)NULL;
+  } else
+    ok = 1;
+  if(ok < 0) {
+    forget(c);
+    free(c);
+  } else {
+    c->refs++;
+    pModel = &c->model;
+# ifdef DEBUG
+    fprintf(stderr,"Acquire3DS: %s has %d users\n", c->path, c->refs);
+# endif
+  }
+  veThrMutexUnlock(cacheLock);
+  return pModel;
+}
+
+/*
+ * Give back a model from Acquire3DS().  When no one else has it, it is
+ * freed - delete its buffer objects (Uncompile3DS()) in each context
+ * before that.
+ */
+void Release3DS (struct t3DModel *pModel)
+{
+  struct tCached *c;
+
+  if(pModel == (struct t3DModel *)NULL)
+    return;
+  veThrMutexLock(cacheLock);
+  for(c = cached; c != (struct tCached *)NULL && &c->model != pModel; c = c->next)
+    ;
+  if(c == (struct tCached *)NULL)
+    fprintf(stderr,"Release3DS: model was not from Acquire3DS()\n");
+  else if(--c->refs == 0) {
+    forget(c);
+    Free3DS(&c->model);
+    free(c);
+  }
+  veThrMutexUnlock(cacheLock);
+}
@@ -0,0 +1,8 @@
+#ifndef _CACHE3DS_H
+#define _CACHE3DS_H
+
+struct t3DModel *Acquire3DS (char * root, char * strFileName ); /* shared - do not change it */
+void Prefetch3DS (char * root, char * strFileName ); /* start loading it for Acquire3DS() */
+void Release3DS (struct t3DModel *pModel );          /* done with it */
+
+# endif
@@ -0,0 +1,204 @@
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <ve.h>
+# include "3ds.h"
+# include "3dsLoader.h"
+# include "loadTexture.h"
+
+/* # define DEBUG */
+
+/*
+ * Loading models in the background.  Load3DS() queues a model and
+ * returns at once; a pool of worker threads reads each queued file
+ * (Parse3DS()) and decodes its textures (decodeTexture()), so a scene's
+ * models load side by side while the application gets on with
+ * starting up.  Wait3DS() then hands the textures to txm and gives
+ * back the model, exactly as Import3DS() would have - call it from the
+ * thread that owns txm (the render thread), then Compile3DS() in each
+ * context that draws the model.
+ *
+ * The pool has a thread per processor, or R3DS_THREADS if that is set
+ * in the environment.  It is started by the first Load3DS(), which
+ * must not race another.
+ */
+
+# define LOAD_QUEUED 0
+# define LOAD_DONE   1
+# define LOAD_FAILED 2
+
+struct t3DSLoad {
+  char root[512];
+  char file[512];
+  int state;                              // LOAD_*
+  struct t3DModel model;
+  struct txtexture **tex;                 // the texture of each material, in list order
+  int *same;                              // ... or the material it shares one with (-1 if not)
+  struct t3DSLoad *next;                  // in the queue
+};
+
+static VeThrMutex *lock = (VeThrMutex *)NULL;
+static VeThrCond *work, *done;
+static struct t3DSLoad *head, *tail;
+
+/*
+ * Read a model and its textures - all of the work that does not need
+ * txm or GL.  Returns LOAD_DONE or LOAD_FAILED.
+ */
+static int loadModel(struct t3DSLoad *pLoad)
+{
+  struct tMaterialInfo *p, *q;
+  int i, j;
+
+  if(Parse3DS(&pLoad->model, pLoad->root, pLoad->file, DEFAULT_CREASE_ANGLE) < 0)
+    return LOAD_FAILED;
+  pLoad->tex = (struct txtexture **)calloc(pLoad->model.numOfMaterials + 1,
+					   sizeof(struct txtexture *));
+  pLoad->same = (int *)malloc(sizeof(int) * (pLoad->model.numOfMaterials + 1));
+  if(pLoad->tex == (struct txtexture **)NULL || pLoad->same == (int *)NULL) {
+    fprintf(stderr,"Load3DS: out of memory for the textures of %s\n", pLoad->file);
+    Free3DS(&pLoad->model);
+    return LOAD_FAILED;
+  }
+  for(i=0, p=pLoad->model.pMaterials; p != (struct tMaterialInfo *)NULL; i++, p=p->next) {
+    pLoad->same[i] = -1;
+    if(*(p->strFile) == '\0')
+      continue;
+    /* materials often share a texture - decode it once */
+    for(j=0, q=pLoad->model.pMaterials; q != p; j++, q=q->next)
+      if(strcmp(q->strFile, p->strFile) == 0)
+	break;
+    if(q != p)
+      pLoad->same[i] = pLoad->same[j] < 0 ? j : pLoad->same[j];
+    else
+      pLoad->tex[i] = decodeTexture(pLoad->root, p->strFile);
+  }
+  return LOAD_DONE;
+}
+
+static void *worker(void *arg)
+{
+  struct t3DSLoad *pLoad;
+  int state;
+
+  for(;;) {
+    veThrMutexLock(lock);
+    while(head == (struct t3DSLoad *)NULL)
+      veThrCondWait(work, lock);
+    pLoad = head;
+    if((head = pLoad->next) == (struct t3DSLoad *)NULL)
+      tail = (struct t3DSLoad *)NULL;
+    veThrMutexUnlock(lock);
+
+# ifdef DEBUG
+    fprintf(stderr,"Load3DS: loading %s/%s\n", pLoad->root, pLoad->file);
+# endif
+    state = loadModel(pLoad);
+
+    veThrMutexLock(lock);
+    pLoad->state = state;
+    veThrCondBcast(done);
+    veThrMutexUnlock(lock);
+  }
+  return NULL;
+}
+
+static void startPool(void)
+{
+  char *s;
+  long n;
+
+  lock = veThrMutexCreate();
+  work = veThrCondCreate();
+  done = veThrCondCreate();
+  if((s = getenv("R3DS_THREADS")) != (char *)NULL)
+    n = atoi(s);
+  else
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n < 1)
+    n = 1;
+# ifdef DEBUG
+  fprintf(stderr,"Load3DS: %ld loader threads\n", n);
+# endif
+  while(n-- > 0)
+    veThreadInit(NULL, worker, NULL, 0, VE_THR_KERNEL);
+}
+
+/*
+ * Start loading a model in the background.  The handle is for Wait3DS().
+ */
+struct t3DSLoad *Load3DS (char * root, char * strFileName)
+{
+  struct t3DSLoad *pLoad;
+
+  if((pLoad = (struct t3DSLoad *)calloc(1, sizeof(struct t3DSLoad))) ==
+     (struct t3DSLoad *)NULL) {
+    fprintf(stderr,"Load3DS: out of memory loading %s\n", strFileName);
+    exit(1);
+  }
+  snprintf(pLoad->root, sizeof(pLoad->root), "%s", root);
+  snprintf(pLoad->file, sizeof(pLoad->file), "%s", strFileName);
+  pLoad->state = LOAD_QUEUED;
+
+  if(lock == (VeThrMutex *)NULL)
+    startPool();
+  veThrMutexLock(lock);
+  if(tail == (struct t3DSLoad *)NULL)
+    head = pLoad;
+  else
+    tail->next = pLoad;
+  tail = pLoad;
+  veThrCondSignal(work);
+  veThrMutexUnlock(lock);
+  return pLoad;
+}
+
+/*
+ * Has the model been read (so that Wait3DS() will not block)?
+ */
+int Ready3DS (struct t3DSLoad *pLoad)
+{
+  int ready;
+
+  veThrMutexLock(lock);
+  ready = pLoad->state != LOAD_QUEUED;
+  veThrMutexUnlock(lock);
+  return ready;
+}
+
+/*
+ * Wait for a model from Load3DS() and put it in pModel, with its
+ * textures given to txm.  Returns what Import3DS() would have.  The
+ * handle is freed - wait for each one once.
+ */
+int Wait3DS (struct t3DSLoad *pLoad, struct t3DModel *pModel)
+{
+  struct tMaterialInfo *p, *q;
+  int i, j, ok;
+
+  veThrMutexLock(lock);
+  while(pLoad->state == LOAD_QUEUED)
+    veThrCondWait(done, lock);
+  veThrMutexUnlock(lock);
+
+  if((ok = pLoad->state == LOAD_DONE)) {
+    *pModel = pLoad->model;
+    for(i=0, p=pModel->pMaterials; p != (struct tMaterialInfo *)NULL; i++, p=p->next) {
+      if(*(p->strFile) == '\0')
+	continue;
+      if(pLoad->same[i] < 0)
+	p->id = addTexture(pLoad->tex[i]);
+      else {
+	/* the one it shares with is earlier in the list, so it has its id */
+	for(j=0, q=pModel->pMaterials; j < pLoad->same[i]; j++, q=q->next)
+	  ;
+	p->id = q->id;
+      }
+    }
+  }
+  free(pLoad->tex);
+  free(pLoad->same);
+  free(pLoad);
+  return ok ? 1 : -1;
+}
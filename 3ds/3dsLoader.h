@@ -0,0 +1,10 @@
+#ifndef _LOAD3DS_H
+#define _LOAD3DS_H
+
+struct t3DSLoad;                                     /* a model being loaded */
+
+struct t3DSLoad *Load3DS (char * root, char * strFileName ); /* start loading */
+int Ready3DS (struct t3DSLoad *pLoad );              /* would Wait3DS() not block? */
+int Wait3DS (struct t3DSLoad *pLoad, struct t3DModel *pModel ); /* as Import3DS() */
+
+# endif
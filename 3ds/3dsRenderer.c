@@ -1,5 +1,8 @@
 # include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
 # include <ve.h>
+# define GL_GLEXT_PROTOTYPES
 # include <GL/gl.h>
 # include <GL/glu.h>
 # include "3ds.h"
@@ -7,82 +10,312 @@
 
 /* # define DEBUG */
 
-void Render3DS (struct t3DModel *pModel )
+/*
+ * Set the surface properties for a material (NULL = none) and return
+ * whether it is textured.
+ */
+static int setMaterial(struct tMaterialInfo *mat)
+{
+  if(mat == (struct tMaterialInfo *)NULL) {
+    glDisable(GL_TEXTURE_2D);
+    glColor3ub(255, 255, 255);
+    return 0;
+  }
+  if(*(mat->strFile) == '\0') {
+    glDisable(GL_TEXTURE_2D);
+    glColor3ub(mat->color[0], mat->color[1], mat->color[2]);
+    return 0;
+  }
+  glEnable(GL_TEXTURE_2D);
+  txmBindTexture(NULL, mat->id);
+  glColor3ub(255, 255, 255);
+  return 1;
+}
+
+/*
+ * Can we use buffer objects in the current context?  GL 1.5 or later -
+ * the ARB extension alone has differently named entry points.
+ */
+static int haveVBO(void)
 {
-  int i, j, Vertex, hasTexture;
+# ifdef GL_ARRAY_BUFFER
+  const char *v;
+  int major, minor;
+
+  if((v = (const char *) glGetString(GL_VERSION)) == (const char *)NULL)
+    return 0;
+  if(sscanf(v, "%d.%d", &major, &minor) != 2)
+    return 0;
+  return (major > 1) || (major == 1 && minor >= 5);
+# else
+  return 0;
+# endif
+}
+
+/*
+ * Which of a mesh's buffer objects (vbo[] and ibo[]) are the current
+ * context's - -1 if it cannot have any.
+ */
+static int contextSlot(void)
+{
+  int k = txmContextId(NULL);
+
+  return (k >= 0 && k < MESH_CONTEXTS) ? k : -1;
+}
+
+/*
+ * Put the mesh Import3DS() built for each object of a model into
+ * buffer objects, so that Render3DS() draws it from there rather than
+ * from client memory.  The buffers belong to the context that is
+ * current when Compile3DS() is called (and to contexts that share
+ * with it), so it must be called in each context that draws the
+ * model - e.g. in each window's setup - and Uncompile3DS() in each
+ * before the model is freed.  Does nothing if the context does not
+ * have buffer objects, txm cannot tell it from the others, or
+ * R3DS_NOVBO is set in the environment.  Returns the number of
+ * objects put into buffers.
+ */
+int Compile3DS(struct t3DModel *pModel)
+{
+  int n = 0;
+# ifdef GL_ARRAY_BUFFER
   struct t3DObject *pObject;
-  struct tMaterialInfo *mat;
+  struct tMesh *m;
+  GLuint b[2];
+  int k;
 
-# ifdef DEBUG
-  fprintf(stderr, "Render3DS: Rendering model\n");
+  if(!haveVBO() || getenv("R3DS_NOVBO") != (char *)NULL || (k = contextSlot()) < 0)
+    return 0;
+  for(pObject=pModel->pObject;pObject != (struct t3DObject *)NULL;pObject=pObject->next) {
+    if((m = pObject->pMesh) == (struct tMesh *)NULL || m->numOfIndices == 0)
+      continue;
+    if(m->vbo[k] != 0) {
+      n++;                                // done already
+      continue;
+    }
+    glGenBuffers(2, b);
+    m->vbo[k] = b[0];
+    m->ibo[k] = b[1];
+    glBindBuffer(GL_ARRAY_BUFFER, m->vbo[k]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 8 * m->numOfVerts, m->pData, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo[k]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->indexSize * m->numOfIndices, m->pIndices,
+		 GL_STATIC_DRAW);
+    n++;
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 # endif
+  return n;
+}
 
-  /* establish 'default' material */
-  mat = (struct tMaterialInfo *) NULL;
-  hasTexture = 0;
-  glDisable(GL_TEXTURE_2D);
-  glColor3ub(255, 0, 0);
-  glBegin(GL_TRIANGLES);
+/*
+ * Delete the buffer objects Compile3DS() made for a model in the
+ * current context.  The model can still be drawn there (from client
+ * memory) or compiled again.
+ */
+void Uncompile3DS(struct t3DModel *pModel)
+{
+# ifdef GL_ARRAY_BUFFER
+  struct t3DObject *pObject;
+  struct tMesh *m;
+  GLuint b[2];
+  int k;
 
-  /* rendering every object */
+  if((k = contextSlot()) < 0)
+    return;
   for(pObject=pModel->pObject;pObject != (struct t3DObject *)NULL;pObject=pObject->next) {
-# ifdef DEBUG
-    fprintf(stderr, "Render3DS: Rendering object %s\n", pObject->strName);
+    if((m = pObject->pMesh) == (struct tMesh *)NULL || m->vbo[k] == 0)
+      continue;
+    b[0] = m->vbo[k];
+    b[1] = m->ibo[k];
+    glDeleteBuffers(2, b);
+    m->vbo[k] = m->ibo[k] = 0;
+  }
 # endif
+}
 
-    /* every face of every object */
-    for (j = 0; j < pObject->numOfFaces; j++ ) {
+/*
+ * A mesh in immediate mode, for Render3DSImmediate() - a glBegin() and
+ * glEnd() around each batch.
+ */
+static void renderMeshImmediate(struct tMesh *m, struct tMaterialInfo **pmat, int *pset)
+{
+  unsigned short *sidx = (unsigned short *)m->pIndices;
+  unsigned int *iidx = (unsigned int *)m->pIndices;
+  int j, k, hasTexture = 0;
+  float *d;
 
-      /* same texture as current? */
-      if(pObject->pFaces[j].mat != mat) {
-	glEnd();
+  for(k = 0; k < m->numOfBatches; k++) {
+    if(!*pset || m->pBatches[k].mat != *pmat) {
+      *pmat = m->pBatches[k].mat;
+      *pset = 1;
+      (void) setMaterial(*pmat);
+    }
+    hasTexture = *pmat != (struct tMaterialInfo *)NULL && *((*pmat)->strFile) != '\0';
+    glBegin(GL_TRIANGLES);
+    for(j = m->pBatches[k].first; j < m->pBatches[k].first + m->pBatches[k].count; j++) {
+      d = m->pData + 8 * (m->indexSize == sizeof(unsigned short) ? sidx[j] : iidx[j]);
+      glNormal3f(d[2], d[3], d[4]);
+      if(hasTexture)
+	glTexCoord2f(d[0], d[1]);
+      glVertex3f(d[5], d[6], d[7]);
+    }
+    glEnd();
+  }
+}
 
-	/* assign surface colour properties */
-	hasTexture = 0;
-	if(pObject->pFaces[j].mat == (struct tMaterialInfo *)NULL) {
-	  glDisable(GL_TEXTURE_2D);
-	  glColor3ub(255, 255, 255);
-# ifdef DEBUG
-	  fprintf(stderr,"rendering unlabelled texture\n");
-# endif
-	  hasTexture = 0;
-	} else {
-	  mat = pObject->pFaces[j].mat;
-	  if(*(mat->strFile) == '\0') {
-	    glDisable(GL_TEXTURE_2D);
-	    glColor3ub(mat->color[0], mat->color[1], mat->color[2]);
+/*
+ * The original renderer - every vertex of every face in immediate
+ * mode, for objects that Import3DS() could not build a mesh for.
+ */
+static void renderObjectImmediate(struct t3DObject *pObject, struct tMaterialInfo **pmat,
+				  int *phasTexture)
+{
+  int j, Vertex, hasTexture = *phasTexture;
+  struct tMaterialInfo *mat = *pmat;
+
+  glBegin(GL_TRIANGLES);
+
+  /* every face of every object */
+  for (j = 0; j < pObject->numOfFaces; j++ ) {
+
+    /* same texture as current? */
+    if(pObject->pFaces[j].mat != mat) {
+      glEnd();
+
+      /* assign surface colour properties */
+      if(pObject->pFaces[j].mat == (struct tMaterialInfo *)NULL) {
 # ifdef DEBUG
-	    fprintf(stderr, "rendering in colour %s\n",mat->strName);
+	fprintf(stderr,"rendering unlabelled texture\n");
 # endif
-	    hasTexture = 0;
-	  } else {
-	    hasTexture = 1;
+	hasTexture = setMaterial((struct tMaterialInfo *)NULL);
+      } else {
+	mat = pObject->pFaces[j].mat;
 # ifdef DEBUG
-	    fprintf(stderr, "Render3DS: Rendering texture %s (%d)\n",mat->strName, mat->id);
+	fprintf(stderr, "Render3DS: Rendering material %s (%d)\n",mat->strName, mat->id);
 # endif
-	    glEnable(GL_TEXTURE_2D);
-	    txmBindTexture(NULL, mat->id);
-	    glColor3ub(255, 255, 255);
-	  }
-	}
+	hasTexture = setMaterial(mat);
       }
       glBegin(GL_TRIANGLES);
+    }
 
-      /* render this polygon */
-      for (Vertex = 0; Vertex < 3; Vertex++ ) {
-	int index = pObject->pFaces[j].vertIndex[Vertex];
-	glNormal3f(pObject->pNormals[index].x, pObject->pNormals[index].y, pObject->pNormals[index].z);
-	if(hasTexture && (pObject->pTexVerts != (struct CVector2 *)NULL)) {
-	  glTexCoord2f(pObject->pTexVerts[index].x, pObject->pTexVerts[index].y);
-	}
-        glVertex3f(pObject->pVerts[index].x, pObject->pVerts[index].y, pObject->pVerts[index].z);
+    /* render this polygon */
+    for (Vertex = 0; Vertex < 3; Vertex++ ) {
+      int index = pObject->pFaces[j].vertIndex[Vertex];
+      glNormal3f(pObject->pNormals[index].x, pObject->pNormals[index].y, pObject->pNormals[index].z);
+      int coord = pObject->pFaces[j].coordIndex[Vertex];
+      if(hasTexture && (pObject->pTexVerts != (struct CVector2 *)NULL) &&
+	 coord < pObject->numTexVertex) {
+	glTexCoord2f(pObject->pTexVerts[coord].x, pObject->pTexVerts[coord].y);
       }
+      glVertex3f(pObject->pVerts[index].x, pObject->pVerts[index].y, pObject->pVerts[index].z);
     }
-    glEnd();
   }
-# ifdef DEBUG 
+  glEnd();
+  *pmat = mat;
+  *phasTexture = hasTexture;
+}
+
+/*
+ * Draw the batches of a mesh - one glDrawElements() per
+ * material, and the material is only set up when it changes.  The
+ * buffer objects of the context's slot are used if it has them; they are
+ * left bound between objects (*pbound) and render() clears them at
+ * the end.
+ */
+static void renderObjectBatches(struct tMesh *m, int slot, struct tMaterialInfo **pmat, int *pset,
+				int *pbound)
+{
+  GLenum type = m->indexSize == sizeof(unsigned short) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  char *data = (char *)m->pData, *indices = (char *)m->pIndices;
+  int k;
+
+  if(m->numOfIndices == 0)
+    return;
+# ifdef GL_ARRAY_BUFFER
+  if(slot >= 0 && m->vbo[slot]) {
+    glBindBuffer(GL_ARRAY_BUFFER, m->vbo[slot]);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo[slot]);
+    data = indices = (char *)NULL;
+    *pbound = 1;
+  } else if(*pbound) {
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    *pbound = 0;
+  }
+# endif
+  glInterleavedArrays(GL_T2F_N3F_V3F, 0, data);
+  for(k = 0; k < m->numOfBatches; k++) {
+    if(!*pset || m->pBatches[k].mat != *pmat) {
+      *pmat = m->pBatches[k].mat;
+      *pset = 1;
+      (void) setMaterial(*pmat);
+    }
+    glDrawElements(GL_TRIANGLES, m->pBatches[k].count, type,
+		   indices + m->indexSize * m->pBatches[k].first);
+  }
+}
+
+static void render(struct t3DModel *pModel, int immediate)
+{
+  int hasTexture, batched = 0, bound = 0, set = 0, slot = -1;
+  struct t3DObject *pObject;
+  struct tMaterialInfo *mat, *bmat = (struct tMaterialInfo *)NULL;
+
+# ifdef DEBUG
+  fprintf(stderr, "Render3DS: Rendering model\n");
+# endif
+
+  /* establish 'default' material */
+  mat = (struct tMaterialInfo *) NULL;
+  hasTexture = 0;
+  glDisable(GL_TEXTURE_2D);
+  glColor3ub(255, 0, 0);
+
+  /* rendering every object */
+  for(pObject=pModel->pObject;pObject != (struct t3DObject *)NULL;pObject=pObject->next) {
+# ifdef DEBUG
+    fprintf(stderr, "Render3DS: Rendering object %s\n", pObject->strName);
+# endif
+    if(pObject->pMesh == (struct tMesh *)NULL) {
+      renderObjectImmediate(pObject, &mat, &hasTexture);
+      set = 0;
+    } else if(immediate) {
+      renderMeshImmediate(pObject->pMesh, &bmat, &set);
+      mat = bmat;
+      hasTexture = bmat && *(bmat->strFile);
+    } else {
+      if(!batched) {
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	slot = contextSlot();
+	batched = 1;
+      }
+      renderObjectBatches(pObject->pMesh, slot, &bmat, &set, &bound);
+      mat = bmat;
+      hasTexture = bmat && *(bmat->strFile);
+    }
+  }
+  if(batched) {
+# ifdef GL_ARRAY_BUFFER
+    if(bound) {
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+# endif
+    glPopClientAttrib();
+  }
+# ifdef DEBUG
   fprintf(stderr, "Render3DS: Rendering complete\n");
 # endif
 }
 
+void Render3DS (struct t3DModel *pModel )
+{
+  render(pModel, 0);
+}
 
+void Render3DSImmediate (struct t3DModel *pModel )
+{
+  render(pModel, 1);
+}
@@ -1,6 +1,9 @@
 #ifndef _RENDER3DS_H
 #define _RENDER3DS_H
 
+int Compile3DS (struct t3DModel *pModel );          /* in each context, after Import3DS() */
+void Uncompile3DS (struct t3DModel *pModel );       /* in each context, before Free3DS() */
 void Render3DS (struct t3DModel *pModel );
+void Render3DSImmediate (struct t3DModel *pModel ); /* same, in immediate mode */
 
 # endif
@@ -0,0 +1,210 @@
+/*
+ * 3dsbench - compares the immediate mode and compiled (vertex array /
+ * buffer object) paths of Render3DS() on a model: the number of GL
+ * calls each makes per frame and the time per frame.
+ *
+ *   3dsbench [-n frames] [-s size] [-crease degrees] [-novbo] <root> <file.3ds>
+ *
+ * This needs no window system - it draws into an EGL pbuffer, so with
+ * Mesa it runs anywhere, e.g.
+ *
+ *   EGL_PLATFORM=surfaceless LIBGL_ALWAYS_SOFTWARE=1 \
+ *     ./3dsbench ../vr-auto-show/cars Corvette.3ds
+ *
+ * The GL calls are counted by building the renderer into this program
+ * with every GL entry point it uses wrapped in a counting macro, so the
+ * counts are exactly what Render3DS() asks for, whatever the driver
+ * does with them.
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <EGL/egl.h>
+# include <EGL/eglext.h>
+# include <ve.h>
+# define GL_GLEXT_PROTOTYPES
+# include <GL/gl.h>
+# include <GL/glu.h>
+
+static long glcalls, gldraws;
+
+# define COUNT(x) (glcalls++, x)
+# define DRAW(x) (glcalls++, gldraws++, x)
+# define glBegin(a) DRAW(glBegin(a))
+# define glEnd() COUNT(glEnd())
+# define glNormal3f(a,b,c) COUNT(glNormal3f(a,b,c))
+# define glTexCoord2f(a,b) COUNT(glTexCoord2f(a,b))
+# define glVertex3f(a,b,c) COUNT(glVertex3f(a,b,c))
+# define glColor3ub(a,b,c) COUNT(glColor3ub(a,b,c))
+# define glEnable(a) COUNT(glEnable(a))
+# define glDisable(a) COUNT(glDisable(a))
+# define glBindBuffer(a,b) COUNT(glBindBuffer(a,b))
+# define glInterleavedArrays(a,b,c) COUNT(glInterleavedArrays(a,b,c))
+# define glDrawElements(a,b,c,d) DRAW(glDrawElements(a,b,c,d))
+# define glPushClientAttrib(a) COUNT(glPushClientAttrib(a))
+# define glPopClientAttrib() COUNT(glPopClientAttrib())
+# define txmBindTexture(a,b) COUNT(txmBindTexture(a,b))
+
+# include "3dsRenderer.c"
+
+# undef glEnable
+# undef glDisable
+
+/*
+ * Just enough of a texture renderer for txm to load the model's
+ * textures into the one context we have.
+ */
+static int bench_reserve(void) { GLuint id; glGenTextures(1, &id); return (int)id; }
+static int bench_ctxid(void) { return 0; }
+static int bench_bind(int id) { glBindTexture(GL_TEXTURE_2D, id); return 0; }
+static int bench_unload(int id) { GLuint d = id; glDeleteTextures(1, &d); return 0; }
+static int bench_load(int id, TXTexture *t)
+{
+  static GLenum fmts[5] = { 0, GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA };
+
+  if(t->type != TXM_UBYTE || t->ncomp <= 0 || t->ncomp > 4)
+    return -1;
+  glBindTexture(GL_TEXTURE_2D, id);
+  gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGBA, t->width, t->height, fmts[t->ncomp],
+		    GL_UNSIGNED_BYTE, t->data);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  return 0;
+}
+static TXRenderer bench_renderer = {
+  bench_reserve, bench_ctxid, bench_load, bench_unload, bench_bind, NULL
+};
+
+static void makeContext(int size)
+{
+  EGLint cattr[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 16, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLint sattr[] = { EGL_WIDTH, size, EGL_HEIGHT, size, EGL_NONE };
+  EGLDisplay dpy;
+  EGLConfig cfg;
+  EGLContext ctx;
+  EGLSurface surf;
+  EGLint n;
+
+  if((dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY)) == EGL_NO_DISPLAY ||
+     !eglInitialize(dpy, NULL, NULL)) {
+    fprintf(stderr, "3dsbench: cannot open an EGL display\n");
+    exit(1);
+  }
+  if(!eglBindAPI(EGL_OPENGL_API) ||
+     !eglChooseConfig(dpy, cattr, &cfg, 1, &n) || n < 1 ||
+     (ctx = eglCreateContext(dpy, cfg, EGL_NO_CONTEXT, NULL)) == EGL_NO_CONTEXT) {
+    fprintf(stderr, "3dsbench: cannot create an OpenGL context\n");
+    exit(1);
+  }
+  if((surf = eglCreatePbufferSurface(dpy, cfg, sattr)) == EGL_NO_SURFACE ||
+     !eglMakeCurrent(dpy, surf, surf, ctx)) {
+    fprintf(stderr, "3dsbench: cannot create a %dx%d pbuffer\n", size, size);
+    exit(1);
+  }
+  fprintf(stderr, "3dsbench: %s / %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+}
+
+static void setupView(struct t3DModel *model, int size)
+{
+  static GLfloat pos[4] = { 1.0, 1.0, 1.0, 0.0 };
+
+  glViewport(0, 0, size, size);
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  gluPerspective(45.0, 1.0, 0.1, 100.0);
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  gluLookAt(0.0, 0.5, 3.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+  glScalef(model->scale, model->scale, model->scale);
+  glTranslatef(-model->center_x, -model->center_y, -model->center_z);
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_LIGHTING);
+  glEnable(GL_LIGHT0);
+  glLightfv(GL_LIGHT0, GL_POSITION, pos);
+  glEnable(GL_COLOR_MATERIAL);
+  glEnable(GL_NORMALIZE);
+}
+
+/* average time per frame in ms, and GL calls/draws per frame */
+static double bench(struct t3DModel *model, int immediate, int frames, long *calls, long *draws)
+{
+  long t0;
+  int k;
+
+  /* warm up (first use of textures, buffers) */
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  render(model, immediate);
+  glFinish();
+
+  glcalls = gldraws = 0;
+  t0 = veClockNano();
+  for(k = 0; k < frames; k++) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    render(model, immediate);
+    glFinish();
+  }
+  *calls = glcalls / frames;
+  *draws = gldraws / frames;
+  return (veClockNano() - t0) / (1.0e6 * frames);
+}
+
+int main(int argc, char **argv)
+{
+  struct t3DModel model;
+  struct t3DObject *o;
+  int frames = 50, size = 512, verts = 0, drawn = 0, faces = 0, batches = 0, vbo = 0, i;
+  float crease = DEFAULT_CREASE_ANGLE;
+  long icalls, idraws, ccalls, cdraws;
+  double itime, ctime;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if(strcmp(argv[i], "-n") == 0 && i+1 < argc)
+      frames = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-s") == 0 && i+1 < argc)
+      size = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-crease") == 0 && i+1 < argc)
+      crease = atof(argv[++i]);
+    else if(strcmp(argv[i], "-novbo") == 0)
+      setenv("R3DS_NOVBO", "1", 1);
+    else
+      break;
+  }
+  if(argc - i != 2 || frames <= 0 || size <= 0) {
+    fprintf(stderr, "usage: 3dsbench [-n frames] [-s size] [-crease degrees] [-novbo] "
+	    "<root> <file.3ds>\n");
+    exit(1);
+  }
+
+  makeContext(size);
+  txmSetRenderer(NULL, &bench_renderer);
+  if(Import3DSSmooth(&model, argv[i], argv[i+1], crease) < 0) {
+    fprintf(stderr, "3dsbench: cannot load %s/%s\n", argv[i], argv[i+1]);
+    exit(1);
+  }
+  vbo = Compile3DS(&model) > 0;
+  for(o = model.pObject; o != (struct t3DObject *)NULL; o = o->next) {
+    verts += o->numOfVerts;
+    faces += o->numOfFaces;
+    if(o->pMesh) {
+      drawn += o->pMesh->numOfVerts;
+      batches += o->pMesh->numOfBatches;
+    }
+  }
+  setupView(&model, size);
+
+  itime = bench(&model, 1, frames, &icalls, &idraws);
+  ctime = bench(&model, 0, frames, &ccalls, &cdraws);
+
+  printf("%s: %d objects, %d vertices (%d drawn), %d faces, %d materials, %d batches\n",
+	 argv[i+1], model.numOfObjects, verts, drawn, faces, model.numOfMaterials, batches);
+  printf("  immediate      %8ld GL calls %6ld draws/frame  %8.2f ms/frame\n",
+	 icalls, idraws, itime);
+  printf("  %-14s %8ld GL calls %6ld draws/frame  %8.2f ms/frame\n",
+	 vbo ? "buffer objects" : "vertex arrays", ccalls, cdraws, ctime);
+  printf("  calls %.1fx fewer, %.2fx faster\n",
+	 ccalls > 0 ? (double)icalls / ccalls : 0.0, ctime > 0.0 ? itime / ctime : 0.0);
+  return 0;
+}
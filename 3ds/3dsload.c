@@ -0,0 +1,186 @@
+/*
+ * 3dsload - times Parse3DS() (reading a file and building its meshes,
+ * without the textures) on a set of models.
+ *
+ *   3dsload [-n repeat] [-j threads] [-scene] <root> <file.3ds> ...
+ *
+ * e.g.
+ *
+ *   ./3dsload -n 5 ../vr-auto-show/cars *.3ds
+ *
+ * With -j the files are shared out among that many threads, all
+ * parsing at once, to check that the parser is reentrant (run it
+ * under a thread sanitizer) and to see how loading scales.
+ *
+ * With -scene the files are loaded as one scene, textures and all -
+ * once with Import3DS() one after another, and once with Load3DS()
+ * and Wait3DS() (set R3DS_THREADS to change the number of loader
+ * threads).
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <sys/stat.h>
+# include <pthread.h>
+# include <ve.h>
+# include "3ds.h"
+# include "3dsLoader.h"
+
+struct load {
+  char *root, *file;
+  int repeat;
+  int objects, verts, faces;
+  long size;
+  double ms;                              // per load
+  int failed;
+};
+
+static struct load *loads;
+static int nloads, next;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void timeLoad(struct load *l)
+{
+  struct t3DModel model;
+  struct t3DObject *o;
+  struct stat st;
+  char path[1024];
+  long t0;
+  int k;
+
+  snprintf(path, sizeof(path), "%s/%s", l->root, l->file);
+  l->size = stat(path, &st) == 0 ? (long)st.st_size : 0;
+  t0 = veClockNano();
+  for(k = 0; k < l->repeat; k++) {
+    if(Parse3DS(&model, l->root, l->file, DEFAULT_CREASE_ANGLE) < 0) {
+      l->failed = 1;
+      return;
+    }
+    if(k == 0) {
+      l->objects = model.numOfObjects;
+      for(o = model.pObject; o != (struct t3DObject *)NULL; o = o->next) {
+	l->verts += o->numOfVerts;
+	l->faces += o->numOfFaces;
+      }
+    }
+    Free3DS(&model);
+  }
+  l->ms = (veClockNano() - t0) / (1.0e6 * l->repeat);
+}
+
+static void *worker(void *arg)
+{
+  int k;
+
+  for(;;) {
+    pthread_mutex_lock(&lock);
+    k = next++;
+    pthread_mutex_unlock(&lock);
+    if(k >= nloads)
+      return NULL;
+    timeLoad(&loads[k]);
+  }
+}
+
+/*
+ * txm wants a renderer to bind textures with - this one does nothing
+ */
+static int null_reserve(void) { static int id = 0; return ++id; }
+static int null_ctxid(void) { return 0; }
+static int null_load(int id, TXTexture *t) { return 0; }
+static int null_id(int id) { return 0; }
+static TXRenderer null_renderer = {
+  null_reserve, null_ctxid, null_load, null_id, null_id, NULL
+};
+
+/* the time to load every file, in ms */
+static double timeScene(char *root, char **files, int n, int async)
+{
+  struct t3DSLoad **pending;
+  struct t3DModel model;
+  long t0;
+  int k;
+
+  pending = (struct t3DSLoad **)malloc(sizeof(struct t3DSLoad *) * n);
+  t0 = veClockNano();
+  if(async) {
+    for(k = 0; k < n; k++)
+      pending[k] = Load3DS(root, files[k]);
+    for(k = 0; k < n; k++)
+      if(Wait3DS(pending[k], &model) > 0)
+	Free3DS(&model);
+  } else {
+    for(k = 0; k < n; k++)
+      if(Import3DS(&model, root, files[k]) > 0)
+	Free3DS(&model);
+  }
+  free(pending);
+  return (veClockNano() - t0) / 1.0e6;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t *threads;
+  int repeat = 3, nthreads = 1, scene = 0, i, k;
+  long t0, bytes = 0;
+  double wall, ms = 0.0, serial = 0.0, async = 0.0;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if(strcmp(argv[i], "-n") == 0 && i+1 < argc)
+      repeat = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-j") == 0 && i+1 < argc)
+      nthreads = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-scene") == 0)
+      scene = 1;
+    else
+      break;
+  }
+  if(argc - i < 2 || repeat <= 0 || nthreads <= 0) {
+    fprintf(stderr, "usage: 3dsload [-n repeat] [-j threads] [-scene] <root> <file.3ds> ...\n");
+    exit(1);
+  }
+
+  if(scene) {
+    txmSetRenderer(NULL, &null_renderer);
+    (void) timeScene(argv[i], argv + i + 1, argc - i - 1, 1);   /* start the loader threads */
+    for(k = 0; k < repeat; k++) {
+      serial += timeScene(argv[i], argv + i + 1, argc - i - 1, 0);
+      async += timeScene(argv[i], argv + i + 1, argc - i - 1, 1);
+    }
+    printf("%d files: Import3DS() %.2f ms, Load3DS() %.2f ms (%.2fx)\n", argc - i - 1,
+	   serial / repeat, async / repeat, async > 0.0 ? serial / async : 0.0);
+    return 0;
+  }
+
+  nloads = argc - i - 1;
+  loads = (struct load *)calloc(nloads, sizeof(struct load));
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+  for(k = 0; k < nloads; k++) {
+    loads[k].root = argv[i];
+    loads[k].file = argv[i+1+k];
+    loads[k].repeat = repeat;
+  }
+
+  t0 = veClockNano();
+  for(k = 0; k < nthreads; k++)
+    pthread_create(&threads[k], NULL, worker, NULL);
+  for(k = 0; k < nthreads; k++)
+    pthread_join(threads[k], NULL);
+  wall = (veClockNano() - t0) / 1.0e6;
+
+  for(k = 0; k < nloads; k++) {
+    if(loads[k].failed) {
+      printf("%-32s failed\n", loads[k].file);
+      continue;
+    }
+    printf("%-32s %8ld bytes %4d objects %7d vertices %7d faces %8.2f ms %7.1f MB/s\n",
+	   loads[k].file, loads[k].size, loads[k].objects, loads[k].verts, loads[k].faces,
+	   loads[k].ms, loads[k].ms > 0.0 ? loads[k].size / (1.0e3 * loads[k].ms) : 0.0);
+    bytes += loads[k].size;
+    ms += loads[k].ms;
+  }
+  printf("total %ld bytes, %.2f ms per load of all files (%.1f MB/s), "
+	 "%.2f ms wall with %d thread%s\n", bytes, ms, ms > 0.0 ? bytes / (1.0e3 * ms) : 0.0,
+	 wall / repeat, nthreads, nthreads == 1 ? "" : "s");
+  return 0;
+}
@@ -1,5 +1,6 @@
 # include <stdio.h>
-# include <strings.h>
+# include <stdlib.h>
+# include <string.h>
 # include <ve.h>
 # include "loadTexture.h"
 # ifdef OLD_VE
@@ -25,55 +26,90 @@ static char *types[] = {
 };
 
 
-int loadTexture(char *root, char *fname)
+/*
+ * Find the file for a texture, trying each of the paths and types in
+ * turn.  Returns 0 with its name in buf, or -1 if there is none.
+ */
+static int findTexture(char *root, char *fname, char *buf, int size)
 {
   FILE *fd;
-  char head[255], tail[255], buf[512], *p, *q, *s;
-  int id, i, j;
-
-# ifdef DEBUG
-  fprintf(stderr,"loading texture |%s|\n",fname);
-# endif
+  char head[255], *p;
+  int i, j;
 
   p = strrchr(fname, '.');
-  if(p == (char *)NULL) {
-    strcpy(tail, "");
-    strcpy(head, fname);
-  } else {
-    strcpy(tail, p+1);
-    for(s=head,q=fname;q!=p;q++,s++){
-      *s = *q;
-    }
-    *s = '\0';
-  }
+  if(p == (char *)NULL)
+    p = fname + strlen(fname);
+  if(p - fname >= sizeof(head))
+    return(-1);
+  memcpy(head, fname, p - fname);
+  head[p - fname] = '\0';
 # ifdef DEBUG
-  fprintf(stderr,"loadTexture: %s |%s| and |%s|\n",fname, head,tail);
+  fprintf(stderr,"loadTexture: %s |%s|\n",fname, head);
 # endif
   for(i=0;*paths[i] != '\0';i++) {
     for(j=0;*types[j] != '\0';j++) {
-      sprintf(buf, "%s/%s%s%s",root, paths[i],head,types[j]);
+      snprintf(buf, size, "%s/%s%s%s",root, paths[i],head,types[j]);
 # ifdef DEBUG
       fprintf(stderr,"loadTexture: %s as %s\n",fname,buf);
 # endif
       if((fd = fopen(buf,"r")) != (FILE *)NULL) {
 	(void) fclose(fd);
-# ifdef DEBUG
-	fprintf(stderr, "*** sending %s to txm\n",buf);
-# endif
-	if((id = txmAddTexFile(NULL, buf, NULL, 0)) > 0) {
-# ifdef DEUBG
-	  fprintf(stderr,"**** texture %s found as %s\n",fname,buf);
-# endif
-	  txmBindTexture(NULL, id);
-	  return id;
-	} else {
-	  fprintf(stderr,"**** texture %s not loadable\n",fname);
-	  return(-1);
-	}
+	return 0;
       }
     }
   }
-
-  fprintf(stderr,"**** texture %s missing\n",fname);
   return(-1);
 }
+
+/*
+ * Read a texture into memory, without telling txm about it (so this
+ * is safe in any thread).  NULL if it is missing or cannot be read.
+ */
+TXTexture *decodeTexture(char *root, char *fname)
+{
+  TXTexture *t;
+  char buf[512];
+
+# ifdef DEBUG
+  fprintf(stderr,"loading texture |%s|\n",fname);
+# endif
+  if(findTexture(root, fname, buf, sizeof(buf)) < 0) {
+    fprintf(stderr,"**** texture %s missing\n",fname);
+    return (TXTexture *)NULL;
+  }
+# ifdef DEBUG
+  fprintf(stderr, "*** sending %s to txm\n",buf);
+# endif
+  if((t = txmLoadFile(buf, NULL, 0)) == (TXTexture *)NULL)
+    fprintf(stderr,"**** texture %s not loadable\n",fname);
+  return t;
+}
+
+/*
+ * Hand a texture from decodeTexture() over to txm, which owns it from
+ * then on (and frees it if it already has the same one).  Returns its
+ * id, or -1 for no texture.  txm is not thread safe - call this from
+ * one thread at a time.
+ */
+int addTexture(TXTexture *t)
+{
+  TXTexture *u;
+  int id;
+
+  if(t == (TXTexture *)NULL)
+    return(-1);
+  id = txmAddTexture(NULL, t->data, t->type, t->width, t->height, t->ncomp, 0);
+  if(id <= 0 || (u = txmLookupTexture(NULL, id)) == (TXTexture *)NULL || u->data != t->data)
+    free(t->data);
+  free(t);  /* do not free internal fields */
+  return id > 0 ? id : -1;
+}
+
+int loadTexture(char *root, char *fname)
+{
+  int id;
+
+  if((id = addTexture(decodeTexture(root, fname))) > 0)
+    txmBindTexture(NULL, id);
+  return id;
+}
@@ -15,4 +15,7 @@
 #ifndef _TEXTURELOADER_H
 #define _TEXTURELOADER_H
 int loadTexture(char *root, char *fname);
+/* the two halves of loadTexture() - see loadTexture.c */
+struct txtexture *decodeTexture(char *root, char *fname);
+int addTexture(struct txtexture *t);
 #endif
@@ -3,6 +3,9 @@
  * to maintain throughput from the input tracker and to reduce
  * the latency of events delivered to the application
  *
+ * When the device I/O reactor is available, it reads the line
+ * for us instead and neither thread is started.
+ *
  */
 
 #include <assert.h>
@@ -83,7 +86,11 @@ typedef struct vei_ft {
   float update_rate;
   VeStatistic *cback_rate_stat;
   float cback_rate;
+  int nupdates, ncbacks;
+  long elapsed, cback_elapsed;
 
+  int pos_id[MAXSTATION], quat_id[MAXSTATION]; /* element names */
+  VeDeviceIO *io; /* NULL if we are reading in our own threads */
 } VeiFT;
 
 
@@ -377,6 +384,180 @@ static int line_is_clean(FILE *f) {
   return 0; /* it's not clean */
 }
 
+/*
+ * parse one line from the tracker and update the data[] array
+ * (do *not* generate VE events) - now is the time the line was received
+ */
+static void parse_line(VeDevice *d, VeiFT *f, char *linebuf, long now) {
+  int lineoffs;
+  /* data we read in... */
+  int stnum;
+  long tmstamp;
+  VeVector3 p;
+  VeQuat q;
+
+  if ((f->nupdates % 50) == 0) {
+    if (f->nupdates > 0) {
+      f->elapsed = veClock() - f->elapsed;
+      f->update_rate = f->nupdates/(float)(f->elapsed/1000.0);
+      veUpdateStatistic(f->update_rate_stat);
+    }
+    f->nupdates = 0;
+    f->elapsed = veClock();
+  }
+  f->nupdates++;
+
+  VE_DEBUG(2,("%s: reading incoming line",d->name));
+
+  if (f->tmstamp) {
+    if (sscanf(linebuf,TMSTAMP_SCAN "%n",
+	       &stnum,&tmstamp,
+	       &(p.data[0]),&(p.data[1]),&(p.data[2]),
+	       &(q.data[3]),&(q.data[0]),&(q.data[1]),&(q.data[2]),
+	       &lineoffs) < TMSTAMP_SCAN_CNT) {
+      veNotice(MODULE,"%s: mangled input - no time-stamp",d->name);
+      return;
+    }
+    if (strlen(linebuf) != TMSTAMP_SIZE) {
+      veNotice(MODULE,"%s: mangled input - incorrect line size",d->name);
+      return;
+    }
+    tmstamp += f->tmstamp_zero;
+  } else {
+    /* effects of "%n" on return count are non-standard */
+    if (sscanf(linebuf,STD_SCAN "%n",
+	       &stnum,
+	       &(p.data[0]),&(p.data[1]),&(p.data[2]),
+	       &(q.data[3]),&(q.data[0]),&(q.data[1]),&(q.data[2]),
+	       &lineoffs) < STD_SCAN_CNT) {
+      veNotice(MODULE,"%s: mangled input - no time-stamp",d->name);
+      return;
+    }
+    if (strlen(linebuf) != STD_SIZE) {
+      veNotice(MODULE,"%s: mangled input - incorrect line size",d->name);
+      return;
+    }
+    tmstamp = now;
+  }
+
+  if (stnum <= 0 || stnum >= MAXSTATION) {
+    veNotice(MODULE,"%s: mangled input - invalid station number: %d",
+	     d->name,stnum);
+    return;
+  }
+
+  /* is the line clean */
+  {
+    char *l;
+    l = &(linebuf[lineoffs]);
+    while (isspace(*l))
+      l++;
+    if (*l != '\0') {
+      veNotice(MODULE,"%s: mangled line - junk after actual data: %s",l);
+      return;
+    }
+  }
+
+  /* we have read a clean-line */
+  /* tweak values */
+  p.data[0] *= 0.01;
+  p.data[1] *= 0.01;
+  p.data[2] *= 0.01;
+
+  VE_DEBUG(2,("%s: successfully parsed line",d->name));
+
+  /* update */
+  {
+    VeiFTStation *st;
+    float pd, qd;
+
+    st = &(f->data[stnum-1]);
+
+    /* do we need to update?  we are the only ones
+       updating so we don't need to lock to check... */
+    pd = PDIST2(st->p,p);
+    qd = QDIST2(st->q,q);
+    /* To update, this must be an active station, plus one 
+       of the following must be true:
+       - init == 0 (have never updated this station)
+       - both epsilons are 0 (implies no filtering)
+       - change in either p or q exceeds its respective
+         epsilon value
+       - tmstamp must be >= current timestamp and 
+         <= (current timestamp - TMSTAMP_WINDOW) 
+         (helps throw away some bogus entries)
+         (only check if st->init is true
+    */
+    if (st->active && (!st->init || (st->p_eps2 == 0.0 && 
+				     st->q_eps2 == 0.0) ||
+		       st->p_eps2 <= pd || st->q_eps2 <= qd)
+	&& (!st->init || tmstamp >= st->tmstamp)) {
+      /* update data - need to lock to avoid partial updates
+	 being passed on, and to get cond. var. right */
+      VE_DEBUG(2,("%s: update - [%ld] %2d (%2.4f,%2.4f,%2.4f) (%1.5f,%1.5f,%1.5f,%1.5f)",
+		  d->name,tmstamp,stnum,
+		  p.data[0],p.data[1],p.data[2],
+		  q.data[0],q.data[1],q.data[2],q.data[3]));
+
+      veThrMutexLock(f->mutex);
+      st->p = p;
+      st->q = q;
+      st->tmstamp = tmstamp;
+      st->init = 1;
+      st->updated = 1;
+      veThrCondSignal(f->update);
+      veThrMutexUnlock(f->mutex);
+    }
+  }
+}
+
+/*
+ * send a VE event for a station
+ */
+static void send_station(VeDevice *d, VeiFT *f, int stnum, long tmstamp,
+			 VeVector3 *p, VeQuat *q) {
+  int k;
+
+  VE_DEBUG(2,("%s: callback for station %d",d->name,stnum));
+  if ((f->ncbacks % 50) == 0) {
+    if (f->ncbacks > 0) {
+      f->cback_elapsed = veClock() - f->cback_elapsed;
+      f->cback_rate = f->ncbacks/(float)(f->cback_elapsed/1000.0);
+      veUpdateStatistic(f->cback_rate_stat);
+    }
+    f->ncbacks = 0;
+    f->cback_elapsed = veClock();
+  }
+  f->ncbacks++;
+
+  /* make sure we process both position and quaternion before
+     frame updates */
+  {
+    VeDeviceEvent *ve;
+    VeDeviceE_Vector *evec;
+
+    veLockFrame();
+
+    /* update elements */
+    ve = veDeviceEventInitId(VE_ELEM_VECTOR,3,d->id,f->pos_id[stnum-1]);
+    evec = (VeDeviceE_Vector *)(ve->content);
+    for(k = 0; k < 3; k++)
+      evec->value[k] = p->data[k];
+    ve->timestamp = tmstamp;
+    veDeviceInsertEvent(ve);
+
+    /* right now there is no correction of angles - this is wrong! */
+    ve = veDeviceEventInitId(VE_ELEM_VECTOR,4,d->id,f->quat_id[stnum-1]);
+    evec = (VeDeviceE_Vector *)(ve->content);
+    for(k = 0; k < 4; k++)
+      evec->value[k] = q->data[k];
+    ve->timestamp = tmstamp;
+    veDeviceInsertEvent(ve);
+
+    veUnlockFrame();
+  }
+}
+
 /*
  * read thread - read in values from tracker as quickly as
  * possible and update the data[] array (do *not* generate
@@ -388,15 +569,7 @@ static void *read_thread(void *v) {
   VeiFT *f = (VeiFT *)(d->instance->idata);
   FILE *logf = NULL;
   char linebuf[MAXLN];
-  int lineoffs, k;
-  int nupdates;
-  long elapsed = 0;
   FILE *inf;
-  /* data we read in... */
-  int stnum;
-  long tmstamp;
-  VeVector3 p;
-  VeQuat q;
 
 #if 0
   logf = fopen("/tmp/fastrak.log","w");
@@ -410,17 +583,6 @@ static void *read_thread(void *v) {
   send_ft(f->fd,(f->stream ? "C" : "c"));
 
   while (1) {
-    if ((nupdates % 50) == 0) {
-      if (nupdates > 0) {
-	elapsed = veClock() - elapsed;
-	f->update_rate = nupdates/(float)(elapsed/1000.0);
-	veUpdateStatistic(f->update_rate_stat);
-      }
-      nupdates = 0;
-      elapsed = veClock();
-    }
-    nupdates++;
-
     if (!(f->stream)) {
       VE_DEBUG(2,("%s: polling tracker",d->name));
       send_ft(f->fd,"P");
@@ -442,108 +604,7 @@ static void *read_thread(void *v) {
     }
 #endif
 
-    VE_DEBUG(2,("%s: reading incoming line",d->name));
-
-    if (f->tmstamp) {
-      if (sscanf(linebuf,TMSTAMP_SCAN "%n",
-		 &stnum,&tmstamp,
-		 &(p.data[0]),&(p.data[1]),&(p.data[2]),
-		 &(q.data[3]),&(q.data[0]),&(q.data[1]),&(q.data[2]),
-		 &lineoffs) < TMSTAMP_SCAN_CNT) {
-	veNotice(MODULE,"%s: mangled input - no time-stamp",d->name);
-	continue;
-      }
-      if (strlen(linebuf) != TMSTAMP_SIZE) {
-	veNotice(MODULE,"%s: mangled input - incorrect line size",d->name);
-	continue;
-      }
-      tmstamp += f->tmstamp_zero;
-    } else {
-      /* effects of "%n" on return count are non-standard */
-      if (sscanf(linebuf,STD_SCAN "%n",
-		 &stnum,
-		 &(p.data[0]),&(p.data[1]),&(p.data[2]),
-		 &(q.data[3]),&(q.data[0]),&(q.data[1]),&(q.data[2]),
-		 &lineoffs) < STD_SCAN_CNT) {
-	veNotice(MODULE,"%s: mangled input - no time-stamp",d->name);
-	continue;
-      }
-      if (strlen(linebuf) != STD_SIZE) {
-	veNotice(MODULE,"%s: mangled input - incorrect line size",d->name);
-	continue;
-      }
-      tmstamp = veClock();
-    }
-
-    if (stnum <= 0 || stnum >= MAXSTATION) {
-      veNotice(MODULE,"%s: mangled input - invalid station number: %d",
-	      d->name,stnum);
-      continue;
-    }
-
-    /* is the line clean */
-    {
-      char *l;
-      l = &(linebuf[lineoffs]);
-      while (isspace(*l))
-	l++;
-      if (*l != '\0') {
-	veNotice(MODULE,"%s: mangled line - junk after actual data: %s",l);
-	continue;
-      }
-    }
-
-    /* we have read a clean-line */
-    /* tweak values */
-    p.data[0] *= 0.01;
-    p.data[1] *= 0.01;
-    p.data[2] *= 0.01;
-
-    VE_DEBUG(2,("%s: successfully parsed line",d->name));
-
-    /* update */
-    {
-      VeiFTStation *st;
-      float pd, qd;
-
-      st = &(f->data[stnum-1]);
-
-      /* do we need to update?  we are the only ones
-	 updating so we don't need to lock to check... */
-      pd = PDIST2(st->p,p);
-      qd = QDIST2(st->q,q);
-      /* To update, this must be an active station, plus one 
-	 of the following must be true:
-	 - init == 0 (have never updated this station)
-	 - both epsilons are 0 (implies no filtering)
-	 - change in either p or q exceeds its respective
-	   epsilon value
-	 - tmstamp must be >= current timestamp and 
-           <= (current timestamp - TMSTAMP_WINDOW) 
-           (helps throw away some bogus entries)
-	   (only check if st->init is true
-      */
-      if (st->active && (!st->init || (st->p_eps2 == 0.0 && 
-				       st->q_eps2 == 0.0) ||
-			 st->p_eps2 <= pd || st->q_eps2 <= qd)
-		&& (!st->init || tmstamp >= st->tmstamp)) {
-	/* update data - need to lock to avoid partial updates
-	   being passed on, and to get cond. var. right */
-	VE_DEBUG(2,("%s: update - [%ld] %2d (%2.4f,%2.4f,%2.4f) (%1.5f,%1.5f,%1.5f,%1.5f)",
-		    d->name,tmstamp,stnum,
-		    p.data[0],p.data[1],p.data[2],
-		    q.data[0],q.data[1],q.data[2],q.data[3]));
-
-	veThrMutexLock(f->mutex);
-	st->p = p;
-	st->q = q;
-	st->tmstamp = tmstamp;
-	st->init = 1;
-	st->updated = 1;
-	veThrCondSignal(f->update);
-	veThrMutexUnlock(f->mutex);
-      }
-    }
+    parse_line(d,f,linebuf,veClock());
   }
 
   veError(MODULE,"%s: read thread loop broken",d->name);
@@ -557,8 +618,6 @@ static void *read_thread(void *v) {
 static void *event_thread(void *v) {
   VeDevice *d = (VeDevice *)v;
   VeiFT *f = (VeiFT *)(d->instance->idata);
-  int ncbacks = 0;
-  long cback_elapsed = 0;
   int k = 0;
   /* data we read in... */
   int stnum;
@@ -602,57 +661,60 @@ static void *event_thread(void *v) {
     veThrMutexUnlock(f->mutex);
 
     /* outside of the critical section, send a VE event */
-    VE_DEBUG(2,("%s: callback for station %d",d->name,stnum));
-    if ((ncbacks % 50) == 0) {
-      if (ncbacks > 0) {
-	cback_elapsed = veClock() - cback_elapsed;
-	f->cback_rate = ncbacks/(float)(cback_elapsed/1000.0);
-	veUpdateStatistic(f->cback_rate_stat);
-      }
-      ncbacks = 0;
-      cback_elapsed = veClock();
-    }
-    ncbacks++;
-
-    /* make sure we process both position and quaternion before
-       frame updates */
-    {
-      VeDeviceEvent *ve;
-      VeDeviceE_Vector *evec;
-      char s[80];
-
-      veLockFrame();
-
-      ve = veDeviceEventCreate(VE_ELEM_VECTOR,3);
-      /* update elements */
-      sprintf(s, "%s%d", "pos",stnum);
-      ve->device = veDupString(d->name);
-      ve->elem = veDupString(s);
-      evec = (VeDeviceE_Vector *)(ve->content);
-      for(k = 0; k < 3; k++)
-	evec->value[k] = p.data[k];
-      ve->timestamp = tmstamp;
-      veDeviceInsertEvent(ve);
-
-      /* right now there is no correction of angles - this is wrong! */
-      sprintf(s, "%s%d", "quat",stnum);
-      ve = veDeviceEventCreate(VE_ELEM_VECTOR,4);
-      ve->device = veDupString(d->name);
-      ve->elem = veDupString(s);
-      evec = (VeDeviceE_Vector *)(ve->content);
-      for(k = 0; k < 4; k++)
-	evec->value[k] = q.data[k];
-      ve->timestamp = tmstamp;
-      veDeviceInsertEvent(ve);
-
-      veUnlockFrame();
-    }
+    send_station(d,f,stnum,tmstamp,&p,&q);
   }
   
   veError(MODULE,"%s: event thread loop broken",d->name);
   return NULL;
 }
 
+/*
+ * reactor parse function - used instead of both threads when the
+ * device I/O reactor is reading the line for us.  Everything that
+ * has arrived is parsed first, so a station that reported several
+ * times only generates events for its latest record.
+ */
+static int parse_input(VeDevice *d, unsigned char *buf, int len, long when,
+		       void *arg) {
+  VeiFT *f = (VeiFT *)arg;
+  char linebuf[MAXLN];
+  int k, n, start = 0;
+
+  if (!buf)
+    veFatalError(MODULE,"eof from tracker");
+
+  for(k = 0; k < len; k++) {
+    if (buf[k] != '\n')
+      continue;
+    if ((n = k+1-start) >= MAXLN)
+      veNotice(MODULE,"%s: mangled input - line is too long",d->name);
+    else {
+      memcpy(linebuf,buf+start,n);
+      linebuf[n] = '\0';
+      parse_line(d,f,linebuf,when);
+      if (!(f->stream)) {
+	VE_DEBUG(2,("%s: polling tracker",d->name));
+	send_ft(f->fd,"P");
+      }
+    }
+    start = k+1;
+  }
+  if (start == 0 && len >= MAXLN) {
+    /* the rest of the line will be thrown out as mangled */
+    veNotice(MODULE,"%s: mangled input - line is too long",d->name);
+    start = len;
+  }
+
+  /* only we update data[] in this mode, so no need to lock to look */
+  for(k = 0; k < MAXSTATION; k++)
+    if (f->data[k].updated) {
+      f->data[k].updated = 0;
+      send_station(d,f,k+1,f->data[k].tmstamp,&(f->data[k].p),
+		   &(f->data[k].q));
+    }
+  return start;
+}
+
 static VeDevice *new_ft_driver(VeDeviceDriver *driver,
 				VeDeviceDesc *desc,
 				VeStrMap override) {
@@ -679,11 +741,22 @@ static VeDevice *new_ft_driver(VeDeviceDriver *driver,
     veDeviceAddElemSpec(d->model,s);
     sprintf(s,"quat%d vector 4 {0.0 0.0} {0.0 0.0} {0.0 0.0} {0.0 0.0}",k+1);
     veDeviceAddElemSpec(d->model,s);
+    sprintf(s,"pos%d",k+1);
+    f->pos_id[k] = veDeviceIntern(s);
+    sprintf(s,"quat%d",k+1);
+    f->quat_id[k] = veDeviceIntern(s);
   }
 
-  /* two-thread model */
-  veThreadInitDelayed(read_thread,d,0,0);
-  veThreadInitDelayed(event_thread,d,0,0);
+  if ((f->io = veDeviceIOWatch(d,f->fd,parse_input,NULL,f))) {
+    /* put ourselves into streaming or polling mode */
+    send_ft(f->fd,(f->stream ? "C" : "c"));
+    if (!(f->stream))
+      send_ft(f->fd,"P");
+  } else {
+    /* two-thread model */
+    veThreadInitDelayed(read_thread,d,0,0);
+    veThreadInitDelayed(event_thread,d,0,0);
+  }
   return d;
 }
 
@@ -37,6 +37,14 @@ typedef struct vei_flock_of_birds {
   float range;
   float range_conv;
   float p_eps, q_eps;
+  int bps;         /* line speed in bits per second */
+  VeDeviceIO *io;  /* NULL if we are reading in our own thread */
+  /* state of the report loop */
+  int init;
+  VeVector3 old_p;
+  VeQuat old_q;
+  int nupdates, ncbacks;
+  long elapsed, cback_elapsed;
 } VeiFlockOfBirds;
 
 static int str_to_bps(char *c) {
@@ -92,12 +100,12 @@ static VeiFlockOfBirds *open_serial(char *name, VeDeviceInstance *i) {
   if (c = veDeviceInstOption(i,"raw"))
     b->raw = atoi(c);
 
-  if (c = veDeviceInstOption(i,"speed"))
-    b->speed = str_to_bps(c);
-  else
-    b->speed = str_to_bps(DEFAULT_FOB_SPEED);
+  if (!(c = veDeviceInstOption(i,"speed")))
+    c = DEFAULT_FOB_SPEED;
+  b->speed = str_to_bps(c);
   if (b->speed < 0)
     return NULL;
+  b->bps = atoi(c);
 
   b->fd = open(b->line, O_RDWR|O_NOCTTY);
   if (b->fd < 0) {
@@ -248,6 +256,15 @@ static int forceread(int fd, unsigned char *buf, int n) {
   return n;
 }
 
+/* Who wants hacks?  We do! We do! */
+/* Convert screwy FOB data format into something sane - buf must point
+   at the byte with the framing bit */
+static void decode_bird_words(unsigned char *buf, short *wds, int n) {
+  int i;
+  for(i = 0; i < n; i++)
+    wds[i] = (((short)(buf[2*i]&0x7f)<<1)|((short)buf[2*i+1]<<8))<<1;
+}
+
 /* beware - read_bird_data and read_bird_words are not the same... */
 static int read_bird_data(int fd, short *wds, int n) {
   unsigned char buf[MAXWORDS*2];
@@ -270,7 +287,7 @@ static int read_bird_data(int fd, short *wds, int n) {
    data format, so we do some extra work */
 static int read_bird_words(int fd, short *wds, int n, int latest) {
   unsigned char buf[MAXWORDS*2];
-  int i,j,m,sofar,avail;
+  int i,m,sofar,avail;
 
   if (n > MAXWORDS)
     veFatalError(MODULE, "tried to read too many words from bird: %d", n);
@@ -292,10 +309,7 @@ static int read_bird_words(int fd, short *wds, int n, int latest) {
 	return m; /* error on read */
       sofar += m;
     }
-    /* Who wants hacks?  We do! We do! */
-    /* Convert screwy FOB data format into something sane */
-    for(i = 0; i < n; i++)
-      wds[i] = (((short)(buf[2*i]&0x7f)<<1)|((short)buf[2*i+1]<<8))<<1;
+    decode_bird_words(buf,wds,n);
   } else {
     /* read all the data in the buffer and take the latest */
     while(1) {
@@ -309,8 +323,7 @@ static int read_bird_words(int fd, short *wds, int n, int latest) {
       for(i = m-1; i >= 0; i--)
 	if ((buf[i] & 0x80) && (m-i-1 >= 2*n)) {
 	  /* YAY! a framing bit with a full packet after it */
-	  for(j = 0; j < n; j++, i += 2)
-	    wds[j] = (((short)(buf[i]&0x7f)<<1)|((short)buf[i+1]<<8))<<1;
+	  decode_bird_words(&(buf[i]),wds,n);
 	  return n;
 	}
       sofar += m; /* try again after an infinitessimal nap? */
@@ -408,22 +421,144 @@ static void show_bird_info(VeDevice *d) {
 
 /* size of a packet in words... */
 #define PKTSIZE 7
+
+/* turn one position/quaternion record into events */
+static void fob_report(VeDevice *d, short *wds, long tm) {
+  VeiFlockOfBirds *b = (VeiFlockOfBirds *)(d->instance->idata);
+  VeVector3 p;
+  VeQuat q;
+  VeFrame f, frame;
+  int j;
+  int do_call = 0;
+
+  if ((b->nupdates % 50) == 0) {
+    if (b->nupdates > 0) {
+      b->elapsed = veClock() - b->elapsed;
+      b->update_rate = b->nupdates/(float)(b->elapsed/1000.0);
+      veUpdateStatistic(b->update_rate_stat);
+    }
+    b->nupdates = 0;
+    b->elapsed = veClock();
+  }
+  b->nupdates++;
+
+  for(j = 0; j < 3; j++)
+    p.data[j] = wds[j]*b->range_conv;
+  /* the bird's order for quaternions is different from VE's */
+  for(j = 0; j < 3; j++)
+    q.data[j] = wds[j+4]*QUAT_CONV;
+  /* important:  the quaternion should represent the rotation required
+     to get from the base to the current orientation - the FOB returns
+     the opposite - the rotation to get from the view to the origin,
+     so we flip the scalar of the quaternion */
+  q.data[3] = -wds[3]*QUAT_CONV;
+
+  VE_DEBUG(2,("FOB: Pos (%3.2f %3.2f %3.2f) Quat (%4.2f %4.2f %4.2f,%4.2f)",
+	      p.data[0],p.data[1],p.data[2],q.data[0],q.data[1],q.data[2],q.data[3]));
+
+  if (!b->init) {
+    b->init = 1;
+    do_call = 1;
+  } else {
+    /* don't report anything until we get a significant variation in the
+       data (as defined by the epsilon values - this is done very 
+       intelligently right now (there must be the full value of the variation
+       in at least one axis) but it is a cheap and quick check */
+    for(j = 0; j < 3 && !do_call; j++)
+      if (fabs(p.data[j] - b->old_p.data[j]) > b->p_eps)
+	do_call = 1;
+    for(j = 0; j < 3 && !do_call; j++)
+      if (fabs(q.data[j] - b->old_q.data[j]) > b->q_eps)
+	do_call = 1;
+  }
+
+  if (do_call) {
+    veFrameIdentity(&frame);
+    frame.loc = p;
+    /* now map it into env co-ordinates */
+    veMapFrame(&b->frame,&frame,&f);
+    /* correct for any receiver orientation problems */
+    veMapFrame(&b->recvf,&f,&frame);
+
+    VE_DEBUG(1,("Tracker position in world: (%4.2f %4.2f %4.2f)",
+		frame.loc.data[0], frame.loc.data[1],
+		frame.loc.data[2]));
+
+    if ((b->ncbacks % 50) == 0) {
+      if (b->ncbacks > 0) {
+	b->cback_elapsed = veClock() - b->cback_elapsed;
+	b->cback_rate = b->ncbacks/(float)(b->cback_elapsed/1000.0);
+	veUpdateStatistic(b->cback_rate_stat);
+      }
+      b->ncbacks = 0;
+      b->cback_elapsed = veClock();
+    }
+    b->ncbacks++;
+
+    {
+      VeDeviceEvent *ve;
+      VeDeviceE_Vector *evec;
+      static int pos_id = 0, quat_id = 0;
+
+      if (!pos_id) {
+	pos_id = veDeviceIntern("pos");
+	quat_id = veDeviceIntern("quat");
+      }
+
+      veLockFrame();
+
+      /* update elements */
+      ve = veDeviceEventInitId(VE_ELEM_VECTOR,3,d->id,pos_id);
+      evec = (VeDeviceE_Vector *)(ve->content);
+      for(j = 0; j < 3; j++)
+	evec->value[j] = frame.loc.data[j];
+      ve->timestamp = tm;
+      veDeviceInsertEvent(ve);
+
+      /* right now there is no correction of angles - this is wrong! */
+      ve = veDeviceEventInitId(VE_ELEM_VECTOR,4,d->id,quat_id);
+      evec = (VeDeviceE_Vector *)(ve->content);
+      for(j = 0; j < 4; j++)
+	evec->value[j] = q.data[j];
+      ve->timestamp = tm;
+      veDeviceInsertEvent(ve);
+
+      veUnlockFrame();
+	
+      /* only update old values when we actually have something to report
+	 to avoid "stealthy creeping" (i.e. several successive updates
+	 being lost because they all fall under the radar) */
+      b->old_p = p;
+      b->old_q = q;
+    }
+  }
+}
+
+/* ask for data - in point mode this is repeated for every record */
+static void fob_request(VeiFlockOfBirds *b) {
+  unsigned char obuf[2];
+  obuf[0] = ']';  /* position/quaternion */
+#ifdef USE_STREAM
+  obuf[1] = '@';  /* stream mode */
+  send_bird_data(b->fd,obuf,2);
+#else
+  send_bird_data(b->fd,obuf,1);
+#endif /* USE_STREAM */
+}
+
+/* ask for a single record (point mode) */
+static void fob_poll(VeiFlockOfBirds *b) {
+  unsigned char obuf[1];
+  obuf[0] = 'B';
+  send_bird_data(b->fd,obuf,1);
+}
+
 static void *fob_thread(void *v) {
   /* More datatypes, must have more... */
   VeDevice *d = (VeDevice *)v;
   VeiFlockOfBirds *b = (VeiFlockOfBirds *)(d->instance->idata);
-  unsigned char obuf[10];
   short wds[10];
-  VeVector3 old_p, p;
-  VeQuat old_q, q;
-  VeFrame f, frame;
-  int j, init = 0;
   long tm;
-  int do_call = 0;
-  long elapsed = 0;
-  int nupdates = 0;
-  int ncbacks = 0;
-  long cback_elapsed = 0;
 
   VE_DEBUG(1,("fob_thread starting"));
 
@@ -432,30 +567,12 @@ static void *fob_thread(void *v) {
 #endif /* 0 */
 
   /* request data */
-  obuf[0] = ']';  /* position/quaternion */
-#ifdef USE_STREAM
-  obuf[1] = '@';  /* stream mode */
-  send_bird_data(b->fd,obuf,2);
-#else
-  send_bird_data(b->fd,obuf,1);
-#endif /* USE_STREAM */
+  fob_request(b);
 
   while (1) {
     /* read data agressively - that is, consume all incoming records and only 
        consider the last one, since we are
        running in stream mode... */
-
-    if ((nupdates % 50) == 0) {
-      if (nupdates > 0) {
-	elapsed = veClock() - elapsed;
-	b->update_rate = nupdates/(float)(elapsed/1000.0);
-	veUpdateStatistic(b->update_rate_stat);
-      }
-      nupdates = 0;
-      elapsed = veClock();
-    }
-    nupdates++;
-
 #ifdef USE_STREAM
     /* read at least one... */
     if (read_bird_words(b->fd,wds,PKTSIZE,!b->raw) != PKTSIZE) 
@@ -464,103 +581,60 @@ static void *fob_thread(void *v) {
 			     very recently (within 1 update cycle) this isn't
 			     a bad estimate */
 #else
-    obuf[0] = 'B';
-    send_bird_data(b->fd,obuf,1);
+    fob_poll(b);
     if (read_bird_words(b->fd,wds,PKTSIZE,0) != PKTSIZE)
       veFatalError(MODULE, "bad read from tracker - %s", strerror(errno));
     tm = veClock(); /* this is a weak estimate */
 #endif
 
-    for(j = 0; j < 3; j++)
-      p.data[j] = wds[j]*b->range_conv;
-    /* the bird's order for quaternions is different from VE's */
-    for(j = 0; j < 3; j++)
-      q.data[j] = wds[j+4]*QUAT_CONV;
-    /* important:  the quaternion should represent the rotation required
-       to get from the base to the current orientation - the FOB returns
-       the opposite - the rotation to get from the view to the origin,
-       so we flip the scalar of the quaternion */
-    q.data[3] = -wds[3]*QUAT_CONV;
-
-    VE_DEBUG(2,("FOB: Pos (%3.2f %3.2f %3.2f) Quat (%4.2f %4.2f %4.2f,%4.2f)",
-		p.data[0],p.data[1],p.data[2],q.data[0],q.data[1],q.data[2],q.data[3]));
-
-    do_call = 0;
-    if (!init) {
-      init = 1;
-      do_call = 1;
-    } else {
-      /* don't report anything until we get a significant variation in the
-	 data (as defined by the epsilon values - this is done very 
-	 intelligently right now (there must be the full value of the variation
-	 in at least one axis) but it is a cheap and quick check */
-      for(j = 0; j < 3 && !do_call; j++)
-	if (fabs(p.data[j] - old_p.data[j]) > b->p_eps)
-	  do_call = 1;
-      for(j = 0; j < 3 && !do_call; j++)
-	if (fabs(q.data[j] - old_q.data[j]) > b->q_eps)
-	  do_call = 1;
-    }
+    fob_report(d,wds,tm);
+  }
+}
 
-    if (do_call) {
-      veFrameIdentity(&frame);
-      frame.loc = p;
-      /* now map it into env co-ordinates */
-      veMapFrame(&b->frame,&frame,&f);
-      /* correct for any receiver orientation problems */
-      veMapFrame(&b->recvf,&f,&frame);
-
-      VE_DEBUG(1,("Tracker position in world: (%4.2f %4.2f %4.2f)",
-		  frame.loc.data[0], frame.loc.data[1],
-		  frame.loc.data[2]));
-
-      if ((ncbacks % 50) == 0) {
-	if (ncbacks > 0) {
-	  cback_elapsed = veClock() - cback_elapsed;
-	  b->cback_rate = ncbacks/(float)(cback_elapsed/1000.0);
-	  veUpdateStatistic(b->cback_rate_stat);
-	}
-	ncbacks = 0;
-	cback_elapsed = veClock();
-      }
-      ncbacks++;
-
-      {
-	VeDeviceEvent *ve;
-	VeDeviceE_Vector *evec;
-
-	veLockFrame();
-
-	ve = veDeviceEventCreate(VE_ELEM_VECTOR,3);
-	/* update elements */
-	ve->device = veDupString(d->name);
-	ve->elem = veDupString("pos");
-	evec = (VeDeviceE_Vector *)(ve->content);
-	for(j = 0; j < 3; j++)
-	  evec->value[j] = frame.loc.data[j];
-	ve->timestamp = tm;
-	veDeviceInsertEvent(ve);
-
-	/* right now there is no correction of angles - this is wrong! */
-	ve = veDeviceEventCreate(VE_ELEM_VECTOR,4);
-	ve->device = veDupString(d->name);
-	ve->elem = veDupString("quat");
-	evec = (VeDeviceE_Vector *)(ve->content);
-	for(j = 0; j < 4; j++)
-	  evec->value[j] = q.data[j];
-	ve->timestamp = tm;
-	veDeviceInsertEvent(ve);
-
-	veUnlockFrame();
-	
-	/* only update old values when we actually have something to report
-	   to avoid "stealthy creeping" (i.e. several successive updates
-	   being lost because they all fall under the radar) */
-	old_p = p;
-	old_q = q;
+/* When reading through the device I/O reactor:  the packet has spent
+   most of its life crossing the serial line (about 15ms at 9600 baud),
+   so take that off the time it was received. */
+static long fob_stamp(VeDevice *d, long recv, int len, void *arg) {
+  VeiFlockOfBirds *b = (VeiFlockOfBirds *)arg;
+  /* 10 bits on the line for each byte */
+  return recv - (2*PKTSIZE*10*1000L)/b->bps;
+}
+
+static int fob_parse(VeDevice *d, unsigned char *buf, int len, long when,
+		     void *arg) {
+  VeiFlockOfBirds *b = (VeiFlockOfBirds *)arg;
+  short wds[PKTSIZE];
+  int i, last = -1;
+
+  if (!buf)
+    veFatalError(MODULE, "bad read from tracker - %s", strerror(errno));
+
+  /* skip anything before a framing bit and only report the latest
+     complete packet (every packet, if "raw" is set, as the threaded
+     reader does) - a partial one is left for next time */
+  i = 0;
+  while (i < len) {
+    if (!(buf[i] & 0x80))
+      i++;
+    else if (len - i < 2*PKTSIZE)
+      break;
+    else {
+      if (b->raw && last >= 0) {
+	decode_bird_words(&(buf[last]),wds,PKTSIZE);
+	fob_report(d,wds,when);
       }
+      last = i;
+      i += 2*PKTSIZE;
     }
   }
+  if (last >= 0) {
+    decode_bird_words(&(buf[last]),wds,PKTSIZE);
+    fob_report(d,wds,when);
+#ifndef USE_STREAM
+    fob_poll(b);
+#endif /* USE_STREAM */
+  }
+  return i;
 }
 
 static VeDevice *new_fob_driver(VeDeviceDriver *driver, VeDeviceDesc *desc,
@@ -662,8 +736,15 @@ static VeDevice *new_fob_driver(VeDeviceDriver *driver, VeDeviceDesc *desc,
       parseVector3(d->name,c,&fob->recvf.up);
   }
 
-  /* Build VeDeviceModel for this device */
-  veThreadInitDelayed(fob_thread,d,0,0);
+  /* read through the device I/O reactor if we can, otherwise in a
+     thread of our own */
+  if ((fob->io = veDeviceIOWatch(d,fob->fd,fob_parse,fob_stamp,fob))) {
+    fob_request(fob);
+#ifndef USE_STREAM
+    fob_poll(fob);
+#endif /* USE_STREAM */
+  } else
+    veThreadInitDelayed(fob_thread,d,0,0);
   return d;
 }
 
@@ -25,6 +25,7 @@ typedef struct vei_flock_of_birds_group {
   char *line;
   int speed;
   int birds;	     /* # of birds in group */
+  int combine;	     /* one pos and one quat event for all birds */
   VeFrame frame;
   int raw;
   VeStatistic *update_rate_stat;
@@ -35,6 +36,7 @@ typedef struct vei_flock_of_birds_group {
   float range;
   float range_conv;
   float p_eps, q_eps;
+  int *pos_id, *quat_id; /* element names (only [0] if combined) */
 } VeiFlockOfBirdsGroup;
 
 static int sync_bird(VeiFlockOfBirdsGroup *b);
@@ -95,6 +97,9 @@ static VeiFlockOfBirdsGroup *open_serial(char *name, VeDeviceInstance *i) {
   if (c = veDeviceInstOption(i,"raw"))
     b->raw = atoi(c);
 
+  if (c = veDeviceInstOption(i,"combine"))
+    b->combine = atoi(c);
+
   if (c = veDeviceInstOption(i,"speed"))
     b->speed = str_to_bps(c);
   else
@@ -576,19 +581,36 @@ static void *fobg_thread(void *v) {
       {
 	VeDeviceEvent *ve;
 	VeDeviceE_Vector *evec;
-	char s[6];
 
 	veLockFrame();
 
 	/* insert events (pos, quat) of Flock of Birds to ve devices 
 	 */
-	for (i=0; i<b->birds; i++) {
+	if (b->combine) {
+	  /* all birds in one event each for pos and quat, so that
+	     filters can deal with the whole flock at once */
+	  ve = veDeviceEventInitId(VE_ELEM_VECTOR,3*b->birds,d->id,
+				   b->pos_id[0]);
+	  evec = (VeDeviceE_Vector *)(ve->content);
+	  for (i=0; i<b->birds; i++)
+	    for(j = 0; j < 3; j++)
+	      evec->value[i*3+j] = p[i].data[j];
+	  ve->timestamp = tm;
+	  veDeviceInsertEvent(ve);
+
+	  ve = veDeviceEventInitId(VE_ELEM_VECTOR,4*b->birds,d->id,
+				   b->quat_id[0]);
+	  evec = (VeDeviceE_Vector *)(ve->content);
+	  for (i=0; i<b->birds; i++)
+	    for(j = 0; j < 4; j++)
+	      evec->value[i*4+j] = q[i].data[j];
+	  ve->timestamp = tm;
+	  veDeviceInsertEvent(ve);
+	}
+	for (i=0; i<b->birds && !b->combine; i++) {
 	  /* add Master's pos event to Fob device */
-	  sprintf(s,"%s%d","pos",i);
-	  ve = veDeviceEventCreate(VE_ELEM_VECTOR,3);
+	  ve = veDeviceEventInitId(VE_ELEM_VECTOR,3,d->id,b->pos_id[i]);
 	  /* update elements */
-	  ve->device = veDupString(d->name);
-	  ve->elem = veDupString(s);
 	  evec = (VeDeviceE_Vector *)(ve->content);
 	  for(j = 0; j < 3; j++)
 	    evec->value[j] = p[i].data[j];
@@ -597,10 +619,7 @@ static void *fobg_thread(void *v) {
 
 	  /* add quat event to Fob device */
 	  /* right now there is no correction of angles - this is wrong! */
-	  sprintf(s,"%s%d","quat",i);
-	  ve = veDeviceEventCreate(VE_ELEM_VECTOR,4);
-	  ve->device = veDupString(d->name);
-	  ve->elem = veDupString(s);
+	  ve = veDeviceEventInitId(VE_ELEM_VECTOR,4,d->id,b->quat_id[i]);
 	  evec = (VeDeviceE_Vector *)(ve->content);
 	  for(j = 0; j < 4; j++)
 	    evec->value[j] = q[i].data[j];
@@ -665,11 +684,30 @@ static VeDevice *new_fobg_driver(VeDeviceDriver *driver, VeDeviceDesc *desc,
    * (Note: in the final version, I may want to use quaternions as more stable
    * data-type and then filters to generate angles or matrices as desired) 
    */
-  for (j=0; j<fobg->birds; j++) {
+  if (fobg->combine) {
+     /* pos = pos0 pos1 ..., quat = quat0 quat1 ... */
+     sprintf(s,"pos vector %d",3*fobg->birds);
+     veDeviceAddElemSpec(d->model,s);
+     sprintf(s,"quat vector %d",4*fobg->birds);
+     veDeviceAddElemSpec(d->model,s);
+  }
+  /* intern the element names once, rather than for every event */
+  fobg->pos_id = malloc((fobg->birds+1)*sizeof(int));
+  fobg->quat_id = malloc((fobg->birds+1)*sizeof(int));
+  assert(fobg->pos_id != NULL && fobg->quat_id != NULL);
+  if (fobg->combine) {
+     fobg->pos_id[0] = veDeviceIntern("pos");
+     fobg->quat_id[0] = veDeviceIntern("quat");
+  }
+  for (j=0; j<fobg->birds && !fobg->combine; j++) {
      sprintf(s,"%s%d %s","pos",j,"vector 3 {0.0 0.0} {0.0 0.0} {0.0 0.0}");
      veDeviceAddElemSpec(d->model,s);
      sprintf(s,"%s%d %s","quat",j,"vector 4 {0.0 0.0} {0.0 0.0} {0.0 0.0} {0.0 0.0}");
      veDeviceAddElemSpec(d->model,s);
+     sprintf(s,"%s%d","pos",j);
+     fobg->pos_id[j] = veDeviceIntern(s);
+     sprintf(s,"%s%d","quat",j);
+     fobg->quat_id[j] = veDeviceIntern(s);
   }
 
   /* initialize device from options now, before starting thread 
@@ -12,6 +12,7 @@
 
 #include <linux/joystick.h>
 
+#include <ve_clock.h>
 #include <ve_debug.h>
 #include <ve_device.h>
 #include <ve_driver.h>
@@ -20,6 +21,7 @@
 
 struct driver_linuxjs_private {
   int fd;
+  VeDeviceIO *io; /* NULL if we are reading in our own thread */
 };
 
 /* implicit */
@@ -34,7 +36,7 @@ struct driver_linuxjs_private {
 #define BUTTONNAME "button%d"
 #define BUTTONSPEC "button%d switch"
 
-static void push_js_event(VeDevice *d, struct js_event *e) {
+static void push_js_event(VeDevice *d, struct js_event *e, long tm) {
   VeDeviceEvent *ve;
   int is_init;
   char ename[80];
@@ -44,13 +46,11 @@ static void push_js_event(VeDevice *d, struct js_event *e) {
   case JS_EVENT_BUTTON:
     {
       VeDeviceE_Switch *sw;
-      ve = veDeviceEventCreate(VE_ELEM_SWITCH,0);
-      ve->device = veDupString(d->name);
       sprintf(ename,BUTTONNAME,e->number);
-      ve->elem = veDupString(ename);
-      ve->timestamp = veClock();
+      ve = veDeviceEventInitId(VE_ELEM_SWITCH,0,d->id,veDeviceIntern(ename));
       sw = VE_EVENT_SWITCH(ve);
       sw->state = e->value ? 1 : 0;
+      ve->timestamp = tm;
       veDeviceApplyEventToModel(d->model,ve);
       if (!is_init)
 	veDeviceInsertEvent(ve);
@@ -59,15 +59,13 @@ static void push_js_event(VeDevice *d, struct js_event *e) {
   case JS_EVENT_AXIS:
     {
       VeDeviceE_Valuator *val;
-      ve = veDeviceEventCreate(VE_ELEM_VALUATOR,0);
-      ve->device = veDupString(d->name);
       sprintf(ename,AXISNAME,e->number);
-      ve->elem = veDupString(ename);
-      ve->timestamp = veClock();
+      ve = veDeviceEventInitId(VE_ELEM_VALUATOR,0,d->id,veDeviceIntern(ename));
       val = VE_EVENT_VALUATOR(ve);
       val->min = -1.0;
       val->max = 1.0;
       val->value = e->value/(float)LINUX_JS_MAX;
+      ve->timestamp = tm;
       veDeviceApplyEventToModel(d->model,ve);
       if (!is_init)
 	veDeviceInsertEvent(ve);
@@ -95,7 +93,7 @@ static void *js_thread(void *v) {
     }
     /* we have one event - block rendering while we catch up... */
     veLockFrame();
-    push_js_event(d,&e);
+    push_js_event(d,&e,veClock());
     while (vePeekFd(fd) > 0) {
       if ((i = read(fd,&e,sizeof(e))) != sizeof(e)) {
 	veUnlockFrame();
@@ -104,12 +102,39 @@ static void *js_thread(void *v) {
 	close(fd);
 	return NULL;
       }
-      push_js_event(d,&e);
+      push_js_event(d,&e,veClock());
     }
     veUnlockFrame();
   }
 }
 
+/* reactor parse function - handles whole events, leaving any partial
+   one for next time */
+static int js_parse(VeDevice *d, unsigned char *buf, int len, long when,
+		    void *arg) {
+  struct driver_linuxjs_private *priv =
+    (struct driver_linuxjs_private *)arg;
+  struct js_event e;
+  int k;
+
+  if (!buf) {
+    /* the reactor has stopped watching fd by now */
+    veError(MODULE,"bad read from joystick: %s",strerror(errno));
+    close(priv->fd);
+    return -1;
+  }
+  if (len < sizeof(e))
+    return 0;
+  /* block rendering while we catch up... */
+  veLockFrame();
+  for(k = 0; k + sizeof(e) <= len; k += sizeof(e)) {
+    memcpy(&e,buf+k,sizeof(e));
+    push_js_event(d,&e,when);
+  }
+  veUnlockFrame();
+  return k;
+}
+
 static VeDevice *new_linuxjs_driver(VeDeviceDriver *driver,
 				    VeDeviceDesc *desc,
 				    VeStrMap override) {
@@ -186,7 +211,7 @@ static VeDevice *new_linuxjs_driver(VeDeviceDriver *driver,
 
   d = veDeviceCreate(desc->name);
   d->instance = i;
-  priv = malloc(sizeof(struct driver_linuxjs_private));
+  priv = calloc(1,sizeof(struct driver_linuxjs_private));
   assert(priv != NULL);
   priv->fd = fd;
   i->idata = (void *)priv;
@@ -202,7 +227,8 @@ static VeDevice *new_linuxjs_driver(VeDeviceDriver *driver,
     sprintf(str,AXISSPEC,k);
     veDeviceAddElemSpec(d->model,str);
   }
-  veThreadInitDelayed(js_thread,d,0,0);
+  if (!(priv->io = veDeviceIOWatch(d,fd,js_parse,NULL,priv)))
+    veThreadInitDelayed(js_thread,d,0,0);
   return d;
 }
 
@@ -17,6 +17,7 @@
 
 struct driver_linuxmouse_private {
   int fd;  /* file descriptor for event handle */
+  VeDeviceIO *io; /* NULL if we are reading in our own thread */
 };
 
 static char *key2name(int key) {
@@ -68,53 +69,72 @@ static int find_devname(char *dspec) {
   return -1;
 }
 
-static void *mouse_thread(void *v) {
-  struct input_event ev;
+/* kernel event times are gettimeofday() times */
+static void push_mouse_event(VeDevice *d, struct input_event *ev) {
   VeDeviceEvent *ve;
   VeDeviceE_Switch *sw;
   VeDeviceE_Valuator *val;
+  char *elem;
+
+  switch (ev->type) {
+  case EV_REL:  /* relative axis motion */
+    if ((elem = axis2name(ev->code))) {
+      ve = veDeviceEventInitId(VE_ELEM_VALUATOR,0,d->id,veDeviceIntern(elem));
+      ve->timestamp = veClockConvTimeval(ev->time.tv_sec,ev->time.tv_usec);
+      val = VE_EVENT_VALUATOR(ve);
+      val->min = val->max = 0.0;
+      val->value = (float)(*(int *)(&ev->value));
+      VE_DEBUG(2,("linuxmouse %s: rel motion %s %f",d->name,elem,
+		  val->value));
+      veDeviceInsertEvent(ve);
+    }
+    break;
+  case EV_KEY:  /* button */
+    if ((elem = key2name(ev->code))) {
+      ve = veDeviceEventInitId(VE_ELEM_SWITCH,0,d->id,veDeviceIntern(elem));
+      ve->timestamp = veClockConvTimeval(ev->time.tv_sec,ev->time.tv_usec);
+      sw = VE_EVENT_SWITCH(ve);
+      sw->state = ev->value;
+      VE_DEBUG(2,("linuxmouse %s: button %s %d",d->name,elem,ev->value));
+      veDeviceInsertEvent(ve);
+    }
+    break;
+  }
+}
+
+static void *mouse_thread(void *v) {
+  struct input_event ev;
   VeDevice *d = (VeDevice *)v;
   struct driver_linuxmouse_private *p = (struct driver_linuxmouse_private *)
     (d->instance->idata);
   
   VE_DEBUG(1,("linuxmouse %s: thread started", d->name));
   
-  while(read(p->fd,&ev,sizeof(ev)) == sizeof(ev)) {
-    char *elem;
-    switch (ev.type) {
-    case EV_REL:  /* relative axis motion */
-      if ((elem = axis2name(ev.code))) {
-	ve = veDeviceEventCreate(VE_ELEM_VALUATOR,0);
-	ve->device = veDupString(d->name);
-	ve->elem = veDupString(elem);
-	ve->timestamp = veClockConvTimespec(ev.time.tv_sec,ev.time.tv_usec);
-	val = VE_EVENT_VALUATOR(ve);
-	val->min = val->max = 0.0;
-	val->value = (float)(*(int *)(&ev.value));
-	VE_DEBUG(2,("linuxmouse %s: rel motion %s %f",d->name,elem,
-		    val->value));
-	veDeviceInsertEvent(ve);
-      }
-      break;
-    case EV_KEY:  /* button */
-      if ((elem = key2name(ev.code))) {
-	ve = veDeviceEventCreate(VE_ELEM_SWITCH,0);
-	ve->device = veDupString(d->name);
-	ve->elem = veDupString(elem);
-	ve->timestamp = veClockConvTimespec(ev.time.tv_sec,ev.time.tv_usec);
-	sw = VE_EVENT_SWITCH(ve);
-	sw->state = ev.value;
-	VE_DEBUG(2,("linuxmouse %s: button %s %d",d->name,elem,ev.value));
-	veDeviceInsertEvent(ve);
-      }
-      break;
-    }
-  }
+  while(read(p->fd,&ev,sizeof(ev)) == sizeof(ev))
+    push_mouse_event(d,&ev);
   
   veError(MODULE,"bad read from event handle: %s",strerror(errno));
   return NULL;
 }
 
+/* reactor parse function - handles whole events, leaving any partial
+   one for next time */
+static int mouse_parse(VeDevice *d, unsigned char *buf, int len, long when,
+		       void *arg) {
+  struct input_event ev;
+  int k;
+
+  if (!buf) {
+    veError(MODULE,"bad read from event handle: %s",strerror(errno));
+    return 0;
+  }
+  for(k = 0; k + sizeof(ev) <= len; k += sizeof(ev)) {
+    memcpy(&ev,buf+k,sizeof(ev));
+    push_mouse_event(d,&ev);
+  }
+  return k;
+}
+
 static VeDevice *new_mouse_driver(VeDeviceDriver *driver,
 				  VeDeviceDesc *desc,
 				  VeStrMap override) {
@@ -165,7 +185,8 @@ static VeDevice *new_mouse_driver(VeDeviceDriver *driver,
   veDeviceAddElemSpec(d->model,"left switch");
   veDeviceAddElemSpec(d->model,"middle switch");
   veDeviceAddElemSpec(d->model,"right switch");
-  veThreadInitDelayed(mouse_thread,d,0,0);
+  if (!(p->io = veDeviceIOWatch(d,p->fd,mouse_parse,NULL,p)))
+    veThreadInitDelayed(mouse_thread,d,0,0);
   return d;
 }
 
@@ -0,0 +1,158 @@
+/*
+  A rendering driver that does not draw anything.  It opens no windows
+  and needs no display or graphics hardware, but otherwise goes through
+  the same motions as a real renderer (computing the view for each
+  window and calling the application's render callback), so that
+  multi-processing and frame synchronization can be exercised and
+  measured on headless machines.  It is only used when asked for by
+  name (e.g. "-ve_opt render null").
+*/
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ve.h>
+
+#define MODULE "driver:null"
+
+/* simulated cost of rendering (per window) and swapping, in usecs */
+static int render_usecs = 0;
+static int swap_usecs = 0;
+
+typedef struct {
+  int x, y, w, h;
+} VeiNullWindow;
+
+static int get_usecs(char *name) {
+  char *s;
+  float ms;
+  if ((s = veGetOption(name)) && sscanf(s,"%f",&ms) == 1 && ms > 0.0)
+    return (int)(ms*1000.0);
+  return 0;
+}
+
+void veRImplInit(void) {
+  render_usecs = get_usecs("null_render_ms");
+  swap_usecs = get_usecs("null_swap_ms");
+  VE_DEBUGM(1,("null renderer: render %d us, swap %d us",
+	       render_usecs,swap_usecs));
+}
+
+int veRImplOpenWindow(VeWindow *w) {
+  VeiNullWindow *nw;
+  nw = veAllocObj(VeiNullWindow);
+  assert(nw != NULL);
+  if (w->geometry)
+    veParseGeom(w->geometry,&(nw->x),&(nw->y),&(nw->w),&(nw->h));
+  w->udata = nw;
+  veRenderCallSetupCback(w);
+  return 0;
+}
+
+void veRImplCloseWindow(VeWindow *w) {
+  veFree(w->udata);
+  w->udata = NULL;
+}
+
+void veRImplGetWinInfo(VeWindow *win, int *x, int *y, int *w, int *h) {
+  VeiNullWindow *nw = (VeiNullWindow *)(win->udata);
+  if (nw) {
+    if (x) *x = nw->x;
+    if (y) *y = nw->y;
+    if (w) *w = nw->w;
+    if (h) *h = nw->h;
+  }
+}
+
+void veRImplReloadView(VeWindow *w, long tm, float znear, float zfar,
+		       VeWallView *wv) {
+  VeFrame eye;
+  veCalcStereoEye(&(wv->eye_frame),&eye,veGetProfile(),wv->eye);
+  veGetWindowClipView(w,&(wv->eye_frame),&eye,znear,zfar,wv);
+}
+
+static void render_eye(VeWindow *w, long tm, int steye) {
+  VeWallView v;
+  float znear, zfar;
+
+  memset(&v,0,sizeof(VeWallView));
+  v.eye = steye;
+  v.eye_frame = *(veGetDefaultEye());
+  veGetZClip(&znear,&zfar);
+  veRImplReloadView(w,tm,znear,zfar,&v);
+  veRenderCallCback(w,tm,&v);
+}
+
+void veRImplWindow(VeWindow *w) {
+  long tm = veClock();
+  switch (w->eye) {
+  case VE_WIN_LEFT:
+    render_eye(w,tm,VE_EYE_LEFT);
+    break;
+  case VE_WIN_RIGHT:
+    render_eye(w,tm,VE_EYE_RIGHT);
+    break;
+  case VE_WIN_STEREO:
+    render_eye(w,tm,VE_EYE_LEFT);
+    render_eye(w,tm,VE_EYE_RIGHT);
+    break;
+  default:
+    render_eye(w,tm,VE_EYE_MONO);
+  }
+  if (render_usecs > 0)
+    veMicroSleep(render_usecs);
+}
+
+void veRImplSwap(VeWindow *w) {
+  if (swap_usecs > 0)
+    veMicroSleep(swap_usecs);
+}
+
+/* texture manager support - textures are accepted and ignored */
+static int null_nextid = 0;
+
+static int null_reserve(void) {
+  return ++null_nextid;
+}
+
+static int null_ctxid(void) {
+  return 0;
+}
+
+static int null_load(int id, TXTexture *t) {
+  return 0;
+}
+
+static int null_unload(int id) {
+  return 0;
+}
+
+static int null_bind(int id) {
+  return 0;
+}
+
+static TXOption null_txoptions[] = {
+  { -1, -1, -1 }
+};
+
+static TXRenderer the_null_renderer = {
+  null_reserve,
+  null_ctxid,
+  null_load,
+  null_unload,
+  null_bind,
+  null_txoptions
+};
+
+TXRenderer *veTXMImplRenderer(void) {
+  return &the_null_renderer;
+}
+
+void VE_DRIVER_PROBE(null) (void *phdl) {
+  veDriverProvide(phdl,"render","null");
+  veDriverProvide(phdl,"txmrender","null");
+}
+
+void VE_DRIVER_INIT(null) (void) {
+}
@@ -220,27 +220,31 @@ void veRImplSwap(VeWindow *w) {
 
 
 void veRImplWindow(VeWindow *w) {
-  long t1;
+  long when;
   if (check_errors) {
     while (glGetError() != GL_NO_ERROR)
       ;
   }
   veiGlStubSetWindow(w); /* activate our window */
+  /* when this frame should be seen - also tells the prediction filter
+     what to aim for */
+  when = veClock()+1000/TARGETED_HZ;
+  veDeviceSetDisplayTime(when);
   switch (w->eye) {
   case VE_WIN_MONO:
-    veiGlRenderMonoWindow(w,veClock()+1000/TARGETED_HZ,NULL,VE_EYE_MONO);
+    veiGlRenderMonoWindow(w,when,NULL,VE_EYE_MONO);
     break;
   case VE_WIN_LEFT:
-    veiGlRenderMonoWindow(w,veClock()+1000/TARGETED_HZ,NULL,VE_EYE_LEFT);
+    veiGlRenderMonoWindow(w,when,NULL,VE_EYE_LEFT);
     break;
   case VE_WIN_RIGHT:
-    veiGlRenderMonoWindow(w,veClock()+1000/TARGETED_HZ,NULL,VE_EYE_RIGHT);
+    veiGlRenderMonoWindow(w,when,NULL,VE_EYE_RIGHT);
     break;
   case VE_WIN_STEREO:
     glDrawBuffer(GL_BACK_LEFT);
-    veiGlRenderMonoWindow(w,veClock()+1000/TARGETED_HZ,NULL,VE_EYE_LEFT);
+    veiGlRenderMonoWindow(w,when,NULL,VE_EYE_LEFT);
     glDrawBuffer(GL_BACK_RIGHT);
-    veiGlRenderMonoWindow(w,veClock()+1000/TARGETED_HZ,NULL,VE_EYE_RIGHT);
+    veiGlRenderMonoWindow(w,when,NULL,VE_EYE_RIGHT);
     break;
   default:
     veFatalError(MODULE,"veRenderWindow: unexpected value for"
@@ -0,0 +1,530 @@
+/* Rotation format conversion kernels - see rot_kern.h */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "rot_kern.h"
+
+#if defined(__SSE2__)
+#define ROT_SSE2
+#include <emmintrin.h>
+#endif
+
+int rot_size(int fmt) {
+  switch (fmt) {
+  case ROT_ANG:  return 3;
+  case ROT_QUAT: return 4;
+  case ROT_MTX:  return 16;
+  }
+  return 0;
+}
+
+char *rot_simd(void) {
+#ifdef ROT_SSE2
+  return "sse2";
+#else
+  return NULL;
+#endif
+}
+
+/* Scalar reference.  This is written for clarity and in double
+   precision, and where it can it uses a different route from the SIMD
+   version (angles to a matrix as the product of three axis rotations,
+   the classic trace test for matrices to quaternions, angles straight
+   from a matrix) so that the two check each other. */
+
+/* m[r][c] from a quaternion (as veQuatToRotMatrix()) */
+static void ref_q2m(double *q, double m[3][3]) {
+  double x = q[0], y = q[1], z = q[2], w = q[3];
+  m[0][0] = 1.0 - 2.0*(y*y + z*z);
+  m[0][1] = 2.0*(x*y - w*z);
+  m[0][2] = 2.0*(x*z + w*y);
+  m[1][0] = 2.0*(x*y + w*z);
+  m[1][1] = 1.0 - 2.0*(x*x + z*z);
+  m[1][2] = 2.0*(y*z - w*x);
+  m[2][0] = 2.0*(x*z - w*y);
+  m[2][1] = 2.0*(y*z + w*x);
+  m[2][2] = 1.0 - 2.0*(x*x + y*y);
+}
+
+static void ref_a2m(double *a, double m[3][3]) {
+  double rx[3][3], ry[3][3], rz[3][3], t[3][3];
+  int r, c, k;
+
+  memset(rx,0,sizeof(rx));
+  memset(ry,0,sizeof(ry));
+  memset(rz,0,sizeof(rz));
+  rx[0][0] = 1.0;
+  rx[1][1] = rx[2][2] = cos(a[0]);
+  rx[2][1] = sin(a[0]);  rx[1][2] = -rx[2][1];
+  ry[1][1] = 1.0;
+  ry[0][0] = ry[2][2] = cos(a[1]);
+  ry[0][2] = sin(a[1]);  ry[2][0] = -ry[0][2];
+  rz[2][2] = 1.0;
+  rz[0][0] = rz[1][1] = cos(a[2]);
+  rz[1][0] = sin(a[2]);  rz[0][1] = -rz[1][0];
+  for(r = 0; r < 3; r++)
+    for(c = 0; c < 3; c++)
+      for(t[r][c] = 0.0, k = 0; k < 3; k++)
+	t[r][c] += rx[r][k]*ry[k][c];
+  for(r = 0; r < 3; r++)
+    for(c = 0; c < 3; c++)
+      for(m[r][c] = 0.0, k = 0; k < 3; k++)
+	m[r][c] += t[r][k]*rz[k][c];
+}
+
+/* a[0] first and then a[2] from what is left once Rx(a[0]) is taken
+   out, so that near gimbal lock (a[1] = +/-90 degrees) a[0] may be
+   arbitrary but the rotation still comes out right */
+static void ref_m2a(double m[3][3], double *a) {
+  double s0, c0;
+  a[0] = atan2(-m[1][2],m[2][2]);
+  a[1] = atan2(m[0][2],sqrt(m[1][2]*m[1][2] + m[2][2]*m[2][2]));
+  s0 = sin(a[0]);
+  c0 = cos(a[0]);
+  a[2] = atan2(c0*m[1][0] + s0*m[2][0],c0*m[1][1] + s0*m[2][1]);
+}
+
+static void ref_a2q(double *a, double *q) {
+  double cx = cos(a[0]/2.0), sx = sin(a[0]/2.0),
+    cy = cos(a[1]/2.0), sy = sin(a[1]/2.0),
+    cz = cos(a[2]/2.0), sz = sin(a[2]/2.0);
+  q[0] = sx*cy*cz + cx*sy*sz;
+  q[1] = cx*sy*cz - sx*cy*sz;
+  q[2] = cx*cy*sz + sx*sy*cz;
+  q[3] = cx*cy*cz - sx*sy*sz;
+}
+
+static void ref_m2q(double m[3][3], double *q) {
+  double t = m[0][0] + m[1][1] + m[2][2], s;
+  if (t > 0.0) {
+    s = 2.0*sqrt(t + 1.0);
+    q[3] = 0.25*s;
+    q[0] = (m[2][1] - m[1][2])/s;
+    q[1] = (m[0][2] - m[2][0])/s;
+    q[2] = (m[1][0] - m[0][1])/s;
+  } else if (m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+    s = 2.0*sqrt(1.0 + m[0][0] - m[1][1] - m[2][2]);
+    q[0] = 0.25*s;
+    q[1] = (m[0][1] + m[1][0])/s;
+    q[2] = (m[0][2] + m[2][0])/s;
+    q[3] = (m[2][1] - m[1][2])/s;
+  } else if (m[1][1] > m[2][2]) {
+    s = 2.0*sqrt(1.0 + m[1][1] - m[0][0] - m[2][2]);
+    q[0] = (m[0][1] + m[1][0])/s;
+    q[1] = 0.25*s;
+    q[2] = (m[1][2] + m[2][1])/s;
+    q[3] = (m[0][2] - m[2][0])/s;
+  } else {
+    s = 2.0*sqrt(1.0 + m[2][2] - m[0][0] - m[1][1]);
+    q[0] = (m[0][2] + m[2][0])/s;
+    q[1] = (m[1][2] + m[2][1])/s;
+    q[2] = 0.25*s;
+    q[3] = (m[1][0] - m[0][1])/s;
+  }
+}
+
+static void ref_qnorm(double *q) {
+  double l = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+  int k;
+  if (l <= 0.0) {
+    q[0] = q[1] = q[2] = 0.0;
+    q[3] = 1.0;
+    return;
+  }
+  if (q[3] < 0.0)
+    l = -l;
+  for(k = 0; k < 4; k++)
+    q[k] /= l;
+}
+
+static void ref_put_mtx(double m[3][3], float *out) {
+  int r, c;
+  for(c = 0; c < 4; c++)
+    for(r = 0; r < 4; r++)
+      out[c*4+r] = (r < 3 && c < 3) ? (float)m[r][c] : (r == c ? 1.0f : 0.0f);
+}
+
+void rot_convert_ref(int fin, int fout, float *in, float *out, int n) {
+  int isz = rot_size(fin), osz = rot_size(fout);
+  double a[3], q[4], m[3][3];
+  int j, k, r, c;
+
+  for(j = 0; j < n; j++, in += isz, out += osz) {
+    switch (fin) {
+    case ROT_ANG:
+      for(k = 0; k < 3; k++)
+	a[k] = in[k];
+      if (fout == ROT_ANG) {
+	for(k = 0; k < 3; k++)
+	  out[k] = (float)a[k];
+      } else if (fout == ROT_QUAT) {
+	ref_a2q(a,q);
+	ref_qnorm(q);
+	for(k = 0; k < 4; k++)
+	  out[k] = (float)q[k];
+      } else {
+	ref_a2m(a,m);
+	ref_put_mtx(m,out);
+      }
+      break;
+
+    case ROT_QUAT:
+      for(k = 0; k < 4; k++)
+	q[k] = in[k];
+      ref_qnorm(q);
+      if (fout == ROT_QUAT) {
+	for(k = 0; k < 4; k++)
+	  out[k] = (float)q[k];
+      } else {
+	ref_q2m(q,m);
+	if (fout == ROT_MTX)
+	  ref_put_mtx(m,out);
+	else {
+	  ref_m2a(m,a);
+	  for(k = 0; k < 3; k++)
+	    out[k] = (float)a[k];
+	}
+      }
+      break;
+
+    case ROT_MTX:
+      for(r = 0; r < 3; r++)
+	for(c = 0; c < 3; c++)
+	  m[r][c] = in[c*4+r];
+      if (fout == ROT_ANG) {
+	ref_m2a(m,a);
+	for(k = 0; k < 3; k++)
+	  out[k] = (float)a[k];
+      } else {
+	/* going through a quaternion also squares up a matrix that has
+	   drifted from being orthonormal */
+	ref_m2q(m,q);
+	ref_qnorm(q);
+	if (fout == ROT_QUAT) {
+	  for(k = 0; k < 4; k++)
+	    out[k] = (float)q[k];
+	} else {
+	  ref_q2m(q,m);
+	  ref_put_mtx(m,out);
+	}
+      }
+      break;
+    }
+  }
+}
+
+#ifdef ROT_SSE2
+/* Four rotations at a time, as four quaternions held component-wise
+   ("structure of arrays") in the lanes of x, y, z and w. */
+
+typedef union {
+  __m128 v;
+  float f[4];
+} rv4;
+
+#define RSET(x) _mm_set1_ps(x)
+
+/* sine and cosine of four angles at once - Cephes' single precision
+   polynomials after reduction to [-pi/4,pi/4] by octant */
+static void sincos4(__m128 x, __m128 *s, __m128 *c) {
+  __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+  __m128 ssign, csign, y, z, ps, pc, sel;
+  __m128i j, one = _mm_set1_epi32(1), two = _mm_set1_epi32(2),
+    four = _mm_set1_epi32(4);
+
+  ssign = _mm_and_ps(x,sign);
+  x = _mm_andnot_ps(sign,x);
+
+  /* octant, rounded up to even */
+  j = _mm_cvttps_epi32(_mm_mul_ps(x,RSET(1.27323954473516f)));
+  j = _mm_and_si128(_mm_add_epi32(j,one),_mm_set1_epi32(~1));
+  y = _mm_cvtepi32_ps(j);
+
+  /* octants 4-7 flip the sine; octants 2-5 flip the cosine */
+  ssign = _mm_xor_ps(ssign,
+		     _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j,four),29)));
+  csign = _mm_castsi128_ps(_mm_slli_epi32(
+	    _mm_andnot_si128(_mm_sub_epi32(j,two),four),29));
+  /* octants 2,3,6,7 swap sine and cosine */
+  sel = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j,two),two));
+
+  /* extended precision x - y*pi/4 */
+  x = _mm_add_ps(x,_mm_mul_ps(y,RSET(-0.78515625f)));
+  x = _mm_add_ps(x,_mm_mul_ps(y,RSET(-2.4187564849853515625e-4f)));
+  x = _mm_add_ps(x,_mm_mul_ps(y,RSET(-3.77489497744594108e-8f)));
+  z = _mm_mul_ps(x,x);
+
+  pc = RSET(2.443315711809948e-5f);
+  pc = _mm_add_ps(_mm_mul_ps(pc,z),RSET(-1.388731625493765e-3f));
+  pc = _mm_add_ps(_mm_mul_ps(pc,z),RSET(4.166664568298827e-2f));
+  pc = _mm_mul_ps(_mm_mul_ps(pc,z),z);
+  pc = _mm_add_ps(_mm_sub_ps(pc,_mm_mul_ps(z,RSET(0.5f))),RSET(1.0f));
+
+  ps = RSET(-1.9515295891e-4f);
+  ps = _mm_add_ps(_mm_mul_ps(ps,z),RSET(8.3321608736e-3f));
+  ps = _mm_add_ps(_mm_mul_ps(ps,z),RSET(-1.6666654611e-1f));
+  ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ps,z),x),x);
+
+  *s = _mm_xor_ps(_mm_or_ps(_mm_and_ps(sel,pc),_mm_andnot_ps(sel,ps)),ssign);
+  *c = _mm_xor_ps(_mm_or_ps(_mm_and_ps(sel,ps),_mm_andnot_ps(sel,pc)),csign);
+}
+
+static __m128 sel4(__m128 m, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(m,a),_mm_andnot_ps(m,b));
+}
+
+/* make unit length with w >= 0 */
+static void qnorm4(__m128 *x, __m128 *y, __m128 *z, __m128 *w) {
+  __m128 l, neg;
+  l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(*x,*x),_mm_mul_ps(*y,*y)),
+		 _mm_add_ps(_mm_mul_ps(*z,*z),_mm_mul_ps(*w,*w)));
+  l = _mm_sqrt_ps(l);
+  /* a zero quaternion becomes the identity */
+  neg = _mm_cmple_ps(l,_mm_setzero_ps());
+  *w = sel4(neg,RSET(1.0f),*w);
+  l = sel4(neg,RSET(1.0f),l);
+  l = _mm_xor_ps(l,_mm_and_ps(_mm_cmplt_ps(*w,_mm_setzero_ps()),
+			      RSET(-0.0f)));
+  l = _mm_div_ps(RSET(1.0f),l);
+  *x = _mm_mul_ps(*x,l);
+  *y = _mm_mul_ps(*y,l);
+  *z = _mm_mul_ps(*z,l);
+  *w = _mm_mul_ps(*w,l);
+}
+
+static void ang_to_q4(float *in, __m128 *x, __m128 *y, __m128 *z, __m128 *w) {
+  __m128 sx, cx, sy, cy, sz, cz, h = RSET(0.5f), t;
+  rv4 a[3];
+  int k;
+  for(k = 0; k < 4; k++) {
+    a[0].f[k] = in[k*3];
+    a[1].f[k] = in[k*3+1];
+    a[2].f[k] = in[k*3+2];
+  }
+  sincos4(_mm_mul_ps(a[0].v,h),&sx,&cx);
+  sincos4(_mm_mul_ps(a[1].v,h),&sy,&cy);
+  sincos4(_mm_mul_ps(a[2].v,h),&sz,&cz);
+  t = _mm_mul_ps(cy,cz);
+  *x = _mm_mul_ps(sx,t);
+  *w = _mm_mul_ps(cx,t);
+  t = _mm_mul_ps(sy,sz);
+  *x = _mm_add_ps(*x,_mm_mul_ps(cx,t));
+  *w = _mm_sub_ps(*w,_mm_mul_ps(sx,t));
+  t = _mm_mul_ps(sy,cz);
+  *y = _mm_mul_ps(cx,t);
+  *z = _mm_mul_ps(sx,t);
+  t = _mm_mul_ps(cy,sz);
+  *y = _mm_sub_ps(*y,_mm_mul_ps(sx,t));
+  *z = _mm_add_ps(*z,_mm_mul_ps(cx,t));
+  qnorm4(x,y,z,w);
+}
+
+static void quat_to_q4(float *in, __m128 *x, __m128 *y, __m128 *z, __m128 *w) {
+  __m128 r0 = _mm_loadu_ps(in), r1 = _mm_loadu_ps(in+4),
+    r2 = _mm_loadu_ps(in+8), r3 = _mm_loadu_ps(in+12);
+  _MM_TRANSPOSE4_PS(r0,r1,r2,r3);
+  *x = r0;  *y = r1;  *z = r2;  *w = r3;
+  qnorm4(x,y,z,w);
+}
+
+/* Shepperd's method, choosing the largest of the four diagonal
+   combinations in each lane rather than branching */
+static void mtx_to_q4(float *in, __m128 *x, __m128 *y, __m128 *z, __m128 *w) {
+  rv4 m[3][3];
+  __m128 one = RSET(1.0f), t0, t1, t2, t3, tm, mw, mx, my, s, inv, big;
+  __m128 a, b, c, d, e, f;
+  int k, r, cc;
+
+  for(k = 0; k < 4; k++)
+    for(r = 0; r < 3; r++)
+      for(cc = 0; cc < 3; cc++)
+	m[r][cc].f[k] = in[k*16+cc*4+r];
+
+  t0 = _mm_add_ps(_mm_add_ps(one,m[0][0].v),_mm_add_ps(m[1][1].v,m[2][2].v));
+  t1 = _mm_sub_ps(_mm_add_ps(one,m[0][0].v),_mm_add_ps(m[1][1].v,m[2][2].v));
+  t2 = _mm_sub_ps(_mm_add_ps(one,m[1][1].v),_mm_add_ps(m[0][0].v,m[2][2].v));
+  t3 = _mm_sub_ps(_mm_add_ps(one,m[2][2].v),_mm_add_ps(m[0][0].v,m[1][1].v));
+  tm = _mm_max_ps(_mm_max_ps(t0,t1),_mm_max_ps(t2,t3));
+
+  mw = _mm_cmpge_ps(t0,tm);
+  mx = _mm_andnot_ps(mw,_mm_cmpge_ps(t1,tm));
+  my = _mm_andnot_ps(_mm_or_ps(mw,mx),_mm_cmpge_ps(t2,tm));
+  /* and the z case is whatever is left */
+
+  s = _mm_mul_ps(RSET(2.0f),_mm_sqrt_ps(tm));
+  big = _mm_mul_ps(s,RSET(0.25f));
+  inv = _mm_div_ps(one,s);
+
+  a = _mm_mul_ps(_mm_sub_ps(m[2][1].v,m[1][2].v),inv);
+  b = _mm_mul_ps(_mm_sub_ps(m[0][2].v,m[2][0].v),inv);
+  c = _mm_mul_ps(_mm_sub_ps(m[1][0].v,m[0][1].v),inv);
+  d = _mm_mul_ps(_mm_add_ps(m[0][1].v,m[1][0].v),inv);
+  e = _mm_mul_ps(_mm_add_ps(m[0][2].v,m[2][0].v),inv);
+  f = _mm_mul_ps(_mm_add_ps(m[1][2].v,m[2][1].v),inv);
+
+  *x = sel4(mw,a,sel4(mx,big,sel4(my,d,e)));
+  *y = sel4(mw,b,sel4(mx,d,sel4(my,big,f)));
+  *z = sel4(mw,c,sel4(mx,e,sel4(my,f,big)));
+  *w = sel4(mw,big,sel4(mx,a,sel4(my,b,c)));
+  qnorm4(x,y,z,w);
+}
+
+static void q4_to_quat(__m128 x, __m128 y, __m128 z, __m128 w, float *out) {
+  _MM_TRANSPOSE4_PS(x,y,z,w);
+  _mm_storeu_ps(out,x);
+  _mm_storeu_ps(out+4,y);
+  _mm_storeu_ps(out+8,z);
+  _mm_storeu_ps(out+12,w);
+}
+
+/* the rotation part of the matrix, m[r][c] */
+static void q4_to_m(__m128 x, __m128 y, __m128 z, __m128 w, rv4 m[3][3]) {
+  __m128 one = RSET(1.0f), two = RSET(2.0f);
+  __m128 x2 = _mm_mul_ps(x,two), y2 = _mm_mul_ps(y,two),
+    z2 = _mm_mul_ps(z,two);
+  __m128 xx = _mm_mul_ps(x,x2), yy = _mm_mul_ps(y,y2), zz = _mm_mul_ps(z,z2),
+    xy = _mm_mul_ps(x,y2), xz = _mm_mul_ps(x,z2), yz = _mm_mul_ps(y,z2),
+    wx = _mm_mul_ps(w,x2), wy = _mm_mul_ps(w,y2), wz = _mm_mul_ps(w,z2);
+
+  m[0][0].v = _mm_sub_ps(one,_mm_add_ps(yy,zz));
+  m[0][1].v = _mm_sub_ps(xy,wz);
+  m[0][2].v = _mm_add_ps(xz,wy);
+  m[1][0].v = _mm_add_ps(xy,wz);
+  m[1][1].v = _mm_sub_ps(one,_mm_add_ps(xx,zz));
+  m[1][2].v = _mm_sub_ps(yz,wx);
+  m[2][0].v = _mm_sub_ps(xz,wy);
+  m[2][1].v = _mm_add_ps(yz,wx);
+  m[2][2].v = _mm_sub_ps(one,_mm_add_ps(xx,yy));
+}
+
+static void q4_to_mtx(__m128 x, __m128 y, __m128 z, __m128 w, float *out) {
+  rv4 m[3][3];
+  float *o;
+  int k, r, c;
+
+  q4_to_m(x,y,z,w,m);
+  for(k = 0; k < 4; k++) {
+    o = out + k*16;
+    for(c = 0; c < 3; c++) {
+      for(r = 0; r < 3; r++)
+	o[c*4+r] = m[r][c].f[k];
+      o[c*4+3] = 0.0f;
+    }
+    o[12] = o[13] = o[14] = 0.0f;
+    o[15] = 1.0f;
+  }
+}
+
+/* atan2 of four pairs - Cephes' single precision arctangent after
+   reduction to [0,tan(pi/8)], then put in the right quadrant */
+static __m128 atan2_4(__m128 y, __m128 x) {
+  __m128 sign = RSET(-0.0f), zero = _mm_setzero_ps();
+  __m128 t, tsign, big, mid, a, base, z, r;
+
+  t = _mm_div_ps(y,x);
+  tsign = _mm_and_ps(t,sign);
+  t = _mm_andnot_ps(sign,t);
+
+  big = _mm_cmpgt_ps(t,RSET(2.414213562373095f));
+  mid = _mm_andnot_ps(big,_mm_cmpgt_ps(t,RSET(0.4142135623730950f)));
+  a = sel4(big,_mm_div_ps(RSET(-1.0f),t),
+	   sel4(mid,_mm_div_ps(_mm_sub_ps(t,RSET(1.0f)),
+			       _mm_add_ps(t,RSET(1.0f))),t));
+  base = sel4(big,RSET((float)(M_PI/2.0)),
+	      _mm_and_ps(mid,RSET((float)(M_PI/4.0))));
+
+  z = _mm_mul_ps(a,a);
+  r = RSET(8.05374449538e-2f);
+  r = _mm_add_ps(_mm_mul_ps(r,z),RSET(-1.38776856032e-1f));
+  r = _mm_add_ps(_mm_mul_ps(r,z),RSET(1.99777106478e-1f));
+  r = _mm_add_ps(_mm_mul_ps(r,z),RSET(-3.33329491539e-1f));
+  r = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(r,z),a),a);
+  r = _mm_xor_ps(_mm_add_ps(r,base),tsign);
+
+  /* x < 0 is half a turn away */
+  r = _mm_add_ps(r,_mm_and_ps(_mm_cmplt_ps(x,zero),
+			      _mm_or_ps(_mm_andnot_ps(sign,RSET((float)M_PI)),
+					_mm_and_ps(y,sign))));
+  /* and atan2(0,0) is 0 rather than whatever 0/0 gave */
+  return _mm_andnot_ps(_mm_and_ps(_mm_cmpeq_ps(x,zero),_mm_cmpeq_ps(y,zero)),
+		       r);
+}
+
+/* as ref_m2a(), with the matrix terms needed taken straight from the
+   quaternion.  The sine and cosine of a[0] are the normalised
+   arguments that gave it, so need not be computed again. */
+static void q4_to_ang(__m128 x, __m128 y, __m128 z, __m128 w, float *out) {
+  rv4 m[3][3], a[3];
+  __m128 cy, s0, c0, ok;
+  int k;
+
+  q4_to_m(x,y,z,w,m);
+  cy = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(m[1][2].v,m[1][2].v),
+			      _mm_mul_ps(m[2][2].v,m[2][2].v)));
+  a[0].v = atan2_4(_mm_xor_ps(m[1][2].v,RSET(-0.0f)),m[2][2].v);
+  a[1].v = atan2_4(m[0][2].v,cy);
+  ok = _mm_cmpgt_ps(cy,_mm_setzero_ps());
+  cy = sel4(ok,cy,RSET(1.0f));
+  s0 = _mm_and_ps(ok,_mm_div_ps(_mm_xor_ps(m[1][2].v,RSET(-0.0f)),cy));
+  c0 = sel4(ok,_mm_div_ps(m[2][2].v,cy),RSET(1.0f));
+  a[2].v = atan2_4(_mm_add_ps(_mm_mul_ps(c0,m[1][0].v),
+			      _mm_mul_ps(s0,m[2][0].v)),
+		   _mm_add_ps(_mm_mul_ps(c0,m[1][1].v),
+			      _mm_mul_ps(s0,m[2][1].v)));
+  for(k = 0; k < 4; k++, out += 3) {
+    out[0] = a[0].f[k];
+    out[1] = a[1].f[k];
+    out[2] = a[2].f[k];
+  }
+}
+
+/* convert exactly four rotations */
+static void convert4(int fin, int fout, float *in, float *out) {
+  __m128 x, y, z, w;
+
+  switch (fin) {
+  case ROT_ANG:  ang_to_q4(in,&x,&y,&z,&w); break;
+  case ROT_QUAT: quat_to_q4(in,&x,&y,&z,&w); break;
+  default:       mtx_to_q4(in,&x,&y,&z,&w); break;
+  }
+  switch (fout) {
+  case ROT_ANG:  q4_to_ang(x,y,z,w,out); break;
+  case ROT_QUAT: q4_to_quat(x,y,z,w,out); break;
+  default:       q4_to_mtx(x,y,z,w,out); break;
+  }
+}
+
+void rot_convert(int fin, int fout, float *in, float *out, int n) {
+  float tin[4*16], tout[4*16];
+  int isz = rot_size(fin), osz = rot_size(fout), k;
+
+  if (fin == ROT_ANG && fout == ROT_ANG) {
+    if (in != out)
+      memmove(out,in,n*3*sizeof(float));
+    return;
+  }
+  for( ; n >= 4; n -= 4, in += 4*isz, out += 4*osz)
+    convert4(fin,fout,in,out);
+  if (n > 0) {
+    /* pad the last few with identities */
+    memset(tin,0,sizeof(tin));
+    memcpy(tin,in,n*isz*sizeof(float));
+    for(k = n; k < 4; k++) {
+      if (fin == ROT_QUAT)
+	tin[k*4+3] = 1.0f;
+      else if (fin == ROT_MTX)
+	tin[k*16] = tin[k*16+5] = tin[k*16+10] = tin[k*16+15] = 1.0f;
+    }
+    convert4(fin,fout,tin,tout);
+    memcpy(out,tout,n*osz*sizeof(float));
+  }
+}
+
+#else /* ROT_SSE2 */
+
+void rot_convert(int fin, int fout, float *in, float *out, int n) {
+  rot_convert_ref(fin,fout,in,out,n);
+}
+
+#endif /* ROT_SSE2 */
@@ -0,0 +1,30 @@
+#ifndef ROT_KERN_H
+#define ROT_KERN_H
+
+/* Rotation format conversion kernels for the rot filters.
+
+   Every conversion goes through a quaternion, so a matrix is only
+   built when one is asked for.  Data is "array of structures" - n
+   rotations one after another:
+
+   ROT_ANG   3 floats - angles (radians) about x, y and z, applied in
+             that order, i.e. the rotation Rx*Ry*Rz
+   ROT_QUAT  4 floats - [x,y,z,w] as in VeQuat
+   ROT_MTX   16 floats - 4x4 matrix, column-major as for OpenGL
+
+   rot_convert() uses SIMD instructions when they were available at
+   compile time (see rot_simd()) and rot_convert_ref() is the plain
+   scalar version that it is checked against.  Quaternions that come
+   out of either have w >= 0.  "in" and "out" may be the same array
+   if the two formats are the same size. */
+
+#define ROT_ANG  0
+#define ROT_QUAT 1
+#define ROT_MTX  2
+
+int rot_size(int fmt);
+char *rot_simd(void);  /* name of the instruction set used, or NULL */
+void rot_convert(int fin, int fout, float *in, float *out, int n);
+void rot_convert_ref(int fin, int fout, float *in, float *out, int n);
+
+#endif /* ROT_KERN_H */
@@ -0,0 +1,143 @@
+/*
+  evbench - a micro-benchmark for device event dispatch.
+
+  This pushes synthetic events through the full input path (filter
+  table, device models and the callback list - i.e. what every
+  tracker or joystick sample goes through) and reports how many
+  events per second that manages.  To look like a real application,
+  the filter table and callback list are padded with entries for
+  other devices, as vem, BlueScript "filter" blocks and application
+  bindings would add.  All settings are given as VE options
+  (-ve_opt name value):
+
+    evbench_events     number of events to measure (default 200000)
+    evbench_warmup     events to process before measuring (default 1000)
+    evbench_callbacks  number of callbacks that do not match (default 32)
+    evbench_filters    number of filters that do not match (default 16)
+    evbench_devices    number of devices events come from (default 4)
+    evbench_vector     if non-zero, send 3-vectors rather than valuators
+                       and add an indexed callback (".0") for each
+                       device (default 0)
+    evbench_min_rate   if set, exit with status 1 when the measured
+                       events/sec is lower (for use as a regression check)
+
+  The result is a single line:
+
+    evbench: events=200000 callbacks=32 filters=16 devices=4 vector=0
+      events/sec=... ns/event=... delivered=...
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ve.h>
+
+static int nevents = 200000, nwarmup = 1000;
+static int ncbacks = 32, nfilters = 16, ndevices = 4, vector = 0;
+static float min_rate = 0.0;
+static long delivered = 0;
+
+static int optval(char *name, int def) {
+  char *s;
+  return (s = veGetOption(name)) ? atoi(s) : def;
+}
+
+static int pass_filter(VeDeviceEvent *e, void *arg) {
+  return VE_FILT_CONTINUE;
+}
+
+static int never_cback(VeDeviceEvent *e, void *arg) {
+  fprintf(stderr,"evbench: unexpected callback for %s.%s\n",
+	  e->device,e->elem);
+  exit(1);
+}
+
+static int count_cback(VeDeviceEvent *e, void *arg) {
+  delivered++;
+  return 0;
+}
+
+static void send_events(int n, char **devs) {
+  VeDeviceEvent *e;
+  int k;
+
+  for(k = 0; k < n; k++) {
+    if (vector) {
+      e = veDeviceEventInit(VE_ELEM_VECTOR,3,devs[k % ndevices],"pos");
+      VE_EVENT_VECTOR(e)->value[0] = (float)k;
+    } else {
+      e = veDeviceEventInit(VE_ELEM_VALUATOR,0,devs[k % ndevices],"x");
+      VE_EVENT_VALUATOR(e)->value = (float)k;
+    }
+    veDeviceProcessEvent(e);
+    veDeviceEventDestroy(e);
+  }
+}
+
+int main(int argc, char **argv) {
+  char name[64], **devs;
+  long t0;
+  double secs, rate;
+  int k;
+
+  veInit(&argc,argv);
+
+  nevents = optval("evbench_events",nevents);
+  nwarmup = optval("evbench_warmup",nwarmup);
+  ncbacks = optval("evbench_callbacks",ncbacks);
+  nfilters = optval("evbench_filters",nfilters);
+  ndevices = optval("evbench_devices",ndevices);
+  vector = optval("evbench_vector",vector);
+  if (ndevices < 1)
+    ndevices = 1;
+  if (nevents < 1)
+    nevents = 1;
+  if (veGetOption("evbench_min_rate"))
+    min_rate = atof(veGetOption("evbench_min_rate"));
+
+  devs = malloc(ndevices*sizeof(char *));
+  for(k = 0; k < ndevices; k++) {
+    sprintf(name,"bench%d",k);
+    devs[k] = strdup(name);
+  }
+
+  /* callbacks are searched most-recently-added first, so the one that
+     counts goes in first and everything else in front of it */
+  veDeviceAddCallback(count_cback,NULL,"*.*");
+  for(k = 0; k < ncbacks; k++) {
+    sprintf(name,"other%d.button%d",k,k);
+    veDeviceAddCallback(never_cback,NULL,name);
+  }
+  if (vector)
+    for(k = 0; k < ndevices; k++) {
+      sprintf(name,"%s.pos.0",devs[k]);
+      veDeviceAddCallback(count_cback,NULL,name);
+    }
+  for(k = 0; k < nfilters; k++) {
+    sprintf(name,"other%d.axis%d",k,k);
+    veDeviceFilterAdd(veDeviceParseSpec(name),
+		      veDeviceFilterCreate(pass_filter,NULL),VE_FTABLE_TAIL);
+  }
+  veDeviceFilterAdd(veDeviceParseSpec("*.*"),
+		    veDeviceFilterCreate(pass_filter,NULL),VE_FTABLE_TAIL);
+
+  send_events(nwarmup,devs);
+  delivered = 0;
+  t0 = veClockNano();
+  send_events(nevents,devs);
+  secs = (veClockNano() - t0)/1.0e9;
+  rate = (secs > 0.0) ? nevents/secs : 0.0;
+
+  printf("evbench: events=%d callbacks=%d filters=%d devices=%d vector=%d "
+	 "events/sec=%.0f ns/event=%.0f delivered=%ld\n",
+	 nevents,ncbacks,nfilters,ndevices,vector,rate,
+	 secs*1.0e9/nevents,delivered);
+  fflush(stdout);
+  if (min_rate > 0.0 && rate < min_rate) {
+    /* veExit() is registered with atexit() and would turn this into
+       a successful exit, so bypass it */
+    fprintf(stderr,"evbench: event rate below %g\n",min_rate);
+    _exit(1);
+  }
+  return 0;
+}
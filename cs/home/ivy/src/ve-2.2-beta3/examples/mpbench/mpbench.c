@@ -0,0 +1,249 @@
+/*
+  mpbench - a synthetic benchmark for the MP layer.
+
+  This runs a frame loop on a small cluster of slave processes on the
+  local machine (one process per window, using the null renderer so no
+  display or graphics hardware is needed) and reports how fast frames
+  go through the MP layer and what they cost.  All settings are given
+  as VE options (-ve_opt name value):
+
+    mpbench_slaves   number of slave processes (default 4)
+    mpbench_frames   number of frames to measure (default 1000)
+    mpbench_warmup   frames to run before measuring (default 50)
+    mpbench_state    size of the replicated state variable in bytes
+                     (default 1024)
+    mpbench_dirty    bytes of the state variable changed each frame
+                     (default - all of it)
+    mpbench_delta    if non-zero, replicate the state variable with
+                     VE_MP_DELTA (default 0)
+    mpbench_data     bytes pushed with veMPDataPush() (default 0)
+    mpbench_data_every  frames between data pushes (default 1)
+    mpbench_min_fps  if set, exit with status 1 when the measured frame
+                     rate is lower (for use as a regression check)
+
+  Anything else (e.g. mp_pipeline, mp_mcast, null_render_ms) is passed
+  through to the library as usual.  The result is a single line:
+
+    mpbench: slaves=4 frames=1000 fps=... barrier_p50=... barrier_p99=...
+      bytes/frame=... syscalls/frame=...
+
+  Barrier latency is the time the master spends in veMPRenderFrame()
+  (in ms).  Bytes and system calls are those made by the master process.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ve.h>
+
+#define SV_STATE 0
+#define DT_DATA  0
+
+static int nslaves = 4;
+static int nframes = 1000, nwarmup = 50;
+static int state_sz = 1024, dirty_sz = -1, data_sz = 0, data_every = 1;
+static float min_fps = 0.0;
+static unsigned char *state = NULL, *data = NULL;
+
+/* measurement (master only) */
+static VeStatistic *barrier;   /* histogram of veMPRenderFrame() time */
+static long frame_start;
+static int frames = 0, done = 0;
+static long t0;
+static unsigned int tx0, rx0, bytes0;
+static char env_path[64] = "";
+
+static int optval(char *name, int def) {
+  char *s;
+  return (s = veGetOption(name)) ? atoi(s) : def;
+}
+
+/* read an -ve_opt before veInit() has been called */
+static char *early_opt(int argc, char **argv, char *name) {
+  int i;
+  for(i = 1; i+2 < argc+1; i++)
+    if (strcmp(argv[i],"-ve_opt") == 0 && i+2 < argc &&
+	strcmp(argv[i+1],name) == 0)
+      return argv[i+2];
+  return NULL;
+}
+
+static unsigned int stat_int(char *module, char *name) {
+  VeStatisticList *l;
+  for(l = veGetStatistics(); l; l = l->next)
+    if (strcmp(l->stat->module,module) == 0 &&
+	strcmp(l->stat->name,name) == 0)
+      return (unsigned int)*(int *)(l->stat->data);
+  return 0;
+}
+
+static unsigned int io_calls(void) {
+  return stat_int("ve_mp_posix","tx_syscalls") +
+    stat_int("ve_mp_posix","rx_syscalls");
+}
+
+/* write an environment with one window per slave */
+static void make_env(int n) {
+  FILE *f;
+  int k;
+
+  snprintf(env_path,sizeof(env_path),"/tmp/mpbench.%d.env",(int)getpid());
+  if (!(f = fopen(env_path,"w"))) {
+    perror(env_path);
+    exit(1);
+  }
+  fprintf(f,"env mpbench {\n"
+	  "  desc \"mpbench - %d local slaves\"\n"
+	  "  option doublebuffer 1\n"
+	  "  wall bench {\n"
+	  "    loc 0.0 0.0 -1.0\n"
+	  "    dir 0.0 0.0 1.0\n"
+	  "    up 0.0 1.0 0.0\n"
+	  "    size 1.0 1.0\n",n);
+  for(k = 0; k < n; k++)
+    fprintf(f,"    window w%d {\n"
+	    "      slave auto unique\n"
+	    "      display default\n"
+	    "      geometry 64x64+%d+0\n"
+	    "    }\n",k,k*64);
+  fprintf(f,"  }\n}\n");
+  fclose(f);
+}
+
+static void cleanup(void) {
+  if (env_path[0])
+    unlink(env_path);
+}
+
+static void data_handler(int tag, void *buf, int dlen) {
+  /* nothing to do - we are only measuring delivery */
+}
+
+static void pre_frame(void) {
+  frame_start = veClockNano();
+}
+
+static void post_frame(void) {
+  frames++;
+  if (frames == nwarmup) {
+    /* start measuring */
+    t0 = veClock();
+    tx0 = stat_int("ve_mp_posix","tx_bytes");
+    rx0 = io_calls();
+    veHistStatReset(barrier);
+  } else if (frames > nwarmup) {
+    veHistStatAdd(barrier,(veClockNano() - frame_start)/1.0e6);
+    if (frames == nwarmup + nframes)
+      done = 1;
+  }
+}
+
+static void report(void) {
+  float secs, fps;
+  unsigned int bytes, calls;
+
+  secs = (veClock() - t0)/1000.0;
+  fps = (secs > 0.0) ? nframes/secs : 0.0;
+  bytes = stat_int("ve_mp_posix","tx_bytes") - tx0;
+  calls = io_calls() - rx0;
+  printf("mpbench: slaves=%d frames=%d fps=%.1f barrier_p50=%.3g "
+	 "barrier_p99=%.3g bytes/frame=%.0f syscalls/frame=%.1f\n",
+	 nslaves,nframes,fps,
+	 veHistStatPercentile(barrier,0.5),
+	 veHistStatPercentile(barrier,0.99),
+	 (float)bytes/nframes,(float)calls/nframes);
+  fflush(stdout);
+  if (min_fps > 0.0 && fps < min_fps) {
+    /* veExit() is registered with atexit() and would turn this into
+       a successful exit, so bypass it */
+    fprintf(stderr,"mpbench: frame rate below %g\n",min_fps);
+    cleanup();
+    _exit(1);
+  }
+  exit(0);
+}
+
+/* generate the next frame's worth of traffic */
+static void idle(void) {
+  static int off = 0, cnt = 0;
+  int k;
+
+  if (done)
+    report();
+
+  if (state_sz > 0) {
+    for(k = 0; k < dirty_sz; k++)
+      state[(off+k) % state_sz]++;
+    off = (off + dirty_sz) % state_sz;
+  }
+  if (data_sz > 0 && (++cnt % data_every) == 0)
+    veMPDataPush(DT_DATA,data,data_sz);
+  vePostRedisplay();
+}
+
+int main(int argc, char **argv) {
+  char **nargv;
+  char *s;
+  int k, n;
+
+  if (argc < 2 || strcmp(argv[1],"-vemp_slave") != 0) {
+    /* master: build the environment and make sure we use the null
+       renderer - the slaves inherit our arguments */
+    if ((s = early_opt(argc,argv,"mpbench_slaves")))
+      nslaves = atoi(s);
+    if (nslaves < 1)
+      nslaves = 1;
+    make_env(nslaves);
+    atexit(cleanup);
+    nargv = malloc((argc+7)*sizeof(char *));
+    n = 0;
+    nargv[n++] = argv[0];
+    nargv[n++] = "-ve_env";
+    nargv[n++] = env_path;
+    if (!early_opt(argc,argv,"render")) {
+      nargv[n++] = "-ve_opt";
+      nargv[n++] = "render";
+      nargv[n++] = "null";
+    }
+    for(k = 1; k < argc; k++)
+      nargv[n++] = argv[k];
+    nargv[n] = NULL;
+    argc = n;
+    argv = nargv;
+  }
+
+  veInit(&argc,argv);
+
+  nframes = optval("mpbench_frames",nframes);
+  nwarmup = optval("mpbench_warmup",nwarmup);
+  state_sz = optval("mpbench_state",state_sz);
+  dirty_sz = optval("mpbench_dirty",state_sz);
+  if (dirty_sz > state_sz)
+    dirty_sz = state_sz;
+  data_sz = optval("mpbench_data",data_sz);
+  data_every = optval("mpbench_data_every",data_every);
+  if (data_every < 1)
+    data_every = 1;
+  if ((s = veGetOption("mpbench_min_fps")))
+    min_fps = atof(s);
+  if (nwarmup < 1)
+    nwarmup = 1;
+
+  if (state_sz > 0) {
+    state = calloc(state_sz,1);
+    veMPAddStateVar(SV_STATE,state,state_sz,
+		    VE_MP_AUTO | (optval("mpbench_delta",0) ? VE_MP_DELTA : 0));
+  }
+  if (data_sz > 0)
+    data = calloc(data_sz,1);
+  veMPDataAddHandler(DT_DATA,data_handler);
+
+  barrier = veNewHistStatistic("mpbench","barrier","ms",0.01);
+  veAddStatistic(barrier);
+  veRenderPreCback(pre_frame);
+  veRenderPostCback(post_frame);
+  veSetIdleProc(idle);
+
+  veRun();
+  return 0;
+}
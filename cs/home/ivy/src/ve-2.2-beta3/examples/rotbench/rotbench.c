@@ -0,0 +1,167 @@
+/*
+  rotbench - checks and times the rotation conversion kernels used by
+  the "rot" filters (drivers/rot).
+
+  Every conversion between angles, quaternions and matrices is run on
+  the same random rotations through both rot_convert() (SIMD where
+  available) and rot_convert_ref() (plain scalar), the results are
+  compared and the time per rotation of each is reported.  Quaternions
+  are compared allowing for q and -q being the same rotation and
+  angles are compared by the rotations they describe, since different
+  angles can give the same rotation.
+
+    rotbench [count [repeat]]
+
+    count   rotations per batch (default 4096)
+    repeat  batches to time (default 200)
+
+  The exit status is 1 if any result differs by more than the
+  tolerance, so this can be used as a regression check.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ve_clock.h>
+
+#include "rot_kern.h"
+
+#define TOLERANCE 1.0e-4
+
+static char *fmt_names[3] = { "ang", "quat", "mtx" };
+
+/* rotation part of a matrix in the kernel's layout, m[r][c] */
+static void to_mtx(int fmt, float *v, double m[3][3]) {
+  float t[16];
+  int r, c;
+  if (fmt != ROT_MTX) {
+    rot_convert_ref(fmt,ROT_MTX,v,t,1);
+    v = t;
+  }
+  for(r = 0; r < 3; r++)
+    for(c = 0; c < 3; c++)
+      m[r][c] = v[c*4+r];
+}
+
+static double compare(int fmt, float *a, float *b) {
+  double ma[3][3], mb[3][3], e, d, s;
+  int k, r, c;
+
+  e = 0.0;
+  switch (fmt) {
+  case ROT_QUAT:
+    for(d = s = 0.0, k = 0; k < 4; k++) {
+      d = fmax(d,fabs(a[k] - b[k]));
+      s = fmax(s,fabs(a[k] + b[k]));
+    }
+    e = fmin(d,s);
+    break;
+  case ROT_MTX:
+    for(k = 0; k < 16; k++)
+      e = fmax(e,fabs(a[k] - b[k]));
+    break;
+  default:
+    to_mtx(fmt,a,ma);
+    to_mtx(fmt,b,mb);
+    for(r = 0; r < 3; r++)
+      for(c = 0; c < 3; c++)
+	e = fmax(e,fabs(ma[r][c] - mb[r][c]));
+    break;
+  }
+  return e;
+}
+
+static double urand(double lo, double hi) {
+  return lo + (hi - lo)*(rand()/(double)RAND_MAX);
+}
+
+/* random rotations in each format - a few of them exactly at the
+   awkward places (identity, half turns, gimbal lock) */
+static void make_input(int fmt, float *v, int n) {
+  float a[3];
+  int j, k;
+
+  for(j = 0; j < n; j++) {
+    for(k = 0; k < 3; k++)
+      a[k] = urand(-M_PI,M_PI);
+    switch (j % 16) {
+    case 0: a[0] = a[1] = a[2] = 0.0f; break;
+    case 1: a[0] = M_PI; a[1] = a[2] = 0.0f; break;
+    case 2: a[1] = M_PI/2.0; break;
+    case 3: a[1] = -M_PI/2.0; break;
+    }
+    if (fmt == ROT_ANG)
+      memcpy(v + j*3,a,sizeof(a));
+    else
+      rot_convert_ref(ROT_ANG,fmt,a,v + j*rot_size(fmt),1);
+    if (fmt == ROT_QUAT && (j % 3) == 0) {
+      /* not quite unit length and the "other" sign */
+      for(k = 0; k < 4; k++)
+	v[j*4+k] *= -1.01f;
+    }
+  }
+}
+
+static double nsec_per(long t, int n, int repeat) {
+  return (double)t/((double)n*repeat);
+}
+
+int main(int argc, char **argv) {
+  float *in, *out, *ref;
+  int n = 4096, repeat = 200, fin, fout, j, k, fail = 0;
+  double e, emax;
+  long t0, tfast, tref;
+
+  if (argc > 1)
+    n = atoi(argv[1]);
+  if (argc > 2)
+    repeat = atoi(argv[2]);
+  if (n <= 0 || repeat <= 0) {
+    fprintf(stderr,"usage: rotbench [count [repeat]]\n");
+    exit(1);
+  }
+
+  in = malloc(n*16*sizeof(float));
+  out = malloc(n*16*sizeof(float));
+  ref = malloc(n*16*sizeof(float));
+  if (!in || !out || !ref) {
+    fprintf(stderr,"rotbench: out of memory\n");
+    exit(1);
+  }
+  srand(1);
+
+  printf("rotbench: simd=%s count=%d repeat=%d\n",
+	 rot_simd() ? rot_simd() : "none",n,repeat);
+  for(fin = ROT_ANG; fin <= ROT_MTX; fin++) {
+    make_input(fin,in,n);
+    for(fout = ROT_ANG; fout <= ROT_MTX; fout++) {
+      rot_convert(fin,fout,in,out,n);
+      rot_convert_ref(fin,fout,in,ref,n);
+      emax = 0.0;
+      for(j = 0; j < n; j++) {
+	k = rot_size(fout);
+	e = compare(fout,out + j*k,ref + j*k);
+	if (!(e <= emax))
+	  emax = e; /* catches NaN too */
+      }
+
+      t0 = veClockNano();
+      for(k = 0; k < repeat; k++)
+	rot_convert(fin,fout,in,out,n);
+      tfast = veClockNano() - t0;
+      t0 = veClockNano();
+      for(k = 0; k < repeat; k++)
+	rot_convert_ref(fin,fout,in,ref,n);
+      tref = veClockNano() - t0;
+
+      printf("%4s->%-4s  ns/rot=%7.2f  ref ns/rot=%7.2f  speedup=%5.2f  "
+	     "max_err=%.2g%s\n",fmt_names[fin],fmt_names[fout],
+	     nsec_per(tfast,n,repeat),nsec_per(tref,n,repeat),
+	     tfast > 0 ? (double)tref/tfast : 0.0,emax,
+	     emax <= TOLERANCE ? "" : "  FAILED");
+      if (!(emax <= TOLERANCE))
+	fail = 1;
+    }
+  }
+  return fail;
+}
@@ -667,6 +667,7 @@ void bsSubsElemFree(BSSubsElem *);
 BSList *bsGetScript(BSInterp *i, BSObject *o, int *mustfree_r);
 
 int bsEval(BSInterp *, BSObject *);
+int bsEvalScript(BSInterp *, BSList *); /* list from bsGetScript() */
 int bsEvalSource(BSInterp *, BSParseSource *);
 int bsEvalString(BSInterp *, char *);
 int bsEvalStream(BSInterp *, FILE *);
@@ -136,6 +136,8 @@ int txmBindTexture(TXManager *mgr, int id); /* bind texture in the current
 					       context */
 int txmBoundTexture(TXManager *mgr); /* returns id of bound texture - 0 if
 					none */
+int txmContextId(TXManager *mgr); /* returns the renderer's number for the
+				     current context - -1 if none */
 int txmReloadTexture(TXManager *mgr, int id); /* force texture to be reloaded
 						 in all contexts (needed if
 						 you change it) */
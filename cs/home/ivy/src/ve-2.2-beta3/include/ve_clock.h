@@ -117,6 +117,18 @@ long veClockConvTimespec(long tv_secs, long tv_nsecs);
 long veClockNano();     /* returns hi-res clock in nanoseconds - not necess.
 			   referenced to zero point */
 
+/** function veClockFine
+    Like <code>veClock()</code> - milliseconds since the zero reference
+    point - but with the fraction of a millisecond kept, to the
+    resolution of <code>veClockHires()</code>.  Unlike
+    <code>veClockNano()</code> the value can be compared directly with
+    event timestamps and other <code>veClock()</code> values.
+
+    @returns
+    The current value of the clock in milliseconds.
+**/
+double veClockFine();
+
 /* the following are platform-specific */
 
 /** function veClockGetRef
@@ -883,6 +883,12 @@ typedef struct ve_device {
       if the device has no model.
   */
   VeDeviceModel *model;
+  /** member id
+      The interned identifier of the device's name (see
+      <code>veDeviceIntern()</code>), for creating events with
+      <code>veDeviceEventInitId()</code>.
+  */
+  int id;
 } VeDevice;
 
 /** function veDeviceCreate
@@ -1071,12 +1077,17 @@ typedef struct ve_device_event {
       The name of the device from which this event originates.  This
       may be a real, virtual or purely virtual device.  This name may be
       modified by filters before being passed to callbacks.
+      The library fills this in with a shared, interned string (see
+      <code>veDeviceIntern()</code>) which must not be modified or freed.
+      To change the name, use <code>veDeviceEventRename()</code> or
+      assign a new string (which the library will not free).
    */
   char *device;
   /** member elem
       The name of the element from which this event originates.  This
       element may or may not be a declared member of the device.  In other
       words, there are no restrictions on what this value may be.
+      The same rules apply as for <code>device</code>.
   */
   char *elem;       /* names of device and element of device */
   /** member index
@@ -1092,6 +1103,23 @@ typedef struct ve_device_event {
       The actual data (i.e. element content) for the event.
   */
   VeDeviceEContent *content; /* data about the event (depends upon etype) */
+  /** member device_id, elem_id
+      The interned identifiers of <code>device</code> and
+      <code>elem</code>, or 0 if they are not known.  These are only
+      meaningful while the names have not been changed by assigning to
+      them, so use <code>veDeviceEventDeviceId()</code> and
+      <code>veDeviceEventElemId()</code> rather than reading them directly.
+  */
+  int device_id, elem_id;
+  /** member merged
+      The number of earlier samples of the same element that were
+      merged into this event while it was queued (see
+      <code>veDevicePushEvent()</code>).  This is 0 for an event that
+      has not been coalesced.
+  */
+  int merged;
+  struct ve_device_event *pool_next; /* private - event pool */
+  double inserted; /* private - latency tracking (see veClockFine()) */
 } VeDeviceEvent;
 
 #define VE_EVENT_TYPE(x) ((x)->content->type)
@@ -1101,8 +1129,41 @@ typedef struct ve_device_event {
 #define VE_EVENT_VALUATOR(x) ((VeDeviceE_Valuator *)((x)->content))
 #define VE_EVENT_VECTOR(x) ((VeDeviceE_Vector *)((x)->content))
 
+/** function veDeviceIntern
+    Looks up the identifier for a device or element name, assigning
+    a new one if the name has not been seen before.  Identifiers are
+    small positive integers and are never reused.  Devices intern their
+    names when they are created (see the <code>id</code> member of
+    <code>VeDevice</code>) and drivers are expected to intern their
+    element names once when they start rather than for every event.
+
+    @param name
+    The name to look up.
+
+    @returns
+    The identifier for the name, or 0 if <i>name</i> is <code>NULL</code>.
+ */
+int veDeviceIntern(char *name);
+
+/** function veDeviceInternName
+    Returns the interned string for an identifier returned by
+    <code>veDeviceIntern()</code>.  The string is shared and remains
+    valid for the life of the program.
+
+    @param id
+    The identifier.
+
+    @returns
+    The name, or <code>NULL</code> if <i>id</i> is not a valid identifier.
+ */
+char *veDeviceInternName(int id);
+
 /** function veDeviceEventCreate
     Creates a device event object.
+    Events are taken from a per-thread pool (and returned to it by
+    <code>veDeviceEventDestroy()</code>) and an event that is reused
+    for the same kind of content does not need any memory to be
+    allocated.
     
     @param type
     The type of the event to create.
@@ -1146,6 +1207,70 @@ VeDeviceEvent *veDeviceEventCreate(VeDeviceEType type, int vsize);
 VeDeviceEvent *veDeviceEventInit(VeDeviceEType type, int vsize,
 				 char *device, char *elem);
 
+/** function veDeviceEventInitId
+    The same as <code>veDeviceEventInit()</code> except that the device
+    and element are given as interned identifiers (see
+    <code>veDeviceIntern()</code>).  This is the cheapest way for a
+    driver to create an event.
+
+    @param type
+    The type of the event to create.
+
+    @param vsize
+    If the event is of type <code>VE_ELEM_VECTOR</code> then this argument
+    is the size of the vector.
+
+    @param device
+    The identifier of the device name, or 0 to leave the device unset.
+
+    @param elem
+    The identifier of the element name, or 0 to leave the element unset.
+
+    @returns
+    A pointer to the newly created object, or <code>NULL</code> if an
+    error occurs.
+ */
+VeDeviceEvent *veDeviceEventInitId(VeDeviceEType type, int vsize,
+				   int device, int elem);
+
+/** function veDeviceEventRename
+    Changes the device and/or element name of an event.
+
+    @param e
+    The event to rename.
+
+    @param device
+    The new device name, or <code>NULL</code> to leave it unchanged.
+
+    @param elem
+    The new element name, or <code>NULL</code> to leave it unchanged.
+ */
+void veDeviceEventRename(VeDeviceEvent *e, char *device, char *elem);
+
+/** function veDeviceEventDeviceId
+    Returns the interned identifier of an event's device name, interning
+    the name if it has been changed by assignment.
+
+    @param e
+    The event.
+
+    @returns
+    The identifier, or 0 if the event has no device name.
+ */
+int veDeviceEventDeviceId(VeDeviceEvent *e);
+
+/** function veDeviceEventElemId
+    Returns the interned identifier of an event's element name, interning
+    the name if it has been changed by assignment.
+
+    @param e
+    The event.
+
+    @returns
+    The identifier, or 0 if the event has no element name.
+ */
+int veDeviceEventElemId(VeDeviceEvent *e);
+
 #define veDeviceEventType(e) ((e)?((e)->content?((e)->content->type):\
     VE_ELEM_UNDEF):VE_ELEM_UNDEF)
 
@@ -1338,6 +1463,124 @@ VeDeviceSpec *veDeviceParseSpec(char *str);
 */
 int veDeviceMatchSpec(VeDeviceEvent *e, VeDeviceSpec *s);
 
+/** struct VeDeviceSpecIndex
+    A compiled form of an ordered list of specifications, used by the
+    callback list and the filter table so that finding the entries that
+    match an event does not mean comparing the event against every
+    specification in turn.  Specifications are reduced to interned
+    device and element identifiers, and the entries matching each
+    distinct device/element/type combination seen are worked out once
+    and remembered.  The index is rebuilt (lazily, the next time it is
+    used) whenever it is invalidated.  The structure is opaque.
+*/
+typedef struct ve_device_spec_index VeDeviceSpecIndex;
+
+/** function VeDeviceSpecIndexFill
+    The type of function used to (re)build an index.  It should call
+    <code>veDeviceSpecIndexAdd()</code> for each entry of the list, in
+    order.
+ */
+typedef void (*VeDeviceSpecIndexFill)(VeDeviceSpecIndex *x);
+
+/** function veDeviceSpecIndexCreate
+    Creates a new, empty index.
+
+    @param fill
+    The function which will be called to fill in the index when it
+    needs to be built.
+
+    @returns
+    A pointer to the new index.
+ */
+VeDeviceSpecIndex *veDeviceSpecIndexCreate(VeDeviceSpecIndexFill fill);
+
+/** function veDeviceSpecIndexAdd
+    Adds an entry to the end of an index.  This should only be called
+    from the index's fill function.
+
+    @param x
+    The index.
+
+    @param s
+    The specification for the entry.  The specification must not be
+    changed while it is part of the index.  Entries without a
+    specification never match anything.
+
+    @param data
+    The value to return for this entry from
+    <code>veDeviceSpecIndexMatch()</code>.
+ */
+void veDeviceSpecIndexAdd(VeDeviceSpecIndex *x, VeDeviceSpec *s, void *data);
+
+/** function veDeviceSpecIndexInvalidate
+    Marks an index as out of date.  This must be called whenever the
+    list that the index is built from changes.
+
+    @param x
+    The index.
+ */
+void veDeviceSpecIndexInvalidate(VeDeviceSpecIndex *x);
+
+/** struct VeDeviceSpecMatch
+    The result of looking up an event in an index.
+ */
+typedef struct ve_device_spec_match {
+  /** member data
+      The <i>data</i> values of the matching entries, in order.  The
+      array belongs to the index.
+  */
+  void **data;
+  /** member n
+      The number of matching entries.
+  */
+  int n;
+  /* what the match was made for - see veDeviceSpecIndexChanged() */
+  int gen;
+  char *device, *elem;
+  int type, vsize;
+} VeDeviceSpecMatch;
+
+/** function veDeviceSpecIndexMatch
+    Finds the entries of an index that match an event.  The result is
+    the same as calling <code>veDeviceMatchSpec()</code> on each entry
+    in order.
+
+    @param x
+    The index.
+
+    @param e
+    The event.
+
+    @param m
+    Filled in with the matching entries.
+ */
+void veDeviceSpecIndexMatch(VeDeviceSpecIndex *x, VeDeviceEvent *e,
+			    VeDeviceSpecMatch *m);
+
+/** function veDeviceSpecIndexChanged
+    Checks whether a match is still good - i.e. the index has not been
+    invalidated and the event has not been renamed or changed type
+    since the match was made.  Callers that run code (callbacks,
+    filters) between entries must check this before going on to the
+    next entry.
+
+    @param x
+    The index.
+
+    @param e
+    The event.
+
+    @param m
+    A match previously filled in by <code>veDeviceSpecIndexMatch()</code>
+    for this event.
+
+    @returns
+    Non-zero if the match is out of date, in which case its array must
+    no longer be used.
+ */
+int veDeviceSpecIndexChanged(VeDeviceSpecIndex *x, VeDeviceEvent *e,
+			     VeDeviceSpecMatch *m);
+
 /** function veDeviceAddCallbackSpec
     Adds a callback to the internal list of callbacks given a
     device specification object.
@@ -1552,6 +1795,72 @@ typedef struct ve_device_ftable_entry {
   struct ve_device_ftable_entry *next;
 } VeDeviceFTableEntry;
 
+/** subsection Pose Prediction
+    A tracker sample is already some milliseconds old when it arrives
+    and will be older still by the time a frame drawn from it reaches
+    the display.  The prediction filter hides some of that latency by
+    extrapolating each sensor's position (3-vector) and orientation
+    (4-vector quaternion, as in <code>VeQuat</code>) forward to the
+    time at which the next frame is expected to be shown.  It keeps a
+    short motion history for every element that it sees and rewrites
+    the event's values in place; other events pass through untouched.
+    From BlueScript it is installed with
+<pre>
+        predict head.* horizon display smooth 0.5
+</pre>
+    The options are:
+    <ul>
+    <li><code>horizon</code> - how far ahead to predict: a fixed number
+    of milliseconds past the event's timestamp, or <code>display</code>
+    (the default) for the next display time reported by the renderer
+    with <code>veDeviceSetDisplayTime()</code>.</li>
+    <li><code>max</code> - the longest prediction that will be made
+    (default 100ms).</li>
+    <li><code>model</code> - <code>velocity</code> (the default) or
+    <code>acceleration</code>.  Orientations are extrapolated along
+    the arc between the last two samples, as a slerp past its end.</li>
+    <li><code>smooth</code> - how much of the previous motion estimate
+    is kept when a new sample arrives, from 0 (none - the most
+    responsive) up to but not including 1.  Higher values reduce the
+    jitter that extrapolation adds to a noisy tracker (default 0.5).</li>
+    </ul>
+    <p>Each prediction is compared with the sensor's real pose once
+    samples for that time arrive.  The average errors over the last
+    second are reported as the statistics <code>pos_error</code> (in
+    the tracker's units) and <code>rot_error</code> (in degrees).</p>
+ */
+
+/** function veDevicePredictFilter
+    Creates a new prediction filter.  The filter should be added to
+    the filter table after any filters that convert or rename the
+    tracker's data.
+
+    @param options
+    The options described above, or <code>NULL</code> for the defaults.
+
+    @returns
+    A pointer to the new filter, or <code>NULL</code> if an option is
+    invalid.
+ */
+VeDeviceFilter *veDevicePredictFilter(VeStrMap options);
+
+/** function veDeviceSetDisplayTime
+    Called by the renderer as it starts a frame to say when the frame
+    is expected to reach the display.  The prediction filter aims at
+    this time (or, once it has passed, the frame after it).
+
+    @param when
+    The expected display time (see <code>veClock()</code>).
+ */
+void veDeviceSetDisplayTime(long when);
+
+/** function veDeviceGetDisplayTime
+    @returns
+    The last time passed to <code>veDeviceSetDisplayTime()</code>,
+    or 0 if none has been.
+ */
+long veDeviceGetDisplayTime(void);
+
 /** section Event Queue
     Events are conceptually organized into a queue.  All events are
     processed in the order that they arrive.  Events are not necessarily
@@ -1588,6 +1897,44 @@ typedef struct ve_device_ftable_entry {
     
     @returns
     0 on success, non-zero on failure.
+
+    @misc
+    Events added at the tail go into a fixed-size ring
+    (<code>event_queue_size</code> option, default 1024 events) without
+    taking any lock, so that device threads do not hold each other up.
+    If the ring is full, what happens depends on the
+    <code>queue_overflow</code> option of the device the event is from
+    (or the <code>event_queue_overflow</code> option if the device does
+    not set one):
+    <ul>
+    <li><code>drop</code> (the default) - the oldest event in the ring
+    is thrown away.</li>
+    <li><code>coalesce</code> - a valuator or vector event replaces the
+    newest queued event for the same element.  Other events are
+    handled as for <code>drop</code>.</li>
+    <li><code>block</code> - wait for space for up to
+    <code>event_queue_block_ms</code> milliseconds (default 100),
+    then drop.</li>
+    </ul>
+    <p>A device can also ask for its samples to be coalesced all the
+    time, by setting its <code>coalesce</code> option to 1 (the
+    <code>event_coalesce</code> option sets the default for all
+    devices).  Then a valuator or vector event for an element which
+    already has a sample waiting in the queue is merged into that
+    sample rather than being queued separately, so callbacks only see
+    the latest value, and the <code>merged</code> member of the event
+    says how many samples it stands for.  Triggers, switches and
+    keyboard events are always queued, and a sample is never merged
+    across one of those from the same device, so the order of those
+    and the values around them is kept.  This is meant for trackers
+    and joysticks, whose samples otherwise pile up while the
+    application is busy drawing.
+    <p>The number of events waiting when the queue is processed, and
+    the number of events dropped and coalesced are available as the
+    statistics <code>event_queue_depth</code>,
+    <code>event_queue_drops</code> and <code>event_queue_merged</code>.
+    Adding events at the head of the queue is not limited and is never
+    coalesced.
 */
 int veDevicePushEvent(VeDeviceEvent *e, int where, int disp);
 
@@ -1712,6 +2059,46 @@ void veDeviceBlockEvents(int disp);
 */
 void veDeviceUnblockEvents(void);
 
+/** subsection Latency
+    The library can measure how long each device's events take to get
+    from the driver to the screen.  Measurement is turned on by using
+    the built-in <code>_latency</code> device (<code>use _latency</code>
+    in the devices file or <code>veDeviceUse("_latency")</code>) or by
+    setting the <code>event_latency</code> option to 1.  Every event
+    given to <code>veDeviceInsertEvent()</code> is then timed with
+    <code>veClockFine()</code> at each stage of its life, and the times
+    are kept in histograms (see <code>VeStatHistogram</code> in
+    <a href="ve_stats.h.html">ve_stats</a>) named
+    <code><i>stage</i>_latency[<i>device</i>]</code>, in milliseconds:
+    <ul>
+    <li><code>insert</code> - from the event's timestamp (which drivers
+    set when the input arrived) to <code>veDeviceInsertEvent()</code>.
+    Timestamps are whole milliseconds, so this is only accurate to a
+    millisecond.</li>
+    <li><code>filter</code> - waiting in the queue and going through
+    the filter table.</li>
+    <li><code>callback</code> - updating the device model and running
+    callbacks.</li>
+    <li><code>frame</code> - from the end of the callbacks to the start
+    of the next frame.  Only the first event delivered for a device in
+    each frame is counted.</li>
+    <li><code>total</code> - from the timestamp of that event to the
+    start of the frame.</li>
+    </ul>
+    Samples can be added from any thread without a lock.  The
+    histograms are published once a second, with the count, mean,
+    50th, 90th, 95th and 99th percentiles and maximum for that second,
+    and then started again.
+ */
+
+/** function veDeviceLatencyFrame
+    Marks the start of a frame for latency measurement, closing the
+    <code>frame</code> and <code>total</code> samples of the events
+    delivered since the last frame.  It is called by the rendering
+    layer and does nothing unless measurement is on.
+ */
+void veDeviceLatencyFrame(void);
+
 /* must be called before handling any device stuff */
 /** function veDeviceInit
     This function must be called before calling any other ve_device
@@ -1762,6 +2149,214 @@ float veDeviceToValuator(VeDeviceEvent *e);
 */
 int veDeviceToSwitch(VeDeviceEvent *e);
 
+/** section Recording and Replay
+    The events that drivers give to <code>veDeviceInsertEvent()</code>
+    can be recorded to a compact binary file and played back later,
+    so that a problem seen in a live session can be reproduced with
+    exactly the same input.  Recording starts at start-up if the
+    <code>event_record</code> option names a file, or under program
+    control with <code>veDeviceRecordStart()</code>.  Events made by
+    filters are not recorded, since playing back the driver events
+    makes them again.
+    <p>A recording is played back by the built-in <code>replay</code>
+    driver, e.g.
+<pre>
+        use show replay {
+            file /tmp/show.rec
+            speed 0
+        }
+</pre>
+    which re-inserts every event (under its original device and
+    element names) through <code>veDeviceInsertEvent()</code>.  The
+    driver's options are:
+    <ul>
+    <li><code>file</code> - the recording to play (required).</li>
+    <li><code>speed</code> - 1 (the default) plays the events back
+    with their original timing, other values scale it (2 is twice as
+    fast) and 0 plays them as fast as possible.</li>
+    <li><code>loop</code> - the number of times to play the recording
+    (default 1), or 0 to repeat it forever.</li>
+    <li><code>exit</code> - if non-zero, the program exits once the
+    recording has been played, which (with the null renderer) makes
+    for repeatable load tests of the input path.</li>
+    </ul>
+    Event timestamps keep their original offset from the time the
+    event reached the library.  The number of events and the rate at
+    which they were played are reported as a notice after each pass.
+ */
+
+/** function veDeviceRecordStart
+    Starts recording device events to a file, replacing any recording
+    that is already in progress.
+
+    @param file
+    The file to write.  It is created or truncated.
+
+    @returns
+    0 on success, or -1 if the file cannot be opened.
+ */
+int veDeviceRecordStart(char *file);
+
+/** function veDeviceRecordStop
+    Stops recording device events and closes the file.  It is not an
+    error to call this when nothing is being recorded.  A recording
+    that is in progress when the program exits is closed properly.
+ */
+void veDeviceRecordStop(void);
+
+/** struct VeDeviceReplay
+    A recording that is open for reading.  The structure is opaque.
+ */
+typedef struct ve_device_replay VeDeviceReplay;
+
+/** function veDeviceReplayOpen
+    Opens a recording for reading.
+
+    @param file
+    The recording to open.
+
+    @returns
+    A handle for the recording, or <code>NULL</code> if the file
+    cannot be opened or is not a recording.
+ */
+VeDeviceReplay *veDeviceReplayOpen(char *file);
+
+/** function veDeviceReplayNext
+    Reads the next event from a recording.
+
+    @param r
+    The recording.
+
+    @param when
+    If not <code>NULL</code>, the time (in milliseconds) at which the
+    event arrived, relative to the start of the recording, is stored
+    here.
+
+    @returns
+    A newly-created event, or <code>NULL</code> at the end of the
+    recording (or if the rest of it cannot be read).  The event's
+    timestamp is relative to its arrival time - add the time at which
+    the event is being replayed before using it.
+ */
+VeDeviceEvent *veDeviceReplayNext(VeDeviceReplay *r, long *when);
+
+/** function veDeviceReplayRewind
+    Goes back to the first event in a recording.
+
+    @param r
+    The recording.
+ */
+void veDeviceReplayRewind(VeDeviceReplay *r);
+
+/** function veDeviceReplayClose
+    Closes a recording and frees the handle.
+
+    @param r
+    The recording.
+ */
+void veDeviceReplayClose(VeDeviceReplay *r);
+
+/** section Device I/O
+    Most drivers spend their lives waiting for bytes to arrive on a
+    file descriptor (a serial line, a joystick or an event device).
+    Rather than running a thread of its own for this, a driver can
+    hand the descriptor to the device I/O reactor.  A single thread
+    waits on every registered descriptor at once (using epoll where
+    it is available), reads whatever has arrived and passes it to the
+    driver's parse function along with the time at which it was
+    received.  Parse functions run in the reactor thread and so must
+    not block - they should consume the complete packets or lines
+    in what they are given and leave any partial one for next time.
+    <p>The reactor thread is started through the delay gate (see
+    <code>veThreadInitDelayed()</code>) the first time a descriptor is
+    registered.  The following options are recognized:
+    <ul>
+    <li><code>device_io</code> - if 0, the reactor is disabled and
+    drivers fall back to their own threads.</li>
+    <li><code>device_io_cpu</code> - if set, the reactor thread is
+    bound to the given CPU (where the platform supports it) so that
+    input handling does not move around between processors.</li>
+    </ul>
+ */
+
+/** struct VeDeviceIO
+    A file descriptor that is being watched by the device I/O reactor.
+    The structure is opaque.
+ */
+typedef struct ve_device_io VeDeviceIO;
+
+/** function VeDeviceIOProc
+    The type of a parse function.  It is called in the reactor thread
+    with everything that has been read from the descriptor and not yet
+    consumed, and should return the number of bytes (from the start of
+    <i>buf</i>) that it has consumed.  Anything left over is kept and
+    passed again, with more data appended, the next time the descriptor
+    is readable.  The <i>when</i> argument is the time at which the
+    data was received, as returned by the watch's stamp function.
+    If the descriptor reports end-of-file or an error, it stops being
+    watched and the function is called one last time with <i>buf</i>
+    set to <code>NULL</code> and <i>len</i> set to -1 - this is where
+    the driver may close the descriptor (never before, since the
+    number could be reused and then unwatched by mistake).
+ */
+typedef int (*VeDeviceIOProc)(VeDevice *d, unsigned char *buf, int len,
+			      long when, void *arg);
+
+/** function VeDeviceIOStampProc
+    The type of a timestamping function.  It is called for each read
+    with the time at which the reactor woke up for the descriptor
+    (<i>recv</i>, taken before the data is read) and the number of
+    bytes that were read, and returns the time to pass to the parse
+    function.  Drivers use this to correct for known delays between
+    the measurement and the data reaching the host, for example the
+    time a packet takes to cross a slow serial line.
+ */
+typedef long (*VeDeviceIOStampProc)(VeDevice *d, long recv, int len,
+				    void *arg);
+
+/** function veDeviceIOWatch
+    Registers a file descriptor with the device I/O reactor, starting
+    the reactor if necessary.  The descriptor remains the driver's
+    and may still be written to (e.g. to poll a tracker) from the
+    parse function or elsewhere.
+
+    @param d
+    The device that the descriptor belongs to.
+
+    @param fd
+    The file descriptor to read from.
+
+    @param proc
+    The parse function for the data.
+
+    @param stamp
+    The timestamping function, or <code>NULL</code> to use the time
+    at which the reactor woke up unchanged.
+
+    @param arg
+    An arbitrary argument passed to <i>proc</i> and <i>stamp</i>.
+
+    @returns
+    A handle for the watch or <code>NULL</code> if the reactor is not
+    available (e.g. it has been disabled, or the platform has no
+    epoll).  Drivers should fall back to reading the descriptor in a
+    thread of their own in that case.
+ */
+VeDeviceIO *veDeviceIOWatch(VeDevice *d, int fd, VeDeviceIOProc proc,
+			    VeDeviceIOStampProc stamp, void *arg);
+
+/** function veDeviceIOUnwatch
+    Stops watching a descriptor.  The descriptor is not closed.  This
+    may be called from the watch's own parse function.  The parse
+    function will not be called again once this returns, except
+    when called from another thread while the parse function is
+    running, in which case that call is allowed to finish.
+
+    @param io
+    The watch to remove.
+ */
+void veDeviceIOUnwatch(VeDeviceIO *io);
+
 /** section Controls
     A control is, in effect, a canned set of callbacks for 
     receiving events and creating behaviours based upon those
@@ -26,6 +26,7 @@
 #define HAS_THREADLIB 1
 #define HAS_POSIXSELECT 1
 #define HAS_POSIXPOLL 1
+#define HAS_EPOLL 1
 #define HAS_SOCKETS 1
 #define HAS_RSH 1
 #define HAS_FORK 1
@@ -92,6 +93,8 @@
 #define ACFGS_POSIXSELECT ""
 #define ACFG_POSIXPOLL 
 #define ACFGS_POSIXPOLL ""
+#define ACFG_EPOLL 
+#define ACFGS_EPOLL ""
 #define ACFG_SOCKETS 
 #define ACFGS_SOCKETS ""
 #define ACFG_RSH /usr/bin/rsh
@@ -26,6 +26,7 @@ HAS_THREADIMPL = 1
 HAS_THREADLIB = 1
 HAS_POSIXSELECT = 1
 HAS_POSIXPOLL = 1
+HAS_EPOLL = 1
 HAS_SOCKETS = 1
 HAS_RSH = 1
 HAS_FORK = 1
@@ -64,6 +65,7 @@ ACFG_THREADIMPL = posix
 ACFG_THREADLIB = -lpthread
 ACFG_POSIXSELECT = 
 ACFG_POSIXPOLL = 
+ACFG_EPOLL = 
 ACFG_SOCKETS = 
 ACFG_RSH = /usr/bin/rsh
 ACFG_FORK = 
@@ -2690,12 +2690,10 @@ static int event_proc(BSObject *o, BSInterp *i, int objc, BSObject **objv) {
 	  e->index = v_int;
 	  break;
 	case EV_DEVICE:
-	  veFree(e->device);
-	  e->device = veDupString(bsObjGetStringPtr(objv[1]));
+	  veDeviceEventRename(e,bsObjGetStringPtr(objv[1]),NULL);
 	  break;
 	case EV_ELEM:
-	  veFree(e->elem);
-	  e->elem = veDupString(bsObjGetStringPtr(objv[1]));
+	  veDeviceEventRename(e,NULL,bsObjGetStringPtr(objv[1]));
 	  break;
 	case EV_TYPE:
 	  /* get type */
@@ -3027,22 +3025,23 @@ static int event_proc(BSObject *o, BSInterp *i, int objc, BSObject **objv) {
       if (*s != '.' || strncmp(s,"*.",2)) {
 	/* device name is specified... */
 	char *c;
-	veFree(e->device);
-	e->device = veDupString(s);
-	if ((s = strchr(e->device,'.'))) {
+	c = veDupString(s);
+	if ((s = strchr(c,'.'))) {
 	  *s = '\0';
 	  s++;
 	}
+	veDeviceEventRename(e,c,NULL);
+	if (s)
+	  s = strchr(bsObjGetStringPtr(objv[1]),'.')+1;
+	veFree(c);
       } else {
 	/* device name is not specified */
 	s = strchr(s,'.');
 	assert(s != NULL); /* otherwise above test was bogus... */
 	s++;
       }
-      if (s && strcmp(s,"*")) {
-	veFree(e->elem);
-	e->elem = veDupString(s);
-      }
+      if (s && strcmp(s,"*"))
+	veDeviceEventRename(e,NULL,s);
     }
     break;
 
@@ -3112,9 +3111,19 @@ static int event_proc(BSObject *o, BSInterp *i, int objc, BSObject **objv) {
   return BS_OK;
 }
 
+/* Everything a filter needs is set up once, when it is created, so
+   that running it for an event does not allocate anything: the body
+   is parsed in advance and "e" is an opaque object that is pointed at
+   each event in turn, in a variable slot that stays put. */
 typedef struct ve_blue_filter_ctx {
+  BSInterp *interp;   /* where the body runs */
+  VeThrMutex *mutex;  /* held while it runs */
   BSContext *ctx;
   BSObject *body;
+  BSList *script;     /* body, already parsed */
+  BSOpaque *ev;       /* what "e" refers to */
+  BSObject *evobj;
+  BSVariable *evvar;  /* where "e" is kept */
 } VeBlueFilterCtx;
 
 static int filter_proc(VeDeviceEvent *e, void *arg) {
@@ -3122,27 +3131,27 @@ static int filter_proc(VeDeviceEvent *e, void *arg) {
   int fcode = VE_FILT_CONTINUE;
 
   VeBlueFilterCtx *c = (VeBlueFilterCtx *)arg;
-  BSObject *o;
+  BSInterp *i = c->interp;
 
-  veThrMutexLock(interp_mutex);
+  veThrMutexLock(c->mutex);
+
+  /* the body may have set or unset "e" last time */
+  if (c->evvar->type != BS_V_LOCAL || c->evvar->o->opaqueRep != c->ev)
+    bsSet(i,c->ctx,"e",c->evobj);
+  c->ev->data = (void *)e;
 
-  o = make_event_object(e);
-  
-  bsSet(interp,c->ctx,"e",o);
-  bsClearResult(interp);
   {
     /* cleaner way of doing this? */
     BSContext *save;
-    save = interp->stack;
-    interp->stack = c->ctx;
-    code = bsEval(interp,c->body);
-    interp->stack = save;
+    save = i->stack;
+    i->stack = c->ctx;
+    code = bsEvalScript(i,c->script);
+    i->stack = save;
   }
-  bsUnset(interp,c->ctx,"e");
-  
-  /* prevent event from being destroyed */
-  o->opaqueRep->data = NULL;
-  bsObjDelete(o);
+
+  /* the event is not ours - any reference to "e" that the body kept
+     is no longer valid */
+  c->ev->data = NULL;
 
   switch (code) {
   case BS_OK:
@@ -3159,14 +3168,14 @@ static int filter_proc(VeDeviceEvent *e, void *arg) {
     
   case BS_ERROR:
     veError(MODULE,"BlueScript error: %s",
-	    bsObjGetStringPtr(bsGetResult(interp)));
+	    bsObjGetStringPtr(bsGetResult(i)));
     fcode = VE_FILT_ERROR;
     break;
 
   case BS_RETURN: /* check value */
     {
       char *s;
-      s = bsObjGetStringPtr(bsGetResult(interp));
+      s = bsObjGetStringPtr(bsGetResult(i));
       if (strcmp(s,"continue") == 0)
 	fcode = VE_FILT_CONTINUE;
       else if (strcmp(s,"deliver") == 0)
@@ -3188,22 +3197,31 @@ static int filter_proc(VeDeviceEvent *e, void *arg) {
     fcode = VE_FILT_ERROR;
   }
 
-  veThrMutexUnlock(interp_mutex);
+  veThrMutexUnlock(c->mutex);
   return fcode;
 }
 
 /*@bsdoc 
 procedure filter {
-    usage {filter <devspec> <body>}
+    usage {filter <devspec> [private <bool>] <body>}
+    desc {Runs <body> for each event matching <devspec>, with the
+	event in variable "e".  Normally the body runs in the main
+	interpreter and so waits for any other script that is running.
+	A private filter has an interpreter of its own, with only the
+	standard BlueScript commands and the event's own methods, and
+	so only waits for itself.}
 }
 */
 
 static int cmd_filter(BSInterp *i, int objc, BSObject *objv[], void *cdata) {
-  static char *usage = "usage: filter <devspec> { <body> }";
+  static char *usage = "usage: filter <devspec> [private <bool>] { <body> }";
   VeDeviceSpec *spec;
   VeBlueFilterCtx *c;
+  int private = 0, mustfree;
   
-  if (objc != 3) {
+  if (objc == 5 && strcmp(bsObjGetStringPtr(objv[2]),"private") == 0)
+    private = atoi(bsObjGetStringPtr(objv[3]));
+  else if (objc != 3) {
     bsSetStringResult(i,usage,BS_S_STATIC);
     return BS_ERROR;
   }
@@ -3215,8 +3233,36 @@ static int cmd_filter(BSInterp *i, int objc, BSObject *objv[], void *cdata) {
   }
   
   c = veAllocObj(VeBlueFilterCtx);
+  if (private) {
+    c->interp = bsInterpCreateStd();
+    c->mutex = veThrMutexCreate();
+  } else {
+    c->interp = interp;
+    c->mutex = interp_mutex;
+  }
+  c->body = bsObjCopy(objv[objc-1]);
+  /* the parsed script is kept with the body, or is ours to keep if the
+     interpreter is saving memory - either way it lasts as long as the
+     filter */
+  if (!(c->script = bsGetScript(c->interp,c->body,&mustfree))) {
+    /* the error is in the interpreter that parsed the body, which is
+       only ours to destroy if it is private */
+    if (c->interp != i)
+      bsSetResult(i,bsGetResult(c->interp));
+    if (private) {
+      bsInterpDestroy(c->interp);
+      veThrMutexDestroy(c->mutex);
+    }
+    bsObjDelete(c->body);
+    veFree(c);
+    return BS_ERROR;
+  }
   c->ctx = bsContextPush(NULL); /* create a context for us */
-  c->body = bsObjCopy(objv[2]);
+
+  c->evobj = make_event_object(NULL);
+  c->ev = c->evobj->opaqueRep;
+  bsSet(c->interp,c->ctx,"e",c->evobj);
+  c->evvar = bsGetVar(c->interp,c->ctx,"e",1);
 
   veDeviceFilterAdd(spec,
 		    veDeviceFilterCreate(filter_proc,c),
@@ -3225,6 +3271,44 @@ static int cmd_filter(BSInterp *i, int objc, BSObject *objv[], void *cdata) {
   return BS_OK;
 }
 
+/*@bsdoc
+procedure predict {
+    usage {predict <devspec> [<option> <value> ...]}
+}
+*/
+
+static int cmd_predict(BSInterp *i, int objc, BSObject *objv[], void *cdata) {
+  static char *usage = "usage: predict <devspec> [<option> <value> ...]";
+  VeDeviceSpec *spec;
+  VeDeviceFilter *f;
+  VeStrMap opts;
+  int k;
+
+  if (objc < 2 || (objc % 2) != 0) {
+    bsSetStringResult(i,usage,BS_S_STATIC);
+    return BS_ERROR;
+  }
+
+  if (!(spec = veDeviceParseSpec(bsObjGetStringPtr(objv[1])))) {
+    bsSetStringResult(i,"invalid device spec for predict",BS_S_STATIC);
+    return BS_ERROR;
+  }
+
+  opts = veStrMapCreate();
+  for(k = 2; k < objc; k += 2)
+    veStrMapInsert(opts,bsObjGetStringPtr(objv[k]),
+		   bsObjGetStringPtr(objv[k+1]));
+  f = veDevicePredictFilter(opts);
+  veStrMapDestroy(opts,NULL);
+  if (!f) {
+    bsSetStringResult(i,"invalid options for predict",BS_S_STATIC);
+    return BS_ERROR;
+  }
+  veDeviceFilterAdd(spec,f,VE_FTABLE_TAIL);
+
+  return BS_OK;
+}
+
 /*@bsdoc
 package vemisc {
     longname {VE Miscellaneous}
@@ -3268,6 +3352,32 @@ static int cmd_include(BSInterp *i, int objc, BSObject *objv[], void *cdata) {
   return code;
 }
 
+/* load a driver by what it provides - e.g. filter drivers, which
+   nothing else would load */
+/*@bsdoc
+procedure require {
+    usage {require <type> <name>}
+}
+*/
+static int cmd_require(BSInterp *i, int objc, BSObject *objv[],
+		       void *cdata) {
+  static char *usage = "usage: require <type> <name>";
+
+  if (objc != 3) {
+    bsSetStringResult(i,usage,BS_S_STATIC);
+    return BS_ERROR;
+  }
+
+  if (veDriverRequire(bsObjGetStringPtr(objv[1]),
+		      bsObjGetStringPtr(objv[2]))) {
+    bsClearResult(i);
+    bsAppendResult(i,"cannot load driver for ",bsObjGetStringPtr(objv[1]),
+		   " ",bsObjGetStringPtr(objv[2]),NULL);
+    return BS_ERROR;
+  }
+  return BS_OK;
+}
+
 /* access functions */
 #define LOC 0
 #define DIR 1
@@ -3486,6 +3596,8 @@ void veBlueInit(void) {
   /* extra functionality */
   /* include - include contents of other files */
   veBlueSetExtProc("include",cmd_include,NULL);
+  /* require - load drivers */
+  veBlueSetExtProc("require",cmd_require,NULL);
 
   /* VE commands */
 
@@ -3544,6 +3656,7 @@ void veBlueInit(void) {
 
   /* filter functions */
   veBlueSetExtProc("filter",cmd_filter,NULL);
+  veBlueSetExtProc("predict",cmd_predict,NULL);
   veBlueSetExtProc("event",cmd_event,NULL);
 
   /* origin/eye access */
@@ -12,39 +12,311 @@
 #include <ve_thread.h>
 #include <ve_core.h>
 #include <ve_mp.h>
+#include <ve_main.h>
+#include <ve_error.h>
+#include <ve_stats.h>
 
 #define MODULE "ve_dev_event"
+#define NSTR(x) ((x)?(x):"")
 
-VeDeviceEvent *veDeviceEventCreate(VeDeviceEType type, int vsize) {
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define eq_cas(p,o,n) __sync_bool_compare_and_swap((p),(o),(n))
+#define eq_barrier()  __sync_synchronize()
+#else
+/* no atomic operations - producers serialize on a lock instead */
+#define EQ_CAS_LOCKED
+static VeThrMutex *eq_cas_mutex = NULL;
+static int eq_cas(volatile unsigned long *p, unsigned long o,
+		  unsigned long n) {
+  int k = 0;
+  veThrMutexLock(eq_cas_mutex);
+  if (*p == o) {
+    *p = n;
+    k = 1;
+  }
+  veThrMutexUnlock(eq_cas_mutex);
+  return k;
+}
+#define eq_barrier()
+#endif
+
+/* Interned device and element names.  Names are never removed, so an
+   id and the string it maps to stay valid for good.  Names are kept in
+   fixed-size chunks that never move, so that looking up an id does not
+   need the lock. */
+#define INTERN_CHUNK  256
+#define INTERN_CHUNKS 1024
+
+static VeStrMap intern_map = NULL;
+static char **intern_names[INTERN_CHUNKS];
+static unsigned char *intern_flags[INTERN_CHUNKS]; /* EQF_* below */
+static volatile int intern_n = 0;
+static VeThrMutex *intern_mutex = NULL;
+
+int veDeviceIntern(char *name) {
+  int id;
+  if (!name)
+    return 0;
+  if (!intern_mutex) {
+    /* first use is from veDeviceInit() or earlier, before there are
+       any driver threads */
+    intern_mutex = veThrMutexCreate();
+    intern_map = veStrMapCreate();
+  }
+  veThrMutexLock(intern_mutex);
+  if (!(id = (int)(long)veStrMapLookup(intern_map,name))) {
+    id = intern_n+1; /* 0 is never used */
+    if (id >= INTERN_CHUNK*INTERN_CHUNKS)
+      veFatalError(MODULE,"too many device and element names");
+    if (!intern_names[id/INTERN_CHUNK]) {
+      intern_names[id/INTERN_CHUNK] = veAlloc(INTERN_CHUNK*sizeof(char *),1);
+      intern_flags[id/INTERN_CHUNK] = veAlloc(INTERN_CHUNK,1);
+    }
+    intern_names[id/INTERN_CHUNK][id%INTERN_CHUNK] = veDupString(name);
+    veStrMapInsert(intern_map,name,(void *)(long)id);
+    eq_barrier(); /* name is in place before the id is */
+    intern_n = id;
+  }
+  veThrMutexUnlock(intern_mutex);
+  return id;
+}
+
+char *veDeviceInternName(int id) {
+  if (id <= 0 || id > intern_n)
+    return NULL;
+  return intern_names[id/INTERN_CHUNK][id%INTERN_CHUNK];
+}
+
+/* Event pool.  Each thread keeps up to EPOOL_MAX free events (with
+   their content still attached, to be reused for the same type) and
+   moves EPOOL_BATCH at a time to or from a shared pool, so that events
+   created by a driver thread and destroyed by whoever processes them
+   find their way back. */
+#define EPOOL_MAX    64
+#define EPOOL_BATCH  32
+#define EPOOL_SHARED 4096  /* beyond this, free events for real */
+
+struct ve_event_pool {
+  VeDeviceEvent *free;
+  int n;
+};
+
+static VeThrKey *epool_key = NULL;
+static VeThrMutex *epool_mutex = NULL;
+static VeDeviceEvent *epool_shared = NULL;
+static int epool_nshared = 0;
+
+static void event_free(VeDeviceEvent *e) {
+  if (e->content)
+    veDeviceEContentDestroy(e->content);
+  veFree(e);
+}
+
+/* move n events from *from to *to - returns number moved */
+static int epool_move(VeDeviceEvent **from, VeDeviceEvent **to, int n) {
   VeDeviceEvent *e;
-  e = veAllocObj(VeDeviceEvent);
-  e->content = veDeviceEContentCreate(type,vsize);
+  int k;
+  for(k = 0; k < n && (e = *from); k++) {
+    *from = e->pool_next;
+    e->pool_next = *to;
+    *to = e;
+  }
+  return k;
+}
+
+/* a thread is going away - give its events to everyone else */
+static void epool_release(void *v) {
+  struct ve_event_pool *p = (struct ve_event_pool *)v;
+  veThrMutexLock(epool_mutex);
+  epool_nshared += epool_move(&(p->free),&epool_shared,p->n);
+  veThrMutexUnlock(epool_mutex);
+  veFree(p);
+}
+
+static struct ve_event_pool *epool_get(void) {
+  struct ve_event_pool *p;
+  if (!epool_key)
+    return NULL;
+  if (!(p = (struct ve_event_pool *)veThrDataGet(epool_key))) {
+    p = veAllocObj(struct ve_event_pool);
+    veThrDataSet(epool_key,p);
+  }
+  return p;
+}
+
+static void epool_init(void) {
+  if (!epool_key) {
+    epool_mutex = veThrMutexCreate();
+    epool_key = veThrKeyCreate(epool_release);
+  }
+}
+
+extern int veDeviceEContentIsPacked(VeDeviceEContent *c);
+
+/* size of the content structure for anything but a vector */
+static int econtent_size(VeDeviceEType type) {
+  switch (type) {
+  case VE_ELEM_TRIGGER:  return sizeof(VeDeviceE_Trigger);
+  case VE_ELEM_SWITCH:   return sizeof(VeDeviceE_Switch);
+  case VE_ELEM_VALUATOR: return sizeof(VeDeviceE_Valuator);
+  case VE_ELEM_KEYBOARD: return sizeof(VeDeviceE_Keyboard);
+  default:
+    /* this space deliberately left blank */;
+  }
+  return 0;
+}
+
+/* clear an event, keeping its content if that can be reused as
+   type/vsize */
+static void event_reset(VeDeviceEvent *e, VeDeviceEType type, int vsize) {
+  VeDeviceEContent *c = e->content;
+  VeDeviceE_Vector *vec;
+  int dsize;
+
+  memset(e,0,sizeof(VeDeviceEvent));
   e->index = -1;
+  if (c && c->type == type) {
+    if (type == VE_ELEM_VECTOR) {
+      vec = (VeDeviceE_Vector *)c;
+      if (vec->size == vsize && veDeviceEContentIsPacked(c)) {
+	/* a single block - see veDeviceEContentCreate() */
+	memset(vec->min,0,3*vsize*sizeof(float));
+	e->content = c;
+	return;
+      }
+    } else if ((dsize = econtent_size(type)) > 0) {
+      memset(c,0,dsize);
+      c->type = type;
+      e->content = c;
+      return;
+    }
+  }
+  if (c)
+    veDeviceEContentDestroy(c);
+  e->content = veDeviceEContentCreate(type,vsize);
+}
+
+static VeDeviceEvent *event_new(VeDeviceEType type, int vsize) {
+  struct ve_event_pool *p;
+  VeDeviceEvent *e = NULL;
+
+  if ((p = epool_get())) {
+    if (!p->free) {
+      int k;
+      veThrMutexLock(epool_mutex);
+      k = epool_move(&epool_shared,&(p->free),EPOOL_BATCH);
+      epool_nshared -= k;
+      veThrMutexUnlock(epool_mutex);
+      p->n += k;
+    }
+    if ((e = p->free)) {
+      p->free = e->pool_next;
+      p->n--;
+    }
+  }
+  if (!e)
+    e = veAllocObj(VeDeviceEvent);
+  event_reset(e,type,vsize);
   return e;
 }
 
-VeDeviceEvent *veDeviceEventInit(VeDeviceEType type, int vsize, 
-				 char *device, char *elem) {
+VeDeviceEvent *veDeviceEventCreate(VeDeviceEType type, int vsize) {
+  return event_new(type,vsize);
+}
+
+VeDeviceEvent *veDeviceEventInitId(VeDeviceEType type, int vsize,
+				   int device, int elem) {
   VeDeviceEvent *e;
-  e = veDeviceEventCreate(type,vsize);
+  e = event_new(type,vsize);
   assert(e != NULL);
-  if (device)
-    e->device = veDupString(device);
-  if (elem)
-    e->elem = veDupString(elem);
+  e->device = veDeviceInternName(device);
+  e->device_id = e->device ? device : 0;
+  e->elem = veDeviceInternName(elem);
+  e->elem_id = e->elem ? elem : 0;
   e->timestamp = veClock();
   return e;
 }
 
+VeDeviceEvent *veDeviceEventInit(VeDeviceEType type, int vsize, 
+				 char *device, char *elem) {
+  return veDeviceEventInitId(type,vsize,veDeviceIntern(device),
+			     veDeviceIntern(elem));
+}
+
+void veDeviceEventRename(VeDeviceEvent *e, char *device, char *elem) {
+  if (device) {
+    e->device_id = veDeviceIntern(device);
+    e->device = veDeviceInternName(e->device_id);
+  }
+  if (elem) {
+    e->elem_id = veDeviceIntern(elem);
+    e->elem = veDeviceInternName(e->elem_id);
+  }
+}
+
+/* the name may have been assigned to since the id was set */
+static int name_id(char *name, int *id) {
+  if (!name)
+    return 0;
+  if (*id <= 0 || veDeviceInternName(*id) != name)
+    *id = veDeviceIntern(name);
+  return *id;
+}
+
+int veDeviceEventDeviceId(VeDeviceEvent *e) {
+  return name_id(e->device,&(e->device_id));
+}
+
+int veDeviceEventElemId(VeDeviceEvent *e) {
+  return name_id(e->elem,&(e->elem_id));
+}
+
+/* copy names (and ids) from one event to another - interned names are
+   shared, anything else is copied since we do not know where it came
+   from */
+static void event_copy_names(VeDeviceEvent *to, VeDeviceEvent *from) {
+  to->device = from->device;
+  to->elem = from->elem;
+  if (veDeviceEventDeviceId(from))
+    to->device = veDeviceInternName(to->device_id = from->device_id);
+  if (veDeviceEventElemId(from))
+    to->elem = veDeviceInternName(to->elem_id = from->elem_id);
+}
+
+/* a new event with a copy of the given content */
+static VeDeviceEvent *event_with_content(VeDeviceEContent *c) {
+  VeDeviceEvent *e;
+  VeDeviceE_Vector *from, *to;
+  int vsize;
+
+  if (!c) {
+    e = event_new(VE_ELEM_UNDEF,0);
+    return e;
+  }
+  if (c->type == VE_ELEM_VECTOR) {
+    from = (VeDeviceE_Vector *)c;
+    vsize = from->size;
+    e = event_new(VE_ELEM_VECTOR,vsize);
+    to = VE_EVENT_VECTOR(e);
+    memcpy(to->min,from->min,sizeof(float)*vsize);
+    memcpy(to->max,from->max,sizeof(float)*vsize);
+    memcpy(to->value,from->value,sizeof(float)*vsize);
+  } else {
+    e = event_new(c->type,0);
+    if (e->content)
+      memcpy(e->content,c,econtent_size(c->type));
+  }
+  return e;
+}
+
 VeDeviceEvent *veDeviceEventCopy(VeDeviceEvent *e) {
   VeDeviceEvent *ecopy;
   
-  ecopy = veAllocObj(VeDeviceEvent);
+  ecopy = event_with_content(e->content);
   ecopy->timestamp = e->timestamp;
   ecopy->index = e->index;
-  ecopy->device = e->device ? veDupString(e->device) : NULL;
-  ecopy->elem = e->elem ? veDupString(e->elem) : NULL;
-  ecopy->content = veDeviceEContentCopy(e->content);
+  ecopy->merged = e->merged;
+  event_copy_names(ecopy,e);
   return ecopy;
 }
 
@@ -53,20 +325,37 @@ VeDeviceEvent *veDeviceEventFromElem(char *device, VeDeviceElement *el) {
   if (!el)
     return NULL;
   /* need to do the initialization ourselves */
-  e = veAllocObj(VeDeviceEvent);
+  e = event_with_content(el->content);
   e->timestamp = veClock();
   e->index = 0;
-  e->device = device ? veDupString(e->device) : NULL;
-  e->elem = el->name ? veDupString(el->name) : NULL;
-  e->content = veDeviceEContentCopy(el->content);
+  veDeviceEventRename(e,device,el->name);
   return e;
 }
 
 void veDeviceEventDestroy(VeDeviceEvent *e) {
-  if (e) {
-    if (e->content)
-      veDeviceEContentDestroy(e->content);
-    veFree(e);
+  struct ve_event_pool *p;
+  if (!e)
+    return;
+  if (!(p = epool_get())) {
+    event_free(e);
+    return;
+  }
+  e->pool_next = p->free;
+  p->free = e;
+  if (++(p->n) > EPOOL_MAX) {
+    /* pass some on */
+    VeDeviceEvent *batch = NULL;
+    p->n -= epool_move(&(p->free),&batch,EPOOL_BATCH);
+    veThrMutexLock(epool_mutex);
+    if (epool_nshared < EPOOL_SHARED) {
+      epool_nshared += epool_move(&batch,&epool_shared,EPOOL_BATCH);
+      batch = NULL;
+    }
+    veThrMutexUnlock(epool_mutex);
+    while ((e = batch)) {
+      batch = e->pool_next;
+      event_free(e);
+    }
   }
 }
 
@@ -77,6 +366,14 @@ struct ve_device_cback {
   struct ve_device_cback *next;
 } *cback_list = NULL;
 
+static VeDeviceSpecIndex *cback_index = NULL;
+
+static void cback_fill(VeDeviceSpecIndex *x) {
+  struct ve_device_cback *c;
+  for(c = cback_list; c; c = c->next)
+    veDeviceSpecIndexAdd(x,c->spec,c);
+}
+
 int veDeviceAddCallback(VeDeviceEventProc p, void *arg, char *spec) {
   VeDeviceSpec *s;
   if (veMPTestSlaveGuard())
@@ -96,6 +393,8 @@ int veDeviceAddCallbackSpec(VeDeviceEventProc p, void *arg, VeDeviceSpec *s) {
   /* stick at head of callback list (overrides callbacks added before it) */
   c->next = cback_list;
   cback_list = c;
+  if (cback_index)
+    veDeviceSpecIndexInvalidate(cback_index);
   return 0;
 }
 
@@ -115,62 +414,94 @@ int veDeviceRemoveCallback(VeDeviceEventProc p) {
 	cback_list = c; /* must have been head */
     }
   }
+  if (cback_index)
+    veDeviceSpecIndexInvalidate(cback_index);
   return 0;
 }
 
+/* call one callback - returns non-zero if callback processing should
+   stop here */
+static int cback_call(struct ve_device_cback *c, VeDeviceEvent *e, 
+		      int *res) {
+  int cont = 0;
+
+  if (e->content->type == VE_ELEM_VECTOR && 
+      c->spec && c->spec->index >= 0) {
+    /* need to create a valuator for an index of this vector */
+    VeDeviceE_Vector *vec;
+    VeDeviceE_Valuator *val;
+    VeDeviceEvent *ve;
+
+    vec = (VeDeviceE_Vector *)(e->content);
+    /* we should not match a spec that references an index outside of
+       our vector */
+    assert(c->spec->index < vec->size);
+
+    /* build a new event which is just the valuator portion... */
+    ve = veDeviceEventCreate(VE_ELEM_VALUATOR,0);
+    val = (VeDeviceE_Valuator *)(ve->content);
+    ve->timestamp = e->timestamp;
+    event_copy_names(ve,e);
+    ve->index = c->spec->index;
+    val->min = vec->min[c->spec->index];
+    val->max = vec->max[c->spec->index];
+    val->value = vec->value[c->spec->index];
+    veLockCallbacks();
+    vePfEvent(MODULE,"callback","%s %s",ve->device,ve->elem);
+    *res = c->proc(ve,c->arg);
+    veUnlockCallbacks();
+    veDeviceEventDestroy(ve);
+    cont = 1;
+  } else {
+    veLockCallbacks();
+    vePfEvent(MODULE,"callback","%s %s",e->device,e->elem);
+    *res = c->proc(e,c->arg);
+    veUnlockCallbacks();
+    cont = 0;
+  }
+  return (!cont || *res);
+}
+
 int veDeviceHandleCallback(VeDeviceEvent *e) {
   struct ve_device_cback *c;
+  VeDeviceSpecMatch m;
+  int k;
   int res = -1;
-  int cont = 0;
 
   /* first step: try controllers */
   if (veDeviceCtrlEvent(e) == 0)
     return 0; /* event consumed by controller */
 
-  for(c = cback_list; c; c = c->next) {
-    if (veDeviceMatchSpec(e,c->spec)) {
-      if (e->content->type == VE_ELEM_VECTOR && 
-	  c->spec && c->spec->index >= 0) {
-	/* need to create a valuator for an index of this vector */
-	VeDeviceE_Vector *vec;
-	VeDeviceE_Valuator *val;
-	VeDeviceEvent *ve;
-
-	vec = (VeDeviceE_Vector *)(e->content);
-	/* we should not match a spec that references an index outside of
-	   our vector */
-	assert(c->spec->index < vec->size);
-
-	/* build a new event which is just the valuator portion... */
-	ve = veDeviceEventCreate(VE_ELEM_VALUATOR,0);
-	val = (VeDeviceE_Valuator *)(ve->content);
-	ve->timestamp = e->timestamp;
-	ve->device = e->device ? veDupString(e->device) : NULL;
-	ve->elem = e->elem ? veDupString(e->elem) : NULL;
-	ve->index = c->spec->index;
-	val->min = vec->min[c->spec->index];
-	val->max = vec->max[c->spec->index];
-	val->value = vec->value[c->spec->index];
-	veLockCallbacks();
-	vePfEvent(MODULE,"callback","%s %s",ve->device,ve->elem);
-	res = c->proc(ve,c->arg);
-	veUnlockCallbacks();
-	veDeviceEventDestroy(ve);
-	cont = 1;
-      } else {
-	veLockCallbacks();
-	vePfEvent(MODULE,"callback","%s %s",e->device,e->elem);
-	res = c->proc(e,c->arg);
-	veUnlockCallbacks();
-	cont = 0;
-      }
-      if (!cont || res)
-	return res;
+  if (!cback_index)
+    cback_index = veDeviceSpecIndexCreate(cback_fill);
+  veDeviceSpecIndexMatch(cback_index,e,&m);
+  for(k = 0; k < m.n; k++) {
+    c = (struct ve_device_cback *)m.data[k];
+    if (cback_call(c,e,&res))
+      return res;
+    if (veDeviceSpecIndexChanged(cback_index,e,&m)) {
+      /* the list or the event changed under us - carry on from here
+	 the slow way */
+      for(c = c->next; c; c = c->next)
+	if (veDeviceMatchSpec(e,c->spec) && cback_call(c,e,&res))
+	  return res;
+      break;
     }
   }
   return res;
 }
 
+/* The event queue is in two parts:
+   - a bounded ring that device threads add to (VE_QUEUE_TAIL) without
+     taking a lock.  Each slot carries a sequence number, so producers
+     only ever race on the tail index and the consumer can tell a slot
+     that has been claimed from one that has been filled.
+   - a list of events that go in front of everything in the ring -
+     events pushed at VE_QUEUE_HEAD (filters re-queueing events) and
+     anything spilled out of the ring to be taken from the tail.
+   Removing events, adding at the head and dealing with a full ring all
+   happen with equeue_mutex held, so there is only ever one consumer.
+*/
 static struct ve_device_equeue {
   VeDeviceEvent *event;
   int disp;  /* filter code: 
@@ -180,20 +511,360 @@ static struct ve_device_equeue {
   struct ve_device_equeue *next, *prev;
 } *equeue_head = NULL, *equeue_tail = NULL;
 
+#define EQ_DEFAULT_SIZE 1024
+#define EQ_MIN_SIZE     16
+#define EQ_BLOCK_MS     100  /* default limit on blocking for space */
+
+struct ve_device_eslot {
+  volatile unsigned long seq; /* == position: empty
+				 == position+1: holds an event */
+  VeDeviceEvent *event;
+  int disp;
+};
+
+static struct ve_device_eslot *ering = NULL;
+static unsigned long ering_mask = 0;
+static volatile unsigned long ering_tail = 0; /* next position to fill */
+static unsigned long ering_head = 0; /* next position to empty
+					(equeue_mutex) */
+
+/* what to do with an event when the ring is full */
+#define EQ_DROP     0  /* throw away the oldest queued event */
+#define EQ_COALESCE 1  /* replace a queued event from the same element */
+#define EQ_BLOCK    2  /* wait (for a while) for space */
+static int eq_default_policy = EQ_DROP;
+static int eq_coalesce_default = 0; /* coalesce samples all the time? */
+static long eq_block_ms = EQ_BLOCK_MS;
+static int eq_waiters = 0; /* producers waiting for space (equeue_mutex) */
+static VeThrCond *equeue_space = NULL;
+
+
+/* statistics - published when the queue is processed */
+static int eq_depth = 0;   /* events waiting at the start of the last pass */
+static int eq_drops = 0;   /* events thrown away because the ring was full */
+static int eq_merged = 0;  /* events coalesced because the ring was full */
+static VeStatistic *eq_stats[3];
+
 static VeThrMutex *equeue_mutex = NULL;
 static VeThrMutex *einsert_mutex = NULL;
 /* inserted event disposition */
-static int event_disp = VE_DEVICE_NOBLOCK;
+static volatile int event_disp = VE_DEVICE_NOBLOCK;
 
 extern void veDeviceLatencyInit();
+extern void veDeviceRecordInit();
+extern void veDeviceRecordEvent(VeDeviceEvent *e);
+extern void veDeviceLatencyInsert(VeDeviceEvent *e);
+extern double veDeviceLatencyFiltered(VeDeviceEvent *e);
+extern void veDeviceLatencyDelivered(VeDeviceEvent *e, double filtered);
+
+static int eq_parse_policy(char *s) {
+  if (strcmp(s,"drop") == 0)
+    return EQ_DROP;
+  if (strcmp(s,"coalesce") == 0)
+    return EQ_COALESCE;
+  if (strcmp(s,"block") == 0)
+    return EQ_BLOCK;
+  veWarning(MODULE,"unknown event queue overflow policy '%s' - using 'drop'",
+	    s);
+  return EQ_DROP;
+}
+
+static void eq_init(void) {
+  static char *names[] = { "event_queue_depth", "event_queue_drops",
+			   "event_queue_merged" };
+  int *data[3];
+  unsigned long k, n = EQ_DEFAULT_SIZE;
+  char *s;
+
+  if ((s = veGetOption("event_queue_size")) && atoi(s) > 0)
+    n = atoi(s);
+  /* a power of 2, so that positions wrap cleanly */
+  for(k = EQ_MIN_SIZE; k < n; k <<= 1)
+    ;
+  ering = veAlloc(k*sizeof(struct ve_device_eslot),1);
+  for(n = 0; n < k; n++)
+    ering[n].seq = n;
+  ering_mask = k-1;
+  if ((s = veGetOption("event_queue_overflow")))
+    eq_default_policy = eq_parse_policy(s);
+  if ((s = veGetOption("event_coalesce")))
+    eq_coalesce_default = atoi(s);
+  if ((s = veGetOption("event_queue_block_ms")))
+    eq_block_ms = atol(s);
+  equeue_space = veThrCondCreate();
+#ifdef EQ_CAS_LOCKED
+  eq_cas_mutex = veThrMutexCreate();
+#endif
+
+  data[0] = &eq_depth;
+  data[1] = &eq_drops;
+  data[2] = &eq_merged;
+  for(k = 0; k < 3; k++) {
+    eq_stats[k] = veNewStatistic(MODULE,names[k],"events");
+    eq_stats[k]->type = VE_STAT_INT;
+    eq_stats[k]->data = data[k];
+    veAddStatistic(eq_stats[k]);
+  }
+}
 
 int veDeviceInit() {
+  epool_init();
   equeue_mutex = veThrMutexCreate();
   einsert_mutex = veThrMutexCreate();
+  eq_init();
   veDeviceLatencyInit();
+  veDeviceRecordInit();
   return 0;
 }
 
+/* Try to put an event in the ring.  Returns 0 on success or -1 if the
+   ring is full. */
+static int ering_put(VeDeviceEvent *e, int disp, unsigned long *where) {
+  struct ve_device_eslot *sl;
+  unsigned long pos;
+  long dif;
+
+  for(;;) {
+    pos = ering_tail;
+    sl = &(ering[pos & ering_mask]);
+    dif = (long)(sl->seq - pos);
+    if (dif == 0) {
+      if (eq_cas(&ering_tail,pos,pos+1))
+	break; /* slot is ours */
+    } else if (dif < 0)
+      return -1; /* still holds an event from the last time around */
+    /* otherwise another producer got there first */
+  }
+  sl->event = e;
+  sl->disp = disp;
+  eq_barrier();
+  sl->seq = pos+1; /* publish */
+  if (where)
+    *where = pos;
+  return 0;
+}
+
+/* Take the oldest event out of the ring - call with equeue_mutex held.
+   Returns NULL if there is nothing (or the oldest slot has been claimed
+   but not filled yet). */
+static VeDeviceEvent *ering_get(int *disp) {
+  struct ve_device_eslot *sl = &(ering[ering_head & ering_mask]);
+  VeDeviceEvent *e;
+
+  if (sl->seq != ering_head+1)
+    return NULL;
+  eq_barrier();
+  e = sl->event;
+  if (disp)
+    *disp = sl->disp;
+  sl->event = NULL;
+  eq_barrier();
+  sl->seq = ering_head + ering_mask + 1; /* free for the next lap */
+  ering_head++;
+  if (eq_waiters)
+    veThrCondBcast(equeue_space);
+  return e;
+}
+
+static int ering_pending(void) {
+  return ering[ering_head & ering_mask].seq == ering_head+1;
+}
+
+/* overflow policy for the device an event comes from */
+static int eq_policy(VeDeviceEvent *e) {
+  VeDevice *d;
+  char *s;
+  if (e->device && (d = veDeviceFind(e->device)) && d->instance &&
+      d->instance->options &&
+      (s = veStrMapLookup(d->instance->options,"queue_overflow")))
+    return eq_parse_policy(s);
+  return eq_default_policy;
+}
+
+/* Copy a newer sample of the same element into a queued event.
+   Returns 0 if that was possible (and e can go). */
+static int event_merge(VeDeviceEvent *old, VeDeviceEvent *e) {
+  VeDeviceE_Vector *to, *from;
+
+  if (VE_EVENT_TYPE(old) != VE_EVENT_TYPE(e) || old->index != e->index)
+    return -1;
+  switch (VE_EVENT_TYPE(e)) {
+  case VE_ELEM_VALUATOR:
+    *VE_EVENT_VALUATOR(old) = *VE_EVENT_VALUATOR(e);
+    break;
+  case VE_ELEM_VECTOR:
+    to = VE_EVENT_VECTOR(old);
+    from = VE_EVENT_VECTOR(e);
+    if (to->size != from->size)
+      return -1;
+    memcpy(to->min,from->min,sizeof(float)*from->size);
+    memcpy(to->max,from->max,sizeof(float)*from->size);
+    memcpy(to->value,from->value,sizeof(float)*from->size);
+    break;
+  default:
+    /* only valuators and vectors carry their whole state in each
+       event */
+    return -1;
+  }
+  old->timestamp = e->timestamp;
+  old->merged += e->merged + 1;
+  return 0;
+}
+
+/* Merge e into the newest queued event from the same element, if there
+   is one - call with equeue_mutex held.  Returns 0 if e has been
+   merged (and destroyed). */
+static int ering_coalesce(VeDeviceEvent *e, int disp) {
+  struct ve_device_eslot *sl;
+  VeDeviceEvent *old;
+  unsigned long pos;
+  int device, elem;
+
+  if (VE_EVENT_TYPE(e) != VE_ELEM_VALUATOR &&
+      VE_EVENT_TYPE(e) != VE_ELEM_VECTOR)
+    return -1;
+  device = veDeviceEventDeviceId(e);
+  elem = veDeviceEventElemId(e);
+  for(pos = ering_tail; pos != ering_head; ) {
+    pos--;
+    sl = &(ering[pos & ering_mask]);
+    if (sl->seq != pos+1)
+      continue; /* not filled in yet */
+    old = sl->event;
+    if (sl->disp == disp && veDeviceEventDeviceId(old) == device &&
+	veDeviceEventElemId(old) == elem && event_merge(old,e) == 0) {
+      veDeviceEventDestroy(e);
+      eq_merged++;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* the ring is full - apply the overflow policy */
+static void ering_overflow(VeDeviceEvent *e, int disp) {
+  int policy = eq_policy(e);
+  long t0 = veClock();
+  VeDeviceEvent *old;
+
+  veThrMutexLock(equeue_mutex);
+  while (ering_put(e,disp,NULL)) {
+    if (policy == EQ_COALESCE && ering_coalesce(e,disp) == 0)
+      break;
+    if (policy == EQ_BLOCK && veClock() - t0 < eq_block_ms) {
+      /* bounded, so that a consumer that pushes to its own full
+	 queue cannot hang */
+      eq_waiters++;
+      veThrCondTimedWait(equeue_space,equeue_mutex,1);
+      eq_waiters--;
+      continue;
+    }
+    /* make room */
+    if ((old = ering_get(NULL))) {
+      veDeviceEventDestroy(old);
+      eq_drops++;
+    }
+  }
+  veThrMutexUnlock(equeue_mutex);
+}
+
+/* Samples in the ring that later samples from the same element can be
+   merged into, for devices that coalesce all the time (equeue_mutex).
+   The entry with elem -1 for a device records where the last of its
+   events that must not be merged across was queued. */
+#define EQ_PENDING_HASH 256
+#define EQF_KNOWN    0x1  /* flags for device names */
+#define EQF_COALESCE 0x2
+
+static struct ve_device_epending {
+  int device, elem, index;
+  unsigned long pos;    /* ring position */
+  VeDeviceEvent *event; /* NULL if nothing has been queued yet */
+  struct ve_device_epending *next;
+} *eq_pending[EQ_PENDING_HASH];
+
+static struct ve_device_epending *eq_pending_find(int device, int elem,
+						  int index) {
+  struct ve_device_epending *p;
+  unsigned h;
+
+  h = ((unsigned)device*31U + (unsigned)elem*7U + (unsigned)index) &
+    (EQ_PENDING_HASH-1);
+  for(p = eq_pending[h]; p; p = p->next)
+    if (p->device == device && p->elem == elem && p->index == index)
+      return p;
+  p = veAllocObj(struct ve_device_epending);
+  p->device = device;
+  p->elem = elem;
+  p->index = index;
+  p->next = eq_pending[h];
+  eq_pending[h] = p;
+  return p;
+}
+
+/* should events from this device be coalesced?  (decided the first
+   time the device name turns up) */
+static int eq_coalescing(VeDeviceEvent *e) {
+  unsigned char *f;
+  VeDevice *d;
+  char *s;
+  int id, c;
+
+  if (!(id = veDeviceEventDeviceId(e)))
+    return 0;
+  f = &(intern_flags[id/INTERN_CHUNK][id%INTERN_CHUNK]);
+  if (!(*f & EQF_KNOWN)) {
+    c = eq_coalesce_default;
+    if ((d = veDeviceFind(e->device)) && d->instance &&
+	d->instance->options &&
+	(s = veStrMapLookup(d->instance->options,"coalesce")))
+      c = atoi(s);
+    *f = EQF_KNOWN | (c ? EQF_COALESCE : 0);
+  }
+  return (*f & EQF_COALESCE);
+}
+
+/* queue an event from a device that coalesces its samples */
+static void eq_push_coalesce(VeDeviceEvent *e, int disp) {
+  struct ve_device_epending *p, *b;
+  struct ve_device_eslot *sl;
+  unsigned long pos;
+  int device, type;
+
+  device = veDeviceEventDeviceId(e);
+  type = veDeviceEventType(e);
+  veThrMutexLock(equeue_mutex);
+  b = eq_pending_find(device,-1,-1);
+  if (type == VE_ELEM_VALUATOR || type == VE_ELEM_VECTOR) {
+    p = eq_pending_find(device,veDeviceEventElemId(e),e->index);
+    sl = &(ering[p->pos & ering_mask]);
+    /* still waiting, and nothing to keep in order since? */
+    if (p->event && (long)(p->pos - ering_head) >= 0 && 
+	sl->seq == p->pos+1 && sl->event == p->event && sl->disp == disp &&
+	(!b->event || (long)(b->pos - p->pos) < 0) &&
+	event_merge(p->event,e) == 0) {
+      eq_merged++;
+      veThrMutexUnlock(equeue_mutex);
+      veDeviceEventDestroy(e);
+      return;
+    }
+  } else
+    p = b;
+  if (ering_put(e,disp,&pos) == 0) {
+    p->event = e;
+    p->pos = pos;
+    veThrMutexUnlock(equeue_mutex);
+    return;
+  }
+  if (p == b) {
+    /* wherever this ends up, it is after everything queued so far */
+    b->event = e;
+    b->pos = ering_tail;
+  }
+  veThrMutexUnlock(equeue_mutex);
+  ering_overflow(e,disp);
+}
+
 int veDevicePushEvent(VeDeviceEvent *e, int where, int disp) {
   struct ve_device_equeue *eq;
 
@@ -210,23 +881,25 @@ int veDevicePushEvent(VeDeviceEvent *e, int where, int disp) {
     return -1;
   }
 
+  if (where == VE_QUEUE_TAIL) {
+    if (eq_coalescing(e))
+      eq_push_coalesce(e,disp);
+    else if (ering_put(e,disp,NULL))
+      ering_overflow(e,disp);
+    return 0;
+  }
+
   veThrMutexLock(equeue_mutex);
 
   eq = veAllocObj(struct ve_device_equeue);
   eq->event = e;
   eq->disp = disp;
-  if (!equeue_head) {
-    equeue_head = equeue_tail = veAllocObj(struct ve_device_equeue);
-    equeue_head->event = e;
-  } else if (where == VE_QUEUE_HEAD) {
-    eq->next = equeue_head;
+  eq->next = equeue_head;
+  if (equeue_head)
     equeue_head->prev = eq;
-    equeue_head = eq;
-  } else {
-    equeue_tail->next = eq;
-    eq->prev = equeue_tail;
+  else
     equeue_tail = eq;
-  }
+  equeue_head = eq;
 
   veThrMutexUnlock(equeue_mutex);
 
@@ -235,12 +908,13 @@ int veDevicePushEvent(VeDeviceEvent *e, int where, int disp) {
 
 /* 1 if something is there */
 int veDeviceEventPending() {
-  return (equeue_head ? 1 : 0);
+  return ((equeue_head || ering_pending()) ? 1 : 0);
 }
 
 VeDeviceEvent *veDeviceNextEvent(int where, int *disp) {
   VeDeviceEvent *e;
   struct ve_device_equeue *eq;
+  int d;
 
   assert(equeue_mutex != NULL);
 
@@ -250,6 +924,27 @@ VeDeviceEvent *veDeviceNextEvent(int where, int *disp) {
   }
 
   veThrMutexLock(equeue_mutex);
+  if (where == VE_QUEUE_HEAD && !equeue_head) {
+    /* the usual case */
+    e = ering_get(disp);
+    veThrMutexUnlock(equeue_mutex);
+    return e;
+  }
+  if (where == VE_QUEUE_TAIL) {
+    /* the ring can only be emptied from the front, so move it all
+       to the end of the list */
+    while ((e = ering_get(&d))) {
+      eq = veAllocObj(struct ve_device_equeue);
+      eq->event = e;
+      eq->disp = d;
+      eq->prev = equeue_tail;
+      if (equeue_tail)
+	equeue_tail->next = eq;
+      else
+	equeue_head = eq;
+      equeue_tail = eq;
+    }
+  }
   if (!equeue_head)
     e = NULL;
   else {
@@ -279,6 +974,7 @@ VeDeviceEvent *veDeviceNextEvent(int where, int *disp) {
 
 static int _doProcessEvent(VeDeviceEvent *e) {
   VeDeviceFTableEntry *te = NULL;
+  double filtered;
   int status;
 
   if (!e) {
@@ -313,15 +1009,32 @@ static int _doProcessEvent(VeDeviceEvent *e) {
   }
 
   /* if we fall through then deliver it */
+  filtered = veDeviceLatencyFiltered(e);
   veDeviceApplyEvent(e);
   veDeviceHandleCallback(e);
+  veDeviceLatencyDelivered(e,filtered);
   return 0;
 }
 
+/* publish queue statistics if anything has changed */
+static void eq_publish(int depth) {
+  static int last_drops = 0, last_merged = 0;
+  int k;
+  if (depth == eq_depth && eq_drops == last_drops && eq_merged == last_merged)
+    return;
+  eq_depth = depth;
+  last_drops = eq_drops;
+  last_merged = eq_merged;
+  for(k = 0; k < 3; k++)
+    veUpdateStatistic(eq_stats[k]);
+}
+
 void veDeviceProcessQueueNolock(void) {
   VeDeviceEvent *e;
   int disp;
   
+  /* (only a snapshot - device threads keep adding to the ring) */
+  eq_publish((int)(ering_tail - ering_head));
   while (e = veDeviceNextEvent(VE_QUEUE_HEAD,&disp)) {
     switch (disp) {
     case VE_FILT_CONTINUE:
@@ -329,8 +1042,13 @@ void veDeviceProcessQueueNolock(void) {
       break;
 
     case VE_FILT_DELIVER:
-      veDeviceApplyEvent(e);
-      veDeviceHandleCallback(e);
+      {
+	/* already filtered - this is time spent in the queue */
+	double filtered = veDeviceLatencyFiltered(e);
+	veDeviceApplyEvent(e);
+	veDeviceHandleCallback(e);
+	veDeviceLatencyDelivered(e,filtered);
+      }
       break;
 
     default:
@@ -372,9 +1090,29 @@ void veDeviceProcessQueue(void) {
 /* We also process queued events immediately after finishing with an
    inserted event (if we are in "noblock" mode). */
 int veDeviceInsertEvent(VeDeviceEvent *e) {
-int res;
+  int res = 0;
   if (veMPTestSlaveGuard())
     return 0;
+  /* record what the drivers give us - events made by filters would be
+     made again on replay */
+  veDeviceRecordEvent(e);
+  veDeviceLatencyInsert(e);
+  if (event_disp == VE_DEVICE_QUEUE) {
+    /* Blocked - queueing does not need to wait for whoever is
+       processing events.  If events were unblocked while we were
+       adding this one then the backlog might already have been
+       processed, so pick it up ourselves. */
+    vePfEvent(MODULE,"queue-event","%s %s",e->device,e->elem);
+    veDevicePushEvent(e,VE_QUEUE_TAIL,0);
+    eq_barrier();
+    if (event_disp == VE_DEVICE_NOBLOCK) {
+      veThrMutexLock(einsert_mutex);
+      if (event_disp == VE_DEVICE_NOBLOCK && veDeviceEventPending())
+	veDeviceProcessQueueNolock();
+      veThrMutexUnlock(einsert_mutex);
+    }
+    return 0;
+  }
   veThrMutexLock(einsert_mutex);
   VE_DEBUGM(2,("InsertEvent: (%s,%s)",e->device?e->device:"<NULL>",
 	      e->elem?e->elem:"<NULL>"));
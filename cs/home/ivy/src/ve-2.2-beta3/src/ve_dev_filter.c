@@ -29,6 +29,13 @@ VeDeviceFilter *veDeviceFilterCreate(VeDeviceEventProc proc,
    this module... */
 
 static VeDeviceFTableEntry *ft_head = NULL, *ft_tail = NULL;
+static VeDeviceSpecIndex *ft_index = NULL;
+
+static void ft_fill(VeDeviceSpecIndex *x) {
+  VeDeviceFTableEntry *f;
+  for(f = ft_head; f; f = f->next)
+    veDeviceSpecIndexAdd(x,f->spec,f);
+}
 
 int veDeviceFilterAdd(VeDeviceSpec *spec, VeDeviceFilter *filter, int where) {
   VeDeviceFTableEntry *e;
@@ -57,103 +64,126 @@ int veDeviceFilterAdd(VeDeviceSpec *spec, VeDeviceFilter *filter, int where) {
       ft_head = e;
     ft_tail = e;
   }
+  if (ft_index)
+    veDeviceSpecIndexInvalidate(ft_index);
   return 0;
 }
 
+/* the next filter table entry after f which matches e - from the
+   compiled index, unless the table or the event has changed since we
+   started (a filter added filters or renamed the event), in which
+   case we walk the table */
+static VeDeviceFTableEntry *ft_next(VeDeviceEvent *e, VeDeviceFTableEntry *f,
+				    VeDeviceSpecMatch *m, int *k) {
+  if (!veDeviceSpecIndexChanged(ft_index,e,m))
+    return (*k < m->n) ? (VeDeviceFTableEntry *)m->data[(*k)++] : NULL;
+  for(f = f ? f->next : ft_head; f && !veDeviceMatchSpec(e,f->spec);
+      f = f->next)
+    ;
+  return f;
+}
+
 int veDeviceFilterProcess(VeDeviceEvent *e) {
   int status, ret_status = VE_FILT_CONTINUE;
   VeDeviceFTableEntry *f;
+  VeDeviceSpecMatch m;
+  int k;
 
   if (!e)
     return ret_status; /* nothing to do */
 
-  f = ft_head;
-  while (f) {
-    if (veDeviceMatchSpec(e,f->spec)) {
-      if (f->filter->proc) {
-	/* special case - filters that map to a particular index of a
-	   vector */
-	if (veDeviceEventType(e) == VE_ELEM_VECTOR &&
-	    f->spec && f->spec->index >= 0 && e->index < 0) {
-	  VeDeviceEvent *ve;
-	  int mapped;
-
-	  ve = veDeviceEventCreate(VE_ELEM_VALUATOR,0);
-	  ve->timestamp = e->timestamp;
-	  ve->device = e->device ? veDupString(e->device) : NULL;
-	  ve->elem = e->elem ? veDupString(e->elem) : NULL;
-	  ve->index = f->spec->index;
-	  VE_EVENT_VALUATOR(ve)->min = VE_EVENT_VECTOR(e)->min[ve->index];
-	  VE_EVENT_VALUATOR(ve)->max = VE_EVENT_VECTOR(e)->max[ve->index];
-	  VE_EVENT_VALUATOR(ve)->value = VE_EVENT_VECTOR(e)->value[ve->index];
-
-	  status = f->filter->proc(e,f->filter->cdata);
+  if (!ft_index)
+    ft_index = veDeviceSpecIndexCreate(ft_fill);
+  veDeviceSpecIndexMatch(ft_index,e,&m);
+  k = 0;
+  f = NULL;
+  while ((f = ft_next(e,f,&m,&k))) {
+    if (f->filter->proc) {
+      /* special case - filters that map to a particular index of a
+	 vector */
+      if (veDeviceEventType(e) == VE_ELEM_VECTOR &&
+	  f->spec && f->spec->index >= 0 && e->index < 0) {
+	VeDeviceEvent *ve;
+	int mapped;
+
+	ve = veDeviceEventInitId(VE_ELEM_VALUATOR,0,
+				 veDeviceEventDeviceId(e),
+				 veDeviceEventElemId(e));
+	ve->timestamp = e->timestamp;
+	ve->index = f->spec->index;
+	VE_EVENT_VALUATOR(ve)->min = VE_EVENT_VECTOR(e)->min[ve->index];
+	VE_EVENT_VALUATOR(ve)->max = VE_EVENT_VECTOR(e)->max[ve->index];
+	VE_EVENT_VALUATOR(ve)->value = VE_EVENT_VECTOR(e)->value[ve->index];
+
+	status = f->filter->proc(e,f->filter->cdata);
 	  
-	  mapped = strcmp(e->device,ve->device) || 
-	    strcmp(e->elem, ve->elem) ||
-	    ve->content->type != VE_ELEM_VALUATOR;
-
-	  if (!mapped) {
-	    VE_EVENT_VECTOR(e)->min[ve->index] = VE_EVENT_VALUATOR(ve)->min;
-	    VE_EVENT_VECTOR(e)->max[ve->index] = VE_EVENT_VALUATOR(ve)->max;
-	    VE_EVENT_VECTOR(e)->value[ve->index] = 
-	      VE_EVENT_VALUATOR(ve)->value;
-	  }
+	mapped = strcmp(e->device,ve->device) || 
+	  strcmp(e->elem, ve->elem) ||
+	  ve->content->type != VE_ELEM_VALUATOR;
+
+	if (!mapped) {
+	  VE_EVENT_VECTOR(e)->min[ve->index] = VE_EVENT_VALUATOR(ve)->min;
+	  VE_EVENT_VECTOR(e)->max[ve->index] = VE_EVENT_VALUATOR(ve)->max;
+	  VE_EVENT_VECTOR(e)->value[ve->index] = 
+	    VE_EVENT_VALUATOR(ve)->value;
+	}
 	  
-	  /* deal with special status cases for "sub"-event */
-	  switch (status) {
-	  case VE_FILT_ERROR:
-	    veError(MODULE,"veDeviceFilterProcess: filter returned error");
-	    veDeviceEventDestroy(ve);
-	    return -1;
-
-	  case VE_FILT_CONTINUE:
-	    if (mapped)
-	      /* process this next */
-	      veDevicePushEvent(ve,VE_QUEUE_HEAD,VE_FILT_CONTINUE);
-	    else
-	      veDeviceEventDestroy(ve);
-	    break;
+	/* deal with special status cases for "sub"-event */
+	switch (status) {
+	case VE_FILT_ERROR:
+	  veError(MODULE,"veDeviceFilterProcess: filter returned error");
+	  veDeviceEventDestroy(ve);
+	  return -1;
 
-	  case VE_FILT_RESTART:
+	case VE_FILT_CONTINUE:
+	  if (mapped)
+	    /* process this next */
 	    veDevicePushEvent(ve,VE_QUEUE_HEAD,VE_FILT_CONTINUE);
-	    status = VE_FILT_CONTINUE;
-	    break;
-
-	  case VE_FILT_DISCARD:
-	    if (mapped)
-	      status = VE_FILT_CONTINUE; /* do not discard original */
+	  else
 	    veDeviceEventDestroy(ve);
+	  break;
+
+	case VE_FILT_RESTART:
+	  veDevicePushEvent(ve,VE_QUEUE_HEAD,VE_FILT_CONTINUE);
+	  status = VE_FILT_CONTINUE;
+	  break;
 
-	  case VE_FILT_DELIVER:
-	    if (mapped) {
-	      veDevicePushEvent(ve,VE_QUEUE_HEAD,VE_FILT_DELIVER);
-	      status = VE_FILT_CONTINUE;
-	    } else
-	      veDeviceEventDestroy(ve);
-	    break;
-
-	  default:
-	    veFatalError(MODULE,"veDeviceFilterProcess: invalid filter result: %d", status);
-	  }
-	} else
-	  status = f->filter->proc(e,f->filter->cdata);
-
-	switch(status) {
-	case VE_FILT_ERROR:
 	case VE_FILT_DISCARD:
+	  if (mapped)
+	    status = VE_FILT_CONTINUE; /* do not discard original */
+	  veDeviceEventDestroy(ve);
+	  break;
+
 	case VE_FILT_DELIVER:
-	  return status; /* aborts processing... */
-	case VE_FILT_RESTART:
-	  f = ft_head;
-	  ret_status = VE_FILT_CONTINUE;
-	  continue; /* skip advance at end... */
+	  if (mapped) {
+	    veDevicePushEvent(ve,VE_QUEUE_HEAD,VE_FILT_DELIVER);
+	    status = VE_FILT_CONTINUE;
+	  } else
+	    veDeviceEventDestroy(ve);
+	  break;
+
 	default:
-	  ret_status = status; /* continue as usual */
+	  veFatalError(MODULE,"veDeviceFilterProcess: invalid filter result: %d", status);
 	}
+      } else
+	status = f->filter->proc(e,f->filter->cdata);
+
+      switch(status) {
+      case VE_FILT_ERROR:
+      case VE_FILT_DISCARD:
+      case VE_FILT_DELIVER:
+	return status; /* aborts processing... */
+      case VE_FILT_RESTART:
+	/* start again from the top */
+	veDeviceSpecIndexMatch(ft_index,e,&m);
+	k = 0;
+	f = NULL;
+	ret_status = VE_FILT_CONTINUE;
+	continue;
+      default:
+	ret_status = status; /* continue as usual */
       }
     }
-    f = f->next;
   }
   return ret_status;
 }
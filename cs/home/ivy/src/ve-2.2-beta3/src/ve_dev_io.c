@@ -0,0 +1,230 @@
+/* Device I/O reactor - one thread reading input for every driver that
+   registers a file descriptor, rather than one blocking thread per
+   driver */
+#include "autocfg.h"
+#if defined(__linux) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for CPU affinity */
+#endif
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAS_EPOLL
+#include <sys/epoll.h>
+#endif /* HAS_EPOLL */
+#ifdef __linux
+#include <sched.h>
+#endif /* __linux */
+
+#include <ve_alloc.h>
+#include <ve_clock.h>
+#include <ve_debug.h>
+#include <ve_device.h>
+#include <ve_error.h>
+#include <ve_main.h>
+#include <ve_thread.h>
+
+#define MODULE "ve_dev_io"
+
+/* input that has been read but not yet consumed by a parse function -
+   if a parse function cannot make sense of this much then it is thrown
+   away so that the device can resynchronize */
+#define DEVIO_BUFSZ 4096
+/* events to collect from one epoll_wait() */
+#define DEVIO_EVENTS 16
+
+struct ve_device_io {
+  VeDevice *d;
+  int fd;
+  VeDeviceIOProc proc;
+  VeDeviceIOStampProc stamp;
+  void *arg;
+  int dead;      /* no longer watched - freed by the reactor thread */
+  struct ve_device_io *next; /* on the dead list */
+  int len;       /* unconsumed bytes in buf */
+  unsigned char buf[DEVIO_BUFSZ];
+};
+
+#ifdef HAS_EPOLL
+static int devio_fd = -1;
+static int devio_failed = 0; /* do not try again */
+static VeThrMutex *devio_mutex = NULL;
+static VeDeviceIO *devio_dead = NULL;
+
+/* bind the reactor thread to the CPU given by "device_io_cpu", if any */
+static void devio_bind(void) {
+  char *s;
+  if (!(s = veGetOption("device_io_cpu")))
+    return;
+#if defined(__linux) && defined(CPU_SET)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(atoi(s),&set);
+    /* pid 0 is the calling thread */
+    if (sched_setaffinity(0,sizeof(set),&set))
+      veWarning(MODULE,"cannot bind reactor to cpu %s: %s",s,strerror(errno));
+    else
+      VE_DEBUGM(1,("reactor bound to cpu %s",s));
+  }
+#else
+  veWarning(MODULE,"device_io_cpu is not supported on this platform");
+#endif /* __linux && CPU_SET */
+}
+
+static void devio_read(VeDeviceIO *io, long now) {
+  long when;
+  int n, used, err;
+
+  if (io->len >= DEVIO_BUFSZ) {
+    veWarning(MODULE,"%s: discarding %d bytes of input that could not be parsed",
+	      io->d->name,io->len);
+    io->len = 0;
+  }
+  if ((n = read(io->fd,io->buf+io->len,DEVIO_BUFSZ-io->len)) <= 0) {
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+      return;
+    VE_DEBUGM(1,("%s: %s on input",io->d->name,
+		 n < 0 ? strerror(errno) : "end-of-file"));
+    /* stop watching before the driver hears of it, so that it can
+       close the descriptor (io itself is freed after this batch) */
+    err = errno;
+    veDeviceIOUnwatch(io);
+    errno = err;
+    io->proc(io->d,NULL,-1,now,io->arg);
+    return;
+  }
+  when = io->stamp ? io->stamp(io->d,now,n,io->arg) : now;
+  io->len += n;
+  VE_DEBUGM(6,("%s: read %d bytes (%d buffered)",io->d->name,n,io->len));
+  used = io->proc(io->d,io->buf,io->len,when,io->arg);
+  if (io->dead || used <= 0)
+    return;
+  if (used >= io->len)
+    io->len = 0;
+  else {
+    io->len -= used;
+    memmove(io->buf,io->buf+used,io->len);
+  }
+}
+
+static void *devio_thread(void *x) {
+  struct epoll_event ev[DEVIO_EVENTS];
+  VeDeviceIO *io, *dead;
+  long now;
+  int k, n;
+
+  devio_bind();
+  for(;;) {
+    n = epoll_wait(devio_fd,ev,DEVIO_EVENTS,-1);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      veFatalError(MODULE,"epoll_wait failed: %s",strerror(errno));
+    }
+    /* the earliest we can know that the data is here */
+    now = veClock();
+    for(k = 0; k < n; k++) {
+      io = (VeDeviceIO *)(ev[k].data.ptr);
+      if (!io->dead)
+	devio_read(io,now);
+    }
+    /* anything unwatched before or during this batch can no longer
+       turn up in a later one */
+    if (devio_dead) {
+      veThrMutexLock(devio_mutex);
+      dead = devio_dead;
+      devio_dead = NULL;
+      veThrMutexUnlock(devio_mutex);
+      while ((io = dead)) {
+	dead = io->next;
+	veFree(io);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* start the reactor if we have not already
+   Note return value:
+   0  --> reactor is running (or will be once the delay gate opens)
+   -1 --> reactor is not available
+*/
+static int devio_init(void) {
+  char *s;
+
+  if (devio_fd >= 0)
+    return 0;
+  if (devio_failed)
+    return -1;
+  devio_failed = 1;
+  if ((s = veGetOption("device_io")) && atoi(s) == 0) {
+    VE_DEBUGM(1,("reactor disabled - drivers will use their own threads"));
+    return -1;
+  }
+  if ((devio_fd = epoll_create(DEVIO_EVENTS)) < 0) {
+    veWarning(MODULE,"epoll_create failed (%s) - drivers will use their own threads",
+	      strerror(errno));
+    return -1;
+  }
+  fcntl(devio_fd,F_SETFD,FD_CLOEXEC);
+  devio_mutex = veThrMutexCreate();
+  veThreadInitDelayed(devio_thread,NULL,0,0);
+  devio_failed = 0;
+  VE_DEBUGM(1,("reactor started"));
+  return 0;
+}
+#endif /* HAS_EPOLL */
+
+VeDeviceIO *veDeviceIOWatch(VeDevice *d, int fd, VeDeviceIOProc proc,
+			    VeDeviceIOStampProc stamp, void *arg) {
+#ifdef HAS_EPOLL
+  struct epoll_event ev;
+  VeDeviceIO *io;
+
+  assert(d != NULL);
+  assert(proc != NULL);
+  if (fd < 0 || devio_init())
+    return NULL;
+  io = veAllocObj(VeDeviceIO);
+  io->d = d;
+  io->fd = fd;
+  io->proc = proc;
+  io->stamp = stamp;
+  io->arg = arg;
+  memset(&ev,0,sizeof(ev));
+  /* level-triggered - one read per wakeup is enough and the descriptor
+     can stay in blocking mode for the driver's own use */
+  ev.events = EPOLLIN;
+  ev.data.ptr = io;
+  if (epoll_ctl(devio_fd,EPOLL_CTL_ADD,fd,&ev)) {
+    veWarning(MODULE,"%s: cannot watch descriptor %d: %s",d->name,fd,
+	      strerror(errno));
+    veFree(io);
+    return NULL;
+  }
+  VE_DEBUGM(2,("%s: watching descriptor %d",d->name,fd));
+  return io;
+#else
+  return NULL; /* no reactor - driver uses its own thread */
+#endif /* HAS_EPOLL */
+}
+
+void veDeviceIOUnwatch(VeDeviceIO *io) {
+#ifdef HAS_EPOLL
+  struct epoll_event ev; /* pre-2.6.9 kernels want a non-NULL pointer */
+
+  if (!io || io->dead)
+    return;
+  io->dead = 1;
+  epoll_ctl(devio_fd,EPOLL_CTL_DEL,io->fd,&ev);
+  VE_DEBUGM(2,("%s: no longer watching descriptor %d",io->d->name,io->fd));
+  veThrMutexLock(devio_mutex);
+  io->next = devio_dead;
+  devio_dead = io;
+  veThrMutexUnlock(devio_mutex);
+#endif /* HAS_EPOLL */
+}
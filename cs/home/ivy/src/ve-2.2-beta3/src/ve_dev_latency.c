@@ -0,0 +1,229 @@
+/* Event latency - where the time goes between a driver receiving
+   input and a frame being drawn from it, as histograms per device */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ve_alloc.h>
+#include <ve_clock.h>
+#include <ve_debug.h>
+#include <ve_device.h>
+#include <ve_error.h>
+#include <ve_main.h>
+#include <ve_stats.h>
+#include <ve_thread.h>
+#include <ve_util.h>
+
+#define MODULE "ve_dev_latency"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define lat_barrier() __sync_synchronize()
+#else
+#define lat_barrier()
+#endif
+
+/* the stages of an event's life that are measured - each runs from
+   the end of the previous one, except LAT_TOTAL which covers them all */
+#define LAT_INSERT   0  /* driver timestamp -> veDeviceInsertEvent() */
+#define LAT_FILTER   1  /* inserted -> through the queue and filters */
+#define LAT_CALLBACK 2  /* filtered -> models updated and callbacks run */
+#define LAT_FRAME    3  /* callbacks done -> start of the next frame */
+#define LAT_TOTAL    4  /* driver timestamp -> start of the next frame */
+#define LAT_NSTAGES  5
+
+static char *lat_names[LAT_NSTAGES] = {
+  "insert", "filter", "callback", "frame", "total"
+};
+
+/* smallest interesting latency (ms) - the histograms then run to about
+   a third of a second before everything is lumped together */
+#define LAT_BASE 0.01
+/* how often histograms are published and restarted (ms) */
+#define LAT_PUBLISH 1000
+
+/* Devices are found by their interned id, in fixed-size chunks that
+   never move so that looking one up does not need the lock */
+#define LAT_CHUNK  256
+#define LAT_CHUNKS 1024
+
+typedef struct lat_dev {
+  VeStatistic *stage[LAT_NSTAGES];
+  /* the earliest event delivered since the last frame started */
+  double frame_recv;  /* its driver timestamp */
+  double frame_cb;    /* when its callbacks finished, 0 if none */
+  struct lat_dev *next;
+} LatDev;
+
+static volatile int lat_on = 0;
+static VeThrMutex *lat_mutex = NULL;
+static LatDev **lat_table[LAT_CHUNKS];
+static LatDev *lat_list = NULL;
+static double lat_published = 0.0;
+
+static LatDev *lat_create(int id) {
+  LatDev *d, **chunk;
+  char name[256];
+  int k;
+
+  veThrMutexLock(lat_mutex);
+  if (!(chunk = lat_table[id/LAT_CHUNK])) {
+    chunk = veAlloc(LAT_CHUNK*sizeof(LatDev *),1);
+    lat_table[id/LAT_CHUNK] = chunk;
+  }
+  if (!(d = chunk[id%LAT_CHUNK])) {
+    d = veAllocObj(LatDev);
+    for(k = 0; k < LAT_NSTAGES; k++) {
+      veSnprintf(name,sizeof(name),"%s_latency[%s]",lat_names[k],
+		 veDeviceInternName(id));
+      d->stage[k] = veNewHistStatistic(MODULE,veDupString(name),"ms",
+				       LAT_BASE);
+      veAddStatistic(d->stage[k]);
+    }
+    d->next = lat_list;
+    lat_barrier();
+    lat_list = d;
+    chunk[id%LAT_CHUNK] = d;
+    VE_DEBUGM(1,("measuring latency for %s",veDeviceInternName(id)));
+  }
+  veThrMutexUnlock(lat_mutex);
+  return d;
+}
+
+static LatDev *lat_dev(VeDeviceEvent *e) {
+  LatDev **chunk, *d;
+  int id;
+
+  if ((id = veDeviceEventDeviceId(e)) <= 0 || id >= LAT_CHUNK*LAT_CHUNKS)
+    return NULL;
+  if ((chunk = lat_table[id/LAT_CHUNK]) && (d = chunk[id%LAT_CHUNK]))
+    return d;
+  return lat_create(id);
+}
+
+static void lat_add(LatDev *d, int stage, double ms) {
+  veHistStatAdd(d->stage[stage],(float)ms);
+}
+
+/* publish what has been collected since last time and start again */
+static void lat_publish(double now) {
+  VeStatHistogram *h;
+  LatDev *d;
+  int k;
+
+  if (now - lat_published < LAT_PUBLISH && now >= lat_published)
+    return;
+  veThrMutexLock(lat_mutex);
+  if (now - lat_published >= LAT_PUBLISH || now < lat_published) {
+    lat_published = now;
+    for(d = lat_list; d; d = d->next)
+      for(k = 0; k < LAT_NSTAGES; k++) {
+	h = (VeStatHistogram *)(d->stage[k]->udata);
+	if (h->n > 0) {
+	  veHistStatUpdate(d->stage[k]);
+	  veHistStatReset(d->stage[k]);
+	}
+      }
+  }
+  veThrMutexUnlock(lat_mutex);
+}
+
+/* The following are called by the event code (ve_dev_event.c) as an
+   event passes each point, and by the renderer as a frame starts.  They
+   do nothing unless latency is being measured. */
+void veDeviceLatencyInsert(VeDeviceEvent *e) {
+  LatDev *d;
+  if (!lat_on || !(d = lat_dev(e)))
+    return;
+  e->inserted = veClockFine();
+  lat_add(d,LAT_INSERT,e->inserted - e->timestamp);
+}
+
+double veDeviceLatencyFiltered(VeDeviceEvent *e) {
+  LatDev *d;
+  double now;
+  if (!lat_on || !(d = lat_dev(e)))
+    return 0.0;
+  now = veClockFine();
+  /* events made by filters or processed directly were never inserted */
+  if (e->inserted > 0.0)
+    lat_add(d,LAT_FILTER,now - e->inserted);
+  return now;
+}
+
+void veDeviceLatencyDelivered(VeDeviceEvent *e, double filtered) {
+  LatDev *d;
+  double now;
+  if (!lat_on || filtered <= 0.0 || !(d = lat_dev(e)))
+    return;
+  now = veClockFine();
+  lat_add(d,LAT_CALLBACK,now - filtered);
+  /* events are delivered one at a time (under the event lock) so only
+     the frame start can race with this - at worst one sample is lost */
+  if (d->frame_cb <= 0.0) {
+    d->frame_recv = e->timestamp;
+    d->frame_cb = now;
+  }
+  lat_publish(now);
+}
+
+void veDeviceLatencyFrame(void) {
+  LatDev *d;
+  double now, cb;
+  if (!lat_on)
+    return;
+  now = veClockFine();
+  for(d = lat_list; d; d = d->next)
+    if ((cb = d->frame_cb) > 0.0) {
+      lat_add(d,LAT_FRAME,now - cb);
+      lat_add(d,LAT_TOTAL,now - d->frame_recv);
+      d->frame_cb = 0.0;
+    }
+  lat_publish(now);
+}
+
+/* Using the "_latency" device turns measurement on - it generates no
+   events of its own */
+static VeDevice *new_latency_dev(VeDeviceDriver *driver, VeDeviceDesc *desc,
+				 VeStrMap override) {
+  VeDevice *d;
+
+  assert(desc != NULL);
+  assert(desc->name != NULL);
+
+  VE_DEBUGM(1,("initializing event latency measurement driver"));
+  d = veDeviceCreate(desc->name);
+  d->instance = veDeviceInstanceInit(driver,NULL,desc,override);
+  d->model = NULL;
+  lat_on = 1;
+  return d;
+}
+
+static VeDeviceDriver latency_drv = {
+  "_latencydriver", new_latency_dev, NULL
+};
+
+static VeDeviceDesc latency_desc = {
+  "_latency", "_latencydriver", NULL
+};
+
+/* This initialization function sets up the device so it can be used,
+   but does not set it running by default.  To generate latency
+   statistics:
+
+   use _latency
+
+   in your devices file, or
+
+   veDeviceUse("_latency")
+
+   in your program, or set the "event_latency" option.
+*/
+void veDeviceLatencyInit() {
+  char *s;
+  lat_mutex = veThrMutexCreate();
+  veDeviceAddDriver(&latency_drv);
+  veAddDeviceDesc(&latency_desc);
+  if ((s = veGetOption("event_latency")) && atoi(s))
+    lat_on = 1;
+}
@@ -52,14 +52,16 @@ VeDeviceEContent *veDeviceEContentCreate(VeDeviceEType type, int vsize) {
     c = (VeDeviceEContent *)veAllocObj(VeDeviceE_Valuator);
     break;
   case VE_ELEM_VECTOR:
-    c = (VeDeviceEContent *)veAllocObj(VeDeviceE_Vector);
+    /* one block - the arrays follow the structure */
+    c = (VeDeviceEContent *)veAlloc(sizeof(VeDeviceE_Vector)+
+				    3*(vsize > 0 ? vsize : 0)*sizeof(float),1);
     {
       VeDeviceE_Vector *vec = (VeDeviceE_Vector *)c;
       vec->size = vsize;
       if (vsize > 0) {
-	vec->min = veAlloc(vsize*sizeof(float),1);
-	vec->max = veAlloc(vsize*sizeof(float),1);
-	vec->value = veAlloc(vsize*sizeof(float),1);
+	vec->min = (float *)(vec+1);
+	vec->max = vec->min + vsize;
+	vec->value = vec->max + vsize;
       }
     }
     break;
@@ -74,15 +76,29 @@ VeDeviceEContent *veDeviceEContentCreate(VeDeviceEType type, int vsize) {
   return c;
 }
 
+/* are the arrays of a vector still the ones allocated along with it?
+   (used by the event pool to decide whether content can be reused) */
+int veDeviceEContentIsPacked(VeDeviceEContent *c) {
+  VeDeviceE_Vector *vec = (VeDeviceE_Vector *)c;
+  if (c->type != VE_ELEM_VECTOR || vec->size <= 0)
+    return 1;
+  return (vec->min == (float *)(vec+1) && vec->max == vec->min + vec->size &&
+	  vec->value == vec->max + vec->size);
+}
+
 void veDeviceEContentDestroy(VeDeviceEContent *c) {
   VeDeviceE_Vector *vec;
   if (c) {
     switch(c->type) {
     case VE_ELEM_VECTOR: /* only one with extra storage */
       vec = (VeDeviceE_Vector *)c;
-      veFree(vec->max);
-      veFree(vec->min);
-      veFree(vec->value);
+      /* arrays that have been replaced since creation are separate */
+      if (vec->size > 0 && vec->min != (float *)(vec+1))
+	veFree(vec->min);
+      if (vec->size > 0 && vec->max != (float *)(vec+1) + vec->size)
+	veFree(vec->max);
+      if (vec->size > 0 && vec->value != (float *)(vec+1) + 2*vec->size)
+	veFree(vec->value);
       break;
     default:
       /* this space intentionally left blank */;
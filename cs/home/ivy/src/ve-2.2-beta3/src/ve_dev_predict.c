@@ -0,0 +1,451 @@
+/* Pose prediction - a filter which extrapolates tracker positions and
+   orientations forward to the time at which the next frame is
+   expected to be displayed, hiding some of the tracker and rendering
+   latency */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <ve_alloc.h>
+#include <ve_clock.h>
+#include <ve_debug.h>
+#include <ve_device.h>
+#include <ve_error.h>
+#include <ve_stats.h>
+#include <ve_thread.h>
+#include <ve_util.h>
+
+#define MODULE "ve_dev_predict"
+
+/* horizon if no renderer has told us when it will display (ms) */
+#define PRED_DEFHORIZON 17
+/* never extrapolate further than this by default (ms) */
+#define PRED_DEFMAX 100
+/* samples further apart than this restart the motion estimate (ms) */
+#define PRED_GAP 250
+/* predictions waiting to be compared with real samples, per sensor */
+#define PRED_PENDING 16
+
+#define PRED_VELOCITY     0
+#define PRED_ACCELERATION 1
+
+typedef struct pred_pending {
+  long when;      /* time the prediction was for */
+  float v[4];
+} PredPending;
+
+/* motion history for one vector element (a position or orientation) */
+typedef struct pred_track {
+  int device_id, elem_id;
+  int size;           /* 3 (position) or 4 (quaternion) */
+  int nsamp;          /* samples seen since the last restart (up to 3) */
+  long when;          /* time of the last sample */
+  double v[4];        /* last sample */
+  double vel[3];      /* velocity (units/ms) or angular velocity (rad/ms) */
+  double acc[3];      /* ... and its rate of change (per ms) */
+  PredPending pend[PRED_PENDING];
+  int npend, pendhead;
+  struct pred_track *next;
+} PredTrack;
+
+typedef struct ve_device_predict {
+  long horizon;       /* fixed horizon (ms), or -1 to aim at the display */
+  long maxhorizon;
+  int model;
+  double smooth;      /* weight given to the old motion estimate */
+  PredTrack *tracks;
+} VeDevicePredict;
+
+static VeThrMutex *pred_mutex = NULL;
+
+/* when the next frame will be shown, and how far apart frames are */
+static long pred_display = 0;
+static long pred_period = 0;
+
+/* prediction error, averaged over each second */
+static float pred_pos_error = 0.0, pred_rot_error = 0.0;
+static VeStatistic *pred_pos_stat = NULL, *pred_rot_stat = NULL;
+static double pred_pos_sum = 0.0, pred_rot_sum = 0.0;
+static int pred_pos_n = 0, pred_rot_n = 0;
+static long pred_stat_last = -1;
+
+void veDeviceSetDisplayTime(long when) {
+  long d;
+  /* several windows may report the same frame - only count the time
+     between distinct frames */
+  if (pred_display > 0 && (d = when - pred_display) >= 2 && d <= 1000)
+    pred_period = pred_period > 0 ? (3*pred_period + d)/4 : d;
+  pred_display = when;
+}
+
+long veDeviceGetDisplayTime(void) {
+  return pred_display;
+}
+
+/* quaternions are (x,y,z,w) as in VeQuat */
+static void q_mult(double *a, double *b, double *c) {
+  c[0] = a[3]*b[0] + b[3]*a[0] + a[1]*b[2] - a[2]*b[1];
+  c[1] = a[3]*b[1] + b[3]*a[1] + a[2]*b[0] - a[0]*b[2];
+  c[2] = a[3]*b[2] + b[3]*a[2] + a[0]*b[1] - a[1]*b[0];
+  c[3] = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+}
+
+static void q_norm(double *q) {
+  double m = sqrt(q[0]*q[0]+q[1]*q[1]+q[2]*q[2]+q[3]*q[3]);
+  int k;
+  if (m < 1.0e-9) {
+    q[0] = q[1] = q[2] = 0.0;
+    q[3] = 1.0;
+  } else
+    for(k = 0; k < 4; k++)
+      q[k] /= m;
+}
+
+static double q_dot(double *a, double *b) {
+  return a[0]*b[0]+a[1]*b[1]+a[2]*b[2]+a[3]*b[3];
+}
+
+/* rotation vector (axis times angle) of a unit quaternion */
+static void q_log(double *q, double *r) {
+  double s = sqrt(q[0]*q[0]+q[1]*q[1]+q[2]*q[2]);
+  double a, w = q[3];
+  int k;
+  if (s < 1.0e-9) {
+    r[0] = r[1] = r[2] = 0.0;
+    return;
+  }
+  /* the shorter way round */
+  a = 2.0*atan2(s,fabs(w));
+  if (w < 0.0)
+    a = -a;
+  for(k = 0; k < 3; k++)
+    r[k] = q[k]/s*a;
+}
+
+static void q_exp(double *r, double *q) {
+  double a = sqrt(r[0]*r[0]+r[1]*r[1]+r[2]*r[2]);
+  double s;
+  int k;
+  if (a < 1.0e-9) {
+    q[0] = q[1] = q[2] = 0.0;
+    q[3] = 1.0;
+    return;
+  }
+  s = sin(a/2.0)/a;
+  for(k = 0; k < 3; k++)
+    q[k] = r[k]*s;
+  q[3] = cos(a/2.0);
+}
+
+static void q_slerp(double *a, double *b, double t, double *c) {
+  double bb[4], d, th, sa, sb;
+  int k;
+  d = q_dot(a,b);
+  for(k = 0; k < 4; k++)
+    bb[k] = d < 0.0 ? -b[k] : b[k];
+  d = fabs(d);
+  if (d > 0.9995) {
+    /* too close for the angle to be reliable - lerp */
+    sa = 1.0-t;
+    sb = t;
+  } else {
+    th = acos(d);
+    sa = sin((1.0-t)*th)/sin(th);
+    sb = sin(t*th)/sin(th);
+  }
+  for(k = 0; k < 4; k++)
+    c[k] = sa*a[k] + sb*bb[k];
+  q_norm(c);
+}
+
+/* angle between two orientations (degrees) */
+static double q_angle(double *a, double *b) {
+  double d = fabs(q_dot(a,b));
+  if (d > 1.0)
+    d = 1.0;
+  return 2.0*acos(d)*180.0/M_PI;
+}
+
+static void pred_stats_init(void) {
+  pred_pos_stat = veNewStatistic(MODULE,"pos_error","units");
+  pred_pos_stat->type = VE_STAT_FLOAT;
+  pred_pos_stat->data = &pred_pos_error;
+  veAddStatistic(pred_pos_stat);
+  pred_rot_stat = veNewStatistic(MODULE,"rot_error","deg");
+  pred_rot_stat->type = VE_STAT_FLOAT;
+  pred_rot_stat->data = &pred_rot_error;
+  veAddStatistic(pred_rot_stat);
+}
+
+static void pred_stats_update(long now) {
+  if (pred_stat_last < 0 || now < pred_stat_last) {
+    pred_stat_last = now;
+    return;
+  }
+  if (now - pred_stat_last < 1000)
+    return;
+  pred_stat_last = now;
+  if (pred_pos_n > 0) {
+    pred_pos_error = (float)(pred_pos_sum/pred_pos_n);
+    veUpdateStatistic(pred_pos_stat);
+  }
+  if (pred_rot_n > 0) {
+    pred_rot_error = (float)(pred_rot_sum/pred_rot_n);
+    veUpdateStatistic(pred_rot_stat);
+  }
+  pred_pos_sum = pred_rot_sum = 0.0;
+  pred_pos_n = pred_rot_n = 0;
+}
+
+static PredTrack *pred_track(VeDevicePredict *p, VeDeviceEvent *e, int size) {
+  PredTrack *t, *prev = NULL;
+  int did = veDeviceEventDeviceId(e), eid = veDeviceEventElemId(e);
+
+  for(t = p->tracks; t; prev = t, t = t->next)
+    if (t->device_id == did && t->elem_id == eid) {
+      if (prev) {
+	/* keep busy sensors near the front */
+	prev->next = t->next;
+	t->next = p->tracks;
+	p->tracks = t;
+      }
+      break;
+    }
+  if (!t) {
+    t = veAllocObj(PredTrack);
+    t->device_id = did;
+    t->elem_id = eid;
+    t->next = p->tracks;
+    p->tracks = t;
+    VE_DEBUGM(2,("tracking %s.%s",e->device,e->elem));
+  }
+  if (t->size != size) {
+    t->size = size;
+    t->nsamp = t->npend = 0;
+  }
+  return t;
+}
+
+/* compare predictions that have come due with the sensor's motion
+   between its last two samples */
+static void pred_check(PredTrack *t, double *v, long when) {
+  PredPending *pp;
+  double actual[4], guess[4], u, d;
+  int k;
+
+  while (t->npend > 0) {
+    pp = &(t->pend[t->pendhead]);
+    if (pp->when > when)
+      break;
+    t->pendhead = (t->pendhead+1) % PRED_PENDING;
+    t->npend--;
+    if (pp->when < t->when)
+      continue; /* fell between samples we did not see */
+    u = when > t->when ? (pp->when - t->when)/(double)(when - t->when) : 1.0;
+    if (t->size == 4) {
+      q_slerp(t->v,v,u,actual);
+      for(k = 0; k < 4; k++)
+	guess[k] = pp->v[k];
+      pred_rot_sum += q_angle(actual,guess);
+      pred_rot_n++;
+    } else {
+      d = 0.0;
+      for(k = 0; k < 3; k++) {
+	actual[k] = t->v[k] + u*(v[k]-t->v[k]);
+	d += (actual[k]-pp->v[k])*(actual[k]-pp->v[k]);
+      }
+      pred_pos_sum += sqrt(d);
+      pred_pos_n++;
+    }
+  }
+}
+
+static void pred_remember(PredTrack *t, long when, double *v) {
+  PredPending *pp;
+  int k;
+  if (t->npend >= PRED_PENDING) {
+    t->pendhead = (t->pendhead+1) % PRED_PENDING;
+    t->npend--;
+  }
+  pp = &(t->pend[(t->pendhead+t->npend) % PRED_PENDING]);
+  pp->when = when;
+  for(k = 0; k < t->size; k++)
+    pp->v[k] = (float)(v[k]);
+  t->npend++;
+}
+
+/* fold a new sample into the motion estimate */
+static void pred_sample(VeDevicePredict *p, PredTrack *t, double *v,
+			long when) {
+  double r[3], dq[4], inv[4], nv, dt;
+  int k;
+
+  dt = (double)(when - t->when);
+  if (t->nsamp > 0 && (dt > PRED_GAP || dt < 0)) {
+    VE_DEBUGM(3,("%d.%d: restarting after %g ms gap",
+		 t->device_id,t->elem_id,dt));
+    t->nsamp = t->npend = 0;
+  }
+  if (t->nsamp > 0 && dt <= 0.0)
+    return; /* same millisecond - nothing new to learn about motion */
+
+  if (t->nsamp > 0) {
+    /* measured rate of change since the last sample */
+    if (t->size == 4) {
+      /* the rotation taking the last orientation to this one, as
+	 an angular velocity */
+      inv[0] = -t->v[0]; inv[1] = -t->v[1]; inv[2] = -t->v[2];
+      inv[3] = t->v[3];
+      q_mult(v,inv,dq);
+      q_log(dq,r);
+    } else
+      for(k = 0; k < 3; k++)
+	r[k] = v[k] - t->v[k];
+    for(k = 0; k < 3; k++) {
+      r[k] /= dt;
+      if (t->nsamp == 1) {
+	t->vel[k] = r[k];
+	t->acc[k] = 0.0;
+      } else {
+	nv = p->smooth*t->vel[k] + (1.0-p->smooth)*r[k];
+	t->acc[k] = p->smooth*t->acc[k] + (1.0-p->smooth)*(nv-t->vel[k])/dt;
+	t->vel[k] = nv;
+      }
+    }
+  }
+  if (t->nsamp < 3)
+    t->nsamp++;
+  t->when = when;
+  for(k = 0; k < t->size; k++)
+    t->v[k] = v[k];
+}
+
+/* extrapolate the last sample by h ms */
+static void pred_extrapolate(VeDevicePredict *p, PredTrack *t, double h,
+			     double *out) {
+  double r[3], dq[4];
+  int k, acc;
+
+  acc = (p->model == PRED_ACCELERATION && t->nsamp >= 3);
+  for(k = 0; k < 3; k++)
+    r[k] = (t->nsamp >= 2 ? t->vel[k]*h : 0.0) +
+      (acc ? 0.5*t->acc[k]*h*h : 0.0);
+  if (t->size == 4) {
+    /* continuing along the same great arc, i.e. slerp from the previous
+       sample through this one and beyond */
+    q_exp(r,dq);
+    q_mult(dq,t->v,out);
+    q_norm(out);
+  } else
+    for(k = 0; k < 3; k++)
+      out[k] = t->v[k] + r[k];
+}
+
+/* how far ahead of an event to predict (ms) */
+static long pred_horizon(VeDevicePredict *p, VeDeviceEvent *e) {
+  long target, now, h;
+
+  if (p->horizon >= 0)
+    h = p->horizon;
+  else {
+    now = veClock();
+    if (pred_display > 0) {
+      target = pred_display;
+      if (target < now) {
+	/* that frame has gone - aim for the next one after now */
+	long per = pred_period > 0 ? pred_period : PRED_DEFHORIZON;
+	target += ((now - target)/per + 1)*per;
+      }
+    } else
+      target = now + PRED_DEFHORIZON;
+    h = target - e->timestamp;
+  }
+  if (h < 0)
+    h = 0;
+  if (h > p->maxhorizon)
+    h = p->maxhorizon;
+  return h;
+}
+
+static int pred_filter(VeDeviceEvent *e, void *arg) {
+  VeDevicePredict *p = (VeDevicePredict *)arg;
+  VeDeviceE_Vector *vec;
+  PredTrack *t;
+  double v[4], out[4];
+  long h;
+  int k;
+
+  if (!e->content || VE_EVENT_TYPE(e) != VE_ELEM_VECTOR || e->index >= 0)
+    return VE_FILT_CONTINUE;
+  vec = VE_EVENT_VECTOR(e);
+  if (vec->size != 3 && vec->size != 4)
+    return VE_FILT_CONTINUE;
+
+  for(k = 0; k < vec->size; k++)
+    v[k] = vec->value[k];
+  if (vec->size == 4)
+    q_norm(v);
+  h = pred_horizon(p,e);
+
+  veThrMutexLock(pred_mutex);
+  t = pred_track(p,e,vec->size);
+  pred_check(t,v,e->timestamp);
+  pred_sample(p,t,v,e->timestamp);
+  pred_extrapolate(p,t,(double)h,out);
+  pred_remember(t,e->timestamp+h,out);
+  pred_stats_update(veClock());
+  veThrMutexUnlock(pred_mutex);
+
+  VE_DEBUGM(5,("%s.%s: predicting %ld ms ahead",e->device,e->elem,h));
+  for(k = 0; k < vec->size; k++)
+    vec->value[k] = (float)(out[k]);
+  return VE_FILT_CONTINUE;
+}
+
+VeDeviceFilter *veDevicePredictFilter(VeStrMap options) {
+  VeDevicePredict *p;
+  char *s;
+
+  p = veAllocObj(VeDevicePredict);
+  p->horizon = -1;
+  p->maxhorizon = PRED_DEFMAX;
+  p->model = PRED_VELOCITY;
+  p->smooth = 0.5;
+
+  if (options && (s = veStrMapLookup(options,"horizon")) &&
+      strcmp(s,"display") != 0)
+    p->horizon = atol(s);
+  if (options && (s = veStrMapLookup(options,"max")))
+    p->maxhorizon = atol(s);
+  if (options && (s = veStrMapLookup(options,"model"))) {
+    if (strcmp(s,"velocity") == 0)
+      p->model = PRED_VELOCITY;
+    else if (strcmp(s,"acceleration") == 0)
+      p->model = PRED_ACCELERATION;
+    else {
+      veError(MODULE,"unknown prediction model: %s",s);
+      veFree(p);
+      return NULL;
+    }
+  }
+  if (options && (s = veStrMapLookup(options,"smooth")))
+    p->smooth = atof(s);
+  if (p->smooth < 0.0 || p->smooth >= 1.0) {
+    veError(MODULE,"smooth must be at least 0 and less than 1: %g",
+	    p->smooth);
+    veFree(p);
+    return NULL;
+  }
+  if (p->maxhorizon < 0)
+    p->maxhorizon = 0;
+
+  if (!pred_mutex) {
+    pred_mutex = veThrMutexCreate();
+    pred_stats_init();
+  }
+  VE_DEBUGM(1,("new predictor: horizon %ld, max %ld, model %d, smooth %g",
+	       p->horizon,p->maxhorizon,p->model,p->smooth));
+  return veDeviceFilterCreate(pred_filter,p);
+}
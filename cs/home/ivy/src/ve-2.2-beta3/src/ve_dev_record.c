@@ -0,0 +1,476 @@
+/* Recording device input to a file, and the "replay" driver which plays
+   such a recording back */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <ve_alloc.h>
+#include <ve_clock.h>
+#include <ve_debug.h>
+#include <ve_device.h>
+#include <ve_error.h>
+#include <ve_main.h>
+#include <ve_thread.h>
+#include <ve_util.h>
+
+#define MODULE "ve_dev_record"
+
+/* File format:  a header (REC_MAGIC, then the version as one byte)
+   followed by records.  Each record starts with a tag byte:
+
+   REC_NAME   id name-length name-bytes
+              - introduces a device or element name; ids are those
+                of the recording process's intern table
+   REC_EVENT  type device-id elem-id index dt tsoff content
+              - dt is the time since the previous event arrived (ms)
+                and tsoff is the event's timestamp relative to its
+                arrival
+
+   Integers are variable-length (7 bits a byte, low bits first, top bit
+   set on all but the last byte) and signed ones are zig-zag encoded
+   so that small negative values stay small.  Floats are 4 bytes, most
+   significant first.  Content is nothing (trigger), state (switch),
+   min/max/value (valuator), size then all mins, maxes and values
+   (vector) or key and state (keyboard). */
+#define REC_MAGIC "VEEV"
+#define REC_VERSION 1
+#define REC_NAME   1
+#define REC_EVENT  2
+
+/* sanity limits when reading - largest vector and name id */
+#define REC_MAXVEC 1024
+#define REC_MAXID  (1<<20)
+
+static VeThrMutex *rec_mutex = NULL;
+static FILE *rec_file = NULL;
+static long rec_last;          /* arrival time of the last event (-1 if none) */
+static long rec_flushed;       /* when the file was last flushed */
+static unsigned char *rec_named = NULL;  /* names already written */
+static int rec_nnamed = 0;
+static int rec_count = 0;
+
+static void put_uv(FILE *f, unsigned long v) {
+  while (v >= 0x80) {
+    putc((int)(v & 0x7f)|0x80,f);
+    v >>= 7;
+  }
+  putc((int)v,f);
+}
+
+static void put_sv(FILE *f, long v) {
+  put_uv(f,v < 0 ? ((unsigned long)(-(v+1)) << 1)|1 : (unsigned long)v << 1);
+}
+
+static void put_float(FILE *f, float x) {
+  unsigned int u;
+  assert(sizeof(u) == sizeof(x));
+  memcpy(&u,&x,sizeof(u));
+  putc((u >> 24) & 0xff,f);
+  putc((u >> 16) & 0xff,f);
+  putc((u >> 8) & 0xff,f);
+  putc(u & 0xff,f);
+}
+
+/* write out a name the first time it is used - rec_mutex must be held */
+static void rec_name(int id) {
+  char *s;
+  int n;
+
+  if (id >= rec_nnamed) {
+    n = rec_nnamed ? rec_nnamed : 256;
+    while (n <= id)
+      n *= 2;
+    rec_named = veRealloc(rec_named,n);
+    memset(rec_named+rec_nnamed,0,n-rec_nnamed);
+    rec_nnamed = n;
+  }
+  if (rec_named[id])
+    return;
+  rec_named[id] = 1;
+  s = veDeviceInternName(id);
+  n = strlen(s);
+  putc(REC_NAME,rec_file);
+  put_uv(rec_file,id);
+  put_uv(rec_file,n);
+  fwrite(s,1,n,rec_file);
+}
+
+int veDeviceRecordStart(char *file) {
+  FILE *f;
+
+  if (!rec_mutex)
+    rec_mutex = veThrMutexCreate();
+  veDeviceRecordStop();
+  if (!(f = fopen(file,"wb"))) {
+    veError(MODULE,"cannot open %s for recording: %s",file,strerror(errno));
+    return -1;
+  }
+  fwrite(REC_MAGIC,1,strlen(REC_MAGIC),f);
+  putc(REC_VERSION,f);
+  veThrMutexLock(rec_mutex);
+  memset(rec_named,0,rec_nnamed);
+  rec_count = 0;
+  rec_last = -1; /* the clock may not have been started yet */
+  rec_flushed = 0;
+  rec_file = f;
+  veThrMutexUnlock(rec_mutex);
+  VE_DEBUGM(1,("recording device events to %s",file));
+  return 0;
+}
+
+void veDeviceRecordStop(void) {
+  FILE *f;
+
+  if (!rec_mutex || !rec_file)
+    return;
+  veThrMutexLock(rec_mutex);
+  f = rec_file;
+  rec_file = NULL;
+  veThrMutexUnlock(rec_mutex);
+  if (f) {
+    fclose(f);
+    VE_DEBUGM(1,("recorded %d device events",rec_count));
+  }
+}
+
+/* called for every event a driver inserts - see veDeviceInsertEvent() */
+void veDeviceRecordEvent(VeDeviceEvent *e) {
+  VeDeviceE_Vector *vec;
+  long now;
+  int dev, elem, k;
+
+  if (!rec_file || !e || !e->content)
+    return;
+  dev = veDeviceEventDeviceId(e);
+  elem = veDeviceEventElemId(e);
+  veThrMutexLock(rec_mutex);
+  if (!rec_file) {
+    veThrMutexUnlock(rec_mutex);
+    return;
+  }
+  now = veClock();
+  if (dev)
+    rec_name(dev);
+  if (elem)
+    rec_name(elem);
+  putc(REC_EVENT,rec_file);
+  putc(VE_EVENT_TYPE(e),rec_file);
+  put_uv(rec_file,dev);
+  put_uv(rec_file,elem);
+  put_sv(rec_file,e->index);
+  put_uv(rec_file,(rec_last >= 0 && now > rec_last) ? now - rec_last : 0);
+  put_sv(rec_file,e->timestamp - now);
+  rec_last = now;
+  switch (VE_EVENT_TYPE(e)) {
+  case VE_ELEM_SWITCH:
+    put_sv(rec_file,VE_EVENT_SWITCH(e)->state);
+    break;
+  case VE_ELEM_VALUATOR:
+    put_float(rec_file,VE_EVENT_VALUATOR(e)->min);
+    put_float(rec_file,VE_EVENT_VALUATOR(e)->max);
+    put_float(rec_file,VE_EVENT_VALUATOR(e)->value);
+    break;
+  case VE_ELEM_VECTOR:
+    vec = VE_EVENT_VECTOR(e);
+    put_uv(rec_file,vec->size);
+    for(k = 0; k < vec->size; k++)
+      put_float(rec_file,vec->min[k]);
+    for(k = 0; k < vec->size; k++)
+      put_float(rec_file,vec->max[k]);
+    for(k = 0; k < vec->size; k++)
+      put_float(rec_file,vec->value[k]);
+    break;
+  case VE_ELEM_KEYBOARD:
+    put_sv(rec_file,VE_EVENT_KEYBOARD(e)->key);
+    put_sv(rec_file,VE_EVENT_KEYBOARD(e)->state);
+    break;
+  default:
+    break; /* triggers have no content */
+  }
+  rec_count++;
+  /* keep what is on disk reasonably current in case we crash - the
+     crash may be what the recording is for */
+  if (now - rec_flushed >= 1000 || now < rec_flushed) {
+    fflush(rec_file);
+    rec_flushed = now;
+  }
+  veThrMutexUnlock(rec_mutex);
+}
+
+/* Reading recordings back */
+struct ve_device_replay {
+  FILE *f;
+  char *file;
+  long data;     /* offset of the first record */
+  long at;       /* arrival time of the last event read */
+  int *ids;      /* recorded id -> our intern id */
+  int nids;
+};
+
+static int get_uv(FILE *f, unsigned long *v) {
+  int c, shift = 0;
+  *v = 0;
+  do {
+    if ((c = getc(f)) == EOF || shift > 8*sizeof(long))
+      return -1;
+    *v |= (unsigned long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+static int get_sv(FILE *f, long *v) {
+  unsigned long u;
+  if (get_uv(f,&u))
+    return -1;
+  *v = (u & 1) ? -(long)(u >> 1) - 1 : (long)(u >> 1);
+  return 0;
+}
+
+static int get_float(FILE *f, float *x) {
+  unsigned int u = 0;
+  int k, c;
+  for(k = 0; k < 4; k++) {
+    if ((c = getc(f)) == EOF)
+      return -1;
+    u = (u << 8)|(c & 0xff);
+  }
+  memcpy(x,&u,sizeof(u));
+  return 0;
+}
+
+static int get_floats(FILE *f, float *x, int n) {
+  int k;
+  for(k = 0; k < n; k++)
+    if (get_float(f,&(x[k])))
+      return -1;
+  return 0;
+}
+
+static int replay_id(VeDeviceReplay *r, unsigned long id) {
+  return (id < r->nids) ? r->ids[id] : 0;
+}
+
+static int replay_name(VeDeviceReplay *r) {
+  unsigned long id, n;
+  char buf[1024];
+  int k;
+
+  if (get_uv(r->f,&id) || id > REC_MAXID || get_uv(r->f,&n) ||
+      n >= sizeof(buf) || fread(buf,1,n,r->f) != n)
+    return -1;
+  buf[n] = '\0';
+  if (id >= r->nids) {
+    k = r->nids ? r->nids : 256;
+    while (k <= id)
+      k *= 2;
+    r->ids = veRealloc(r->ids,k*sizeof(int));
+    memset(r->ids+r->nids,0,(k-r->nids)*sizeof(int));
+    r->nids = k;
+  }
+  r->ids[id] = veDeviceIntern(buf);
+  return 0;
+}
+
+VeDeviceReplay *veDeviceReplayOpen(char *file) {
+  VeDeviceReplay *r;
+  char magic[8];
+  FILE *f;
+  int n = strlen(REC_MAGIC);
+
+  if (!(f = fopen(file,"rb"))) {
+    veError(MODULE,"cannot open recording %s: %s",file,strerror(errno));
+    return NULL;
+  }
+  if (fread(magic,1,n,f) != n || strncmp(magic,REC_MAGIC,n) ||
+      getc(f) != REC_VERSION) {
+    veError(MODULE,"%s is not a device event recording (or is from a different version)",
+	    file);
+    fclose(f);
+    return NULL;
+  }
+  r = veAllocObj(VeDeviceReplay);
+  r->f = f;
+  r->file = veDupString(file);
+  r->data = ftell(f);
+  return r;
+}
+
+void veDeviceReplayRewind(VeDeviceReplay *r) {
+  fseek(r->f,r->data,SEEK_SET);
+  r->at = 0;
+}
+
+VeDeviceEvent *veDeviceReplayNext(VeDeviceReplay *r, long *when) {
+  VeDeviceEvent *e;
+  VeDeviceE_Vector *vec;
+  unsigned long dev, elem, dt, size;
+  long index, tsoff, v1, v2;
+  int c, type, bad;
+
+  while ((c = getc(r->f)) == REC_NAME)
+    if (replay_name(r))
+      goto corrupt;
+  if (c == EOF)
+    return NULL;
+  if (c != REC_EVENT || (type = getc(r->f)) == EOF ||
+      get_uv(r->f,&dev) || get_uv(r->f,&elem) || get_sv(r->f,&index) ||
+      get_uv(r->f,&dt) || get_sv(r->f,&tsoff))
+    goto corrupt;
+  size = 0;
+  if (type == VE_ELEM_VECTOR && (get_uv(r->f,&size) || size > REC_MAXVEC))
+    goto corrupt;
+  switch (type) {
+  case VE_ELEM_TRIGGER:
+  case VE_ELEM_SWITCH:
+  case VE_ELEM_VALUATOR:
+  case VE_ELEM_VECTOR:
+  case VE_ELEM_KEYBOARD:
+    break;
+  default:
+    goto corrupt;
+  }
+  e = veDeviceEventInitId(type,size,replay_id(r,dev),replay_id(r,elem));
+  e->index = index;
+  bad = 0;
+  switch (type) {
+  case VE_ELEM_SWITCH:
+    bad = get_sv(r->f,&v1);
+    VE_EVENT_SWITCH(e)->state = v1;
+    break;
+  case VE_ELEM_VALUATOR:
+    bad = get_float(r->f,&(VE_EVENT_VALUATOR(e)->min)) ||
+      get_float(r->f,&(VE_EVENT_VALUATOR(e)->max)) ||
+      get_float(r->f,&(VE_EVENT_VALUATOR(e)->value));
+    break;
+  case VE_ELEM_VECTOR:
+    vec = VE_EVENT_VECTOR(e);
+    bad = get_floats(r->f,vec->min,size) || get_floats(r->f,vec->max,size) ||
+      get_floats(r->f,vec->value,size);
+    break;
+  case VE_ELEM_KEYBOARD:
+    bad = get_sv(r->f,&v1) || get_sv(r->f,&v2);
+    VE_EVENT_KEYBOARD(e)->key = v1;
+    VE_EVENT_KEYBOARD(e)->state = v2;
+    break;
+  }
+  if (bad) {
+    veDeviceEventDestroy(e);
+    goto corrupt;
+  }
+  r->at += dt;
+  if (when)
+    *when = r->at;
+  /* relative to arrival - the caller moves it to when it replays it */
+  e->timestamp = tsoff;
+  return e;
+
+ corrupt:
+  veError(MODULE,"%s: recording is truncated or corrupt",r->file);
+  return NULL;
+}
+
+void veDeviceReplayClose(VeDeviceReplay *r) {
+  if (r) {
+    fclose(r->f);
+    veFree(r->file);
+    veFree(r->ids);
+    veFree(r);
+  }
+}
+
+/* The "replay" driver */
+typedef struct vei_replay {
+  VeDeviceReplay *r;
+  float speed;  /* 0 = as fast as possible */
+  int loop;     /* passes to make, 0 = forever */
+  int exit;     /* exit when done */
+} VeiReplay;
+
+static void *replay_thread(void *v) {
+  VeDevice *d = (VeDevice *)v;
+  VeiReplay *p = (VeiReplay *)(d->instance->idata);
+  VeDeviceEvent *e;
+  long start, when, now, due;
+  int pass, n;
+
+  for(pass = 1; p->loop <= 0 || pass <= p->loop; pass++) {
+    veDeviceReplayRewind(p->r);
+    start = veClock();
+    n = 0;
+    while ((e = veDeviceReplayNext(p->r,&when))) {
+      if (p->speed > 0.0) {
+	due = start + (long)(when/p->speed);
+	/* (a second at a time, in case of long quiet spells) */
+	while ((now = veClock()) < due)
+	  veMicroSleep((due-now > 1000 ? 1000 : due-now)*1000);
+      }
+      e->timestamp += veClock();
+      veDeviceInsertEvent(e);
+      n++;
+    }
+    now = veClock();
+    veNotice(MODULE,"%s: replayed %d events in %ld ms (%.0f events/sec)",
+	     d->name,n,now-start,
+	     now > start ? n/((now-start)/1000.0) : 0.0);
+    if (n == 0) {
+      /* nothing to loop over - do not spin */
+      veError(MODULE,"%s: recording has no events - stopping replay",
+	      d->name);
+      break;
+    }
+  }
+  if (p->exit)
+    veExit();
+  return NULL;
+}
+
+static VeDevice *new_replay_dev(VeDeviceDriver *driver, VeDeviceDesc *desc,
+				VeStrMap override) {
+  VeDeviceInstance *i;
+  VeDevice *d;
+  VeiReplay *p;
+  char *s;
+
+  i = veDeviceInstanceInit(driver,NULL,desc,override);
+  if (!(s = veDeviceInstOption(i,"file"))) {
+    veError(MODULE,"device %s disabled: no recording given (file option)",
+	    desc->name);
+    return NULL;
+  }
+  p = veAllocObj(VeiReplay);
+  if (!(p->r = veDeviceReplayOpen(s))) {
+    veError(MODULE,"device %s disabled: cannot open recording %s",
+	    desc->name,s);
+    veFree(p);
+    return NULL;
+  }
+  p->speed = 1.0;
+  if ((s = veDeviceInstOption(i,"speed")))
+    p->speed = atof(s);
+  p->loop = 1;
+  if ((s = veDeviceInstOption(i,"loop")))
+    p->loop = atoi(s);
+  if ((s = veDeviceInstOption(i,"exit")))
+    p->exit = atoi(s);
+  i->idata = (void *)p;
+
+  d = veDeviceCreate(desc->name);
+  d->instance = i;
+  d->model = veDeviceCreateModel();
+  veThreadInitDelayed(replay_thread,d,0,0);
+  return d;
+}
+
+static VeDeviceDriver replay_drv = {
+  "replay", new_replay_dev, NULL
+};
+
+void veDeviceRecordInit() {
+  char *s;
+  veDeviceAddDriver(&replay_drv);
+  if ((s = veGetOption("event_record")))
+    veDeviceRecordStart(s);
+}
@@ -6,6 +6,7 @@
 
 #include <ve_alloc.h>
 #include <ve_device.h>
+#include <ve_thread.h>
 #include <ve_util.h>
 
 #define MODULE "ve_dev_spec"
@@ -101,3 +102,195 @@ int veDeviceMatchSpec(VeDeviceEvent *e, VeDeviceSpec *s) {
   /* all specified aspects matched */
   return 1;
 }
+
+/* Compiled spec lists.  Each entry's spec is reduced to interned ids
+   (0 for a wildcard) when the index is built.  The entries that match
+   a given device/element/type (and vector size, for the index part)
+   are then found by a scan of the compiled entries the first time an
+   event of that kind turns up and are kept in a hash table - so for
+   any event after the first it costs one lookup to find exactly the
+   entries to call. */
+#define SIDX_HASH  128  /* size of plan hash table (power of 2) */
+#define SIDX_MAX   4096 /* start over if there are more plans than this */
+
+struct ve_device_spec_entry {
+  VeDeviceSpec *spec;
+  void *data;
+  int device, elem;  /* interned ids - 0 is a wildcard */
+};
+
+struct ve_device_spec_plan {
+  int device, elem, type, vsize;
+  int n;
+  void **data;
+  struct ve_device_spec_plan *next;
+};
+
+struct ve_device_spec_index {
+  VeDeviceSpecIndexFill fill;
+  VeThrMutex *mutex;
+  volatile int gen;  /* bumped by each invalidation (mutex) */
+  int built;         /* generation that the entries were built for */
+  struct ve_device_spec_entry *entries;
+  int nentries, spc;
+  struct ve_device_spec_plan *volatile plans[SIDX_HASH];
+  int nplans;
+};
+
+static int is_wildcard(char *s) {
+  return (!s || strcmp(s,"*") == 0);
+}
+
+VeDeviceSpecIndex *veDeviceSpecIndexCreate(VeDeviceSpecIndexFill fill) {
+  VeDeviceSpecIndex *x;
+  x = veAllocObj(VeDeviceSpecIndex);
+  x->fill = fill;
+  x->mutex = veThrMutexCreate();
+  x->gen = 1;
+  x->built = 0;
+  return x;
+}
+
+void veDeviceSpecIndexAdd(VeDeviceSpecIndex *x, VeDeviceSpec *s, void *data) {
+  struct ve_device_spec_entry *e;
+  if (!s)
+    return; /* never matches */
+  if (x->nentries >= x->spc) {
+    x->spc = x->spc ? x->spc*2 : 16;
+    x->entries = veRealloc(x->entries,
+			   x->spc*sizeof(struct ve_device_spec_entry));
+  }
+  e = &(x->entries[x->nentries++]);
+  e->spec = s;
+  e->data = data;
+  e->device = is_wildcard(s->device) ? 0 : veDeviceIntern(s->device);
+  e->elem = is_wildcard(s->elem) ? 0 : veDeviceIntern(s->elem);
+}
+
+void veDeviceSpecIndexInvalidate(VeDeviceSpecIndex *x) {
+  veThrMutexLock(x->mutex);
+  x->gen++;
+  veThrMutexUnlock(x->mutex);
+}
+
+static int event_vsize(VeDeviceEvent *e) {
+  return (veDeviceEventType(e) == VE_ELEM_VECTOR) ? 
+    VE_EVENT_VECTOR(e)->size : 0;
+}
+
+int veDeviceSpecIndexChanged(VeDeviceSpecIndex *x, VeDeviceEvent *e,
+			     VeDeviceSpecMatch *m) {
+  return (x->gen != m->gen || e->device != m->device || e->elem != m->elem ||
+	  veDeviceEventType(e) != m->type || event_vsize(e) != m->vsize);
+}
+
+static void sidx_clear_plans(VeDeviceSpecIndex *x) {
+  struct ve_device_spec_plan *p;
+  int k;
+  for(k = 0; k < SIDX_HASH; k++) {
+    while ((p = x->plans[k])) {
+      x->plans[k] = p->next;
+      veFree(p->data);
+      veFree(p);
+    }
+  }
+  x->nplans = 0;
+}
+
+static unsigned sidx_hash(int device, int elem, int type, int vsize) {
+  unsigned h = (unsigned)device*2654435761U;
+  h ^= (unsigned)elem*40503U + (unsigned)(type+1)*977U + (unsigned)vsize;
+  return (h ^ (h >> 16)) & (SIDX_HASH-1);
+}
+
+/* work out which entries match events of this kind */
+static struct ve_device_spec_plan *sidx_plan(VeDeviceSpecIndex *x,
+					     int device, int elem,
+					     int type, int vsize) {
+  struct ve_device_spec_plan *p;
+  struct ve_device_spec_entry *e;
+  int k, tid;
+
+  /* an element part can match the element's name or its type */
+  tid = elem ? veDeviceIntern(etype_to_str(type)) : 0;
+
+  p = veAllocObj(struct ve_device_spec_plan);
+  p->device = device;
+  p->elem = elem;
+  p->type = type;
+  p->vsize = vsize;
+  p->data = veAlloc((x->nentries > 0 ? x->nentries : 1)*sizeof(void *),0);
+  for(k = 0, e = x->entries; k < x->nentries; k++, e++) {
+    if (e->device && e->device != device)
+      continue;
+    if (e->elem && (!elem || (e->elem != elem && e->elem != tid)))
+      continue;
+    if (e->spec->index >= 0 && type == VE_ELEM_VECTOR && 
+	e->spec->index >= vsize)
+      continue;
+    p->data[p->n++] = e->data;
+  }
+  return p;
+}
+
+static struct ve_device_spec_plan *sidx_find(VeDeviceSpecIndex *x, unsigned h,
+					     int device, int elem,
+					     int type, int vsize) {
+  struct ve_device_spec_plan *p;
+  for(p = x->plans[h]; p; p = p->next)
+    if (p->device == device && p->elem == elem && p->type == type &&
+	p->vsize == vsize)
+      break;
+  return p;
+}
+
+void veDeviceSpecIndexMatch(VeDeviceSpecIndex *x, VeDeviceEvent *e,
+			    VeDeviceSpecMatch *m) {
+  struct ve_device_spec_plan *p;
+  int device, elem, type, vsize;
+  unsigned h;
+
+  device = veDeviceEventDeviceId(e);
+  elem = veDeviceEventElemId(e);
+  type = veDeviceEventType(e);
+  vsize = event_vsize(e);
+  h = sidx_hash(device,elem,type,vsize);
+
+  /* The usual case - the index is up to date and we have seen this
+     kind of event before - needs no lock.  Plans are added at the head
+     of a chain after they are complete and are only freed when the
+     index is rebuilt, which (like everything else about processing
+     events) is serialized by the device layer. */
+  m->gen = x->gen;
+  if (x->built != m->gen || !(p = sidx_find(x,h,device,elem,type,vsize))) {
+    veThrMutexLock(x->mutex);
+    if (x->built != x->gen) {
+      /* rebuild */
+      x->built = x->gen;
+      sidx_clear_plans(x);
+      x->nentries = 0;
+      if (x->fill)
+	x->fill(x);
+    }
+    m->gen = x->built;
+    if (!(p = sidx_find(x,h,device,elem,type,vsize))) {
+      if (x->nplans >= SIDX_MAX) {
+	/* too many kinds of event - start again (as a new generation,
+	   so that nobody keeps using the old plans) */
+	sidx_clear_plans(x);
+	m->gen = x->built = ++(x->gen);
+      }
+      p = sidx_plan(x,device,elem,type,vsize);
+      p->next = x->plans[h];
+      x->plans[h] = p;
+      x->nplans++;
+    }
+    veThrMutexUnlock(x->mutex);
+  }
+  m->data = p->data;
+  m->n = p->n;
+  m->device = e->device;
+  m->elem = e->elem;
+  m->type = type;
+  m->vsize = vsize;
+}
@@ -23,6 +23,7 @@ VeDevice *veDeviceCreate(char *name) {
   d->name = veDupString(name);
   d->instance = NULL;
   d->model = NULL;
+  d->id = veDeviceIntern(name);
   return d;
 }
 
@@ -329,87 +330,3 @@ int veDeviceFunc(VeDevice *device, char *func, char *args,
     return -1; /* driver but no devfunc support */
   return device->instance->driver->devfunc(device,func,args,resp_r,rsz);
 }
-
-/* This is a special device and callback which is used to measure latency in the 
-   event system */
-static VeStatistic *event_latency_stat = NULL;
-static int event_latency = 0;
-
-#define LATENCY_DEV "_latency"
-#define LATENCY_ELEM "_test"
-
-static int latency_cback(VeDeviceEvent *e, void *arg) {
-  int now;
-  now = veClock();
-  event_latency = now-(e->timestamp);
-  veUpdateStatistic(event_latency_stat);
-  VE_DEBUGM(2,("latency_cback: received event"));
-  return VE_FILT_CONTINUE;
-}
-
-static void *latency_thread(void *v) {
-  VeDevice *d = (VeDevice *)v;
-  VeDeviceEvent *e;
-  int interval = 500000; /* update latency once per second */
-  while (1) {
-    veMicroSleep(interval);
-    VE_DEBUGM(2,("latency_thread: creating event"));
-    e = veDeviceEventCreate(VE_ELEM_TRIGGER,0);
-    e->device = veDupString(d->name);
-    e->elem = veDupString(LATENCY_ELEM);
-    e->timestamp = veClock();
-    veDeviceInsertEvent(e);
-  }
-}
-
-static VeDevice *new_latency_dev(VeDeviceDriver *driver, VeDeviceDesc *desc,
-				 VeStrMap override) {
-  VeDevice *d;
-
-  assert(desc != NULL);
-  assert(desc->name != NULL);
-  
-  VE_DEBUGM(1,("initializing event latency measurement driver"));
-  d = veDeviceCreate(desc->name);
-  d->instance = veDeviceInstanceInit(driver,NULL,desc,override);
-  d->model = NULL;
-
-  if (!event_latency_stat) {
-    event_latency_stat = veNewStatistic(MODULE, "event_latency", "msecs");
-    event_latency_stat->type = VE_STAT_INT;
-    event_latency_stat->data = &event_latency;
-    veAddStatistic(event_latency_stat);
-  }
-
-  /* add a callback */
-  veDeviceAddCallback(latency_cback,NULL,LATENCY_DEV "." LATENCY_ELEM);
-
-  veThreadInitDelayed(latency_thread,d,0,0);
-
-  return d;
-}
-
-static VeDeviceDriver latency_drv = {
-  "_latencydriver", new_latency_dev, NULL
-};
-
-static VeDeviceDesc latency_desc = {
-  "_latency", "_latencydriver", NULL
-};
-
-/* This initialization function sets up the device so it can be used, 
-   but does not set it running by default.  To generate latency
-   statistics:
-
-   use _latency
-
-   in your devices file, or
-
-   veDeviceUse("_latency")
-
-   in your program.
-*/
-void veDeviceLatencyInit() {
-  veDeviceAddDriver(&latency_drv);
-  veAddDeviceDesc(&latency_desc);
-}
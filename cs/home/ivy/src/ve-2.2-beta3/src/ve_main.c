@@ -499,7 +499,9 @@ static void *render_thread(void *arg) {
       redisplay_posted = 0;
       veThrMutexUnlock(display_mutex);
       veLockFrameExcl();
-      /* synchronize data */
+      /* synchronize data - everything up to the render command
+	 goes to the slaves together */
+      veMPBundleBegin();
       veMPLocationPush();
       veMPPushStateVar(VE_DTAG_ANY,VE_MP_AUTO);
       vePfEvent(MODULE,"render-start",NULL);
@@ -12,6 +12,8 @@
 #include <ve_debug.h>
 #include <ve_thread.h>
 #include <ve_render.h>
+#include <ve_stats.h>
+#include <ve_main.h>
 #include <ve_mp.h>
 
 #define MODULE "ve_mp"
@@ -57,6 +59,11 @@ typedef struct ve_mp_init_msg {
 } VeMPInitMsg;
 
 static void statevar_handler(int src, VeMPPkt *p);
+static void pool_stat_init(void);
+static void statevar_master_handler(int src, VeMPPkt *p);
+static void statevar_stat_init(void);
+static void statevar_replay(int k, VeMPImplConn c);
+static void bundle_init(void);
 
 static struct vemp_data_handler {
   int tag;
@@ -76,6 +83,19 @@ typedef struct vemp_loc_msg {
   VeFrame eye;
 } VeMPLocMsg;
 
+/* big-endian encoding for values in messages generated here */
+static void put32(unsigned char *b, unsigned long v) {
+  b[0] = (v >> 24) & 0xff;
+  b[1] = (v >> 16) & 0xff;
+  b[2] = (v >> 8) & 0xff;
+  b[3] = v & 0xff;
+}
+
+static unsigned long get32(unsigned char *b) {
+  return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16) |
+    ((unsigned long)b[2] << 8) | (unsigned long)b[3];
+}
+
 static char *mkunique(void) {
   static int cnt = 0;
   char str[128];
@@ -98,9 +118,16 @@ typedef struct vemp_slave {
   /* the is just a reference into vemp_nodes so we should not
      allocate/deallocate it here */
   VeThrMutex *mutex;
+  int mcast; /* slave has joined the multicast group */
+  /* a lost connection that has not been cleaned up yet - conn is
+     NULL from when the connection is lost until the slave has
+     rejoined */
+  VeMPImplConn lost;
 } VeMPSlave;
 static VeMPSlave slaves[MAX_SLAVES];
 static int slave_max = 0;
+static int vemp_mcast = 0; /* if non-zero, at least one slave is reachable
+			      by multicast */
 
 /* (1) Do I need these? and (2) If I do, where do they get called from? */
 void veMPLockSlave(int k) {
@@ -115,12 +142,134 @@ void veMPUnlockSlave(int k) {
 
 static VeThrMutex *slave_msg_mutex = NULL; /* synchronize slave msg handlers */
 
-/* handler for messages from one slave */
+/* rejoining slaves (see veMPDropSlave()) */
+static int rejoin = 1;          /* if 0, losing a slave is fatal */
+static long rejoin_ms = 1000;   /* first delay before restarting a slave */
+#define REJOIN_BACKOFF 16       /* ...which doubles up to this multiple */
+
+/* Messages that every slave must have seen (profile, environment).
+   The last one of each type is kept to replay to rejoining slaves.
+   A slave loads the profile and environment it was started with
+   itself, so anything pushed before there were any slaves is not
+   kept. */
+static struct vemp_sticky {
+  int msg;
+  void *data;
+  int dlen;
+  struct vemp_sticky *next;
+} *sticky = NULL;
+static VeThrMutex *sticky_mutex = NULL;
+
+static void sticky_save(int msg, void *data, int dlen) {
+  struct vemp_sticky *m;
+  if (slave_max == 0)
+    return;
+  if (!sticky_mutex)
+    sticky_mutex = veThrMutexCreate();
+  veThrMutexLock(sticky_mutex);
+  for(m = sticky; m; m = m->next)
+    if (m->msg == msg)
+      break;
+  if (!m) {
+    m = veAllocObj(struct vemp_sticky);
+    m->msg = msg;
+    m->next = sticky;
+    sticky = m;
+  }
+  veFree(m->data);
+  m->data = veAlloc(dlen,0);
+  memcpy(m->data,data,dlen);
+  m->dlen = dlen;
+  veThrMutexUnlock(sticky_mutex);
+}
+
+static int sticky_replay(VeMPImplConn c) {
+  struct vemp_sticky *m;
+  int k = 0;
+  if (!sticky_mutex)
+    return 0;
+  veThrMutexLock(sticky_mutex);
+  for(m = sticky; m && k == 0; m = m->next)
+    k = veMPImplSendv(c,0,VE_MP_RELIABLE,m->msg,0,m->data,m->dlen);
+  veThrMutexUnlock(sticky_mutex);
+  return k;
+}
+
+/* pass one message from slave k to the master handlers */
+static void slave_msg_dispatch(int k, VeMPImplConn c, VeMPPkt *p) {
+  struct vemp_int_handler *mh = NULL;
+
+  if (p->msg == VE_MPMSG__SYSDEP) {
+    /* implementation traffic (e.g. multicast repair requests) */
+    veMPImplSysdep(c,p);
+    veMPPktDestroy(p);
+    return;
+  }
+  /* look for a handler */
+  for(mh = mhandlers; mh; mh = mh->next)
+    if ((mh->msg == p->msg || mh->msg == VE_DMSG_ANY) &&
+	(mh->tag == p->tag || mh->tag == VE_DTAG_ANY))
+      break;
+  if (mh) {
+    VE_DEBUGM(5,("slave_msg_dispatch passing msg (%d,%d) to handler 0x%x",
+		 p->msg, p->tag, (unsigned)(mh->handler)));
+    mh->handler(k,p);
+  } else if (p->msg != VE_MPMSG_CTRL) {
+    veWarning(MODULE,"unhandled message from slave %d (%d,%d)",
+	      k,p->tag,p->msg);
+  }
+  veMPPktDestroy(p);
+}
+
+/* tell master handlers that something has happened to slave k */
+static void slave_ctrl(int k, int tag) {
+  VeMPPkt *p;
+  p = veMPPktCreate(0);
+  p->msg = VE_MPMSG_CTRL;
+  p->tag = tag;
+  slave_msg_dispatch(k,NULL,p);
+}
+
+static void *slave_rejoin_thread(void *x);
+
+/* Connection c to slave k has failed.  Stop sending to the slave
+   and start it again in the background.  The connection itself is
+   cleaned up by the rejoin thread so that this is safe to call from
+   the connection's own message thread or handlers.  Returns
+   non-zero if c is no longer the slave's connection anyway. */
+static int slave_lost(int k, VeMPImplConn c) {
+  if (strcmp(slaves[k].method,VE_MP_THREAD) == 0)
+    /* shares our address space - nothing to restart */
+    veFatalError(MODULE,"lost connection to thread slave %d",k);
+  veThrMutexLock(slaves[k].mutex);
+  if (!c || slaves[k].conn != c) {
+    veThrMutexUnlock(slaves[k].mutex);
+    return -1; /* already dealt with */
+  }
+  slaves[k].conn = NULL;
+  slaves[k].lost = c;
+  slaves[k].mcast = 0;
+  veThrMutexUnlock(slaves[k].mutex);
+  veWarning(MODULE,"lost connection to slave %d (%s,%s)",
+	    k,slaves[k].node,slaves[k].process);
+  veThreadInit(NULL,slave_rejoin_thread,(void *)(long)k,0,0);
+  return 0;
+}
+
+int veMPDropSlave(int k) {
+  if (!veMPIsMaster() || k < 0 || k >= slave_max || !slaves[k].inuse ||
+      strcmp(slaves[k].method,VE_MP_THREAD) == 0)
+    return -1;
+  return slave_lost(k,slaves[k].conn);
+}
+
+/* handler for messages from one slave - used when the implementation
+   has no reactor to watch the connection for us */
 static void *slave_msg_thread(void *x) {
   /* handle messages returned from slave */
   VeMPImplConn c, c_res;
   VeMPPkt *p;
-  int k = (int)x;
+  int k = (int)(long)x;
 
   /* create initial set */
   c = slaves[k].conn;
@@ -128,112 +277,236 @@ static void *slave_msg_thread(void *x) {
   while (veMPImplWait(&c,&c_res,1) == 0) {
     /* process all pending connections */
     if (c_res) {
-      struct vemp_int_handler *mh = NULL;
-
-      if (veMPImplRecv(c_res,&p,-1))
+      if (veMPImplRecv(c_res,&p,-1)) {
+	if (rejoin) {
+	  slave_lost(k,c);
+	  return NULL;
+	}
 	veFatalError(MODULE,"failed to read message from slave %d",
 		     slaves[k].id);
-      /* look for a handler */
-      for(mh = mhandlers; mh; mh = mh->next)
-	if ((mh->msg == p->msg || mh->msg == VE_DMSG_ANY) &&
-	    (mh->tag == p->tag || mh->tag == VE_DTAG_ANY))
-	    break;
-      if (mh) {
-	VE_DEBUGM(5,("slave_msg_thread passing msg (%d,%d) to handler 0x%x",
-		     p->msg, p->tag, (unsigned)(mh->handler)));
-	mh->handler(k,p);
-      } else {
-	veWarning(MODULE,"unhandled message from slave %d (%d,%d)",
-		  k,p->tag,p->msg);
       }
-      veMPPktDestroy(p);
+      slave_msg_dispatch(k,c_res,p);
     }
   }
+  if (rejoin) {
+    slave_lost(k,c);
+    return NULL;
+  }
   veFatalError(MODULE,"failed to wait on connection %d: %s",k,veSysError());
   return NULL;
 }
 
-static void *msg_thread(void *x) {
-  VeMPImplConn conn = (VeMPImplConn)x;
+/* called from the implementation's reactor when slave k has input */
+static void slave_msg_ready(VeMPImplConn c, void *x) {
   VeMPPkt *p;
-  struct vemp_data_handler *dh;
-  struct vemp_int_handler *sh;
+  int k = (int)(long)x;
+  int r;
+
+  while ((r = veMPImplRecv(c,&p,0)) == 0)
+    slave_msg_dispatch(k,c,p);
+  if (r < 0) {
+    if (rejoin)
+      slave_lost(k,c);
+    else
+      veFatalError(MODULE,"failed to read message from slave %d",
+		   slaves[k].id);
+  }
+}
 
-  VE_DEBUGM(5,("msg_thread starting for process",veMPId()));
-  
-  /* do not do anything with timeouts for now... */
-  while (veMPImplRecv(conn,&p,-1) == 0) {
-    VE_DEBUGM(3,("received MP message (%d,%d)",veMPId(),p->msg,p->tag));
+/* start listening to a slave's connection */
+static void slave_listen(int k, VeMPImplConn c) {
+  if (veMPImplWatch(c,slave_msg_ready,(void *)(long)k))
+    veThreadInit(NULL,slave_msg_thread,(void *)(long)k,0,0);
+}
 
-    /* look for a general handler first... */
-    for(sh = shandlers; sh; sh = sh->next)
-      if ((sh->msg == p->msg || sh->msg == VE_DMSG_ANY) &&
-	  (sh->tag == p->tag || sh->tag == VE_DTAG_ANY))
-	break;
-    if (sh) {
-      VE_DEBUGM(5,("msg_thread passing msg (%d,%d) to handler 0x%x",
-		  p->msg, p->tag, (unsigned)(sh->handler)));
-      sh->handler(VE_MPTARG_MASTER,p);
-      veMPPktDestroy(p);
+/* bring back a slave whose connection has been lost */
+static void *slave_rejoin_thread(void *x) {
+  int k = (int)(long)x;
+  VeMPImplConn c;
+  VeMPInitMsg m;
+  char **argv, str[80];
+  long wait = rejoin_ms;
+
+  slave_ctrl(k,VE_MPCTRL_LOST);
+  veMPImplDestroy(slaves[k].lost);
+  slaves[k].lost = NULL;
+  if (!rejoin)
+    return NULL; /* dropped for good */
+
+  /* same arguments as the original slave */
+  argv = veAlloc((vemp_argc+1)*sizeof(char *),0);
+  memcpy(argv,vemp_argv,(vemp_argc+1)*sizeof(char *));
+  sprintf(str,"%d",slaves[k].id);
+  argv[VEMP_SLAVE_ARG] = str;
+  strncpy(m.process,slaves[k].process,INIT_NAMESZ);
+  m.process[INIT_NAMESZ-1] = '\0';
+  strncpy(m.node,slaves[k].node,INIT_NAMESZ);
+  m.node[INIT_NAMESZ-1] = '\0';
+
+  for(;;) {
+    veMicroSleep(wait*1000);
+    if (wait < rejoin_ms*REJOIN_BACKOFF)
+      wait *= 2;
+    VE_DEBUGM(1,("restarting slave %d (%s,%s)",k,
+		 slaves[k].node,slaves[k].process));
+    if (!(c = veMPImplCreate(slaves[k].method,k,slaves[k].node,
+			     vemp_argc,argv))) {
+      veWarning(MODULE,"failed to restart slave %d - will try again",k);
+      continue;
+    }
+    if (veMPImplPrepare(c,0) ||
+	veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG_INIT,0,&m,sizeof(m)) ||
+	sticky_replay(c)) {
+      veWarning(MODULE,"failed to initialize restarted slave %d - "
+		"will try again",k);
+      veMPImplDestroy(c);
       continue;
     }
+    break;
+  }
+  veFree(argv);
+
+  /* state variables go out with the connection being made available,
+     so that no update is missed in between */
+  statevar_replay(k,c);
+  slave_listen(k,c);
+  veNotice(MODULE,"slave %d (%s,%s) has rejoined",k,
+	   slaves[k].node,slaves[k].process);
+  slave_ctrl(k,VE_MPCTRL_JOINED);
+  return NULL;
+}
 
-    VE_DEBUGM(5,("msg_thread trying default handlers"));
+static void unbundle(VeMPImplConn conn, VeMPPkt *p);
 
-    /* try default handlers... */
-    switch (p->msg) {
-    case VE_MPMSG_DATA:
-      for(dh = dhandlers; dh; dh = dh->next)
-	if (dh->tag == p->tag || dh->tag == VE_DTAG_ANY)
-	  break;
-      if (dh)
-	dh->handler(p->tag,p->data,p->dlen);
-      else 
-	veError(MODULE,"unhandled data message tag: %d",p->tag);
-      break;
+/* messages held back on a slave (see veMPHoldMsgs()) */
+struct vemp_held {
+  VeMPImplConn conn;
+  VeMPPkt *p;
+  struct vemp_held *next;
+};
+static VeMPHoldProc hold_pass = NULL;
+static struct vemp_held *held_head = NULL, *held_tail = NULL;
+
+static void hold_msg(VeMPImplConn conn, VeMPPkt *p) {
+  struct vemp_held *h;
+  h = veAllocObj(struct vemp_held);
+  assert(h != NULL);
+  /* packet may be part of a bundle - take a copy */
+  h->p = veMPPktCreate(p->dlen);
+  h->p->seq = p->seq;
+  h->p->ch = p->ch;
+  h->p->msg = p->msg;
+  h->p->tag = p->tag;
+  if (p->dlen > 0)
+    memcpy(h->p->data,p->data,p->dlen);
+  h->conn = conn;
+  h->next = NULL;
+  if (held_tail)
+    held_tail->next = h;
+  else
+    held_head = h;
+  held_tail = h;
+}
 
-    case VE_MPMSG_LOCATION:
-      if (!veMPIsMaster()) {
-	VeMPLocMsg *msg = (VeMPLocMsg *)(p->data);
-	*(veGetOrigin()) = msg->origin;
-	*(veGetDefaultEye()) = msg->eye;
-      }
-      break;
+/* handle a message from the master - does not destroy the packet */
+static void dispatch_msg(VeMPImplConn conn, VeMPPkt *p) {
+  struct vemp_data_handler *dh;
+  struct vemp_int_handler *sh;
 
-    case VE_MPMSG_ENV:
-      if (!veMPIsMaster()) {
-	FILE *f = tmpfile();
-	assert(f != NULL);
-	VE_DEBUGM(2,("received environment message"));
-	fwrite(p->data,p->dlen,1,f);
-	rewind(f);
-	veBlueEvalStream(f);
-	fclose(f);
-	VE_DEBUGM(2,("finished environment message"));
-      }
-      break;
-    case VE_MPMSG_PROFILE:
-      if (!veMPIsMaster()) {
-	FILE *f = tmpfile();
-	assert(f != NULL);
-	VE_DEBUGM(2,("received profile message"));
-	fwrite(p->data,p->dlen,1,f);
-	rewind(f);
-	veBlueEvalStream(f);
-	fclose(f);
-	VE_DEBUGM(2,("finished profile message"));
-      }
-      break;
-    case VE_MPMSG__SYSDEP:
-      veMPImplSysdep(conn,p);
+  if (p->msg == VE_MPMSG_BUNDLE) {
+    /* bundles are transparent to handlers */
+    unbundle(conn,p);
+    return;
+  }
+
+  if (hold_pass && !hold_pass(p)) {
+    hold_msg(conn,p);
+    return;
+  }
+
+  /* look for a general handler first... */
+  for(sh = shandlers; sh; sh = sh->next)
+    if ((sh->msg == p->msg || sh->msg == VE_DMSG_ANY) &&
+	(sh->tag == p->tag || sh->tag == VE_DTAG_ANY))
       break;
-    default:
-      veError(MODULE,"unhandled message type: %d",p->msg);
+  if (sh) {
+    VE_DEBUGM(5,("msg_thread passing msg (%d,%d) to handler 0x%x",
+		p->msg, p->tag, (unsigned)(sh->handler)));
+    sh->handler(VE_MPTARG_MASTER,p);
+    return;
+  }
+
+  VE_DEBUGM(5,("msg_thread trying default handlers"));
+
+  /* try default handlers... */
+  switch (p->msg) {
+  case VE_MPMSG_DATA:
+    for(dh = dhandlers; dh; dh = dh->next)
+      if (dh->tag == p->tag || dh->tag == VE_DTAG_ANY)
+	break;
+    if (dh)
+      dh->handler(p->tag,p->data,p->dlen);
+    else 
+      veError(MODULE,"unhandled data message tag: %d",p->tag);
+    break;
+
+  case VE_MPMSG_LOCATION:
+    if (!veMPIsMaster()) {
+      VeMPLocMsg *msg = (VeMPLocMsg *)(p->data);
+      *(veGetOrigin()) = msg->origin;
+      *(veGetDefaultEye()) = msg->eye;
     }
-    if (p)
-      veMPPktDestroy(p);
+    break;
+
+  case VE_MPMSG_ENV:
+    if (!veMPIsMaster()) {
+      FILE *f = tmpfile();
+      assert(f != NULL);
+      VE_DEBUGM(2,("received environment message"));
+      fwrite(p->data,p->dlen,1,f);
+      rewind(f);
+      veBlueEvalStream(f);
+      fclose(f);
+      VE_DEBUGM(2,("finished environment message"));
+    }
+    break;
+  case VE_MPMSG_PROFILE:
+    if (!veMPIsMaster()) {
+      FILE *f = tmpfile();
+      assert(f != NULL);
+      VE_DEBUGM(2,("received profile message"));
+      fwrite(p->data,p->dlen,1,f);
+      rewind(f);
+      veBlueEvalStream(f);
+      fclose(f);
+      VE_DEBUGM(2,("finished profile message"));
+    }
+    break;
+  case VE_MPMSG__SYSDEP:
+    veMPImplSysdep(conn,p);
+    break;
+  default:
+    veError(MODULE,"unhandled message type: %d",p->msg);
+  }
+}
+
+static void *msg_thread(void *x) {
+  VeMPImplConn conn = (VeMPImplConn)x;
+  VeMPPkt *p;
+
+  VE_DEBUGM(5,("msg_thread starting for process",veMPId()));
+  
+  /* do not do anything with timeouts for now... */
+  while (veMPImplRecv(conn,&p,-1) == 0) {
+    VE_DEBUGM(3,("received MP message (%d,%d)",veMPId(),p->msg,p->tag));
+    dispatch_msg(conn,p);
+    veMPPktDestroy(p);
   }
   VE_DEBUGM(1,("[%2x] message thread finishing",veMPId()));
+  if (conn == vemp_conn && !veMPIsMaster())
+    /* nothing to do without a master - the master restarts us
+       if it wants us back */
+    veFatalError(MODULE,"lost connection to master");
   veMPImplDestroy(conn);
   if (conn == vemp_conn)
     vemp_conn = NULL;
@@ -282,13 +555,21 @@ int veMPSlaveInit(int *argc, char **argv) {
       veFatalError(MODULE,"[%2d] failed to establish connection with master",
 		   vemp_id);
 
-    /* first message we receive (at the upper layer) should be init */
+    /* first message we receive (at the upper layer) should be init -
+       the master checks the connection (implementation messages)
+       before sending it */
     {
       VeMPInitMsg *m;
       VeMPPkt *p;
-      if (veMPImplRecv(vemp_conn,&p,-1))
-	veFatalError(MODULE,"[%2d] failed to receive initialization packed",
-		     vemp_id);
+      for(;;) {
+	if (veMPImplRecv(vemp_conn,&p,-1))
+	  veFatalError(MODULE,"[%2d] failed to receive initialization packed",
+		       vemp_id);
+	if (p->msg != VE_MPMSG__SYSDEP)
+	  break;
+	veMPImplSysdep(vemp_conn,p);
+	veMPPktDestroy(p);
+      }
       if (p->msg != VE_MPMSG_INIT)
 	veFatalError(MODULE,"[%2d] expected init (0x%x) got 0x%x",
 		     vemp_id, VE_MPMSG_INIT, p->msg);
@@ -384,6 +665,8 @@ int veMPGetSlave(char *node, char *process, int allow_fail) {
     slaves[k].method = VE_MP_REMOTE; /* some other node */
   }
   slaves[k].mutex = veThrMutexCreate();
+  slaves[k].mcast = 0;
+  slaves[k].lost = NULL;
   {
     /* create arg list */
     char str[80];
@@ -412,7 +695,7 @@ int veMPGetSlave(char *node, char *process, int allow_fail) {
   {
     /* initialize slave */
     VeMPInitMsg m;
-    if (slaves[k].method == VE_MP_THREAD) {
+    if (strcmp(slaves[k].method,VE_MP_THREAD) == 0) {
       /* this is a local slave - we have no special connection to it */
       /* it is also *not* waiting for an init message,
 	 so we just fake the effects */
@@ -422,6 +705,27 @@ int veMPGetSlave(char *node, char *process, int allow_fail) {
       if (!vemp_slave_node)
 	vemp_slave_node = veDupString(slaves[k].node);
     } else {
+      /* let implementation layer do its work, if it so desires
+	 - e.g. the remote implementation checks that the slave
+	 speaks the same wire format and may setup the "FAST"
+	 channel.  This comes first, so that a slave that cannot
+	 understand us is rejected before it is sent anything else. */
+      VE_DEBUGM(1,("veMPGetSlave - preparing slave %d",k));
+      if (veMPImplPrepare(slaves[k].conn,0)) {
+	if (allow_fail) {
+	  veError(MODULE,"veMPGetSlave - failed to prepare slave %d (%s,%s)",
+		  k, slaves[k].node, slaves[k].process);
+	  veMPImplDestroy(slaves[k].conn);
+	  slaves[k].conn = NULL;
+	  veFree(slaves[k].node);
+	  veFree(slaves[k].process);
+	  veThrMutexDestroy(slaves[k].mutex);
+	  slaves[k].inuse = 0; /* allow slot to be reused */
+	  return -1;
+	}
+	veFatalError(MODULE,"veMPGetSlave - failed to prepare slave %d (%s,%s)",
+		     k, slaves[k].node, slaves[k].process);
+      }
       /* an independent process (local or remote) has been created
 	 and now we need to tell it "who" it is */
       VE_DEBUGM(1,("veMPGetSlave - initializing independent slave %d",k));
@@ -432,18 +736,20 @@ int veMPGetSlave(char *node, char *process, int allow_fail) {
       if (veMPSendMsg(VE_MP_RELIABLE,k,VE_MPMSG_INIT,0,
 		      &m,sizeof(m)))
 	veFatalError(MODULE,"veMPGetSlave - failed to initialize slave %d",k);
-      /* let implementation layer do its work, if it so desires
-	 - e.g. the remote implementation may setup the "FAST"
-	 channel */
-      VE_DEBUGM(1,("veMPGetSlave - preparing slave %d",k));
-      if (veMPImplPrepare(slaves[k].conn,0))
-	veFatalError(MODULE,"veMPGetSlave - failed to prepare slave %d",k);
+      /* if we can, add the slave to the multicast group - otherwise
+	 it just gets its own copy of everything */
+      if (veMPImplMcastCreate() == 0 &&
+	  veMPImplMcastJoin(slaves[k].conn) == 0) {
+	VE_DEBUGM(1,("veMPGetSlave - slave %d joined multicast group",k));
+	slaves[k].mcast = 1;
+	vemp_mcast = 1;
+      }
     }
   }
   
   VE_DEBUGM(1,("veMPGetSlave - initializing message thread for slave %d",k));
   /* setup handler for incoming slave messages */
-  veThreadInit(NULL,slave_msg_thread,(void *)k,0,0);
+  slave_listen(k,slaves[k].conn);
 
   /* connection is ready to go */
   return k;
@@ -471,8 +777,27 @@ int veMPInit(void) {
 
   VE_DEBUGM(2,("veMPInit enter"));
 
+  /* receive-side packet pooling (on unless turned off) */
+  {
+    char *s;
+    if ((s = veGetOption("mp_pktpool")))
+      veMPSetPktPooling(atoi(s));
+  }
+  pool_stat_init();
+
+  {
+    char *s;
+    if ((s = veGetOption("mp_rejoin")))
+      rejoin = atoi(s);
+    if ((s = veGetOption("mp_rejoin_ms")) && atoi(s) > 0)
+      rejoin_ms = atoi(s);
+  }
+
   /* add internal handler for state variables */
+  statevar_stat_init();
+  bundle_init();
   veMPAddSlaveHandler(VE_MPMSG_STATE,VE_DTAG_ANY,statevar_handler);
+  veMPAddMasterHandler(VE_MPMSG_STATE,VE_DTAG_ANY,statevar_master_handler);
 
   if (!vemp_is_master) {
     /* set-up incoming message thread */
@@ -554,6 +879,7 @@ int veMPEnvPush(void) {
     veFatalError(MODULE,"veMPEnvPush: failed to retrieve data from temporary file: %s",
 		 veSysError());
   fclose(f);
+  sticky_save(VE_MPMSG_ENV,buf,sz);
   k = veMPIntPush(VE_MPTARG_ALL,VE_MP_RELIABLE,VE_MPMSG_ENV,0,buf,sz);
   veFree(buf);
   return k;
@@ -580,6 +906,7 @@ int veMPProfilePush(void) {
     veFatalError(MODULE,"veMPProfilePush: failed to retrieve data from temporary file: %s",
 		 veSysError());
   fclose(f);
+  sticky_save(VE_MPMSG_PROFILE,buf,sz);
   k = veMPIntPush(VE_MPTARG_ALL,VE_MP_RELIABLE,VE_MPMSG_PROFILE,0,buf,sz);
   veFree(buf);
   return k;
@@ -630,16 +957,209 @@ int veMPIntPushToMaster(int ch, int msg, int tag, void *data, int dlen) {
   return 0;
 }
 
-/* ignore sequence numbers for now */
+/* bundles */
+/* A bundle is a sequence of sub-messages, each with a header
+   (big-endian):
+   0   2  message id
+   2   2  (reserved - 0)
+   4   4  tag (signed)
+   8   4  payload length
+   12  4  (reserved - 0)
+   16  .. payload, padded to a multiple of BUNDLE_ALIGN so that
+          the next header (and payload) is aligned
+*/
+#define BUNDLE_HDRSZ 16
+#define BUNDLE_ALIGN 8
+#define BUNDLE_MAX   30000 /* keep this within what the implementation
+			      will send as a single packet (MAX_PAYLOAD
+			      for ve_mp_posix) */
+#define BUNDLE_PAD(x) (((x) + BUNDLE_ALIGN - 1) & ~(BUNDLE_ALIGN - 1))
+
+static VeThrMutex *bundle_mutex = NULL;
+static int bundle_mode = 1;   /* use bundles at all? */
+static int bundle_open = 0;   /* collecting? */
+static int bundle_owner = 0;  /* thread that opened the bundle */
+static unsigned char *bundle_buf = NULL;
+static int bundle_len = 0;    /* bytes in bundle_buf */
+static int bundle_cnt = 0;    /* messages in bundle_buf */
+static int bundle_first_msg, bundle_first_tag; /* in case there's only one */
+
+static int int_push(int target, int ch, int msg, int tag, void *data,
+		    int dlen);
+
+static void bundle_init(void) {
+  char *s;
+  if ((s = veGetOption("mp_bundle")))
+    bundle_mode = atoi(s);
+  if (bundle_mode) {
+    bundle_mutex = veThrMutexCreate();
+    bundle_buf = veAlloc(BUNDLE_MAX,0);
+  }
+}
+
+/* call with bundle_mutex held */
+static int bundle_flush(void) {
+  int k = 0;
+  if (bundle_cnt == 1) {
+    /* not worth wrapping */
+    k = int_push(VE_MPTARG_ALL,VE_MP_MCAST,bundle_first_msg,bundle_first_tag,
+		 bundle_buf+BUNDLE_HDRSZ,get32(bundle_buf+8));
+  } else if (bundle_cnt > 1) {
+    VE_DEBUGM(5,("flushing bundle: %d messages, %d bytes",bundle_cnt,
+		 bundle_len));
+    k = int_push(VE_MPTARG_ALL,VE_MP_MCAST,VE_MPMSG_BUNDLE,0,
+		 bundle_buf,bundle_len);
+  }
+  bundle_len = bundle_cnt = 0;
+  return k;
+}
+
+/* call with bundle_mutex held - returns non-zero if the message 
+   cannot be bundled */
+static int bundle_add(int msg, int tag, void *data, int dlen) {
+  unsigned char *b;
+  if (!data || dlen < 0)
+    dlen = 0;
+  if (BUNDLE_HDRSZ + BUNDLE_PAD(dlen) > BUNDLE_MAX)
+    return 1; /* would never fit */
+  if (bundle_len + BUNDLE_HDRSZ + BUNDLE_PAD(dlen) > BUNDLE_MAX)
+    bundle_flush(); /* start a new bundle */
+  b = bundle_buf + bundle_len;
+  put32(b,((unsigned long)msg & 0xffff) << 16);
+  put32(b+4,(unsigned long)tag);
+  put32(b+8,(unsigned long)dlen);
+  put32(b+12,0);
+  if (dlen > 0)
+    memcpy(b+BUNDLE_HDRSZ,data,dlen);
+  if (bundle_cnt == 0) {
+    bundle_first_msg = msg;
+    bundle_first_tag = tag;
+  }
+  bundle_len += BUNDLE_HDRSZ + BUNDLE_PAD(dlen);
+  bundle_cnt++;
+  return 0;
+}
+
+int veMPBundleBegin(void) {
+  if (!bundle_mode || !vemp_is_master)
+    return 0;
+  veThrMutexLock(bundle_mutex);
+  bundle_open = 1;
+  bundle_owner = veThreadId();
+  veThrMutexUnlock(bundle_mutex);
+  return 0;
+}
+
+int veMPBundleEnd(void) {
+  int k;
+  if (!bundle_mode || !vemp_is_master)
+    return 0;
+  veThrMutexLock(bundle_mutex);
+  k = bundle_flush();
+  bundle_open = 0;
+  veThrMutexUnlock(bundle_mutex);
+  return k;
+}
+
+/* slave: dispatch the contents of a bundle in order */
+static void unbundle(VeMPImplConn conn, VeMPPkt *p) {
+  unsigned char *b = (unsigned char *)(p->data);
+  unsigned long v;
+  VeMPPkt sub;
+  int n = 0;
+
+  while (n + BUNDLE_HDRSZ <= p->dlen) {
+    sub = *p;
+    sub.msg = (get32(b+n) >> 16) & 0xffff;
+    v = get32(b+n+4);
+    sub.tag = (v & 0x80000000UL) ? -(int)((~v & 0xffffffffUL) + 1) : (int)v;
+    sub.dlen = get32(b+n+8);
+    if (sub.dlen < 0 || sub.dlen > p->dlen - n - BUNDLE_HDRSZ) {
+      veError(MODULE,"corrupt bundle (sub-message of %d bytes at %d)",
+	      sub.dlen,n);
+      return;
+    }
+    sub.data = (sub.dlen > 0) ? b+n+BUNDLE_HDRSZ : NULL;
+    if (sub.msg == VE_MPMSG_BUNDLE)
+      veError(MODULE,"ignoring nested bundle");
+    else
+      dispatch_msg(conn,&sub);
+    n += BUNDLE_HDRSZ + BUNDLE_PAD(sub.dlen);
+  }
+}
+
+void veMPHoldMsgs(VeMPHoldProc pass) {
+  hold_pass = pass;
+}
+
+void veMPReleaseMsgs(void) {
+  struct vemp_held *h;
+  hold_pass = NULL;
+  /* a released message may start holding again, in which case
+     everything after it stays where it is */
+  while (!hold_pass && (h = held_head)) {
+    if (!(held_head = h->next))
+      held_tail = NULL;
+    dispatch_msg(h->conn,h->p);
+    veMPPktDestroy(h->p);
+    veFree(h);
+  }
+}
+
 int veMPIntPush(int target, int ch, int msg, int tag, void *data, int dlen) {
+  int k;
+  /* only the thread that opened the bundle collects into it - other
+     threads (e.g. message handlers) are not part of the frame */
+  if (bundle_open && bundle_owner == veThreadId()) {
+    veThrMutexLock(bundle_mutex);
+    if (bundle_open) {
+      if (target == VE_MPTARG_ALL && 
+	  (ch == VE_MP_FAST || ch == VE_MP_MCAST) &&
+	  bundle_add(msg,tag,data,dlen) == 0) {
+	veThrMutexUnlock(bundle_mutex);
+	return 0;
+      }
+      /* anything else goes after what we already have */
+      if ((k = bundle_flush())) {
+	veThrMutexUnlock(bundle_mutex);
+	return k;
+      }
+    }
+    veThrMutexUnlock(bundle_mutex);
+  }
+  return int_push(target,ch,msg,tag,data,dlen);
+}
+
+/* ignore sequence numbers for now */
+static int int_push(int target, int ch, int msg, int tag, void *data,
+		    int dlen) {
   if (target == VE_MPTARG_ALL) {
-    int k;
+    int k, mc = 0;
     VE_DEBUGM(5,("MPIntPush(all,%d,%d,%d) %d bytes",ch,msg,tag,dlen));
+    if ((ch == VE_MP_FAST || ch == VE_MP_MCAST) && vemp_mcast) {
+      /* one send for all slaves in the group */
+      if ((k = veMPImplMcastSend(msg,tag,data,dlen)) == 0)
+	mc = 1;
+      else if (k < 0) {
+	veWarning(MODULE,"multicast failed - falling back to unicast");
+	vemp_mcast = 0;
+      }
+    }
     for(k = 0; k < slave_max; k++) {
-      if (slaves[k].inuse) {
+      if (slaves[k].inuse && !(mc && slaves[k].mcast)) {
 	veThrMutexLock(slaves[k].mutex);
+	if (!slaves[k].conn) {
+	  /* lost - it will be brought up to date when it rejoins */
+	  veThrMutexUnlock(slaves[k].mutex);
+	  continue;
+	}
 	if (veMPImplSendv(slaves[k].conn,0,ch,msg,tag,data,dlen)) {
+	  VeMPImplConn c = slaves[k].conn;
 	  veThrMutexUnlock(slaves[k].mutex);
+	  if (rejoin && strcmp(slaves[k].method,VE_MP_THREAD)) {
+	    slave_lost(k,c); /* carry on with the others */
+	    continue;
+	  }
 	  veError(MODULE,"ImplSend(target=%d,msg=%d,tag=%d) - %s",
 		  k,msg,tag,veSysError());
 	  return -1;
@@ -653,7 +1173,16 @@ int veMPIntPush(int target, int ch, int msg, int tag, void *data, int dlen) {
     VE_DEBUGM(5,("MPIntPush(%d,%d,%d,%d) %d bytes",ch,target,msg,tag,dlen));
     if (target >= 0 && target < slave_max && slaves[target].inuse) {
       veThrMutexLock(slaves[target].mutex);
-      if ((k = veMPImplSendv(slaves[target].conn,0,ch,msg,tag,data,dlen))) {
+      if (!slaves[target].conn) {
+	VE_DEBUGM(5,("MPIntPush: dropping message for lost slave %d",target));
+	k = 0;
+      } else if ((k = veMPImplSendv(slaves[target].conn,0,ch,msg,tag,data,dlen))) {
+	if (rejoin && strcmp(slaves[target].method,VE_MP_THREAD)) {
+	  VeMPImplConn c = slaves[target].conn;
+	  veThrMutexUnlock(slaves[target].mutex);
+	  slave_lost(target,c);
+	  return 0;
+	}
 	veError(MODULE,"ImplSend(target=%d,msg=%d,tag=%d) - %s",
 		k,msg,tag,veSysError());
       } 
@@ -732,8 +1261,36 @@ static struct vemp_statevar {
   void *var;
   int vlen;
   int flags;
+  /* VE_MP_DELTA only */
+  unsigned long version; /* master: last version sent
+			    slave: version currently in var */
+  void *shadow;     /* master: copy of what the slaves should have */
+  unsigned char *buf; /* master: message being built */
+  int since_key;    /* master: pushes since last keyframe */
+  int force_key;    /* master: next push must be a keyframe */
+  int asked_key;    /* slave: we have asked for a keyframe */
   struct vemp_statevar *next;
 } *statevars = NULL;
+static VeThrMutex *statevar_mutex = NULL;
+
+/* VE_MP_DELTA message layout (all values big-endian):
+   0   1  type (SV_KEY or SV_DELTA)
+   1   3  (reserved - 0)
+   4   4  version
+   8   4  base version (SV_DELTA only)
+   12  .. SV_KEY: the whole variable
+          SV_DELTA: sequence of <offset:4> <length:4> <bytes>
+*/
+#define SV_KEY    1
+#define SV_DELTA  2
+#define SV_HDRSZ  12
+#define SV_RANGESZ 8  /* overhead per changed range */
+#define SV_BLOCK  64  /* unchanged blocks of this size are skipped quickly */
+static int sv_keyframe = 60; /* pushes between keyframes */
+
+/* bytes of state sent by the last automatic (per-frame) push */
+static int sv_bytes = 0;
+static VeStatistic *sv_bytes_stat = NULL;
 
 int veMPAddStateVar(int tag, void *var, int vlen, int flags) {
   struct vemp_statevar *v;
@@ -741,41 +1298,220 @@ int veMPAddStateVar(int tag, void *var, int vlen, int flags) {
     return -1; /* tag must be >= 0 */
   if (!var || vlen <= 0)
     return -1; /* invalid args */
+  if (!statevar_mutex)
+    statevar_mutex = veThrMutexCreate();
+  veThrMutexLock(statevar_mutex);
   for(v = statevars; v; v = v->next) {
-    if (v->tag == tag) {
-      /* update this one */
-      v->var = var;
-      v->vlen = vlen;
-      v->flags = flags;
-      return 0;
-    }
+    if (v->tag == tag)
+      break;
+  }
+  if (!v) {
+    /* add a new element to the list */
+    v = veAllocObj(struct vemp_statevar);
+    v->tag = tag;
+    v->next = statevars;
+    statevars = v;
+  } else if (v->vlen != vlen) {
+    /* update this one */
+    veFree(v->shadow);
+    veFree(v->buf);
+    v->shadow = NULL;
+    v->buf = NULL;
   }
-  /* add a new element to the list */
-  v = veAllocObj(struct vemp_statevar);
-  v->tag = tag;
   v->var = var;
   v->vlen = vlen;
   v->flags = flags;
-  v->next = statevars;
-  statevars = v;
+  v->since_key = 0;
+  v->force_key = 1; /* slaves start from whatever is in their copy */
+  if ((flags & VE_MP_DELTA) && !v->shadow) {
+    v->shadow = veAlloc(vlen,1);
+    v->buf = veAlloc(SV_HDRSZ+vlen,0);
+  }
+  veThrMutexUnlock(statevar_mutex);
   return 0;
 }
 
+/* builds the next message for a VE_MP_DELTA state variable in v->buf
+   and returns its size, or 0 if nothing needs to be sent */
+static int statevar_delta(struct vemp_statevar *v) {
+  unsigned char *cur = (unsigned char *)(v->var);
+  unsigned char *old = (unsigned char *)(v->shadow);
+  unsigned char *b = v->buf;
+  int max = SV_HDRSZ + v->vlen;
+  int k, n, start, end, len;
+
+  if (v->force_key || ++(v->since_key) >= sv_keyframe) {
+    /* keyframe */
+    v->force_key = 0;
+    v->since_key = 0;
+    b[0] = SV_KEY;
+    b[1] = b[2] = b[3] = 0;
+    v->version = (v->version + 1) & 0xffffffffUL;
+    put32(b+4,v->version);
+    put32(b+8,0);
+    memcpy(b+SV_HDRSZ,cur,v->vlen);
+    memcpy(old,cur,v->vlen);
+    return max;
+  }
+
+  n = SV_HDRSZ;
+  k = 0;
+  while (k < v->vlen) {
+    /* skip quickly over unchanged blocks */
+    len = v->vlen - k;
+    if (len > SV_BLOCK)
+      len = SV_BLOCK;
+    if (memcmp(cur+k,old+k,len) == 0) {
+      k += len;
+      continue;
+    }
+    while (cur[k] == old[k])
+      k++;
+    /* find the end of this range - don't break it for
+       unchanged runs that are shorter than a range header */
+    start = k;
+    end = k+1;
+    for(k = end; k < v->vlen && k - end < SV_RANGESZ; k++)
+      if (cur[k] != old[k])
+	end = k+1;
+    len = end - start;
+    if (n + SV_RANGESZ + len >= max) {
+      /* delta would be no smaller than the whole thing */
+      v->force_key = 1;
+      return statevar_delta(v);
+    }
+    put32(b+n,start);
+    put32(b+n+4,len);
+    memcpy(b+n+SV_RANGESZ,cur+start,len);
+    memcpy(old+start,cur+start,len);
+    n += SV_RANGESZ + len;
+    k = end;
+  }
+  if (n == SV_HDRSZ)
+    return 0; /* nothing has changed */
+  b[0] = SV_DELTA;
+  b[1] = b[2] = b[3] = 0;
+  put32(b+8,v->version);
+  v->version = (v->version + 1) & 0xffffffffUL;
+  put32(b+4,v->version);
+  return n;
+}
+
 int veMPPushStateVar(int tag, int flags) {
   struct vemp_statevar *v;
   int isauto = (flags & VE_MP_AUTO);
+  int n, total = 0;
   if (veMPTestSlaveGuard())
     return 0;
+  if (!statevar_mutex)
+    return 0; /* no state variables */
+  veThrMutexLock(statevar_mutex);
   for(v = statevars; v; v = v->next) {
     if ((tag == VE_DTAG_ANY || tag == v->tag) &&
 	(!isauto || (v->flags & VE_MP_AUTO))) {
-      veMPIntPush(VE_MPTARG_ALL,VE_MP_FAST,VE_MPMSG_STATE,v->tag,
-		  v->var,v->vlen);
+      if (v->flags & VE_MP_DELTA) {
+	if ((n = statevar_delta(v)) > 0)
+	  veMPIntPush(VE_MPTARG_ALL,VE_MP_FAST,VE_MPMSG_STATE,v->tag,
+		      v->buf,n);
+      } else {
+	n = v->vlen;
+	veMPIntPush(VE_MPTARG_ALL,VE_MP_FAST,VE_MPMSG_STATE,v->tag,
+		    v->var,v->vlen);
+      }
+      total += n;
     }
   }
+  veThrMutexUnlock(statevar_mutex);
+  if (isauto && sv_bytes_stat) {
+    sv_bytes = total;
+    veUpdateStatistic(sv_bytes_stat);
+  }
   return 0;
 }
 
+/* Send the current value of every state variable to a rejoining
+   slave and make c its connection.  VE_MP_DELTA variables get a
+   keyframe of what the other slaves have, so that the next delta
+   applies.  Holding statevar_mutex while the connection is made
+   available means no push can fall in between. */
+static void statevar_replay(int k, VeMPImplConn c) {
+  struct vemp_statevar *v;
+  unsigned char *b;
+
+  if (statevar_mutex)
+    veThrMutexLock(statevar_mutex);
+  for(v = statevars; v; v = v->next) {
+    if (v->flags & VE_MP_DELTA) {
+      /* v->buf is only used with statevar_mutex held */
+      b = v->buf;
+      b[0] = SV_KEY;
+      b[1] = b[2] = b[3] = 0;
+      put32(b+4,v->version);
+      put32(b+8,0);
+      memcpy(b+SV_HDRSZ,v->shadow,v->vlen);
+      veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG_STATE,v->tag,
+		    b,SV_HDRSZ+v->vlen);
+    } else {
+      veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG_STATE,v->tag,
+		    v->var,v->vlen);
+    }
+  }
+  veThrMutexLock(slaves[k].mutex);
+  slaves[k].conn = c;
+  veThrMutexUnlock(slaves[k].mutex);
+  if (statevar_mutex)
+    veThrMutexUnlock(statevar_mutex);
+}
+
+/* slave: apply a VE_MP_DELTA message */
+static void statevar_apply(struct vemp_statevar *v, VeMPPkt *p) {
+  unsigned char *b = (unsigned char *)(p->data);
+  unsigned long off, len;
+  int n;
+
+  if (p->dlen < SV_HDRSZ) {
+    veError(MODULE,"state variable %d: short message (%d bytes)",
+	    v->tag,p->dlen);
+    return;
+  }
+  if (b[0] == SV_KEY) {
+    n = p->dlen - SV_HDRSZ;
+    memcpy(v->var,b+SV_HDRSZ,(n < v->vlen ? n : v->vlen));
+    v->version = get32(b+4);
+    v->asked_key = 0;
+    return;
+  }
+  if (b[0] != SV_DELTA) {
+    veError(MODULE,"state variable %d: unknown message type %d",
+	    v->tag,b[0]);
+    return;
+  }
+  if (get32(b+8) != v->version) {
+    /* we've missed something (or just arrived) - ask for a keyframe
+       rather than waiting for the next one */
+    if (!v->asked_key) {
+      VE_DEBUGM(2,("state variable %d out of date - requesting keyframe",
+		   v->tag));
+      veMPSendMsg(VE_MP_RELIABLE,VE_MPTARG_MASTER,VE_MPMSG_STATE,v->tag,
+		  NULL,0);
+      v->asked_key = 1;
+    }
+    return;
+  }
+  for(n = SV_HDRSZ; n + SV_RANGESZ <= p->dlen; n += SV_RANGESZ + len) {
+    off = get32(b+n);
+    len = get32(b+n+4);
+    if (off >= v->vlen || len > v->vlen - off ||
+	len > p->dlen - n - SV_RANGESZ) {
+      veError(MODULE,"state variable %d: bad delta range (%lu,%lu)",
+	      v->tag,off,len);
+      break;
+    }
+    memcpy((char *)(v->var)+off,b+n+SV_RANGESZ,len);
+  }
+  v->version = get32(b+4);
+}
+
 /* ignore STATE messages received on the master... */
 static void statevar_handler(int k, VeMPPkt *p) {
   if (p->msg == VE_MPMSG_STATE && !veMPIsMaster()) {
@@ -785,28 +1521,275 @@ static void statevar_handler(int k, VeMPPkt *p) {
 	int min = (p->dlen < v->vlen ? p->dlen : v->vlen);
 	assert(v->var != NULL);
 	assert(min > 0); /* we should never send 0 bytes of state */
-	memcpy(v->var,p->data,min);
+	if (v->flags & VE_MP_DELTA)
+	  statevar_apply(v,p);
+	else
+	  memcpy(v->var,p->data,min);
 	break;
       }
     }
   }
 }
 
+/* ...except for keyframe requests from slaves */
+static void statevar_master_handler(int k, VeMPPkt *p) {
+  struct vemp_statevar *v;
+  if (p->msg != VE_MPMSG_STATE || !statevar_mutex)
+    return;
+  veThrMutexLock(statevar_mutex);
+  for(v = statevars; v; v = v->next)
+    if (p->tag == v->tag) {
+      VE_DEBUGM(2,("slave %d requested keyframe for state variable %d",
+		   k,v->tag));
+      v->force_key = 1;
+      break;
+    }
+  veThrMutexUnlock(statevar_mutex);
+}
+
+static void statevar_stat_init(void) {
+  char *s;
+  if ((s = veGetOption("mp_keyframe")) && atoi(s) > 0)
+    sv_keyframe = atoi(s);
+  sv_bytes_stat = veNewStatistic(MODULE, "state_bytes", "bytes/frame");
+  sv_bytes_stat->type = VE_STAT_INT;
+  sv_bytes_stat->data = &sv_bytes;
+  veAddStatistic(sv_bytes_stat);
+}
+
 /* packet functions */
+
+/* Every packet is allocated with this wrapper so that veMPPktDestroy()
+   can tell whether it came from a pool.  The packet must be the first
+   member. */
+typedef struct ve_mp_pkt_buf {
+  VeMPPkt pkt;
+  struct ve_mp_pkt_pool *pool; /* NULL if not pooled */
+  int cls;                     /* size class of buf (-1 if none) */
+  void *buf;                   /* pooled buffer attached to pkt */
+  struct ve_mp_pkt_buf *next;  /* free list */
+} VeMPPktBuf;
+
+/* size classes for payload buffers - anything bigger than the last
+   class is allocated directly */
+#define POOL_NCLS 6
+static int pool_cls_size[POOL_NCLS] = { 64, 256, 1024, 4096, 16384, 65536 };
+/* don't hang on to more than this many free buffers per class */
+#define POOL_MAXFREE 32
+
+/* a free buffer stores the link to the next free buffer in its
+   first bytes */
+typedef struct ve_mp_pool_free {
+  struct ve_mp_pool_free *next;
+} VeMPPoolFree;
+
+struct ve_mp_pkt_pool {
+  VeThrMutex *mutex;
+  int refs;             /* owner + outstanding packets */
+  VeMPPktBuf *pkts;     /* free packet headers */
+  VeMPPoolFree *bufs[POOL_NCLS];
+  int nfree[POOL_NCLS];
+  /* counts since last publication to statistics */
+  int hits, misses, direct;
+};
+
+static int pkt_pooling = 1;
+
+/* statistics - totals over all pools */
+#define POOL_STAT_INTERVAL 64 /* publish after this many allocations */
+static VeThrMutex *pool_stat_mutex = NULL;
+static VeStatistic *pool_hits_stat = NULL, *pool_misses_stat = NULL,
+  *pool_direct_stat = NULL;
+static int pool_hits = 0, pool_misses = 0, pool_direct = 0;
+
+static void pool_stat_init(void) {
+  pool_stat_mutex = veThrMutexCreate();
+  pool_hits_stat = veNewStatistic(MODULE, "pkt_pool_hits", "pkts");
+  pool_hits_stat->type = VE_STAT_INT;
+  pool_hits_stat->data = &pool_hits;
+  pool_misses_stat = veNewStatistic(MODULE, "pkt_pool_misses", "pkts");
+  pool_misses_stat->type = VE_STAT_INT;
+  pool_misses_stat->data = &pool_misses;
+  pool_direct_stat = veNewStatistic(MODULE, "pkt_direct_read", "bytes");
+  pool_direct_stat->type = VE_STAT_INT;
+  pool_direct_stat->data = &pool_direct;
+  veAddStatistic(pool_hits_stat);
+  veAddStatistic(pool_misses_stat);
+  veAddStatistic(pool_direct_stat);
+}
+
+/* adds counts taken from a pool - call without any pool's mutex held,
+   since updating a statistic can run arbitrary callbacks */
+static void pool_stat_publish(int hits, int misses, int direct) {
+  veThrMutexLock(pool_stat_mutex);
+  pool_hits += hits;
+  pool_misses += misses;
+  pool_direct += direct;
+  veThrMutexUnlock(pool_stat_mutex);
+  veUpdateStatistic(pool_hits_stat);
+  veUpdateStatistic(pool_misses_stat);
+  veUpdateStatistic(pool_direct_stat);
+}
+
+static void pool_free(VeMPPktPool *pool) {
+  VeMPPktBuf *b;
+  VeMPPoolFree *f;
+  int k;
+  while ((b = pool->pkts)) {
+    pool->pkts = b->next;
+    veFree(b);
+  }
+  for (k = 0; k < POOL_NCLS; k++)
+    while ((f = pool->bufs[k])) {
+      pool->bufs[k] = f->next;
+      veFree(f);
+    }
+  veThrMutexDestroy(pool->mutex);
+  veFree(pool);
+}
+
+void veMPSetPktPooling(int state) {
+  pkt_pooling = (state ? 1 : 0);
+}
+
+int veMPGetPktPooling(void) {
+  return pkt_pooling;
+}
+
+VeMPPktPool *veMPPktPoolCreate(void) {
+  VeMPPktPool *pool;
+  pool = veAllocObj(VeMPPktPool);
+  pool->mutex = veThrMutexCreate();
+  pool->refs = 1;
+  return pool;
+}
+
+void veMPPktPoolDestroy(VeMPPktPool *pool) {
+  int refs;
+  if (!pool)
+    return;
+  veThrMutexLock(pool->mutex);
+  refs = --pool->refs;
+  veThrMutexUnlock(pool->mutex);
+  if (refs == 0)
+    pool_free(pool);
+}
+
+VeMPPkt *veMPPktPoolAlloc(VeMPPktPool *pool, int dlen) {
+  VeMPPktBuf *b;
+  int cls = -1, hit = 1, publish = 0, hits = 0, misses = 0, direct = 0;
+
+  if (!pool || !pkt_pooling)
+    return veMPPktCreate(dlen);
+  if (dlen > 0) {
+    for (cls = 0; cls < POOL_NCLS; cls++)
+      if (dlen <= pool_cls_size[cls])
+	break;
+    if (cls >= POOL_NCLS)
+      cls = -1; /* too big for the pool */
+  }
+
+  veThrMutexLock(pool->mutex);
+  if ((b = pool->pkts))
+    pool->pkts = b->next;
+  else {
+    b = veAllocObj(VeMPPktBuf);
+    hit = 0;
+  }
+  memset(&(b->pkt),0,sizeof(VeMPPkt));
+  b->pool = pool;
+  b->cls = cls;
+  b->buf = NULL;
+  b->next = NULL;
+  if (cls >= 0) {
+    if (pool->bufs[cls]) {
+      b->buf = (void *)(pool->bufs[cls]);
+      pool->bufs[cls] = pool->bufs[cls]->next;
+      pool->nfree[cls]--;
+    } else {
+      b->buf = veAlloc(pool_cls_size[cls],0);
+      hit = 0;
+    }
+  }
+  /* a packet is a hit only if neither its header nor its buffer had
+     to be allocated */
+  if (hit)
+    pool->hits++;
+  else
+    pool->misses++;
+  pool->refs++;
+  /* (before the statistics exist, keep accumulating) */
+  if (pool_stat_mutex && pool->hits + pool->misses >= POOL_STAT_INTERVAL) {
+    hits = pool->hits;
+    misses = pool->misses;
+    direct = pool->direct;
+    pool->hits = pool->misses = pool->direct = 0;
+    publish = 1;
+  }
+  veThrMutexUnlock(pool->mutex);
+  if (publish)
+    pool_stat_publish(hits,misses,direct);
+
+  if (dlen > 0) {
+    b->pkt.dlen = dlen;
+    /* oversized payloads are not pooled */
+    b->pkt.data = (cls >= 0) ? b->buf : veAlloc(dlen,0);
+  }
+  return &(b->pkt);
+}
+
+void veMPPktPoolNoteDirect(VeMPPktPool *pool, int nbytes) {
+  if (!pool)
+    return;
+  veThrMutexLock(pool->mutex);
+  pool->direct += nbytes;
+  veThrMutexUnlock(pool->mutex);
+}
+
 VeMPPkt *veMPPktCreate(int dlen) {
-  VeMPPkt *p;
-  p = veAllocObj(VeMPPkt);
+  VeMPPktBuf *b;
+  b = veAllocObj(VeMPPktBuf);
+  b->cls = -1;
   if (dlen > 0) {
-    p->dlen = dlen;
-    p->data = veAlloc(dlen,0);
-    assert(p->data != NULL);
+    b->pkt.dlen = dlen;
+    b->pkt.data = veAlloc(dlen,0);
+    assert(b->pkt.data != NULL);
   }
-  return p;
+  return &(b->pkt);
 }
 
 void veMPPktDestroy(VeMPPkt *p) {
-  if (p) {
+  VeMPPktBuf *b = (VeMPPktBuf *)p;
+  VeMPPktPool *pool;
+  int refs;
+
+  if (!p)
+    return;
+  if (!(pool = b->pool)) {
     veFree(p->data);
-    veFree(p);
+    veFree(b);
+    return;
+  }
+  /* If the caller has taken the buffer (see the header notes) then
+     p->data is NULL and the pooled buffer is now owned by the caller.
+     If p->data has been replaced then it is freed as usual. */
+  if (p->data && p->data != b->buf)
+    veFree(p->data);
+  veThrMutexLock(pool->mutex);
+  if (b->buf && p->data) {
+    if (pool->nfree[b->cls] < POOL_MAXFREE) {
+      VeMPPoolFree *f = (VeMPPoolFree *)(b->buf);
+      f->next = pool->bufs[b->cls];
+      pool->bufs[b->cls] = f;
+      pool->nfree[b->cls]++;
+    } else
+      veFree(b->buf);
   }
+  b->buf = NULL;
+  b->next = pool->pkts;
+  pool->pkts = b;
+  refs = --pool->refs;
+  veThrMutexUnlock(pool->mutex);
+  if (refs == 0)
+    pool_free(pool);
 }
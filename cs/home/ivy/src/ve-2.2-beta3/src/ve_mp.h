@@ -109,8 +109,10 @@ typedef struct ve_mp_impl_pkt {
       assume that this piece of memory is safe beyond the call to the
       <code>veMPImplSend()</code> function.  The receiving side of an
       implementation should always allocate a new piece of memory here
-      and allow the library/application to handle the freeing of the
-      memory at a later date.
+      (either with <code>veMPPktCreate()</code> or from a packet pool
+      with <code>veMPPktPoolAlloc()</code>) and allow the
+      library/application to handle the freeing of the memory at a
+      later date.
    */
   void *data;          /* data buffer */
 } VeMPPkt;
@@ -170,6 +172,41 @@ typedef void (*VeMPPktHandler)(int src, VeMPPkt *p);
  */
 int veMPGetSlave(char *node, char *process, int allow_fail);
 
+/** misc
+    <p>Slaves that are separate processes can drop out and rejoin while
+    the program is running.  When the master loses its connection to
+    such a slave (or the slave is dropped with
+    <code>veMPDropSlave()</code>), it stops sending to it and starts it
+    again in the background, retrying every <code>mp_rejoin_ms</code>
+    milliseconds (default 1000, doubling after each failure up to 16
+    times that).  Before a rejoining slave receives any regular traffic
+    it is sent the last profile (and environment) pushed to the slaves
+    and the current value of every state variable.  Rejoined slaves do
+    not use multicast.  Master handlers are told about both events with
+    a <code>VE_MPMSG_CTRL</code> message from the slave, tagged
+    <code>VE_MPCTRL_LOST</code> or <code>VE_MPCTRL_JOINED</code>, which
+    does not itself come over the connection.  The rendering module uses
+    this to leave the slave out of frame synchronization until it has
+    caught up.  Set <code>mp_rejoin</code> to 0 to have the loss of a
+    slave be a fatal error instead.</p>
+*/
+
+/** function veMPDropSlave
+    Closes the connection to a slave (terminating the slave process if
+    the implementation can) as if the connection had been lost.
+    If rejoining is enabled the slave will be started again.  This is
+    only meaningful on the master, and may be used on a slave that has
+    stopped responding.
+
+    @param k
+    The slave identifier.
+
+    @returns
+    0 on success, non-zero if there is no such slave or it is not
+    currently connected.
+ */
+int veMPDropSlave(int k);
+
 /** function veMPSlaveInit
     Initializes the multi-processing for a slave.  This needs to be called
     before any other initialization in the system - either as the first
@@ -283,7 +320,8 @@ int veMPEnvPush(void);
  */
 int veMPProfilePush(void);
 
-#define VE_MP_AUTO (1<<0)
+#define VE_MP_AUTO  (1<<0)
+#define VE_MP_DELTA (1<<1)
 
 /** function veMPAddStateVar
     Adds a state variable.  A state variable is a piece of memory that will
@@ -317,6 +355,15 @@ int veMPProfilePush(void);
     does not need to explicitly push the state variable to the slaves; it will
     be done automatically.  Without this flag, state variables need to be explicitly
     pushed to slaves with the <code>veMPPushStateVar()</code> function.</li>
+    <li><code>VE_MP_DELTA</code> - only the parts of the state variable
+    that have changed since the last push are sent, and nothing is sent
+    if the variable has not changed at all.  A full copy (a "keyframe")
+    is still sent every so often (every <code>mp_keyframe</code> pushes
+    - see <code>veGetOption()</code> - default 60) so that slaves which
+    have missed an update or have just joined catch up.  Slaves that
+    notice they are out of date ask for a keyframe right away.  This
+    is worthwhile for large state variables that change a little at a
+    time.  The flag must be the same on the master and the slaves.</li>
     </ul>
 
     @returns
@@ -350,6 +397,67 @@ int veMPAddStateVar(int tag, void *var, int vlen, int flags);
  */
 int veMPPushStateVar(int tag, int flags);
 
+/** function veMPBundleBegin
+    Starts a bundle.  Until <code>veMPBundleEnd()</code> is called,
+    <code>VE_MP_FAST</code> (and <code>VE_MP_MCAST</code>) messages sent
+    to all slaves are collected rather than being sent right away.
+    They are then delivered to the slaves as a single message (or a few,
+    if they do not fit in one packet) and dispatched on each slave in
+    the order in which they were sent.  Any other message sent while the
+    bundle is open (e.g. to a single slave or over
+    <code>VE_MP_RELIABLE</code>) first causes the messages collected so
+    far to be sent, so ordering is always preserved.  Only messages sent
+    by the thread that called <code>veMPBundleBegin()</code> are
+    affected - other threads send as usual.
+    <p>The rendering loop bundles the location, state variables and
+    render command for every frame.  Bundling is on by default and may
+    be turned off with the <code>mp_bundle</code> option (which is read by
+    <code>veMPInit()</code>), in which case this call does nothing.</p>
+    <p>This function only has an effect on the master.</p>
+
+    @returns
+    0 on success, non-zero on failure.
+ */
+int veMPBundleBegin(void);
+
+/** function veMPBundleEnd
+    Sends any messages collected since <code>veMPBundleBegin()</code>
+    and stops collecting.  It is harmless to call this when there is
+    no bundle open.
+
+    @returns
+    0 on success, non-zero on failure.
+ */
+int veMPBundleEnd(void);
+
+/** type VeMPHoldProc
+    A predicate used with <code>veMPHoldMsgs()</code>.  It returns
+    non-zero if the given message may be dispatched right away.
+ */
+typedef int (*VeMPHoldProc)(VeMPPkt *p);
+
+/** function veMPHoldMsgs
+    On a slave, stops dispatching messages from the master, except for
+    those accepted by <i>pass</i>.  Every other message is queued, in
+    order, until <code>veMPReleaseMsgs()</code> is called.  This lets a
+    handler that cannot act on a message yet (e.g. a render request that
+    arrives before the previous frame has been swapped) make sure that
+    nothing sent after that message is applied early.
+    <p>This must only be called from a slave message handler.</p>
+
+    @param pass
+    Messages for which this returns non-zero are dispatched normally.
+ */
+void veMPHoldMsgs(VeMPHoldProc pass);
+
+/** function veMPReleaseMsgs
+    Stops holding messages and dispatches the queued ones in order.
+    If one of them causes <code>veMPHoldMsgs()</code> to be called again
+    then the rest stay queued.  This must only be called from a slave
+    message handler.
+ */
+void veMPReleaseMsgs(void);
+
 /* library interface */
 /* reserved message types */
 #define VE_MPMSG_DATA      0x0   /* application data sync */
@@ -361,6 +469,8 @@ int veMPPushStateVar(int tag, int flags);
 /* 0x6 - was VE_MPMSG_RECONNECT - now obsolete */
 #define VE_MPMSG_STATE     0x7   /* state information message */
 #define VE_MPMSG_INIT      0x8   /* slave initialization message */
+#define VE_MPMSG_BUNDLE    0x9   /* several messages sent together
+				    (see veMPBundleBegin()) */
 
 /* new MP services - these values are reserved here but the 
    appropriate modules must register themselves.  Values are defined
@@ -368,6 +478,12 @@ int veMPPushStateVar(int tag, int flags);
 #define VE_MPMSG_RENDER    0x20  /* MP graphics rendering module */
 #define VE_MPMSG_AUDIO     0x21  /* MP audio rendering module */
 
+/* tags for VE_MPMSG_CTRL messages passed to master handlers when a
+   slave's connection changes (these are never sent to a slave) */
+#define VE_MPCTRL_LOST     0x1   /* connection to the slave was lost */
+#define VE_MPCTRL_JOINED   0x2   /* slave is back and has been resent
+				    profile/environment and state */
+
 /* All values VE_MPMSG__UNRESV are explicitly defined as not
    used by any internal VE module - they are free for applications
    and external modules to use. */
@@ -548,6 +664,25 @@ int veMPSendMsg(int ch, int target, int msg, int tag, void *data, int dlen);
     negative, then a frame number will be chosen randomly.
     Unless you really know what you are doing, you should generally
     not specify a frame number - i.e. always pass '-1' as this value.
+
+    @misc
+    By default this call does not return until every slave has
+    rendered and swapped the frame.  If the <code>mp_pipeline</code>
+    option is set to a depth greater than 1, then this call only waits
+    until fewer than that many frames are outstanding, sends the frame
+    and returns, so that the master can work on the next frame while
+    the slaves render.  The <code>SWAP</code> for a frame is still only
+    sent once every slave has rendered it, so slaves remain swap-locked.
+    A slave that is told to render a frame before it has swapped the
+    previous one waits for the <code>SWAP</code>, and holds back
+    everything sent after the <code>RENDER</code> (the state for later
+    frames) until it has rendered it.
+    A slave that has been lost is not waited for.  When it rejoins it
+    is sent its windows again and counts once it has swapped a frame
+    that was started after it came back.  If the
+    <code>mp_slave_timeout</code> option is set, a slave that has not
+    answered for that many milliseconds is dropped (see
+    <code>veMPDropSlave()</code>) rather than holding up every frame.
  */
 void veMPRenderFrame(long frame);
 
@@ -576,6 +711,10 @@ void veMPRenderFrame(long frame);
     (if possible) and updates its own state accordingly.  This way, if a
     message is lost or delivered out-of-order, the system should hold
     together.</p>
+    <p>The one exception is a <code>RENDER</code> that arrives before the
+    slave has swapped its current frame.  The slave does not advance past
+    the <code>SWAP</code> on its own (that would break swap lock) - it
+    waits for the <code>SWAP</code> and then renders the new frame.</p>
 */
 
 /** section MP Implementation
@@ -627,10 +766,80 @@ VeMPPkt *veMPPktCreate(int dlen);
     @param pkt
     The packet to destroy.  All memory associated with the packet
     (including its buffer space) is freed.  See the description above for
-    details on preserving the buffer space.
+    details on preserving the buffer space.  If the packet was allocated
+    from a packet pool (see <code>veMPPktPoolAlloc()</code>) then the
+    packet and its buffer are returned to the pool rather than freed.
  */
 void veMPPktDestroy(VeMPPkt *p);
 
+/** type VeMPPktPool
+    An opaque type representing a pool of recycled packets.  Pools are
+    used by implementations on the receiving side to avoid allocating
+    and freeing a packet and its payload for every message.  Buffers
+    are kept in a small number of size classes.  A pool must only be
+    created and destroyed by the connection that owns it, but packets
+    allocated from the pool may be destroyed from any thread and may
+    outlive the pool's owner.
+ */
+typedef struct ve_mp_pkt_pool VeMPPktPool;
+
+/** function veMPPktPoolCreate
+    Creates a new, empty packet pool.
+
+    @returns
+    A pointer to the new pool.
+ */
+VeMPPktPool *veMPPktPoolCreate(void);
+
+/** function veMPPktPoolDestroy
+    Releases the owner's reference to a pool.  The pool's memory is
+    freed once every packet allocated from it has been destroyed.
+
+    @param pool
+    The pool to release.  May be <code>NULL</code>.
+ */
+void veMPPktPoolDestroy(VeMPPktPool *pool);
+
+/** function veMPPktPoolAlloc
+    Allocates a packet from a pool.  The packet behaves exactly as one
+    returned by <code>veMPPktCreate()</code> and must be released with
+    <code>veMPPktDestroy()</code>.  The payload buffer may be larger than
+    <i>dlen</i> bytes (it is rounded up to the pool's size class).
+    If pooling is disabled (see <code>veMPSetPktPooling()</code>),
+    <i>pool</i> is <code>NULL</code> or <i>dlen</i> is larger than the
+    largest size class, then this falls back to
+    <code>veMPPktCreate()</code>.
+
+    @param pool
+    The pool from which to allocate.
+
+    @param dlen
+    The size of the data buffer required.
+
+    @returns
+    A packet with all fields except <code>dlen</code> and <code>data</code>
+    initialized to '0'.
+ */
+VeMPPkt *veMPPktPoolAlloc(VeMPPktPool *pool, int dlen);
+
+/** function veMPSetPktPooling
+    Turns pooled packet allocation on (non-zero) or off (zero).  Pooling
+    is on by default.  It can also be controlled with the
+    <code>mp_pktpool</code> option, which is read by <code>veMPInit()</code>.
+ */
+void veMPSetPktPooling(int state);
+
+/** function veMPGetPktPooling
+    @returns
+    Non-zero if pooled packet allocation is enabled.
+ */
+int veMPGetPktPooling(void);
+
+/* Internal - used by implementations to account for payload bytes that
+   were read directly into a pooled buffer (bypassing any intermediate
+   receive buffer). */
+void veMPPktPoolNoteDirect(VeMPPktPool *pool, int nbytes);
+
 /** type VeMPImplConn
     An opaque type representing a connection.  The platform-independent
     layer assumes that this is a pointer-like value, in that it can be
@@ -651,6 +860,10 @@ typedef void *VeMPImplConn;  /* object type for representing a connection betwee
 #define VE_MP_RELIABLE   (0)    /* guaranteed delivery of messages, but at possibly
 				   poor performance */
 #define VE_MP_FAST       (1)    /* fast performance, possibly lost messages though... */
+#define VE_MP_MCAST      (2)    /* like VE_MP_FAST, but messages to VE_MPTARG_ALL
+				   are sent once to a multicast group (if the
+				   implementation supports it) - messages to a
+				   single target are sent as VE_MP_FAST */
 
 
 /* although part of "veMP" this is not an application interface, but
@@ -662,9 +875,13 @@ void veMPCreateSlave(VeMPImplConn);
 VeMPImplConn veMPImplSlaveCreate(int *args, char **argv);
 /* create on the master's side */
 VeMPImplConn veMPImplCreate(char *type, int id, char *node, int argc, char **argv);
-/* prepare a connection - negotiate any further communication channels,
-   trade authentication info, etc */
+/* prepare a connection - check the peer speaks our wire format,
+   negotiate any further communication channels, trade authentication
+   info, etc.  Called before the slave is sent VE_MPMSG_INIT; must not
+   block forever on a peer that does not answer. */
 int veMPImplPrepare(VeMPImplConn c, int flags);
+/* close a connection and free it */
+void veMPImplDestroy(VeMPImplConn c);
 
 int veMPImplSend(VeMPImplConn c, VeMPPkt *p);
 /* for conveniences */
@@ -706,6 +923,56 @@ int veMPImplRecv(VeMPImplConn c, VeMPPkt **p_r, long tmout);
 /* kill off any remaining connections/resources before exiting */
 void veMPImplCleanup(void);
 
+/** function veMPImplMcastCreate
+    Sets up a multicast group on the master for fanning out messages
+    to all slaves.  Implementations that do not support multicast
+    should always fail.  Calling this when the group already exists
+    is harmless.
+
+    @returns
+    0 if the group is available, non-zero otherwise (in which case
+    messages to all slaves are sent to each slave individually).
+ */
+int veMPImplMcastCreate(void);
+
+/** function veMPImplMcastJoin
+    Asks the slave at the other end of a connection to join the
+    multicast group created by <code>veMPImplMcastCreate()</code>.
+    This must be called before a message thread is started for the
+    connection.
+
+    @param c
+    The connection to the slave.
+
+    @returns
+    0 if the slave is now a member of the group, non-zero otherwise.
+ */
+int veMPImplMcastJoin(VeMPImplConn c);
+
+/** function veMPImplMcastSend
+    Sends a message once to every slave that has joined the multicast
+    group.  Delivery guarantees are those of <code>VE_MP_FAST</code>,
+    although implementations should attempt to repair lost packets.
+
+    @param msg
+    The message type id.
+
+    @param tag
+    The tag id.
+
+    @param data
+    The payload.
+
+    @param dlen
+    The size of the payload in bytes.
+
+    @returns
+    0 on success, &lt; 0 if multicast failed (and should no longer be
+    used) or &gt; 0 if this particular message cannot be multicast
+    (e.g. it is too big) and should be sent to each slave individually.
+ */
+int veMPImplMcastSend(int msg, int tag, void *data, int dlen);
+
 /** function veMPImplSysdep
     System-dependent callback.  Allows implementations to use
     the <code>VE_MPMSG__SYSDEP</code> message type to pass information
@@ -740,6 +1007,38 @@ int veMPImplSysdep(VeMPImplConn c, VeMPPkt *p);
  */
 int veMPImplWait(VeMPImplConn *c, VeMPImplConn *c_res, int n);
 
+/** function veMPImplWatch
+    Hands a connection to the implementation's I/O reactor, if it
+    has one, so that no thread has to be dedicated to waiting on it.
+    Whenever input arrives on the connection, <i>ready</i> is called
+    from one of the reactor's worker threads and should read
+    everything that is available with
+    <code>veMPImplRecv(c,&amp;p,0)</code> until that no longer returns
+    0.  The callback is never called for the same connection from
+    two threads at once, but may be called concurrently for different
+    connections, and should not block for long - other connections
+    may be waiting for a worker.  Watching stops when the connection
+    is destroyed.  The callback must have the following type:
+    <blockquote><code>typedef void (*VeMPImplReadyProc)(VeMPImplConn c,
+    void *arg);</code></blockquote>
+
+    @param c
+    The connection to watch.
+
+    @param ready
+    The callback to call when input is available.
+
+    @param arg
+    Passed to <i>ready</i> unchanged.
+
+    @returns
+    0 if the connection is now being watched, non-zero if the reactor
+    is not available (in which case the caller should wait on the
+    connection itself with <code>veMPImplWait()</code>).
+ */
+typedef void (*VeMPImplReadyProc)(VeMPImplConn c, void *arg);
+int veMPImplWatch(VeMPImplConn c, VeMPImplReadyProc ready, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
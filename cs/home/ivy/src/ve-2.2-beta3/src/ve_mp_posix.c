@@ -14,6 +14,11 @@ For local processes and threads, a standard Unix pipe is used for
 communicaiton.  Both <code>VE_MP_RELIABLE</code> and
 <code>VE_MP_FAST</code> are implemented using the pipe.</p>
 
+<p>Independent (local or remote) slaves may also join a UDP multicast
+group which the master uses for <code>VE_MP_FAST</code> and
+<code>VE_MP_MCAST</code> messages sent to all slaves (see
+"Multicast fan-out" below).</p>
+
 */
 #include "autocfg.h"
 #include <assert.h>
@@ -35,6 +40,9 @@ communicaiton.  Both <code>VE_MP_RELIABLE</code> and
 #ifdef HAS_POSIXPOLL
 #include <sys/poll.h>
 #endif /* HAS_POSIXPOLL */
+#ifdef HAS_EPOLL
+#include <sys/epoll.h>
+#endif /* HAS_EPOLL */
 
 /* POSIX socket interface */
 #include <sys/socket.h>
@@ -51,6 +59,7 @@ communicaiton.  Both <code>VE_MP_RELIABLE</code> and
 #include <ve_main.h>
 #include <ve_util.h>
 #include <ve_thread.h>
+#include <ve_stats.h>
 
 #define MODULE "ve_mp_posix"
 
@@ -430,6 +439,10 @@ static pid_t spawn_v(spawn_pipe_t *p, char *prog, int argc, char **argv) {
 #define MAX_PAYLOAD 30000
 #define FBUFSZ (2*MAX_PAYLOAD)
 
+/* how many out-of-order multicast packets a slave will hold on to
+   while waiting for repairs */
+#define MCAST_WINDOW 64
+
 typedef struct ve_mp_posix_fbuffer {
   char buf[FBUFSZ];
   int top, use;
@@ -461,15 +474,122 @@ typedef struct ve_mp_posix_conn {
 		    the fast fd.  This allows us to fairly process packets
 		    from both sources */
 
+  /* packets (and payload buffers) handed out by veMPImplRecv() come
+     from here */
+  VeMPPktPool *pool;
+
+  int crc;       /* if non-zero then a CRC is appended to every header
+		    we send on this connection (see SYSDEP_CONNKEY) */
+  int rx_flags;  /* wire flags of the last packet read */
+
+  /* serializes veMPImplSend() - repairs may be sent from a different
+     thread than regular traffic */
+  VeThrMutex *send_mutex;
+
+  /* multicast reception (slave side only) - if mcast_fd is -1 then
+     we have not joined the group */
+  int mcast_fd;
+  VeMPPosixFBuffer mcast_buf;
+  unsigned long mcast_expect; /* next sequence number to deliver */
+  unsigned long mcast_nacked; /* everything before this has been either
+				 received or asked for */
+  long mcast_gap;  /* veClock() time at which we stop waiting for repairs
+		      of the current gap (0 if there is no gap) */
+  VeMPPkt *mcast_q[MCAST_WINDOW]; /* out-of-order packets */
+  int mcast_nq;    /* number of packets in mcast_q */
+
   /* connection info */
   char *method;  /* what method was requested */
 
   pid_t pid;  /* pid of child (if > 0) */
 
+  /* I/O reactor (see veMPImplWatch()) - all of these are protected
+     by reactor_mutex */
+  VeMPImplReadyProc ready; /* if NULL, the reactor is not watching us */
+  void *ready_arg;
+  int rslot;     /* index in reactor_conns[] */
+  int rstate;    /* R_IDLE, R_QUEUED, R_RUNNING or R_DEAD */
+  int ragain;    /* input arrived while a worker was running ready() */
+  int rthread;   /* veThreadId() of the worker running ready() */
+  struct ve_mp_posix_conn *rnext; /* run queue */
 } VeMPPosixConn;
 
 static VeMPPosixConn *conn_list = NULL;
 
+/* I/O accounting - totals over all connections in this process, so
+   that the cost of the MP layer (e.g. per frame) can be measured.
+   These are published as statistics every IO_STAT_INTERVAL calls. */
+#define IO_STAT_INTERVAL 256
+static VeThrMutex *io_mutex = NULL;
+static int io_tx_calls = 0, io_tx_bytes = 0, io_rx_calls = 0, io_rx_bytes = 0;
+static int io_unpublished = 0;
+static VeStatistic *io_stats[4];
+
+static void io_stat_init(void) {
+  static char *names[] = { "tx_syscalls", "tx_bytes",
+			   "rx_syscalls", "rx_bytes" };
+  static char *units[] = { "calls", "bytes", "calls", "bytes" };
+  int *data[4];
+  int k;
+  if (io_mutex)
+    return;
+  data[0] = &io_tx_calls;
+  data[1] = &io_tx_bytes;
+  data[2] = &io_rx_calls;
+  data[3] = &io_rx_bytes;
+  for(k = 0; k < 4; k++) {
+    io_stats[k] = veNewStatistic(MODULE,names[k],units[k]);
+    io_stats[k]->type = VE_STAT_INT;
+    io_stats[k]->data = data[k];
+    veAddStatistic(io_stats[k]);
+  }
+  io_mutex = veThrMutexCreate();
+}
+
+/* count a system call that moved <i>bytes</i> bytes (may be 0) */
+static void io_note(int tx, int bytes) {
+  int k, publish = 0;
+  if (io_mutex)
+    veThrMutexLock(io_mutex);
+  if (tx) {
+    io_tx_calls++;
+    io_tx_bytes += bytes;
+  } else {
+    io_rx_calls++;
+    io_rx_bytes += bytes;
+  }
+  if (io_mutex && ++io_unpublished >= IO_STAT_INTERVAL) {
+    io_unpublished = 0;
+    publish = 1;
+  }
+  if (io_mutex)
+    veThrMutexUnlock(io_mutex);
+  if (publish)
+    for(k = 0; k < 4; k++)
+      veUpdateStatistic(io_stats[k]);
+}
+
+/* read into an empty buffer from a descriptor that is known to be
+   readable
+   Note return value:
+   0  --> success
+   -1 --> error or end-of-file
+*/
+static int readbuf(VeMPPosixFBuffer *f, int fd) {
+  int k;
+  errno = 0;
+  while ((k = read(fd,f->buf,FBUFSZ)) <= 0 && errno == EINTR)
+    io_note(0,0);
+  io_note(0,k > 0 ? k : 0);
+  if (k <= 0) {
+    perror("read");
+    return -1; /* error or eof */
+  }
+  f->top = 0;
+  f->use = k;
+  return 0;
+}
+
 /* Note return value:
    0  --> success
    -1 --> error
@@ -492,6 +612,7 @@ static int fillbuf(VeMPPosixFBuffer *f, int fd, long tmout) {
     tv.tv_usec = tmout%1000000;
   }
   k = select(fd+1,&st,NULL,NULL,(tmout < 0 ? NULL : &tv));
+  io_note(0,0);
   if (k < 0) {
     perror("select");
     return -1; /* something bad happened */
@@ -499,16 +620,7 @@ static int fillbuf(VeMPPosixFBuffer *f, int fd, long tmout) {
   if (k == 0)
     return 1;  /* timeout */
   /* now try to actually read */
-  errno = 0;
-  while ((k = read(fd,f->buf,FBUFSZ)) <= 0 && errno == EINTR)
-    ;
-  if (k <= 0) {
-    perror("read");
-    return -1; /* error or eof */
-  }
-  f->top = 0;
-  f->use = k;
-  return 0;
+  return readbuf(f,fd);
 }
 
 /* buffered reading */
@@ -562,6 +674,8 @@ static int bufread(VeMPPosixFBuffer *f, int fd, void *buf, int n,
   return n; /* success */
 }
 
+static int wait_for_input(VeMPPosixConn *c, long tmout);
+
 int veMPImplWait(VeMPImplConn *c_v, VeMPImplConn *c_res_v, int n) {
   int ready = 0;
   int k;
@@ -576,14 +690,9 @@ int veMPImplWait(VeMPImplConn *c_v, VeMPImplConn *c_res_v, int n) {
     if (!c[k]) 
       c_res[k] = NULL;
     else {
-      VE_DEBUGM(6,("filling reliable buffer %d",k));
-      if (fillbuf(&(c[k]->rel_buf),c[k]->rel_recv_fd,0) < 0)
-	veFatalError(MODULE,"failure filling reliable slave buffer");
-      if (c[k]->fast_fd >= 0) {
-	VE_DEBUGM(6,("filling fast buffer"));
-	if (fillbuf(&(c[k]->fast_buf),c[k]->fast_fd,0) < 0)
-	  veFatalError(MODULE,"failure filling fast slave buffer");
-      }
+      VE_DEBUGM(6,("filling buffers %d",k));
+      if (wait_for_input(c[k],0) < 0)
+	return -1; /* connection has failed */
       VE_DEBUGM(6,("finishing filling buffers: reliable=%d fast=%d",
 		   c[k]->rel_buf.use, (c[k]->fast_fd >= 0 ? 
 				       c[k]->fast_buf.use : -1)));
@@ -622,6 +731,7 @@ int veMPImplWait(VeMPImplConn *c_v, VeMPImplConn *c_res_v, int n) {
     }
     VE_DEBUGM(6,("waiting on file descriptors..."));
     k = select(max,&fs,NULL,NULL,NULL);
+    io_note(0,0);
     VE_DEBUGM(6,("...wait complete"));
     if (k <= 0)
       return -1; /* error */
@@ -633,14 +743,9 @@ int veMPImplWait(VeMPImplConn *c_v, VeMPImplConn *c_res_v, int n) {
     if (!c[k]) {
       c_res[k] = NULL;
     } else {
-      VE_DEBUGM(6,("filling reliable buffer %d",k));
-      if (fillbuf(&(c[k]->rel_buf),c[k]->rel_recv_fd,0) < 0)
-	veFatalError(MODULE,"failure filling reliable slave buffer");
-      if (c[k]->fast_fd >= 0) {
-	VE_DEBUGM(6,("filling fast buffer"));
-	if (fillbuf(&(c[k]->fast_buf),c[k]->fast_fd,0) < 0)
-	  veFatalError(MODULE,"failure filling fast slave buffer");
-      }
+      VE_DEBUGM(6,("filling buffers %d",k));
+      if (wait_for_input(c[k],0) < 0)
+	return -1; /* connection has failed */
       VE_DEBUGM(6,("finishing filling buffers: reliable=%d fast=%d",
 		   c[k]->rel_buf.use, (c[k]->fast_fd >= 0 ? 
 				       c[k]->fast_buf.use : -1)));
@@ -658,70 +763,323 @@ int veMPImplWait(VeMPImplConn *c_v, VeMPImplConn *c_res_v, int n) {
   return 0; /* done */
 }
 
+/* Fill the buffers of a connection.  If any buffer already has data
+   we are done.  Otherwise a single select() covers all of the
+   connection's descriptors, and each one that is readable is read
+   into its buffer.
+   Note return value:
+   0  --> at least one buffer has data
+   -1 --> error (including the other end closing the connection)
+   1  --> timeout (<i>tmout</i> is in microseconds, &lt; 0 waits forever)
+*/
 static int wait_for_input(VeMPPosixConn *c, long tmout) {
-  /* if a buffer is non-full and something is waiting, then
-     fill that buffer... */
+  static char *names[] = { "reliable", "fast", "multicast" };
+  VeMPPosixFBuffer *f[3];
+  int fd[3];
+  fd_set fs;
+  struct timeval tv;
+  int k, max = 0;
+
   VE_DEBUGM(6,("wait_for_input enter"));
-  VE_DEBUGM(6,("filling reliable buffer"));
-  if (fillbuf(&(c->rel_buf),c->rel_recv_fd,0) < 0)
-    veFatalError(MODULE,"failure filling reliable slave buffer");
-  if (c->fast_fd >= 0) {
-    VE_DEBUGM(6,("filling fast buffer"));
-    if (fillbuf(&(c->fast_buf),c->fast_fd,0) < 0)
-      veFatalError(MODULE,"failure filling fast slave buffer");
-  }
-  VE_DEBUGM(6,("finishing filling buffers: reliable=%d fast=%d",
-	       c->rel_buf.use, (c->fast_fd >= 0 ? c->fast_buf.use : -1)));
-  /* if either buffer is non-empty, we're done */
-  if (c->rel_buf.use > 0 || (c->fast_fd >= 0 && c->fast_buf.use > 0))
-    return 0; /* done */
-  /* if tmout is 0, then we don't try any further... */
-  VE_DEBUGM(6,("wait: both buffers are empty"));
-  if (tmout == 0) {
+  f[0] = &(c->rel_buf);
+  fd[0] = c->rel_recv_fd;
+  f[1] = &(c->fast_buf);
+  fd[1] = c->fast_fd;
+  f[2] = &(c->mcast_buf);
+  fd[2] = c->mcast_fd;
+  for(k = 0; k < 3; k++)
+    if (fd[k] >= 0 && f[k]->use > 0)
+      return 0; /* something is already buffered */
+
+  if (tmout >= 0) {
+    tv.tv_sec = tmout/1000000;
+    tv.tv_usec = tmout%1000000;
+  }
+  VE_DEBUGM(6,("waiting on file descriptors (tmout = %ld)...",tmout));
+  do {
+    FD_ZERO(&fs);
+    for(k = 0; k < 3; k++)
+      if (fd[k] >= 0) {
+	FD_SET(fd[k],&fs);
+	if (fd[k] >= max)
+	  max = fd[k] + 1;
+      }
+    k = select(max,&fs,NULL,NULL,(tmout < 0 ? NULL : &tv));
+    io_note(0,0);
+  } while (k < 0 && errno == EINTR);
+  VE_DEBUGM(6,("...wait complete"));
+  if (k < 0) {
+    return -1; /* error */
+  } else if (k == 0) {
     VE_DEBUGM(6,("wait: timing out"));
     return 1; /* timeout */
   }
-  /* otherwise, wait for timeout */
-  {
-    fd_set fs;
-    int max, k;
-    struct timeval tv;
-    FD_ZERO(&fs);
-    FD_SET(c->rel_recv_fd,&fs);
-    max = c->rel_recv_fd + 1;
-    if (c->fast_fd >= 0) {
-      FD_SET(c->fast_fd,&fs);
-      if (c->fast_fd >= max)
-	max = c->fast_fd + 1;
+  for(k = 0; k < 3; k++)
+    if (fd[k] >= 0 && FD_ISSET(fd[k],&fs) && readbuf(f[k],fd[k])) {
+      /* leave it to the caller to decide if this is fatal */
+      VE_DEBUGM(1,("failure filling %s buffer",names[k]));
+      return -1;
     }
-    if (tmout >= 0) {
-      tv.tv_sec = tmout/1000000;
-      tv.tv_usec = tmout%1000000;
+  VE_DEBUGM(6,("finishing filling buffers: reliable=%d fast=%d mcast=%d",
+	       c->rel_buf.use, (c->fast_fd >= 0 ? c->fast_buf.use : -1),
+	       (c->mcast_fd >= 0 ? c->mcast_buf.use : -1)));
+  return 0;
+}
+
+/** misc
+    <p>On the master, input from slaves is normally handled by an
+    I/O reactor rather than by one thread per slave waiting in
+    <code>veMPImplWait()</code>.  A single thread waits on an epoll
+    set holding the descriptors of every watched connection
+    (edge-triggered) and puts connections with input on a run queue.
+    A small, fixed pool of worker threads takes connections off the
+    queue and calls their ready callback, which drains everything
+    that has arrived.  A connection is only ever handled by one
+    worker at a time, so messages from one slave are still handled
+    in order.  Options:</p>
+    <dl>
+    <dt>mp_reactor</dt>
+    <dd>If 0, do not use the reactor - every slave gets its own
+    thread using <code>select()</code>, as on systems without
+    epoll.</dd>
+    <dt>mp_reactor_threads</dt>
+    <dd>Number of worker threads (default 2).</dd>
+    </dl>
+*/
+#define R_IDLE    0
+#define R_QUEUED  1
+#define R_RUNNING 2
+#define R_DEAD    3   /* destroyed by its own ready callback */
+
+#define REACTOR_MAXCONN    256
+#define REACTOR_WORKERS    2
+#define REACTOR_MAXWORKERS 32
+#define REACTOR_EVENTS     64
+
+static VeThrMutex *reactor_mutex = NULL;
+static VeThrCond *reactor_work = NULL;  /* run queue is not empty */
+static VeThrCond *reactor_done = NULL;  /* a worker finished a connection */
+static VeMPPosixConn *reactor_conns[REACTOR_MAXCONN];
+static VeMPPosixConn *runq_head = NULL, *runq_tail = NULL;
+
+#ifdef HAS_EPOLL
+static int reactor_fd = -1;
+static int reactor_failed = 0; /* do not try again */
+
+/* put a connection on the run queue unless it is already there, or
+   have its worker go around again - reactor_mutex must be held */
+static void reactor_kick(VeMPPosixConn *c) {
+  switch (c->rstate) {
+  case R_IDLE:
+    c->rstate = R_QUEUED;
+    c->rnext = NULL;
+    if (runq_tail)
+      runq_tail->rnext = c;
+    else
+      runq_head = c;
+    runq_tail = c;
+    veThrCondSignal(reactor_work);
+    break;
+  case R_RUNNING:
+    c->ragain = 1;
+    break;
+  }
+}
+
+static void *reactor_thread(void *x) {
+  struct epoll_event ev[REACTOR_EVENTS];
+  VeMPPosixConn *c;
+  int k, n;
+
+  for(;;) {
+    n = epoll_wait(reactor_fd,ev,REACTOR_EVENTS,-1);
+    io_note(0,0);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      veFatalError(MODULE,"epoll_wait failed: %s",strerror(errno));
     }
-    VE_DEBUGM(6,("waiting on file descriptors..."));
-    k = select(max,&fs,NULL,NULL,(tmout < 0 ? NULL : &tv));
-    VE_DEBUGM(6,("...wait complete"));
-    if (k < 0)
-      return -1; /* error */
-    else if (k == 0)
-      return 1; /* timeout */
-  }
-  /* select says that somebody has work to do - there's only
-     two fds so try filling their buffers again */
-  VE_DEBUGM(6,("retry filling reliable buffer"));
-  if (fillbuf(&(c->rel_buf),c->rel_recv_fd,0) < 0)
-    veFatalError(MODULE,"failure filling reliable slave buffer");
-  if (c->fast_fd >= 0) { 
-    VE_DEBUGM(6,("retry filling fast buffer"));
-    if (fillbuf(&(c->fast_buf),c->fast_fd,0) < 0)
-      veFatalError(MODULE,"failure filling fast slave buffer");
-  }
-  /* either we filled a buffer or we got an error (which would have
-     tripped one of the above fatal errors - so at least one of the
-     buffers must be non-empty at this point */
-  assert(c->rel_buf.use > 0 || (c->fast_fd >= 0 && c->fast_buf.use > 0));
-  VE_DEBUGM(6,("wait complete after retry"));
-  return 0; /* done */
+    VE_DEBUGM(6,("reactor: %d events",n));
+    veThrMutexLock(reactor_mutex);
+    for(k = 0; k < n; k++)
+      /* events for a connection that has since been destroyed find
+	 either nothing or a new connection in the slot - the latter
+	 just gets a harmless extra look */
+      if ((c = reactor_conns[ev[k].data.u32]))
+	reactor_kick(c);
+    veThrMutexUnlock(reactor_mutex);
+  }
+  return NULL;
+}
+
+static void *reactor_worker(void *x) {
+  VeMPPosixConn *c;
+
+  veThrMutexLock(reactor_mutex);
+  for(;;) {
+    while (!runq_head)
+      veThrCondWait(reactor_work,reactor_mutex);
+    c = runq_head;
+    if (!(runq_head = c->rnext))
+      runq_tail = NULL;
+    c->rstate = R_RUNNING;
+    c->ragain = 0;
+    c->rthread = veThreadId();
+    veThrMutexUnlock(reactor_mutex);
+
+    c->ready((VeMPImplConn)c,c->ready_arg);
+
+    veThrMutexLock(reactor_mutex);
+    if (c->rstate == R_DEAD) {
+      veFree(c);
+    } else {
+      c->rstate = R_IDLE;
+      if (c->ragain && c->ready)
+	reactor_kick(c); /* to the back of the queue */
+    }
+    veThrCondBcast(reactor_done);
+  }
+  return NULL;
+}
+
+/* start the reactor if we have not already
+   Note return value:
+   0  --> reactor is running
+   -1 --> reactor is not available
+*/
+static int reactor_init(void) {
+  char *s;
+  int k, n;
+
+  if (reactor_fd >= 0)
+    return 0;
+  if (reactor_failed)
+    return -1;
+  reactor_failed = 1;
+  if ((s = veGetOption("mp_reactor")) && atoi(s) == 0) {
+    VE_DEBUGM(1,("reactor disabled - using select"));
+    return -1;
+  }
+  if ((reactor_fd = epoll_create(REACTOR_MAXCONN)) < 0) {
+    veWarning(MODULE,"epoll_create failed (%s) - falling back to select",
+	      strerror(errno));
+    return -1;
+  }
+  fcntl(reactor_fd,F_SETFD,FD_CLOEXEC); /* keep it out of slaves */
+  n = REACTOR_WORKERS;
+  if ((s = veGetOption("mp_reactor_threads")) && (n = atoi(s)) < 1)
+    n = 1;
+  if (n > REACTOR_MAXWORKERS)
+    n = REACTOR_MAXWORKERS;
+  reactor_mutex = veThrMutexCreate();
+  reactor_work = veThrCondCreate();
+  reactor_done = veThrCondCreate();
+  for(k = 0; k < n; k++)
+    veThreadInit(NULL,reactor_worker,NULL,0,0);
+  veThreadInit(NULL,reactor_thread,NULL,0,0);
+  reactor_failed = 0;
+  VE_DEBUGM(1,("reactor started with %d workers",n));
+  return 0;
+}
+
+static int reactor_add(int fd, int slot) {
+  struct epoll_event ev;
+  if (fd < 0)
+    return 0;
+  memset(&ev,0,sizeof(ev));
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u32 = slot;
+  if (epoll_ctl(reactor_fd,EPOLL_CTL_ADD,fd,&ev)) {
+    veError(MODULE,"epoll_ctl(ADD,%d) failed: %s",fd,strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void reactor_del(int fd) {
+  struct epoll_event ev; /* pre-2.6.9 kernels want a non-NULL pointer */
+  if (fd >= 0)
+    epoll_ctl(reactor_fd,EPOLL_CTL_DEL,fd,&ev);
+}
+#endif /* HAS_EPOLL */
+
+int veMPImplWatch(VeMPImplConn c_v, VeMPImplReadyProc ready, void *arg) {
+#ifdef HAS_EPOLL
+  VeMPPosixConn *c = (VeMPPosixConn *)c_v;
+  int k;
+
+  if (!c || !ready || reactor_init())
+    return -1;
+  veThrMutexLock(reactor_mutex);
+  for(k = 0; k < REACTOR_MAXCONN; k++)
+    if (!reactor_conns[k])
+      break;
+  if (k >= REACTOR_MAXCONN) {
+    veThrMutexUnlock(reactor_mutex);
+    return -1;
+  }
+  if (reactor_add(c->rel_recv_fd,k) || reactor_add(c->fast_fd,k) ||
+      reactor_add(c->mcast_fd,k)) {
+    reactor_del(c->rel_recv_fd);
+    reactor_del(c->fast_fd);
+    reactor_del(c->mcast_fd);
+    veThrMutexUnlock(reactor_mutex);
+    return -1;
+  }
+  reactor_conns[k] = c;
+  c->rslot = k;
+  c->ready = ready;
+  c->ready_arg = arg;
+  c->rstate = R_IDLE;
+  /* something may have been buffered before we were watching */
+  reactor_kick(c);
+  veThrMutexUnlock(reactor_mutex);
+  VE_DEBUGM(2,("reactor: watching connection in slot %d",k));
+  return 0;
+#else
+  return -1; /* no reactor - caller waits with veMPImplWait() */
+#endif /* HAS_EPOLL */
+}
+
+/* stop watching a connection that is being destroyed - returns
+   non-zero if we are being called from the connection's own ready
+   callback, in which case the worker frees the connection when the
+   callback returns */
+static int reactor_forget(VeMPPosixConn *c) {
+  VeMPPosixConn **q, *prev;
+  int self = 0;
+
+  if (!reactor_mutex)
+    return 0;
+  veThrMutexLock(reactor_mutex);
+  if (c->ready) {
+#ifdef HAS_EPOLL
+    reactor_del(c->rel_recv_fd);
+    reactor_del(c->fast_fd);
+    reactor_del(c->mcast_fd);
+#endif /* HAS_EPOLL */
+    reactor_conns[c->rslot] = NULL;
+    c->ready = NULL;
+    if (c->rstate == R_QUEUED) {
+      prev = NULL;
+      for(q = &runq_head; *q != c; q = &((*q)->rnext))
+	prev = *q;
+      *q = c->rnext;
+      if (runq_tail == c)
+	runq_tail = prev;
+      c->rstate = R_IDLE;
+    } else if (c->rstate == R_RUNNING) {
+      if (c->rthread == veThreadId()) {
+	c->rstate = R_DEAD;
+	self = 1;
+      } else {
+	while (c->rstate == R_RUNNING)
+	  veThrCondWait(reactor_done,reactor_mutex);
+      }
+    }
+  }
+  veThrMutexUnlock(reactor_mutex);
+  return self;
 }
 
 /* assume we don't like partial reads.
@@ -752,6 +1110,181 @@ static int forceread(VeMPPosixFBuffer *f, int fd, void *buf, int n,
     return 1; /* timeout of some kind */
 }
 
+/* Payloads at least this big that are not already sitting in the
+   receive buffer are read straight from the descriptor into the
+   packet's buffer rather than bouncing through the receive buffer. */
+#define DIRECT_MIN 4096
+
+/* Like forceread() with no timeout, but only for stream descriptors
+   (i.e. not UDP) where we can read exactly as much as we need.
+   Whatever is already buffered is used first.
+   Note return value:
+   0  --> success
+   -1 --> error
+*/
+static int forceread_direct(VeMPPosixConn *c, VeMPPosixFBuffer *f, int fd,
+			    void *buf, int n) {
+  char *b = (char *)buf;
+  int k;
+
+  if ((k = f->use - f->top) > 0) {
+    if (k > n)
+      k = n;
+    memcpy(b,f->buf+f->top,k);
+    f->top += k;
+    if (f->top >= f->use)
+      f->top = f->use = 0;
+    b += k;
+    n -= k;
+  }
+  if (n <= 0)
+    return 0;
+  if (n < DIRECT_MIN)
+    return forceread(f,fd,b,n,-1);
+  VE_DEBUGM(7,("direct read on fd %d (%d bytes)",fd,n));
+  veMPPktPoolNoteDirect(c->pool,n);
+  while (n > 0) {
+    errno = 0;
+    k = read(fd,b,n);
+    io_note(0,k > 0 ? k : 0);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0) {
+      perror("read");
+      return -1;
+    }
+    b += k;
+    n -= k;
+  }
+  return 0;
+}
+
+/** misc
+    <p>Packets are not sent as raw <code>VeMPPkt</code> structures.
+    Every packet is preceded by a fixed-size header with all fields
+    in network (big-endian) byte order, so that masters and slaves
+    of different word sizes and byte orders can talk to each other:</p>
+    <pre>
+    offset  size  field
+    0       2     magic (0x5645 - "VE")
+    2       1     wire version (WIRE_VERSION)
+    3       1     flags (WIRE_F_CRC, WIRE_F_MCAST)
+    4       2     message id
+    6       1     channel
+    7       1     (reserved - 0)
+    8       4     tag (signed)
+    12      4     sequence number (low 32 bits, or the multicast
+                  sequence number if WIRE_F_MCAST is set)
+    16      4     payload length
+    [20     4     CRC-32 of header and payload - only if WIRE_F_CRC]
+    </pre>
+    <p>A packet with a bad magic number or an unknown version is
+    treated as a connection error.  The version is also checked
+    explicitly when a connection is prepared (see
+    <code>SYSDEP_CONNKEY</code>), which is also where the use of
+    CRCs is agreed upon.  CRCs are requested by the master with
+    <code>-ve_opt mp_crc 1</code>.</p>
+*/
+#define WIRE_MAGIC    0x5645
+#define WIRE_VERSION  1
+#define WIRE_F_CRC    0x1
+#define WIRE_F_MCAST  0x2   /* part of the multicast sequence (possibly
+			       a repair sent over the reliable channel) */
+#define WIRE_HDRSZ    20
+#define WIRE_CRCSZ    4
+
+static void put16(unsigned char *b, unsigned v) {
+  b[0] = (v >> 8) & 0xff;
+  b[1] = v & 0xff;
+}
+
+static void put32(unsigned char *b, unsigned long v) {
+  b[0] = (v >> 24) & 0xff;
+  b[1] = (v >> 16) & 0xff;
+  b[2] = (v >> 8) & 0xff;
+  b[3] = v & 0xff;
+}
+
+static unsigned get16(unsigned char *b) {
+  return (b[0] << 8) | b[1];
+}
+
+static unsigned long get32(unsigned char *b) {
+  return ((unsigned long)b[0] << 24) | ((unsigned long)b[1] << 16) |
+    ((unsigned long)b[2] << 8) | (unsigned long)b[3];
+}
+
+/* standard (IEEE 802.3) CRC-32 */
+static unsigned long crc_table[256];
+static int crc_table_ready = 0;
+
+static unsigned long wire_crc(unsigned long crc, void *buf, int n) {
+  unsigned char *b = (unsigned char *)buf;
+  if (!crc_table_ready) {
+    /* harmless if two threads race here - both build the same table */
+    unsigned long c;
+    int k, j;
+    for(k = 0; k < 256; k++) {
+      c = (unsigned long)k;
+      for(j = 0; j < 8; j++)
+	c = (c & 1) ? (0xedb88320UL ^ (c >> 1)) : (c >> 1);
+      crc_table[k] = c;
+    }
+    crc_table_ready = 1;
+  }
+  crc = crc ^ 0xffffffffUL;
+  while (n-- > 0)
+    crc = crc_table[(crc ^ *b++) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffffUL;
+}
+
+/* encodes the header for p into b (which must have room for
+   WIRE_HDRSZ+WIRE_CRCSZ bytes) and returns the encoded size */
+static int wire_encode(unsigned char *b, VeMPPkt *p, void *data, int flags) {
+  put16(b,WIRE_MAGIC);
+  b[2] = WIRE_VERSION;
+  b[3] = flags;
+  put16(b+4,(unsigned)p->msg);
+  b[6] = (unsigned char)p->ch;
+  b[7] = 0;
+  put32(b+8,(unsigned long)p->tag);
+  put32(b+12,p->seq);
+  put32(b+16,(unsigned long)p->dlen);
+  if (!(flags & WIRE_F_CRC))
+    return WIRE_HDRSZ;
+  put32(b+WIRE_HDRSZ,wire_crc(wire_crc(0,b,WIRE_HDRSZ),data,p->dlen));
+  return WIRE_HDRSZ+WIRE_CRCSZ;
+}
+
+/* decodes a WIRE_HDRSZ header into p - returns the flags on success
+   or -1 if this is not a header we understand */
+static int wire_decode(unsigned char *b, VeMPPkt *p) {
+  unsigned long v;
+  if (get16(b) != WIRE_MAGIC) {
+    veError(MODULE,"bad packet magic (0x%04x) - peer is not speaking "
+	    "a compatible MP protocol",get16(b));
+    return -1;
+  }
+  if (b[2] != WIRE_VERSION) {
+    veError(MODULE,"peer speaks MP wire version %d, expected %d",
+	    b[2],WIRE_VERSION);
+    return -1;
+  }
+  p->msg = get16(b+4);
+  p->ch = b[6];
+  v = get32(b+8);
+  /* sign-extend on hosts where long is wider than 32 bits */
+  p->tag = (v & 0x80000000UL) ? -(int)((~v & 0xffffffffUL) + 1) : (int)v;
+  p->seq = get32(b+12);
+  v = get32(b+16);
+  if (v > 0x7fffffffUL) {
+    veError(MODULE,"bad payload length in packet header: %lu",v);
+    return -1;
+  }
+  p->dlen = (int)v;
+  return b[3];
+}
+
 #define MAX_KEY_BUF 256
 #define MAX_CHECK_BUF 256
 
@@ -916,7 +1449,9 @@ void veMPImplCleanup(void) {
 static VeMPPosixConn *create_conn(void) {
   VeMPPosixConn *c;
   c = veAllocObj(VeMPPosixConn);
-  c->rel_recv_fd = c->rel_send_fd = c->fast_fd = -1;
+  c->rel_recv_fd = c->rel_send_fd = c->fast_fd = c->mcast_fd = -1;
+  c->pool = veMPPktPoolCreate();
+  c->send_mutex = veThrMutexCreate();
   /* add to list */
   c->next = conn_list;
   if (conn_list)
@@ -954,8 +1489,422 @@ VeMPImplConn veMPImplSlaveCreate(int *args, char **argv) {
 #define SYSDEP_BESTADDR 0x1   /* request appropriate IP address */
 #define SYSDEP_CONNUDP  0x2   /* start UDP-based connection (FAST) */
 #define SYSDEP_CONNKEY  0x3   /* simple sanity check initialization */
+#define SYSDEP_MCAST    0x4   /* join multicast group */
+#define SYSDEP_MNACK    0x5   /* slave is missing multicast packets */
+#define SYSDEP_MGAP     0x6   /* master cannot repair multicast packets */
+/* how long (in seconds) the master waits for the answer to SYSDEP_CONNKEY
+   - a slave that does not speak our wire format may never answer */
+#define CONNKEY_TIMEOUT 15
 #define ADDRSIZE 80
 #define DELIM " \r\t\n"
+
+static int send_pkt(VeMPPosixConn *c, VeMPPkt *pp, int flags);
+
+/** misc
+    <b>Multicast fan-out</b>
+    <p>When the master sends a <code>VE_MP_FAST</code> or
+    <code>VE_MP_MCAST</code> message to all slaves, a single UDP
+    datagram is sent to a multicast group which every independent
+    (local or remote) slave joins when it is spawned.  Thread slaves
+    and slaves which fail to join are still sent individual copies by
+    the platform-independent layer.</p>
+    <p>Multicast packets carry their own sequence number.  A slave
+    which sees a gap holds on to later packets (up to
+    <code>MCAST_WINDOW</code> of them) and asks the master for the
+    missing ones over the reliable channel (<code>SYSDEP_MNACK</code>).
+    The master keeps the last <code>MCAST_HIST</code> packets around
+    and resends them over the reliable channel; packets that have
+    fallen out of the history are reported as lost
+    (<code>SYSDEP_MGAP</code>).  If repairs do not arrive within
+    <code>MCAST_GAP_MS</code> milliseconds the slave skips the gap -
+    this is no worse than <code>VE_MP_FAST</code> over unicast UDP.</p>
+    <p>The following options (<code>-ve_opt</code>) affect multicast:
+    <code>mp_mcast</code> (set to 0 to disable multicast entirely),
+    <code>mp_mcast_group</code> (group address, default
+    <code>MCAST_GROUP</code>), <code>mp_mcast_port</code> (default is an
+    unused port picked by the master), <code>mp_mcast_if</code>
+    (address of the interface to use - e.g. 127.0.0.1 to test on a
+    single machine) and <code>mp_mcast_ttl</code> (default 1).
+    If the group cannot be set up, everything falls back to unicast.</p>
+*/
+#define MCAST_GROUP  "239.255.86.69"
+#define MCAST_HIST   256
+#define MCAST_GAP_MS 50
+
+/* master side */
+typedef struct ve_mp_posix_mhist {
+  int valid;
+  VeMPPkt pkt;   /* data points to a private copy of size "spc" */
+  int spc;
+} VeMPPosixMHist;
+
+static VeThrMutex *mcast_mutex = NULL;
+static int mcast_send_fd = -1;
+static int mcast_port = 0;
+static char mcast_group[ADDRSIZE];
+static char mcast_if[ADDRSIZE];
+static int mcast_crc = 0;
+static unsigned long mcast_seq = 0; /* next sequence number */
+static VeMPPosixMHist mcast_hist[MCAST_HIST];
+
+/* difference between two (32-bit, wrapping) sequence numbers */
+static long mcast_diff(unsigned long a, unsigned long b) {
+  unsigned long d = (a - b) & 0xffffffffUL;
+  return (d & 0x80000000UL) ? -(long)(((~d) & 0xffffffffUL) + 1) : (long)d;
+}
+
+/* a UDP port that is not in use right now, or -1 */
+static int unused_udp_port(void) {
+  struct sockaddr_in addr;
+  socklen_t alen = sizeof(addr);
+  int fd, port = -1;
+
+  if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+    return -1;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = 0;
+  if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) == 0 &&
+      getsockname(fd,(struct sockaddr *)&addr,&alen) == 0)
+    port = ntohs(addr.sin_port);
+  close(fd);
+  return port;
+}
+
+int veMPImplMcastCreate(void) {
+  struct sockaddr_in addr;
+  unsigned char ttl, loop = 1;
+  struct in_addr ifaddr;
+  char *s;
+  int fd;
+
+  if (mcast_send_fd >= 0)
+    return 0; /* already done */
+  if ((s = veGetOption("mp_mcast")) && !atoi(s)) {
+    VE_DEBUGM(2,("multicast disabled by option"));
+    return -1;
+  }
+  strncpy(mcast_group,(s = veGetOption("mp_mcast_group")) ? s : MCAST_GROUP,
+	  ADDRSIZE);
+  mcast_group[ADDRSIZE-1] = '\0';
+  strncpy(mcast_if,(s = veGetOption("mp_mcast_if")) ? s : "0.0.0.0",
+	  ADDRSIZE);
+  mcast_if[ADDRSIZE-1] = '\0';
+  ttl = (s = veGetOption("mp_mcast_ttl")) ? atoi(s) : 1;
+  mcast_crc = (s = veGetOption("mp_crc")) && atoi(s);
+
+  VE_DEBUGM(2,("creating multicast group %s (if %s)",mcast_group,mcast_if));
+  /* The sender itself is not bound to the group's port: loopback has
+     to stay on for slaves on this host, so a socket bound there would
+     be handed all of the group's traffic and, never reading it, fill
+     its receive buffer for good.  It sends from an ephemeral port
+     instead. */
+  if ((s = veGetOption("mp_mcast_port")) && atoi(s) > 0)
+    mcast_port = atoi(s);
+  else if ((mcast_port = unused_udp_port()) < 0) {
+    veWarning(MODULE,"multicast unavailable - cannot find a port: %s",
+	      strerror(errno));
+    return -1;
+  }
+  if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+    veWarning(MODULE,"multicast unavailable - cannot create socket: %s",
+	      strerror(errno));
+    return -1;
+  }
+  ifaddr.s_addr = inet_addr(mcast_if);
+  if (setsockopt(fd,IPPROTO_IP,IP_MULTICAST_TTL,&ttl,sizeof(ttl)) < 0 ||
+      setsockopt(fd,IPPROTO_IP,IP_MULTICAST_LOOP,&loop,sizeof(loop)) < 0 ||
+      (ifaddr.s_addr != INADDR_ANY &&
+       setsockopt(fd,IPPROTO_IP,IP_MULTICAST_IF,&ifaddr,sizeof(ifaddr)) < 0)) {
+    veWarning(MODULE,"multicast unavailable - cannot set socket options: %s",
+	      strerror(errno));
+    close(fd);
+    return -1;
+  }
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(mcast_port);
+  addr.sin_addr.s_addr = inet_addr(mcast_group);
+  if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+    veWarning(MODULE,"multicast unavailable - cannot connect to %s:%d: %s",
+	      mcast_group,mcast_port,strerror(errno));
+    close(fd);
+    return -1;
+  }
+  mcast_mutex = veThrMutexCreate();
+  mcast_send_fd = fd;
+  VE_DEBUGM(1,("multicast group %s:%d ready",mcast_group,mcast_port));
+  return 0;
+}
+
+int veMPImplMcastJoin(VeMPImplConn c_v) {
+  VeMPPosixConn *c = (VeMPPosixConn *)(c_v);
+  char str[3*ADDRSIZE];
+  unsigned long seq;
+  VeMPPkt *p;
+  int ok;
+
+  if (mcast_send_fd < 0)
+    return -1;
+  veThrMutexLock(mcast_mutex);
+  seq = mcast_seq;
+  veThrMutexUnlock(mcast_mutex);
+  /* anything sent between now and when the slave actually joins will
+     be repaired in the usual way */
+  sprintf(str,"%s %d %s %lu",mcast_group,mcast_port,mcast_if,seq);
+  VE_DEBUGM(2,("asking slave to join multicast group: %s",str));
+  if (veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG__SYSDEP,SYSDEP_MCAST,
+		    str,strlen(str)+1)) {
+    veError(MODULE,"failed to send SYSDEP_MCAST: %s",strerror(errno));
+    return -1;
+  }
+  if (veMPImplRecv(c,&p,-1)) {
+    veError(MODULE,"failed to receive response to SYSDEP_MCAST");
+    return -1;
+  }
+  ok = (p && p->msg == VE_MPMSG__SYSDEP && p->tag == SYSDEP_MCAST &&
+	p->data && p->dlen > 0 && strncmp(p->data,"ok",p->dlen) == 0);
+  if (p)
+    veMPPktDestroy(p);
+  if (!ok) {
+    veWarning(MODULE,"slave could not join multicast group - using unicast");
+    return -1;
+  }
+  return 0;
+}
+
+int veMPImplMcastSend(int msg, int tag, void *data, int dlen) {
+  unsigned char hdr[WIRE_HDRSZ+WIRE_CRCSZ];
+  struct iovec v[2];
+  VeMPPosixMHist *h;
+  VeMPPkt p;
+  int n = 0, tot = 0;
+
+  if (mcast_send_fd < 0)
+    return -1;
+  if (!data || dlen < 0)
+    dlen = 0;
+  if (dlen > MAX_PAYLOAD)
+    return 1; /* too big for a datagram */
+
+  veThrMutexLock(mcast_mutex);
+  p.seq = mcast_seq;
+  p.ch = VE_MP_FAST;
+  p.msg = msg;
+  p.tag = tag;
+  p.dlen = dlen;
+  p.data = NULL;
+  v[n].iov_base = (void *)hdr;
+  v[n].iov_len = wire_encode(hdr,&p,data,
+			     WIRE_F_MCAST | (mcast_crc ? WIRE_F_CRC : 0));
+  tot += v[n].iov_len;
+  n++;
+  if (dlen > 0) {
+    v[n].iov_base = data;
+    v[n].iov_len = dlen;
+    tot += v[n].iov_len;
+    n++;
+  }
+  VE_DEBUGM(3,("send: multicast seq %lu, %d bytes",p.seq,tot));
+  errno = 0;
+  io_note(1,tot);
+  if (writev(mcast_send_fd,v,n) != tot) {
+    veThrMutexUnlock(mcast_mutex);
+    veError(MODULE,"multicast writev failed: %s",strerror(errno));
+    return -1;
+  }
+  /* remember it in case somebody missed it */
+  h = &(mcast_hist[p.seq % MCAST_HIST]);
+  if (dlen > h->spc) {
+    veFree(h->pkt.data);
+    h->pkt.data = veAlloc(dlen,0);
+    h->spc = dlen;
+  }
+  if (dlen > 0)
+    memcpy(h->pkt.data,data,dlen);
+  p.data = h->pkt.data;
+  h->pkt = p;
+  h->valid = 1;
+  mcast_seq = (mcast_seq + 1) & 0xffffffffUL;
+  veThrMutexUnlock(mcast_mutex);
+  return 0;
+}
+
+/* master: resend [first,first+count) to the slave on c */
+static void mcast_repair(VeMPPosixConn *c, unsigned long first,
+			 unsigned long count) {
+  unsigned long seq, lost = 0, k;
+  VeMPPosixMHist *h;
+  VeMPPkt **copy;
+  char str[ADDRSIZE];
+
+  if (mcast_send_fd < 0)
+    return;
+  if (count > MCAST_HIST)
+    count = MCAST_HIST;
+  VE_DEBUGM(3,("repairing multicast %lu+%lu",first,count));
+  /* copy what is still in the history, so that the lock is not held
+     while sending to a slow slave */
+  copy = veAlloc(sizeof(VeMPPkt *)*(count+1),1);
+  veThrMutexLock(mcast_mutex);
+  for(k = 0; k < count; k++) {
+    seq = (first + k) & 0xffffffffUL;
+    h = &(mcast_hist[seq % MCAST_HIST]);
+    if (!(h->valid && h->pkt.seq == seq))
+      continue; /* no longer have it */
+    copy[k] = veMPPktCreate(h->pkt.dlen);
+    copy[k]->seq = h->pkt.seq;
+    copy[k]->ch = h->pkt.ch;
+    copy[k]->msg = h->pkt.msg;
+    copy[k]->tag = h->pkt.tag;
+    if (h->pkt.dlen > 0)
+      memcpy(copy[k]->data,h->pkt.data,h->pkt.dlen);
+  }
+  veThrMutexUnlock(mcast_mutex);
+
+  for(k = 0; k <= count; k++) {
+    seq = (first + k) & 0xffffffffUL;
+    if (k < count && !copy[k]) {
+      lost++;
+      continue;
+    }
+    if (lost > 0) {
+      /* report the run of lost packets that just ended */
+      sprintf(str,"%lu %lu",(seq - lost) & 0xffffffffUL,lost);
+      veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG__SYSDEP,SYSDEP_MGAP,
+		    str,strlen(str)+1);
+      lost = 0;
+    }
+    if (k < count) {
+      send_pkt(c,copy[k],WIRE_F_MCAST | (c->crc ? WIRE_F_CRC : 0));
+      veMPPktDestroy(copy[k]);
+    }
+  }
+  veFree(copy);
+}
+
+/* slave side */
+static int mcast_join(VeMPPosixConn *c, char *group, int port,
+		      char *ifaddr, unsigned long seq) {
+  struct sockaddr_in addr;
+  struct ip_mreq mreq;
+  int fd, on = 1;
+
+  VE_DEBUGM(2,("joining multicast group %s:%d",group,port));
+  if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+    veWarning(MODULE,"cannot create multicast socket: %s",strerror(errno));
+    return -1;
+  }
+  setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  /* binding to the group address filters out anything else that
+     shows up on this port */
+  addr.sin_addr.s_addr = inet_addr(group);
+  addr.sin_port = htons(port);
+  if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+    veWarning(MODULE,"cannot bind multicast socket: %s",strerror(errno));
+    close(fd);
+    return -1;
+  }
+  mreq.imr_multiaddr.s_addr = inet_addr(group);
+  mreq.imr_interface.s_addr = inet_addr(ifaddr);
+  if (setsockopt(fd,IPPROTO_IP,IP_ADD_MEMBERSHIP,&mreq,sizeof(mreq)) < 0) {
+    veWarning(MODULE,"cannot join multicast group %s: %s",group,
+	      strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (c->mcast_fd >= 0)
+    close(c->mcast_fd);
+  c->mcast_fd = fd;
+  c->mcast_buf.top = c->mcast_buf.use = 0;
+  c->mcast_expect = c->mcast_nacked = seq;
+  c->mcast_gap = 0;
+  return 0;
+}
+
+/* slave: accept a packet from the multicast sequence (either from
+   the group or a repair) */
+static void mcast_accept(VeMPPosixConn *c, VeMPPkt *p) {
+  long d = mcast_diff(p->seq,c->mcast_expect);
+  int slot;
+
+  if (d >= MCAST_WINDOW) {
+    /* too far ahead to wait for repairs - give up on everything
+       before this packet */
+    int k;
+    veWarning(MODULE,"lost %ld multicast packets",d);
+    for(k = 0; k < MCAST_WINDOW; k++)
+      if (c->mcast_q[k]) {
+	veMPPktDestroy(c->mcast_q[k]);
+	c->mcast_q[k] = NULL;
+      }
+    c->mcast_nq = 0;
+    c->mcast_expect = c->mcast_nacked = p->seq;
+    d = 0;
+  }
+  slot = p->seq % MCAST_WINDOW;
+  if (d < 0 || c->mcast_q[slot]) {
+    VE_DEBUGM(4,("dropping duplicate multicast packet %lu",p->seq));
+    veMPPktDestroy(p);
+    return;
+  }
+  c->mcast_q[slot] = p;
+  c->mcast_nq++;
+  if (d > 0) {
+    /* there's a gap - ask for anything we haven't asked for yet */
+    if (mcast_diff(p->seq,c->mcast_nacked) >= 0) {
+      unsigned long from;
+      char str[ADDRSIZE];
+      from = (mcast_diff(c->mcast_nacked,c->mcast_expect) > 0) ?
+	c->mcast_nacked : c->mcast_expect;
+      if (from != p->seq) {
+	sprintf(str,"%lu %ld",from,mcast_diff(p->seq,from));
+	VE_DEBUGM(3,("requesting multicast repair: %s",str));
+	veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG__SYSDEP,SYSDEP_MNACK,
+		      str,strlen(str)+1);
+      }
+      c->mcast_nacked = (p->seq + 1) & 0xffffffffUL;
+    }
+    if (!c->mcast_gap)
+      c->mcast_gap = veClock() + MCAST_GAP_MS;
+  }
+}
+
+/* slave: next in-order packet from the multicast sequence, if any */
+static VeMPPkt *mcast_next(VeMPPosixConn *c) {
+  VeMPPkt *p;
+  int slot, k;
+
+  if (c->mcast_nq == 0) {
+    c->mcast_gap = 0;
+    return NULL;
+  }
+  slot = c->mcast_expect % MCAST_WINDOW;
+  if (!c->mcast_q[slot] && c->mcast_gap && veClock() >= c->mcast_gap) {
+    /* waited long enough - skip to the next packet we do have */
+    for(k = 0; k < MCAST_WINDOW && !c->mcast_q[slot]; k++) {
+      c->mcast_expect = (c->mcast_expect + 1) & 0xffffffffUL;
+      slot = c->mcast_expect % MCAST_WINDOW;
+    }
+    VE_DEBUGM(2,("gave up on %d multicast packets",k));
+    c->mcast_gap = 0;
+  }
+  if (!(p = c->mcast_q[slot]))
+    return NULL;
+  c->mcast_q[slot] = NULL;
+  c->mcast_nq--;
+  c->mcast_expect = (c->mcast_expect + 1) & 0xffffffffUL;
+  if (mcast_diff(c->mcast_nacked,c->mcast_expect) < 0)
+    c->mcast_nacked = c->mcast_expect;
+  if (c->mcast_nq == 0)
+    c->mcast_gap = 0;
+  else if (!c->mcast_q[c->mcast_expect % MCAST_WINDOW] && !c->mcast_gap)
+    c->mcast_gap = veClock() + MCAST_GAP_MS;
+  return p;
+}
 int veMPImplSysdep(VeMPImplConn c_v, VeMPPkt *p) {
   VeMPPosixConn *c = (VeMPPosixConn *)(c_v);
 
@@ -1027,6 +1976,92 @@ int veMPImplSysdep(VeMPImplConn c_v, VeMPPkt *p) {
     }
     break;
 
+  case SYSDEP_CONNKEY:
+    /* master is checking that we speak the same wire format and
+       whether to use CRCs */
+    {
+      /* argument is a string of the format:
+	 VEMP <version> <flags>
+      */
+      char str[ADDRSIZE];
+      int ver = -1, wflags = 0;
+
+      VE_DEBUGM(2,("handling SYSDEP_CONNKEY"));
+      if (!p->data || p->dlen <= 0 ||
+	  ((char *)p->data)[p->dlen-1] != '\0' ||
+	  sscanf(p->data,"VEMP %d %d",&ver,&wflags) != 2) {
+	veError(MODULE, "malformed SYSDEP_CONNKEY");
+	return -1;
+      }
+      if (ver != WIRE_VERSION) {
+	veError(MODULE, "master speaks MP wire version %d, expected %d",
+		ver, WIRE_VERSION);
+	return -1;
+      }
+      /* we understand all flags in this version */
+      wflags &= WIRE_F_CRC;
+      sprintf(str,"VEMP %d %d",WIRE_VERSION,wflags);
+      veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG__SYSDEP,SYSDEP_CONNKEY,
+		    (void *)str,strlen(str)+1);
+      c->crc = (wflags & WIRE_F_CRC);
+      VE_DEBUGM(2,("wire version %d, crc %s",WIRE_VERSION,
+		   c->crc ? "on" : "off"));
+    }
+    break;
+
+  case SYSDEP_MCAST:
+    /* master has asked us to join its multicast group */
+    {
+      /* argument is a string of the format:
+	 <group> <port> <interface> <next-sequence>
+      */
+      char group[ADDRSIZE], ifaddr[ADDRSIZE];
+      unsigned long seq;
+      int port;
+      char *res = "fail";
+
+      VE_DEBUGM(2,("handling SYSDEP_MCAST"));
+      if (p->data && p->dlen > 0 && ((char *)p->data)[p->dlen-1] == '\0' &&
+	  strlen(p->data) < ADDRSIZE &&
+	  sscanf(p->data,"%s %d %s %lu",group,&port,ifaddr,&seq) == 4) {
+	if (mcast_join(c,group,port,ifaddr,seq) == 0)
+	  res = "ok";
+      } else
+	veError(MODULE, "malformed SYSDEP_MCAST");
+      veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG__SYSDEP,SYSDEP_MCAST,
+		    res,strlen(res)+1);
+    }
+    break;
+
+  case SYSDEP_MNACK:
+  case SYSDEP_MGAP:
+    /* argument is a string of the format:
+       <first> <count>
+    */
+    {
+      unsigned long first, count, seq;
+      
+      if (!p->data || p->dlen <= 0 || ((char *)p->data)[p->dlen-1] != '\0' ||
+	  sscanf(p->data,"%lu %lu",&first,&count) != 2) {
+	veError(MODULE, "malformed SYSDEP_%s",
+		p->tag == SYSDEP_MNACK ? "MNACK" : "MGAP");
+	return -1;
+      }
+      if (p->tag == SYSDEP_MNACK) {
+	/* slave wants packets resent */
+	mcast_repair(c,first,count);
+      } else if (c->mcast_fd >= 0) {
+	/* master cannot resend these - stop waiting for them */
+	VE_DEBUGM(2,("multicast packets %lu+%lu are lost",first,count));
+	seq = (first + count) & 0xffffffffUL;
+	while (mcast_diff(c->mcast_expect,first) >= 0 &&
+	       mcast_diff(c->mcast_expect,seq) < 0 &&
+	       !c->mcast_q[c->mcast_expect % MCAST_WINDOW])
+	  c->mcast_expect = (c->mcast_expect + 1) & 0xffffffffUL;
+      }
+    }
+    break;
+
   case SYSDEP_BESTADDR:
     {
       /* look at existing address to determine which address we should be
@@ -1072,6 +2107,53 @@ int veMPImplPrepare(VeMPImplConn c_v, int flags) {
 
   VE_DEBUGM(2,("preparing slave connection"));
 
+  io_stat_init();
+
+  {
+    /* check wire format and agree on CRCs before anything else */
+    char str[ADDRSIZE];
+    char *s;
+    VeMPPkt *p;
+    int ver = -1, wflags = 0, k;
+
+    if ((s = veGetOption("mp_crc")) && atoi(s))
+      wflags |= WIRE_F_CRC;
+    sprintf(str,"VEMP %d %d",WIRE_VERSION,wflags);
+    VE_DEBUGM(2,("sending connkey: %s",str));
+    if (veMPImplSendv(c,0,VE_MP_RELIABLE,VE_MPMSG__SYSDEP,SYSDEP_CONNKEY,
+		      str,strlen(str)+1)) {
+      veError(MODULE,"failed to send SYSDEP_CONNKEY: %s",strerror(errno));
+      return -1;
+    }
+    if ((k = veMPImplRecv(c,&p,CONNKEY_TIMEOUT*1000000L))) {
+      if (k > 0)
+	veError(MODULE,"no response to SYSDEP_CONNKEY in %d seconds - "
+		"slave is probably running an incompatible version of VE",
+		CONNKEY_TIMEOUT);
+      else
+	veError(MODULE,"failed to receive response to SYSDEP_CONNKEY "
+		"(slave may be running an incompatible version)");
+      return -1;
+    }
+    if (!p || p->msg != VE_MPMSG__SYSDEP || p->tag != SYSDEP_CONNKEY ||
+	!p->data || p->dlen <= 0 || ((char *)p->data)[p->dlen-1] != '\0' ||
+	sscanf(p->data,"VEMP %d %d",&ver,&wflags) != 2) {
+      veError(MODULE,"invalid response to SYSDEP_CONNKEY");
+      if (p)
+	veMPPktDestroy(p);
+      return -1;
+    }
+    veMPPktDestroy(p);
+    if (ver != WIRE_VERSION) {
+      veError(MODULE,"slave speaks MP wire version %d, expected %d",
+	      ver,WIRE_VERSION);
+      return -1;
+    }
+    c->crc = (wflags & WIRE_F_CRC);
+    VE_DEBUGM(2,("wire version %d, crc %s",WIRE_VERSION,
+		 c->crc ? "on" : "off"));
+  }
+
   if (c->method && (strcmp(c->method,VE_MP_REMOTE) == 0)) {
     /* this is a remote connection */
     /* attempt to reconnect */
@@ -1169,9 +2251,63 @@ int veMPImplPrepare(VeMPImplConn c_v, int flags) {
   return 0;
 }
 
-int veMPImplRecv(VeMPImplConn c_v, VeMPPkt **p_r, long tmout) {
-  VeMPPosixConn *c = (VeMPPosixConn *)(c_v);
+/* read one packet from a buffer/descriptor pair
+   Note return value:
+   0  --> success
+   -1 --> error
+   1  --> timeout
+*/
+static int read_pkt(VeMPPosixConn *c, VeMPPosixFBuffer *f, int fd,
+		    int is_stream, long tmout, VeMPPkt **p_r) {
+  unsigned char hdr[WIRE_HDRSZ+WIRE_CRCSZ];
   VeMPPkt ptmp, *p;
+  int k, flags;
+
+  if ((k = forceread(f,fd,hdr,WIRE_HDRSZ,tmout)))
+    return k;
+  if ((flags = wire_decode(hdr,&ptmp)) < 0)
+    return -1;
+  c->rx_flags = flags;
+  if ((flags & WIRE_F_CRC) &&
+      forceread(f,fd,hdr+WIRE_HDRSZ,WIRE_CRCSZ,-1))
+    return -1;
+  p = veMPPktPoolAlloc(c->pool,ptmp.dlen);
+  p->seq = ptmp.seq;
+  p->ch = ptmp.ch;
+  p->msg = ptmp.msg;
+  p->tag = ptmp.tag;
+  if (p->dlen > 0) {
+    /* we're reading the payload now - note that we switch over to
+       a "-1" timeout at this point to avoid reading a payload
+       fragment. */
+    if (is_stream)
+      k = forceread_direct(c,f,fd,p->data,p->dlen);
+    else
+      k = forceread(f,fd,p->data,p->dlen,-1);
+    if (k) {
+      VE_DEBUGM(3,("receive: payload failed: %s",strerror(errno)));
+      veMPPktDestroy(p);
+      return -1;
+    }
+  }
+  if ((flags & WIRE_F_CRC) &&
+      get32(hdr+WIRE_HDRSZ) != 
+      wire_crc(wire_crc(0,hdr,WIRE_HDRSZ),p->data,p->dlen)) {
+    veError(MODULE,"CRC mismatch on packet (msg=%d, tag=%d, %d bytes)",
+	    p->msg,p->tag,p->dlen);
+    veMPPktDestroy(p);
+    return -1;
+  }
+  if (p_r)
+    *p_r = p;
+  else
+    veMPPktDestroy(p);
+  return 0;
+}
+
+/* read the next packet from whichever stream has one - this does
+   not deal with ordering of the multicast stream */
+static int recv_raw(VeMPPosixConn *c, VeMPPkt **p_r, long tmout) {
   int k;
   int rel_first;
   
@@ -1193,31 +2329,13 @@ int veMPImplRecv(VeMPImplConn c_v, VeMPPkt **p_r, long tmout) {
     VE_DEBUGM(3,("receive: checking reliable first"));
     if (c->rel_buf.use > 0) {
       /* read in a packet */
-      if (k = forceread(&(c->rel_buf),c->rel_recv_fd,&ptmp,
-			sizeof(ptmp),tmout)) {
+      if ((k = read_pkt(c,&(c->rel_buf),c->rel_recv_fd,1,tmout,p_r))) {
 	if (k < 0) {
 	  VE_DEBUGM(3,("receive: read failed: %s", strerror(errno)));
 	  return -1; /* that's bad */
 	}
 	goto skip_pipe1;
       }
-      p = veMPPktCreate(0);
-      *p = ptmp;
-      p->data = NULL;
-      if (p->dlen > 0) {
-	p->data = veAlloc(p->dlen,0);
-	/* we're reading the payload now - note that we switch over to
-	   a "-1" timeout at this point to avoid reading a payload
-	   fragment. */
-	if (forceread(&(c->rel_buf),c->rel_recv_fd,p->data,p->dlen,-1)) {
-	  VE_DEBUGM(3,("receive: payload failed: %s",strerror(errno)));
-	  return -1;
-	}
-      }
-      if (p_r)
-	*p_r = p;
-      else
-	veMPPktDestroy(p);
       c->rel_last = 1; /* last read from reliable stream */
       VE_DEBUGM(3,("receive: returning packet from reliable"));
       return 0; /* successful */
@@ -1229,81 +2347,104 @@ int veMPImplRecv(VeMPImplConn c_v, VeMPPkt **p_r, long tmout) {
   if (c->fast_fd >= 0 && c->fast_buf.use > 0) {
     /* read in a packet */
     VE_DEBUGM(3,("receive: checking fast pipe"));
-    if (k = forceread(&(c->fast_buf),c->fast_fd,&ptmp,
-		      sizeof(ptmp),tmout)) {
+    if ((k = read_pkt(c,&(c->fast_buf),c->fast_fd,0,tmout,p_r))) {
       if (k < 0) {
 	VE_DEBUGM(3,("receive: bad read on fast pipe: %s",strerror(errno)));
 	return -1; /* that's bad */
       }
       goto skip_pipe2;
     }
-    p = veMPPktCreate(0);
-    *p = ptmp;
-    p->data = NULL;
-    if (p->dlen > 0) {
-      p->data = veAlloc(p->dlen,0);
-      /* we're reading the payload now - note that we switch over to
-	 a "-1" timeout at this point to avoid reading a payload
-	 fragment. */
-      if (forceread(&(c->fast_buf),c->fast_fd,p->data,p->dlen,-1)) {
-	VE_DEBUGM(3,("receive: failed on fast pipe payload: %s",strerror(errno)));
-	return -1;
-      }
-    }
-    if (p_r)
-      *p_r = p;
-    else
-      veMPPktDestroy(p);
     c->rel_last = 0; /* last read from fast stream */
     VE_DEBUGM(3,("receive: returning packet from fast pipe"));
     return 0; /* successful */
   }
   
  skip_pipe2:
+  /* try the multicast stream */
+  if (c->mcast_fd >= 0 && c->mcast_buf.use > 0) {
+    VE_DEBUGM(3,("receive: checking multicast"));
+    if ((k = read_pkt(c,&(c->mcast_buf),c->mcast_fd,0,tmout,p_r))) {
+      if (k < 0) {
+	VE_DEBUGM(3,("receive: bad read on multicast: %s",strerror(errno)));
+	return -1; /* that's bad */
+      }
+      goto skip_pipe3;
+    }
+    VE_DEBUGM(3,("receive: returning packet from multicast"));
+    return 0; /* successful */
+  }
 
+ skip_pipe3:
   if (!rel_first) {
     /* check reliable stream last */
     VE_DEBUGM(3,("receive: checking reliable last"));
     if (c->rel_buf.use > 0) {
       /* read in a packet */
-      if (k = forceread(&(c->rel_buf),c->rel_recv_fd,&ptmp,
-			sizeof(ptmp),tmout)) {
+      if ((k = read_pkt(c,&(c->rel_buf),c->rel_recv_fd,1,tmout,p_r))) {
 	if (k < 0) {
 	  VE_DEBUGM(3,("receive: read failed: %s", strerror(errno)));
 	  return -1; /* that's bad */
 	}
-	goto skip_pipe3;
-      }
-      p = veMPPktCreate(0);
-      *p = ptmp;
-      p->data = NULL;
-      if (p->dlen > 0) {
-	p->data = veAlloc(p->dlen,0);
-	assert(p->data != NULL);
-	/* we're reading the payload now - note that we switch over to
-	   a "-1" timeout at this point to avoid reading a payload
-	   fragment. */
-	if (forceread(&(c->rel_buf),c->rel_recv_fd,p->data,p->dlen,-1)) {
-	  VE_DEBUGM(3,("receive: payload failed: %s",strerror(errno)));
-	  return -1;
-	}
+	goto skip_pipe4;
       }
-      if (p_r)
-	*p_r = p;
-      else
-	veMPPktDestroy(p);
       c->rel_last = 1; /* last read from reliable stream */
       VE_DEBUGM(3,("receive: returning packet from reliable"));
       return 0; /* successful */
     }
   }
 
- skip_pipe3:
+ skip_pipe4:
   /* we've skipped all pipes which means we've timedout everywhere */
   VE_DEBUGM(3,("receive: timeout - no packets available"));
   return 1;
 }
 
+int veMPImplRecv(VeMPImplConn c_v, VeMPPkt **p_r, long tmout) {
+  VeMPPosixConn *c = (VeMPPosixConn *)(c_v);
+  VeMPPkt *p;
+  long end = 0, wait, g;
+  int k;
+
+  if (c->mcast_fd < 0 && c->mcast_nq == 0)
+    return recv_raw(c,p_r,tmout); /* nothing to put in order */
+
+  if (p_r)
+    *p_r = NULL;
+  if (tmout > 0)
+    end = veClock() + tmout/1000;
+  for(;;) {
+    if ((p = mcast_next(c)))
+      break;
+    /* don't wait past the point where we would give up on a gap */
+    wait = tmout;
+    if (tmout > 0 && (wait = (end - veClock())*1000) < 0)
+      wait = 0;
+    if (c->mcast_gap) {
+      if ((g = (c->mcast_gap - veClock())*1000) < 0)
+	g = 0;
+      if (wait < 0 || g < wait)
+	wait = g;
+    }
+    if ((k = recv_raw(c,&p,wait))) {
+      if (k < 0)
+	return k;
+      if (c->mcast_gap && veClock() >= c->mcast_gap)
+	continue; /* mcast_next() will skip the gap */
+      if (tmout == 0 || (tmout > 0 && veClock() >= end))
+	return 1;
+      continue;
+    }
+    if (!(c->rx_flags & WIRE_F_MCAST))
+      break; /* not part of the multicast sequence */
+    mcast_accept(c,p);
+  }
+  if (p_r)
+    *p_r = p;
+  else
+    veMPPktDestroy(p);
+  return 0;
+}
+
 int veMPImplSendv(VeMPImplConn c, unsigned long seq, int ch,
 		  int msg, int tag, void *data, int dlen) {
   VeMPPkt p;
@@ -1318,7 +2459,12 @@ int veMPImplSendv(VeMPImplConn c, unsigned long seq, int ch,
 
 int veMPImplSend(VeMPImplConn c_v, VeMPPkt *pp) {
   VeMPPosixConn *c = (VeMPPosixConn *)c_v;
+  return send_pkt(c,pp,c->crc ? WIRE_F_CRC : 0);
+}
+
+static int send_pkt(VeMPPosixConn *c, VeMPPkt *pp, int flags) {
   VeMPPkt p;
+  unsigned char hdr[WIRE_HDRSZ+WIRE_CRCSZ];
   struct iovec v[2];
   int n = 0, tot = 0;
   p = *pp; /* make a copy to tweak */
@@ -1327,17 +2473,18 @@ int veMPImplSend(VeMPImplConn c_v, VeMPPkt *pp) {
      reliable pipe.
   */
   memset(v,0,sizeof(v));
+  if (p.ch == VE_MP_MCAST)
+    p.ch = VE_MP_FAST; /* a single slave is not a group */
   if ((p.ch != VE_MP_RELIABLE && p.ch != VE_MP_FAST) || 
       p.dlen > MAX_PAYLOAD || c->fast_fd < 0)
     p.ch = VE_MP_RELIABLE; /* default to reliable */
-  p.data = NULL; /* pointer is always bogus anyways in packet */
   if ((!pp->data && p.dlen != 0) || p.dlen < 0) {
     veWarning(MODULE,"correcting bogus payload properties: p.dlen = %d",p.dlen);
     p.dlen = 0; /* no data to send */
   }
 
-  v[n].iov_base = (void *)&p;
-  v[n].iov_len = sizeof(p);
+  v[n].iov_base = (void *)hdr;
+  v[n].iov_len = wire_encode(hdr,&p,pp->data,flags);
   tot += v[n].iov_len;
   n++;
   if (p.dlen > 0) {
@@ -1350,16 +2497,21 @@ int veMPImplSend(VeMPImplConn c_v, VeMPPkt *pp) {
 
   VE_DEBUGM(3,("send: sending %d bytes on %s", tot,
 	       (p.ch == VE_MP_RELIABLE ? "reliable" : "fast")));
+  veThrMutexLock(c->send_mutex);
+  io_note(1,tot);
   if (writev((p.ch == VE_MP_RELIABLE ? c->rel_send_fd : c->fast_fd),
 	     v,n) != tot) {
     veError(MODULE,"writev failed: %s",strerror(errno));
   }
+  veThrMutexUnlock(c->send_mutex);
   return 0;
 }
 
 void veMPImplDestroy(VeMPImplConn c_v) {
   VeMPPosixConn *c = (VeMPPosixConn *)c_v;
+  int in_ready;
   if (c) {
+    in_ready = reactor_forget(c);
     /* remove from list */
     if (c->next)
       c->next->prev = c->prev;
@@ -1371,13 +2523,24 @@ void veMPImplDestroy(VeMPImplConn c_v) {
     veFree(c->method);
     if (c->fast_fd >= 0)
       close(c->fast_fd);
+    if (c->mcast_fd >= 0) {
+      int k;
+      close(c->mcast_fd);
+      for(k = 0; k < MCAST_WINDOW; k++)
+	if (c->mcast_q[k])
+	  veMPPktDestroy(c->mcast_q[k]);
+    }
     if (c->rel_recv_fd >= 0)
       close(c->rel_recv_fd);
     if (c->rel_send_fd >= 0)
       close(c->rel_send_fd);
     if (c->pid > 0)
       kill(c->pid,SIGTERM);
-    veFree(c);
+    /* packets still held by the application keep the pool alive */
+    veMPPktPoolDestroy(c->pool);
+    veThrMutexDestroy(c->send_mutex);
+    if (!in_ready)
+      veFree(c);
   }
 }
 
@@ -1401,7 +2564,6 @@ VeMPImplConn veMPImplCreate(char *type, int id, char *node,
   if (strcmp(type,VE_MP_THREAD) == 0) {
     /* create "other" connection side */
     VeMPPosixConn *sl;
-    int sendp[2], recv[2];
     
     if (pipe(sendp) != 0 || pipe(recvp) != 0) {
       veError(MODULE,"failed to create pipes: %s",strerror(errno));
@@ -1445,6 +2607,9 @@ VeMPImplConn veMPImplCreate(char *type, int id, char *node,
 }
 
 void veMPImplEarlyInit(void) {
+  /* a slave going away must show up as a failed write on its
+     connection rather than killing the master */
+  signal(SIGPIPE,SIG_IGN);
   /* set up spawning helper */
   spawn_mutex = veThrMutexCreate();
   spawn_init();
@@ -18,8 +18,32 @@
 #define M_EXIT      0x5   /* shutdown notification */
 #define M_WINDOW    0x6   /* assign a window to a slave */
 
+#define SLV(x) ((x)?(x):"auto")
+
 /* *** Master Node Structures *** */
 
+/* Per-phase round-trip tracking.  A slave's response time includes the
+   time it takes to render (or swap), so the two phases of a frame keep
+   separate estimates.  The retransmit timeout follows Jacobson/Karels
+   (srtt + 4*rttvar) and only samples responses to messages that were
+   not re-sent (Karn's rule). */
+#define PH_RENDER 0
+#define PH_SWAP   1
+#define RTO_INIT  20.0  /* ms - until we have a sample */
+#define RTO_MIN   2.0
+#define RTO_MAX   200.0
+#define HIST_PUBLISH 100 /* frames between histogram statistic updates */
+
+typedef struct ve_render_rtt {
+  float srtt, rttvar, rto; /* ms */
+  int valid;               /* have we taken a sample yet? */
+  VeStatistic *lat;        /* latency histogram (first send to response) */
+  /* timing of the outstanding message */
+  long start;   /* veClockNano() of first send */
+  long sent;    /* veClockNano() of last (re-)send */
+  int resent;   /* non-zero if we have poked this slave again */
+} VeRenderRtt;
+
 /* information about a slave we are connected to */
 typedef struct ve_render_conn {
   int mpid;     /* MP identifier */
@@ -31,8 +55,20 @@ typedef struct ve_render_conn {
   /* initialization flag - returned by slave when we first start */
   int init;
   int stopped;
+  VeRenderRtt rtt[2]; /* indexed by PH_RENDER/PH_SWAP */
+  /* a slave that has dropped out (see veMPDropSlave()) is left out
+     of frame synchronization until it has swapped join_frame */
+  int absent;   /* one of RC_PRESENT, RC_LOST, RC_JOINING */
+  unsigned long join_frame;
+  /* windows assigned to this slave - to send again if it rejoins */
+  int nwnames;
+  char **wnames;
 } VeRenderConn;
 
+#define RC_PRESENT 0
+#define RC_LOST    1
+#define RC_JOINING 2
+
 static VeThrMutex *slaves_mutex = NULL;
 static unsigned long slave_ready_frame = 0;
 static int slave_ready_swapped = 1;
@@ -42,6 +78,22 @@ static VeThrCond *slaves_stopped_cond = NULL;
 static VeRenderConn *slaves = NULL;
 static int slave_spc = 0; /* how much space has been allocated... */
 static int slave_max = 0;
+static int render_running = 0; /* has veMPRenderRun() started the slaves? */
+static long slave_timeout = 0; /* ms - drop a slave that takes longer */
+
+/* Pipelined rendering: with a depth > 1 (option "mp_pipeline"),
+   veMPRenderFrame() returns as soon as it has sent RENDER and the
+   SWAP for each frame is sent from the message handler once every
+   slave has rendered that frame.  These are the frames that have been
+   sent but not yet swapped by every slave, oldest first. */
+#define PIPE_MAX 8
+typedef struct {
+  unsigned long frame;
+  int swap_sent;
+} VeRenderPipe;
+static int pipe_depth = 1;
+static VeRenderPipe pipe_q[PIPE_MAX];
+static int pipe_n = 0;
 
 /* find a slave connection on the master */
 static int find_slave(char *node, char *process, int async) {
@@ -74,9 +126,75 @@ static int find_slave(char *node, char *process, int async) {
   slaves[k].swapped = 1;
   slaves[k].init = 0;
   slaves[k].stopped = 0;
+  slaves[k].absent = RC_PRESENT;
+  slaves[k].nwnames = 0;
+  slaves[k].wnames = NULL;
+  {
+    char str[256];
+    int j;
+    for(j = PH_RENDER; j <= PH_SWAP; j++) {
+      slaves[k].rtt[j].srtt = slaves[k].rtt[j].rttvar = 0.0;
+      slaves[k].rtt[j].rto = RTO_INIT;
+      slaves[k].rtt[j].valid = 0;
+      slaves[k].rtt[j].resent = 0;
+      veSnprintf(str,256,"%s_latency[%s:%s]",
+		 j == PH_RENDER ? "render" : "swap",
+		 SLV(veMPSlaveNode(id)),SLV(veMPSlaveProcess(id)));
+      slaves[k].rtt[j].lat = veNewHistStatistic(MODULE,veDupString(str),
+						"ms",0.125);
+      veAddStatistic(slaves[k].rtt[j].lat);
+    }
+  }
   return k;
 }
 
+/* map an MP slave id onto our slave array */
+static int slave_of(int mpid) {
+  int k;
+  for (k = 0; k < slave_max; k++)
+    if (slaves[k].mpid == mpid)
+      return k;
+  return -1;
+}
+
+static float ns_to_ms(long ns) {
+  return (float)ns/1.0e6;
+}
+
+/* (re-)start the clock on a phase for a slave */
+static void slave_sent(int k, int ph) {
+  slaves[k].rtt[ph].start = slaves[k].rtt[ph].sent = veClockNano();
+  slaves[k].rtt[ph].resent = 0;
+}
+
+/* a slave has responded to the given phase */
+static void slave_responded(int k, int ph) {
+  VeRenderRtt *r = &(slaves[k].rtt[ph]);
+  long now = veClockNano();
+  float sample;
+
+  if (slaves[k].async)
+    return;
+  veHistStatAdd(r->lat,ns_to_ms(now - r->start));
+  if (r->resent)
+    return; /* ambiguous sample */
+  sample = ns_to_ms(now - r->sent);
+  if (!r->valid) {
+    r->srtt = sample;
+    r->rttvar = sample/2.0;
+    r->valid = 1;
+  } else {
+    float err = r->srtt - sample;
+    r->rttvar = 0.75*r->rttvar + 0.25*(err < 0.0 ? -err : err);
+    r->srtt = 0.875*r->srtt + 0.125*sample;
+  }
+  r->rto = r->srtt + 4.0*r->rttvar;
+  if (r->rto < RTO_MIN)
+    r->rto = RTO_MIN;
+  else if (r->rto > RTO_MAX)
+    r->rto = RTO_MAX;
+}
+
 /* *** Slave Node Data *** */
 
 typedef struct ve_render_thread {
@@ -99,6 +217,10 @@ typedef struct ve_render_slave {
   /* state */
   unsigned long active_frame;
   int swapped;
+  /* a RENDER that arrived before the previous frame was swapped
+     (pipelined master) */
+  int pending;
+  unsigned long pending_frame;
 
   int running; /* am I running? */
 } VeRenderSlave;
@@ -121,7 +243,9 @@ typedef struct {
    to see if a slave is in the requested state, or a
    *later* state */
 static int slave_is_ready(int k) {
-  if (slaves[k].async) { /* an asynchronous slave is always ready for more */
+  if (slaves[k].async || slaves[k].absent) {
+    /* an asynchronous slave is always ready for more and we do not
+       wait for one that is not there */
     return 1;
   }
   if (slaves[k].active_frame == slave_ready_frame &&
@@ -141,10 +265,63 @@ static int slaves_are_ready(void) {
   return 1; /* all slaves ready */
 }
 
+/* has slave k rendered (or moved past) frame f? */
+static int slave_rendered(int k, unsigned long f) {
+  return slaves[k].async || slaves[k].absent ||
+    slaves[k].active_frame >= f;
+}
+
+/* has slave k swapped (or moved past) frame f? */
+static int slave_swapped(int k, unsigned long f) {
+  return slaves[k].async || slaves[k].absent || slaves[k].active_frame > f ||
+    (slaves[k].active_frame == f && slaves[k].swapped);
+}
+
+static int slaves_rendered(unsigned long f) {
+  int k;
+  for (k = 0; k < slave_max; k++)
+    if (!slave_rendered(k,f))
+      return 0;
+  return 1;
+}
+
+static int slaves_swapped(unsigned long f) {
+  int k;
+  for (k = 0; k < slave_max; k++)
+    if (!slave_swapped(k,f))
+      return 0;
+  return 1;
+}
+
+/* Which message is slave k holding us up on?  Returns the tag of the
+   message (M_RENDER or M_SWAP) and its frame, or 0 if we are not
+   waiting on this slave. */
+static int slave_owes(int k, unsigned long *frame) {
+  int j;
+  if (slaves[k].async || slaves[k].absent)
+    return 0;
+  if (pipe_depth <= 1) {
+    if (slave_is_ready(k))
+      return 0;
+    *frame = slave_ready_frame;
+    return slave_ready_swapped ? M_SWAP : M_RENDER;
+  }
+  for (j = 0; j < pipe_n; j++)
+    if (!slave_swapped(k,pipe_q[j].frame)) {
+      *frame = pipe_q[j].frame;
+      if (pipe_q[j].swap_sent)
+	return M_SWAP;
+      if (!slave_rendered(k,pipe_q[j].frame))
+	return M_RENDER;
+      return 0; /* others have not rendered this frame yet */
+    }
+  return 0;
+}
+
 static int slaves_are_init(void) {
   int k;
   for (k = 0; k < slave_max; k++)
-    if (!slaves[k].init)
+    if (!slaves[k].init && !slaves[k].absent)
       return 0; /* not initialized */
   return 1; /* all initialized */
 }
@@ -152,7 +329,7 @@ static int slaves_are_init(void) {
 static int slaves_are_stopped(void) {
   int k;
   for (k = 0; k < slave_max; k++)
-    if (!slaves[k].stopped)
+    if (!slaves[k].stopped && !slaves[k].absent)
       return 0; /* not initialized */
   return 1; /* all initialized */
 }
@@ -160,15 +337,101 @@ static int slaves_are_stopped(void) {
 static int slaves_send_msg(int mode, int tag, int msg,
 			   void *data, int dlen) {
   int k;
+  /* if every MP slave is a rendering slave, then we can let the MP
+     layer send the message to all of them at once */
+  if (mode == VE_MP_FAST && slave_max > 0 && 
+      slave_max == veMPNumProcesses())
+    return veMPSendMsg(VE_MP_MCAST,VE_MPTARG_ALL,tag,msg,data,dlen);
   for (k = 0; k < slave_max; k++)
     if (veMPSendMsg(mode,slaves[k].mpid,tag,msg,data,dlen))
       return -1;
   return 0;
 }
 
+/* pipelined mode: swap every frame that all slaves have rendered and
+   retire the frames that all slaves have swapped - call with
+   slaves_mutex held */
+static void pipe_advance(void) {
+  VeRenderMsg msg;
+  int j, k;
+
+  for (j = 0; j < pipe_n; j++) {
+    if (pipe_q[j].swap_sent)
+      continue;
+    if (!slaves_rendered(pipe_q[j].frame))
+      break;
+    /* everyone has this frame - swap lock */
+    msg.frame = pipe_q[j].frame;
+    vePfEvent(MODULE,"M:PIPE-SWAP","frame %d",msg.frame);
+    for (k = 0; k < slave_max; k++)
+      slave_sent(k,PH_SWAP);
+    if (slaves_send_msg(VE_MP_FAST,VE_MPMSG_RENDER,M_SWAP,&msg,sizeof(msg)))
+      veFatalError(MODULE,"failed to send SWAP to slaves");
+    pipe_q[j].swap_sent = 1;
+  }
+  for (j = 0; j < pipe_n && pipe_q[j].swap_sent && 
+	 slaves_swapped(pipe_q[j].frame); j++)
+    ;
+  if (j > 0) {
+    pipe_n -= j;
+    memmove(pipe_q,pipe_q+j,pipe_n*sizeof(VeRenderPipe));
+    veThrCondBcast(slaves_ready_cond);
+  }
+}
+
+/* send slave k its windows and start it - call with slaves_mutex held */
+static void slave_start(int k) {
+  VeRenderWinMsg msg;
+  int j;
+  for(j = 0; j < slaves[k].nwnames; j++) {
+    strncpy(msg.name,slaves[k].wnames[j],WNAMELEN);
+    msg.name[WNAMELEN-1] = '\0';
+    veMPSendMsg(VE_MP_RELIABLE,slaves[k].mpid,
+		VE_MPMSG_RENDER,M_WINDOW,&msg,sizeof(msg));
+  }
+  veMPSendMsg(VE_MP_RELIABLE,slaves[k].mpid,VE_MPMSG_RENDER,M_RUN,NULL,0);
+}
+
+/* the MP layer has lost or regained slave k - call with slaves_mutex held */
+static void master_ctrl(int k, int tag) {
+  switch (tag) {
+  case VE_MPCTRL_LOST:
+    vePfEvent(MODULE,"M:LOST","slave %d",k);
+    slaves[k].absent = RC_LOST;
+    /* whatever we were waiting for may be complete now */
+    if (pipe_depth > 1)
+      pipe_advance();
+    veThrCondBcast(slaves_ready_cond);
+    veThrCondBcast(slaves_stopped_cond);
+    break;
+
+  case VE_MPCTRL_JOINED:
+    vePfEvent(MODULE,"M:JOINED","slave %d",k);
+    slaves[k].absent = RC_JOINING;
+    slaves[k].active_frame = 0;
+    slaves[k].swapped = 1;
+    slaves[k].init = 0;
+    slaves[k].stopped = 0;
+    /* the first frame it can have seen all of */
+    slaves[k].join_frame = slave_ready_frame+1;
+    if (render_running)
+      slave_start(k);
+    break;
+  }
+}
+
 /* message handler on master */
-static void master_render_cback(int k, VeMPPkt *p) {
+static void master_render_cback(int mpid, VeMPPkt *p) {
   VeRenderMsg *msg;
+  int k;
+
+  if (p->msg == VE_MPMSG_CTRL) {
+    veThrMutexLock(slaves_mutex);
+    if ((k = slave_of(mpid)) >= 0)
+      master_ctrl(k,p->tag);
+    veThrMutexUnlock(slaves_mutex);
+    return;
+  }
 
   if (p->msg != VE_MPMSG_RENDER)
     return;
@@ -177,6 +440,13 @@ static void master_render_cback(int k, VeMPPkt *p) {
 
   veThrMutexLock(slaves_mutex);
 
+  if ((k = slave_of(mpid)) < 0) {
+    veWarning(MODULE,"ignoring render message (%d) from unknown slave %d",
+	      p->tag, mpid);
+    veThrMutexUnlock(slaves_mutex);
+    return;
+  }
+
   switch (p->tag) {
   case M_EXIT:
     vePfEvent(MODULE,"M:EXIT","slave %d",k);
@@ -199,16 +469,23 @@ static void master_render_cback(int k, VeMPPkt *p) {
   case M_RENDER:
     if (p->dlen != sizeof(VeRenderMsg)) {
       veError(MODULE,"invalid render message (size = %d)",p->dlen);
-      return;
+      break;
     }
     msg = (VeRenderMsg *)(p->data);
     vePfEvent(MODULE,"M:RENDER","slave %d frame %d",k,msg->frame);
     if (msg->frame > slaves[k].active_frame || msg->frame == 0) {
       slaves[k].active_frame = msg->frame;
       slaves[k].swapped = 0;
-      if (!slave_ready_swapped && slaves_are_ready()) {
-	vePfEvent(MODULE,"M:READY",NULL);
-	veThrCondBcast(slaves_ready_cond);
+      if (pipe_depth > 1) {
+	slave_responded(k,PH_RENDER);
+	pipe_advance();
+      } else {
+	if (!slave_ready_swapped && msg->frame == slave_ready_frame)
+	  slave_responded(k,PH_RENDER);
+	if (!slave_ready_swapped && slaves_are_ready()) {
+	  vePfEvent(MODULE,"M:READY",NULL);
+	  veThrCondBcast(slaves_ready_cond);
+	}
       }
     }
     break;
@@ -216,17 +493,33 @@ static void master_render_cback(int k, VeMPPkt *p) {
   case M_SWAP:
     if (p->dlen != sizeof(VeRenderMsg)) {
       veError(MODULE,"invalid render message (size = %d)",p->dlen);
-      return;
+      break;
     }
     msg = (VeRenderMsg *)(p->data);
     vePfEvent(MODULE,"M:SWAP","slave %d frame %d",k,msg->frame);
+    if (slaves[k].absent == RC_JOINING && msg->frame >= slaves[k].join_frame) {
+      /* a rejoined slave has caught up - every frame from here on is
+	 one it has been sent */
+      vePfEvent(MODULE,"M:CAUGHT-UP","slave %d frame %d",k,msg->frame);
+      slaves[k].absent = RC_PRESENT;
+    }
     /* is this a later state? */
     if ((msg->frame > slaves[k].active_frame || msg->frame == 0) ||
 	(msg->frame == slaves[k].active_frame && !slaves[k].swapped)) {
 	  slaves[k].active_frame = msg->frame;
 	  slaves[k].swapped = 1;
-	  if (slave_ready_swapped && slaves_are_ready())
-	    veThrCondBcast(slaves_ready_cond);
+	  if (pipe_depth > 1) {
+	    slave_responded(k,PH_SWAP);
+	    /* the slave only starts on the next frame now */
+	    if (pipe_n > 0 && !slave_rendered(k,pipe_q[pipe_n-1].frame))
+	      slave_sent(k,PH_RENDER);
+	    pipe_advance();
+	  } else {
+	    if (slave_ready_swapped && msg->frame == slave_ready_frame)
+	      slave_responded(k,PH_SWAP);
+	    if (slave_ready_swapped && slaves_are_ready())
+	      veThrCondBcast(slaves_ready_cond);
+	  }
     }
     break;
 
@@ -238,8 +531,6 @@ static void master_render_cback(int k, VeMPPkt *p) {
   veThrMutexUnlock(slaves_mutex);
 }
 
-#define SLV(x) ((x)?(x):"auto")
-
 /* a thread that renders... */
 static void *render_thread(void *v) {
   VeRenderThread *t = (VeRenderThread *)v;
@@ -296,6 +587,29 @@ static void *render_thread(void *v) {
 
 /* message handler on slave */
 
+/* render a frame on all of our threads and tell the master */
+static void slave_render(VeRenderSlave *me, int src, unsigned long frame) {
+  VeRenderMsg m;
+
+  VE_DEBUGM(2,("msg entry in"));
+  veThrBarrierEnter(me->b_entry); /* let threads start */
+  VE_DEBUGM(2,("msg entry out"));
+  VE_DEBUGM(2,("msg exit in"));
+  veThrBarrierEnter(me->b_exit); /* wait for them to finish */
+  VE_DEBUGM(2,("msg exit out"));
+
+  me->active_frame = frame;
+  me->swapped = 0;
+  m.frame = frame;
+  veMPSendMsg(VE_MP_FAST,src,VE_MPMSG_RENDER,M_RENDER,&m,sizeof(m));
+}
+
+/* while a RENDER is pending, only SWAPs get through - everything
+   else (i.e. the state for later frames) waits */
+static int pass_swap(VeMPPkt *p) {
+  return (p->msg == VE_MPMSG_RENDER && p->tag == M_SWAP);
+}
+
 static void slave_render_cback(int src, VeMPPkt *p) {
   static VeRenderSlave me; /* slave information */
   static int running = 1;
@@ -419,6 +733,8 @@ static void slave_render_cback(int src, VeMPPkt *p) {
   case M_RENDER:
     {
       VeRenderMsg *msg;
+      if (!me.thrs)
+	break; /* (re-)joined while frames are running - not started yet */
       VE_DEBUGM(3,("slave_render_cback - rendering frame"));
       if (p->dlen != sizeof(VeRenderMsg)) {
 	veError(MODULE,"invalid render message (size = %d)",p->dlen);
@@ -427,29 +743,34 @@ static void slave_render_cback(int src, VeMPPkt *p) {
       msg = (VeRenderMsg *)(p->data);
       if ((msg->frame == 0 && me.active_frame != 0)
 	  || msg->frame > me.active_frame) {
-	if (!me.swapped)
-	  veThrBarrierEnter(me.b_swap);
-
+	if (!me.swapped) {
+	  /* The master is running ahead of us and has not told us to
+	     swap the last frame yet.  Swapping on our own would break
+	     swap lock with the other slaves, so render this one when
+	     the SWAP arrives and do not apply anything sent after it
+	     until then. */
+	  VE_DEBUGM(3,("slave_render_cback - deferring frame %lu",
+		       msg->frame));
+	  me.pending = 1;
+	  me.pending_frame = msg->frame;
+	  veMPHoldMsgs(pass_swap);
+	  break;
+	}
 	/* render another frame */
-	VE_DEBUGM(2,("msg entry in"));
-	veThrBarrierEnter(me.b_entry); /* let threads start */
-	VE_DEBUGM(2,("msg entry out"));
-	VE_DEBUGM(2,("msg exit in"));
-	veThrBarrierEnter(me.b_exit); /* wait for them to finish */
-	VE_DEBUGM(2,("msg exit out"));
-
-	me.active_frame = msg->frame;
-	me.swapped = 0;
+	slave_render(&me,src,msg->frame);
+      } else {
+	/* respond with same frame number */
+	veMPSendMsg(VE_MP_FAST,src,VE_MPMSG_RENDER,M_RENDER,
+		    p->data,p->dlen);
       }
-      /* respond with same frame number */
-      veMPSendMsg(VE_MP_FAST,src,VE_MPMSG_RENDER,M_RENDER,
-		  p->data,p->dlen);
     }
     break;
 
   case M_SWAP:
     {
       VeRenderMsg *msg;
+      if (!me.thrs)
+	break; /* (re-)joined while frames are running - not started yet */
       VE_DEBUGM(3,("slave_render_cback - swapping frame"));
       if (p->dlen != sizeof(VeRenderMsg)) {
 	veError(MODULE,"invalid render message (size = %d)",p->dlen);
@@ -467,6 +788,13 @@ static void slave_render_cback(int src, VeMPPkt *p) {
       /* respond with same frame number */
       veMPSendMsg(VE_MP_FAST,src,VE_MPMSG_RENDER,M_SWAP,
 		  p->data,p->dlen);
+      if (me.pending && me.swapped) {
+	/* now we can get on with the deferred frame */
+	me.pending = 0;
+	if (me.pending_frame > me.active_frame)
+	  slave_render(&me,src,me.pending_frame);
+	veMPReleaseMsgs();
+      }
     }
     break;
 
@@ -477,13 +805,126 @@ static void slave_render_cback(int src, VeMPPkt *p) {
   }
 }
 
-#define UPD_INTERVAL 5 /* poke slaves every 5 ms */
+/* Wait until done() is true.  Rather than polling at a fixed rate,
+   sleep until the earliest retransmit deadline of a slave we are still
+   waiting on and only poke the slaves that are overdue, backing off
+   their timeout each time.  Call with slaves_mutex held. */
+static void slaves_wait(int (*done)(void)) {
+  VeRenderMsg msg;
+  long now, due, wait = 0;
+  int k, tag, ph, owed;
+
+  while (!done()) {
+    now = veClockNano();
+    owed = 0;
+    for(k = 0; k < slave_max; k++)
+      if ((tag = slave_owes(k,&msg.frame))) {
+	VeRenderRtt *r = &(slaves[k].rtt[tag == M_SWAP ? PH_SWAP : PH_RENDER]);
+	due = (long)(r->rto*1.0e6) - (now - r->sent);
+	if (!owed || due < wait)
+	  wait = due;
+	owed = 1;
+      }
+    if (!owed) {
+      /* nobody owes us anything (e.g. a slave is waiting for the
+	 others before it can start the next frame) - wait for news */
+      veThrCondTimedWait(slaves_ready_cond,slaves_mutex,(long)RTO_MAX);
+      continue;
+    }
+    if (wait > 0) {
+      /* round up to the next ms - the condition wait has ms resolution */
+      veThrCondTimedWait(slaves_ready_cond,slaves_mutex,
+			 (long)((wait+999999)/1000000));
+      continue;
+    }
+    now = veClockNano();
+    for(k = 0; k < slave_max; k++) {
+      VeRenderRtt *r;
+      if (!(tag = slave_owes(k,&msg.frame)))
+	continue;
+      ph = (tag == M_SWAP) ? PH_SWAP : PH_RENDER;
+      r = &(slaves[k].rtt[ph]);
+      if (now - r->sent < (long)(r->rto*1.0e6))
+	continue;
+      if (slave_timeout > 0 && now - r->start > slave_timeout*1000000L) {
+	/* give up on it - it is brought back in the background */
+	veWarning(MODULE,"slave %d has not responded for %ld ms - dropping it",
+		  k,(now - r->start)/1000000L);
+	slaves[k].absent = RC_LOST;
+	veMPDropSlave(slaves[k].mpid);
+	continue;
+      }
+      /* poke again */
+      vePfEvent(MODULE,"resend","slave %d tag %d frame %d rto %g",
+		k,tag,msg.frame,r->rto);
+      if (veMPSendMsg(VE_MP_FAST,slaves[k].mpid,VE_MPMSG_RENDER,tag,&msg,
+		      sizeof(msg)))
+	veFatalError(MODULE,"failed to re-send %s to slave %d",
+		     tag == M_SWAP ? "SWAP" : "RENDER", k);
+      r->sent = now;
+      r->resent = 1;
+      r->rto *= 2.0;
+      if (r->rto > RTO_MAX)
+	r->rto = RTO_MAX;
+    }
+  }
+}
+
+static int pipe_has_room(void) {
+  return pipe_n < pipe_depth;
+}
+
+static int pipe_is_empty(void) {
+  return pipe_n == 0;
+}
+
+static void publish_stats(unsigned long frame) {
+  int k;
+  if ((frame % HIST_PUBLISH) == 0)
+    for(k = 0; k < slave_max; k++) {
+      veHistStatUpdate(slaves[k].rtt[PH_RENDER].lat);
+      veHistStatUpdate(slaves[k].rtt[PH_SWAP].lat);
+    }
+}
+
+/* pipelined version of veMPRenderFrame - wait for space in the
+   pipeline, send RENDER and let the message handler take care of the
+   rest */
+static void render_frame_pipe(VeRenderMsg *msg) {
+  unsigned long f;
+  int k;
+
+  if (!pipe_has_room()) {
+    /* Send what has been collected for this frame before blocking -
+       nothing may sit in an open bundle while we wait (a SWAP the
+       handler sends in the meantime would otherwise only go out with
+       the next retransmit) */
+    if (veMPBundleEnd())
+      veFatalError(MODULE,"veMPRenderFrame: failed to send bundle to slaves");
+    slaves_wait(pipe_has_room);
+  }
+  /* slaves that are all caught up start on this frame right away -
+     the others start the clock when they swap the previous one */
+  for(k = 0; k < slave_max; k++)
+    if (!slave_owes(k,&f))
+      slave_sent(k,PH_RENDER);
+  pipe_q[pipe_n].frame = msg->frame;
+  pipe_q[pipe_n].swap_sent = 0;
+  pipe_n++;
+  slave_ready_frame = msg->frame;
+  if (slaves_send_msg(VE_MP_FAST,VE_MPMSG_RENDER,M_RENDER,msg,sizeof(*msg)))
+    veFatalError(MODULE,"veMPRenderFrame: failed to send RENDER to slaves");
+  if (veMPBundleEnd())
+    veFatalError(MODULE,"veMPRenderFrame: failed to send bundle to slaves");
+}
+
 void veMPRenderFrame(long frame) {
   int k;
   VeRenderMsg msg;
 
   vePfEvent(MODULE,"render-frame","%d",frame);
 
+  veDeviceLatencyFrame();
   veRenderCallPreCback();
 
   veThrMutexLock(slaves_mutex);
@@ -495,40 +936,39 @@ void veMPRenderFrame(long frame) {
 
   msg.frame = frame;
 
+  if (pipe_depth > 1) {
+    render_frame_pipe(&msg);
+    publish_stats(frame);
+    veThrMutexUnlock(slaves_mutex);
+    veRenderCallPostCback();
+    return;
+  }
+
   /* enter render state */
   slave_ready_frame = frame;
   slave_ready_swapped = 0;
 
+  for(k = 0; k < slave_max; k++)
+    slave_sent(k,PH_RENDER);
   if (slaves_send_msg(VE_MP_FAST,VE_MPMSG_RENDER,M_RENDER,&msg,sizeof(msg)))
     veFatalError(MODULE,"veMPRenderFrame: failed to send RENDER to slaves");
+  /* RENDER closes off any bundle the frame was collected in */
+  if (veMPBundleEnd())
+    veFatalError(MODULE,"veMPRenderFrame: failed to send bundle to slaves");
 
-  while (!slaves_are_ready()) {
-    veThrCondTimedWait(slaves_ready_cond,slaves_mutex,UPD_INTERVAL);
-    for(k = 0; k < slave_max; k++)
-      if (!slave_is_ready(k)) {
-	/* poke again */
-	if (veMPSendMsg(VE_MP_FAST,k,VE_MPMSG_RENDER,M_RENDER,&msg,
-			sizeof(msg)))
-	  veFatalError(MODULE,"veMPRenderFrame: failed to re-send RENDER to slave %d",k);
-      }
-  }
+  slaves_wait(slaves_are_ready);
 
   /* enter swapped state */
   slave_ready_swapped = 1;
+  for(k = 0; k < slave_max; k++)
+    slave_sent(k,PH_SWAP);
   if (slaves_send_msg(VE_MP_FAST,VE_MPMSG_RENDER,M_SWAP,&msg,
 		      sizeof(msg)))
     veFatalError(MODULE,"veMPRenderFrame: failed to send SWAP to slaves");
 
-  while (!slaves_are_ready()) {
-    veThrCondTimedWait(slaves_ready_cond,slaves_mutex,UPD_INTERVAL);
-    for(k = 0; k < slave_max; k++)
-      if (!slave_is_ready(k)) {
-	/* poke again */
-	if (veMPSendMsg(VE_MP_FAST,k,VE_MPMSG_RENDER,M_SWAP,&msg,
-			sizeof(msg)))
-	  veFatalError(MODULE,"veMPRenderFrame: failed to re-send SWAP to slave %d",k);
-      }
-  }
+  slaves_wait(slaves_are_ready);
+
+  publish_stats(frame);
 
   veThrMutexUnlock(slaves_mutex);
 
@@ -539,11 +979,26 @@ void veMPRenderFrame(long frame) {
 void veMPRenderInit(void) {
   /* on anything other than the master, veMPAddMasterHandler() is a no-op */
   if (veMPIsMaster()) {
+    char *s;
     slaves_mutex = veThrMutexCreate();
     slaves_ready_cond = veThrCondCreate();
     slaves_stopped_cond = veThrCondCreate();
+    if ((s = veGetOption("mp_pipeline"))) {
+      pipe_depth = atoi(s);
+      if (pipe_depth < 1)
+	pipe_depth = 1;
+      else if (pipe_depth > PIPE_MAX) {
+	veWarning(MODULE,"mp_pipeline depth %d too large - using %d",
+		  pipe_depth,PIPE_MAX);
+	pipe_depth = PIPE_MAX;
+      }
+    }
+    VE_DEBUGM(1,("pipeline depth %d",pipe_depth));
+    if ((s = veGetOption("mp_slave_timeout")))
+      slave_timeout = atol(s);
   }
   veMPAddMasterHandler(VE_MPMSG_RENDER,VE_DTAG_ANY,master_render_cback);
+  veMPAddMasterHandler(VE_MPMSG_CTRL,VE_DTAG_ANY,master_render_cback);
   veMPAddSlaveHandler(VE_MPMSG_RENDER,VE_DTAG_ANY,slave_render_cback);
 }
 
@@ -574,6 +1029,9 @@ void veMPRenderRun(void) {
       }
       assert(slaves != NULL);
       VE_DEBUGM(3,("veMPRenderRun: assigning window %s to slave %d",w->name,k));
+      slaves[k].wnames = veRealloc(slaves[k].wnames,
+				   (slaves[k].nwnames+1)*sizeof(char *));
+      slaves[k].wnames[slaves[k].nwnames++] = veDupString(w->name);
       strncpy(msg.name,w->name,WNAMELEN);
       msg.name[WNAMELEN-1] = '\0';
       veMPSendMsg(VE_MP_RELIABLE,slaves[k].mpid,
@@ -582,6 +1040,7 @@ void veMPRenderRun(void) {
 
   VE_DEBUGM(1,("veMPRenderRun: sending run to slaves"));
   slaves_send_msg(VE_MP_RELIABLE,VE_MPMSG_RENDER,M_RUN,NULL,0);
+  render_running = 1;
   VE_DEBUGM(1,("veMPRenderRun: waiting for slaves to be ready"));
   while (!slaves_are_init())
     veThrCondWait(slaves_ready_cond,slaves_mutex);
@@ -592,6 +1051,8 @@ void veMPRenderRun(void) {
 void veMPRenderExit(void) {
   if (slaves_mutex) {
     veThrMutexLock(slaves_mutex);
+    /* let outstanding frames finish */
+    slaves_wait(pipe_is_empty);
     VE_DEBUGM(2,("sending exit to slaves"));
     slaves_send_msg(VE_MP_RELIABLE,VE_MPMSG_RENDER,M_EXIT,NULL,0);
     while (!slaves_are_stopped())
@@ -2,6 +2,7 @@
 #include <ve_env.h>
 #include <ve_driver.h>
 #include <ve_render.h>
+#include <ve_main.h>
 
 #define MODULE "ve_render_shim"
 
@@ -15,7 +16,15 @@ void veRenderInit(void) {
   if (!_f) {
     /* do we have a driver loaded */
     if (!(_f = (void *(*)(void))veFindDynFunc(FNAME(Init)))) {
-      if (veDriverRequire("render","*"))
+      char *s;
+      /* a specific renderer can be asked for by name - otherwise
+	 prefer OpenGL over anything else that happens to be installed
+	 (e.g. the null renderer) */
+      if ((s = veGetOption("render"))) {
+	if (veDriverRequire("render",s))
+	  veFatalError(MODULE,"cannot load renderer '%s'",s);
+      } else if (veDriverRequire("render","opengl") &&
+		 veDriverRequire("render","*"))
 	veFatalError(MODULE,"no rendering support available");
     }
     if (!(_f = (void *(*)(void))veFindDynFunc(FNAME(Init))))
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <ve_alloc.h>
 #include <ve_stats.h>
 #include <ve_thread.h>
@@ -180,6 +181,153 @@ VeStatistic *veNewStatistic(char *module, char *name, char *units) {
   return v;
 }
 
+VeStatistic *veNewHistStatistic(char *module, char *name, char *units,
+				float base) {
+  VeStatistic *v;
+  VeStatHistogram *h;
+
+  h = veAllocObj(VeStatHistogram);
+  assert(h != NULL);
+  h->base = (base > 0.0) ? base : 1.0;
+  h->str[0] = '\0';
+  h->strp = h->str;
+  v = veNewStatistic(module,name,units);
+  v->type = VE_STAT_STRING;
+  v->data = &(h->strp);
+  v->udata = h;
+  return v;
+}
+
+/* Samples may be added from several threads at once (e.g. device
+   latencies) - counters are bumped atomically and the sum and maximum
+   are updated with compare-and-swap where we have it.  Without atomic
+   operations a sample may occasionally be lost to a race. */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define hist_inc(p) ((void)__sync_fetch_and_add((p),1))
+#define hist_cas(p,o,n) __sync_bool_compare_and_swap((p),(o),(n))
+#else
+#define hist_inc(p) ((void)((*(p))++))
+#endif
+
+/* which cell (bucket and part of a bucket) a sample is counted in */
+static int hist_cell(VeStatHistogram *h, float v) {
+  double m;
+  int k, e, sub;
+
+  if (v < h->base) {
+    sub = (int)(v/h->base*VE_STAT_HIST_SUB);
+    return sub < VE_STAT_HIST_SUB ? sub : VE_STAT_HIST_SUB-1;
+  }
+  /* v/base = m*2^e with m in [0.5,1) so v is in bucket e */
+  m = frexp(v/h->base,&e);
+  k = e;
+  if (k > VE_STAT_HIST_BUCKETS-1)
+    return VE_STAT_HIST_BUCKETS*VE_STAT_HIST_SUB-1;
+  sub = (int)((2.0*m-1.0)*VE_STAT_HIST_SUB);
+  if (sub >= VE_STAT_HIST_SUB)
+    sub = VE_STAT_HIST_SUB-1;
+  return k*VE_STAT_HIST_SUB + sub;
+}
+
+/* upper bound of a cell */
+static float hist_limit(VeStatHistogram *h, int c) {
+  int k = c / VE_STAT_HIST_SUB, sub = c % VE_STAT_HIST_SUB;
+  if (k == 0)
+    return h->base*(sub+1)/VE_STAT_HIST_SUB;
+  return ldexp(h->base,k-1)*(1.0+(sub+1)/(double)VE_STAT_HIST_SUB);
+}
+
+void veHistStatAdd(VeStatistic *stat, float v) {
+  VeStatHistogram *h = (VeStatHistogram *)(stat->udata);
+
+  if (v < 0.0)
+    v = 0.0;
+  hist_inc(&(h->count[hist_cell(h,v)]));
+  hist_inc(&(h->n));
+#if defined(hist_cas) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+  {
+    union { double d; long long i; } o, n;
+    do {
+      o.i = h->sum.i;
+      n.d = o.d + v;
+    } while (!hist_cas(&(h->sum.i),o.i,n.i));
+  }
+#else
+  h->sum.d += v;
+#endif
+#if defined(hist_cas) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+  {
+    /* non-negative floats order the same way as their bit patterns */
+    union { float f; int i; } n;
+    int o;
+    n.f = v;
+    while ((o = h->max.i) < n.i && !hist_cas(&(h->max.i),o,n.i))
+      ;
+  }
+#else
+  if (v > h->max.f)
+    h->max.f = v;
+#endif
+}
+
+float veHistStatPercentile(VeStatistic *stat, float p) {
+  VeStatHistogram *h = (VeStatHistogram *)(stat->udata);
+  long want, sum;
+  float lim;
+  int c;
+
+  if (h->n <= 0)
+    return 0.0;
+  want = (long)(p*h->n + 0.5);
+  if (want < 1)
+    want = 1;
+  for(c = 0, sum = 0; c < VE_STAT_HIST_BUCKETS*VE_STAT_HIST_SUB-1; c++) {
+    sum += h->count[c];
+    if (sum >= want)
+      break;
+  }
+  if (c == VE_STAT_HIST_BUCKETS*VE_STAT_HIST_SUB-1 ||
+      (lim = hist_limit(h,c)) > h->max.f)
+    return h->max.f;
+  return lim;
+}
+
+int veHistStatUpdate(VeStatistic *stat) {
+  VeStatHistogram *h = (VeStatHistogram *)(stat->udata);
+  long cnt;
+  int k, j, l;
+
+  veSnprintf(h->str,VE_STAT_HIST_STRSZ,
+	     "n=%ld mean=%.3g p50=%.3g p90=%.3g p95=%.3g p99=%.3g max=%.3g |",
+	     h->n, h->n > 0 ? h->sum.d/h->n : 0.0,
+	     veHistStatPercentile(stat,0.5),
+	     veHistStatPercentile(stat,0.9),
+	     veHistStatPercentile(stat,0.95),
+	     veHistStatPercentile(stat,0.99),
+	     h->max.f);
+  /* whole buckets only - the parts would not fit */
+  for(k = 0; k < VE_STAT_HIST_BUCKETS; k++) {
+    l = strlen(h->str);
+    if (l >= VE_STAT_HIST_STRSZ-1)
+      break;
+    for(j = 0, cnt = 0; j < VE_STAT_HIST_SUB; j++)
+      cnt += h->count[k*VE_STAT_HIST_SUB+j];
+    veSnprintf(h->str+l,VE_STAT_HIST_STRSZ-l," %ld",cnt);
+  }
+  return veUpdateStatistic(stat);
+}
+
+void veHistStatReset(VeStatistic *stat) {
+  VeStatHistogram *h = (VeStatHistogram *)(stat->udata);
+  int k;
+
+  for(k = 0; k < VE_STAT_HIST_BUCKETS*VE_STAT_HIST_SUB; k++)
+    h->count[k] = 0;
+  h->n = 0;
+  h->sum.d = 0.0;
+  h->max.f = 0.0;
+}
+
 int veStatToString(VeStatistic *stat, char *str_ret, int len) {
   str_ret[0] = '\0';
   switch(stat->type) {
@@ -300,6 +300,106 @@ VeStatistic *veNewStatistic(char *module, char *name, char *units);
   */
 int veStatToString(VeStatistic *stat, char *str_ret, int len);
 
+/** struct VeStatHistogram
+  A distribution of non-negative samples (typically latencies) that can be
+  published as a statistic.  Samples are counted in logarithmic buckets:
+  bucket 0 holds values below <i>base</i>, bucket <i>k</i> holds values in
+  [base*2^(k-1), base*2^k) and the last bucket holds everything larger.
+  Each bucket is split into <code>VE_STAT_HIST_SUB</code> equal parts, so
+  that percentiles are known to within about 1/VE_STAT_HIST_SUB of their
+  value wherever they fall (in the manner of an HDR histogram).
+  The published value is a string summarizing the sample count, mean,
+  percentiles, maximum and the raw bucket counts.
+  <p>Adding samples uses atomic operations where the compiler provides
+  them, so veHistStatAdd() may be called from any number of threads
+  without a lock.  The module that maintains the histogram is still
+  responsible for serializing calls to veHistStatUpdate() and
+  veHistStatReset().  A reset that races with veHistStatAdd() may lose
+  that sample.
+  */
+#define VE_STAT_HIST_BUCKETS 16
+#define VE_STAT_HIST_SUB 8
+#define VE_STAT_HIST_STRSZ 256
+typedef struct ve_stat_histogram {
+  float base;
+  volatile long count[VE_STAT_HIST_BUCKETS*VE_STAT_HIST_SUB];
+  volatile long n;
+  /* sum and max are unions so that they can be updated with an
+     atomic compare-and-swap of the same size */
+  volatile union { double d; long long i; } sum;
+  volatile union { float f; int i; } max;
+  char str[VE_STAT_HIST_STRSZ];
+  char *strp; /* what the statistic's "data" member points at */
+} VeStatHistogram;
+
+/** function veNewHistStatistic
+  Creates a string statistic backed by a VeStatHistogram (stored in
+  the statistic's "udata" member).  The statistic is not added - the
+  caller still needs to call veAddStatistic().
+
+  @param module
+  Value that will be placed in the module slot in the structure.
+  @param name
+  Value that will be placed in the name slot in the structure.
+  @param units
+  Units of the individual samples.
+  @param base
+  Upper bound of the first bucket.  This should be about the smallest
+  interesting value, e.g. 0.125 for latencies in milliseconds.
+
+  @returns
+  A pointer to the new statistic.
+  */
+VeStatistic *veNewHistStatistic(char *module, char *name, char *units,
+				float base);
+
+/** function veHistStatAdd
+  Adds a sample to a histogram statistic.  This does not notify
+  any listeners - call veHistStatUpdate() for that.
+
+  @param stat
+  A statistic created with veNewHistStatistic().
+  @param v
+  The sample value.  Negative values are counted as zero.
+  */
+void veHistStatAdd(VeStatistic *stat, float v);
+
+/** function veHistStatPercentile
+  Estimates a percentile of the samples collected so far.  The
+  estimate is the upper bound of the part of the bucket containing the
+  percentile, clamped to the largest sample seen.
+
+  @param stat
+  A statistic created with veNewHistStatistic().
+  @param p
+  The percentile as a fraction (e.g. 0.99).
+
+  @returns
+  The estimated value, or 0 if there are no samples.
+  */
+float veHistStatPercentile(VeStatistic *stat, float p);
+
+/** function veHistStatUpdate
+  Regenerates the summary string of a histogram statistic and calls
+  veUpdateStatistic() on it.
+
+  @param stat
+  A statistic created with veNewHistStatistic().
+
+  @returns
+  The result of veUpdateStatistic().
+  */
+int veHistStatUpdate(VeStatistic *stat);
+
+/** function veHistStatReset
+  Discards all samples in a histogram statistic.  The summary string
+  is left alone until the next veHistStatUpdate().
+
+  @param stat
+  A statistic created with veNewHistStatistic().
+  */
+void veHistStatReset(VeStatistic *stat);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -0,0 +1,315 @@
+/*
+  faketracker - pretend to be a tracker on a pseudo-terminal
+
+  Usage:  faketracker [-r rate] [-l link] fob|fastrak
+
+  A pseudo-terminal is created and the name of its slave side is
+  printed (and, with -l, a symbolic link to it is made) so that the
+  fob or fastrak driver can be pointed at it with its "line" option.
+  Enough of the tracker's serial protocol is emulated for the driver
+  to set the tracker up and read from it:
+
+  fob      'B' (point), '@' (stream), 'V' and ']' (output format)
+           and 'O' (examine value) are answered; everything else is
+           ignored.
+  fastrak  'C' (continuous), 'c' (stop), 'P' (poll), 'l' (station
+           on/off) and 'O' (output list - item 21 selects
+           time-stamped records) are understood; everything else is
+           ignored.
+
+  The tracker sweeps a circle of 30cm radius in the horizontal plane
+  while turning about the vertical axis, one revolution every
+  4 seconds, so drivers and filters can be checked against known
+  data.  In stream mode, records are sent at the given rate (default
+  100Hz).  Records that the other end does not read are dropped, as
+  they would be on a real serial line.
+*/
+#define _GNU_SOURCE /* glibc hides the pseudo-terminal calls otherwise */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#define MAXSTATION 12
+#define RADIUS 0.3   /* metres */
+#define PERIOD 4.0   /* seconds per revolution */
+#define FOB_RANGE 0.9144
+
+static int fd = -1;
+static int fob = 0;
+static double t0;
+
+/* fob state */
+static int fob_words = 6;  /* 6 = position/angles, 7 = position/quaternion */
+static int fob_stream = 0;
+
+/* fastrak state */
+static int ft_stream = 0;
+static int ft_tmstamp = 0;
+static int ft_active[MAXSTATION] = { 1 };
+static char ft_cmd[256];
+static int ft_cmdlen = 0;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec + tv.tv_usec/1.0e6;
+}
+
+static void usage(void) {
+  fprintf(stderr,"usage: faketracker [-r rate] [-l link] fob|fastrak\n");
+  exit(1);
+}
+
+static void send_data(void *buf, int n) {
+  /* the pty is non-blocking - if the reader is not keeping up, the
+     record is lost just as it would be on a serial line */
+  if (write(fd,buf,n) != n && errno != EAGAIN)
+    perror("faketracker: write");
+}
+
+/* current position (metres) and orientation (x,y,z,w) */
+static void pose(double *p, double *q) {
+  double a = 2*M_PI*(now()-t0)/PERIOD;
+  p[0] = RADIUS*cos(a);
+  p[1] = 0.0;
+  p[2] = RADIUS*sin(a);
+  q[0] = 0.0;
+  q[1] = sin(a/2);
+  q[2] = 0.0;
+  q[3] = cos(a/2);
+}
+
+/* A bird word carries 14 bits, sent low 7 bits first, with the top
+   bit of the first byte of a record marking the start of the record */
+static void fob_word(unsigned char *b, double v) {
+  int w = (int)floor(v*8192.0);
+  if (w > 8191)
+    w = 8191;
+  if (w < -8192)
+    w = -8192;
+  b[0] = w & 0x7f;
+  b[1] = (w >> 7) & 0x7f;
+}
+
+static void fob_record(void) {
+  unsigned char buf[14];
+  double p[3], q[4];
+  int k;
+
+  pose(p,q);
+  for(k = 0; k < 3; k++)
+    fob_word(&(buf[2*k]),p[k]/FOB_RANGE);
+  if (fob_words == 7) {
+    /* the bird reports the inverse rotation, scalar first */
+    fob_word(&(buf[6]),-q[3]);
+    for(k = 0; k < 3; k++)
+      fob_word(&(buf[8+2*k]),q[k]);
+  } else {
+    /* angles - azimuth, elevation, roll (in 180 degree units) */
+    fob_word(&(buf[6]),atan2(2*q[1]*q[3],1-2*q[1]*q[1])/M_PI);
+    fob_word(&(buf[8]),0.0);
+    fob_word(&(buf[10]),0.0);
+  }
+  buf[0] |= 0x80;
+  send_data(buf,2*fob_words);
+}
+
+/* raw (unframed) word, as returned for examined values */
+static void fob_raw(int w) {
+  unsigned char buf[2];
+  buf[0] = w & 0xff;
+  buf[1] = (w >> 8) & 0xff;
+  send_data(buf,2);
+}
+
+static void fob_examine(int what) {
+  switch (what) {
+  case 0:  /* status: master, initialized, running, output format, point */
+    fob_raw(0x8000|0x4000|0x1000|((fob_words == 7 ? 8 : 4) << 1)|fob_stream);
+    break;
+  case 1:  fob_raw(0x0304); break;     /* PROM revision 3.4 */
+  case 2:  fob_raw(25); break;         /* crystal speed */
+  case 7:  fob_raw(100*256); break;    /* measurement rate */
+  case 15: send_data("6DFOB     ",10); break;  /* model */
+  default: fob_raw(0); break;
+  }
+}
+
+static void fob_input(unsigned char *buf, int n) {
+  static int examine = 0, skip = 0;
+  int k;
+
+  for(k = 0; k < n; k++) {
+    if (skip > 0) {
+      skip--;
+      continue;
+    }
+    if (examine) {
+      examine = 0;
+      fob_examine(buf[k]);
+      continue;
+    }
+    switch (buf[k]) {
+    case 'B': fob_stream = 0; fob_record(); break;
+    case '@': fob_stream = 1; break;
+    case 'V': fob_words = 6; break;
+    case ']': fob_words = 7; break;
+    case 'O': examine = 1; break;
+    case 'L': skip = 2; break;  /* hemisphere */
+    case 'P': skip = 2; break;  /* change value (short ones only) */
+    }
+  }
+}
+
+static void ft_record(int st) {
+  char buf[128];
+  double p[3], q[4];
+
+  pose(p,q);
+  if (ft_tmstamp)
+    sprintf(buf,"%02d %14lu %7.2f%7.2f%7.2f%7.4f%7.4f%7.4f%7.4f\r\n",st,
+	    (unsigned long)((now()-t0)*1000.0),
+	    p[0]*100.0,p[1]*100.0,p[2]*100.0,q[3],q[0],q[1],q[2]);
+  else
+    sprintf(buf,"%02d %7.2f%7.2f%7.2f%7.4f%7.4f%7.4f%7.4f\r\n",st,
+	    p[0]*100.0,p[1]*100.0,p[2]*100.0,q[3],q[0],q[1],q[2]);
+  send_data(buf,strlen(buf));
+}
+
+static void ft_records(void) {
+  int k;
+  for(k = 0; k < MAXSTATION; k++)
+    if (ft_active[k])
+      ft_record(k+1);
+}
+
+/* commands with arguments end with a newline */
+static void ft_line(char *cmd) {
+  int st, on;
+
+  switch (cmd[0]) {
+  case 'l':
+    if (sscanf(cmd+1,"%d,%d",&st,&on) == 2 && st >= 1 && st <= MAXSTATION)
+      ft_active[st-1] = on;
+    break;
+  case 'O':
+    ft_tmstamp = (strstr(cmd,",21,") != NULL);
+    break;
+  case 'M':
+    if (cmd[1] == 'Z')
+      t0 = now();
+    break;
+  }
+}
+
+static void ft_input(unsigned char *buf, int n) {
+  int k;
+
+  for(k = 0; k < n; k++) {
+    if (ft_cmdlen > 0) {
+      if (buf[k] == '\n') {
+	ft_cmd[ft_cmdlen] = '\0';
+	ft_line(ft_cmd);
+	ft_cmdlen = 0;
+      } else if (ft_cmdlen < sizeof(ft_cmd)-1)
+	ft_cmd[ft_cmdlen++] = buf[k];
+      continue;
+    }
+    switch (buf[k]) {
+    case 'C': ft_stream = 1; break;
+    case 'c': ft_stream = 0; break;
+    case 'P': ft_records(); break;
+    case 'u': case 'U': case 'F': case 'f': case '\030': case '\r': case '\n':
+      break;
+    default:
+      ft_cmd[ft_cmdlen++] = buf[k];
+      break;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  struct termios t;
+  struct pollfd pfd;
+  unsigned char buf[256];
+  char *link = NULL, *slave;
+  double rate = 100.0, next;
+  int c, n, sfd, timeout;
+
+  while ((c = getopt(argc,argv,"r:l:")) != -1)
+    switch (c) {
+    case 'r': rate = atof(optarg); break;
+    case 'l': link = optarg; break;
+    default: usage();
+    }
+  if (optind != argc-1 || rate <= 0.0)
+    usage();
+  if (strcmp(argv[optind],"fob") == 0)
+    fob = 1;
+  else if (strcmp(argv[optind],"fastrak") != 0)
+    usage();
+
+  if ((fd = posix_openpt(O_RDWR|O_NOCTTY)) < 0 || grantpt(fd) ||
+      unlockpt(fd) || !(slave = ptsname(fd))) {
+    perror("faketracker: cannot create pseudo-terminal");
+    exit(1);
+  }
+  /* keep the slave open ourselves so that the master does not see a
+     hang-up between drivers, and make it raw so nothing is echoed
+     before the driver sets the line up */
+  if ((sfd = open(slave,O_RDWR|O_NOCTTY)) < 0 || tcgetattr(sfd,&t)) {
+    perror("faketracker: cannot open slave");
+    exit(1);
+  }
+  cfmakeraw(&t);
+  tcsetattr(sfd,TCSANOW,&t);
+  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+  if (link) {
+    unlink(link);
+    if (symlink(slave,link)) {
+      perror("faketracker: cannot create link");
+      exit(1);
+    }
+  }
+  printf("%s\n",slave);
+  fflush(stdout);
+
+  t0 = next = now();
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  for(;;) {
+    timeout = -1;
+    if (fob ? fob_stream : ft_stream) {
+      timeout = (int)((next - now())*1000.0);
+      if (timeout <= 0) {
+	if (fob)
+	  fob_record();
+	else
+	  ft_records();
+	next += 1.0/rate;
+	continue;
+      }
+    } else
+      next = now();
+    if (poll(&pfd,1,timeout) < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("faketracker: poll");
+      exit(1);
+    }
+    if ((pfd.revents & POLLIN) && (n = read(fd,buf,sizeof(buf))) > 0) {
+      if (fob)
+	fob_input(buf,n);
+      else
+	ft_input(buf,n);
+    }
+  }
+  return 0;
+}
@@ -313,6 +313,15 @@ int txmBoundTexture(TXManager *mgr) {
   return ctx->bound;
 }
 
+int txmContextId(TXManager *mgr) {
+  /* for per-context data of the caller's own (e.g. buffer objects) */
+  mgr = getmgr(mgr);
+  assert(mgr != NULL);
+  if (!mgr->renderer || !mgr->renderer->ctxid)
+    return -1;
+  return mgr->renderer->ctxid();
+}
+
 int txmReloadTexture(TXManager *mgr, int id) {
   /* force texture to be reloaded in all contexts (needed if you change it) */
   int k;
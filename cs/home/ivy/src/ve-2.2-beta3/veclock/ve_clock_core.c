@@ -67,6 +67,14 @@ long veClock() {
     (long)(hr.nsecs - zero_time.nsecs)/1000000;
 }
 
+double veClockFine() {
+  VeClockHR hr;
+  hr = veClockHires();
+  /* (the parts are unsigned - do not let the difference wrap) */
+  return ((double)hr.secs - (double)zero_time.secs)*1000.0 +
+    ((double)hr.nsecs - (double)zero_time.nsecs)/1.0e6;
+}
+
 long veClockNano() {
   VeClockHR hr;
   hr = veClockHires();
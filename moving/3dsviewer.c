@@ -72,8 +72,10 @@ static void setupwin(VeWindow *w)
   glEnable(GL_TEXTURE_2D);
   if(Import3DS(&model, root, name) < 0)
     fprintf(stderr,"model load fails\n");
-  else
+  else {
+    Compile3DS(&model);
     fprintf(stderr, "model loaded\n");
+  }
 }
 
 /*
@@ -9,6 +9,7 @@
 # include <GL/glu.h>
 # include <3ds.h>
 # include <3dsRenderer.h>
+# include <3dsCache.h>
 # include <vem.h>
 
 # define LIGHT 
@@ -29,7 +30,7 @@ struct {
   { "sarah", "sarah.3ds", {0, 0, 0, 2.0, -2, 1, -2}},
   { "sarah", "sarah.3ds", {0, 0, 0, 2.0, 0, 1, 0}}
 };
-static struct t3DModel model[NOBJS]; // possibly different on every processor
+static struct t3DModel *model[NOBJS]; // shared by every window - see Acquire3DS()
 
 
 struct world_state {
@@ -88,11 +89,13 @@ static void setupwin(VeWindow *w)
   glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 
   glEnable(GL_TEXTURE_2D);
+  /* the models are shared, but buffer objects are this context's own */
   for(i=0;i<NOBJS;i++) {
-    if(Import3DS(&model[i], models[i].dir, models[i].model) < 0) {
+    if((model[i] = Acquire3DS(models[i].dir, models[i].model)) == NULL) {
       fprintf(stderr,"model %s %s load fails\n", models[i].dir, models[i].model);
       exit(1);
     } else {
+      Compile3DS(model[i]);
       fprintf(stderr, "model loaded\n");
     }
   }
@@ -151,9 +154,9 @@ static void display(VeWindow *w, long tm, VeWallView *wv)
     glRotatef(globalState.tr[i].ry, 0.0f, 1.0f, 0.0f);
     glRotatef(globalState.tr[i].rx, 1.0f, 0.0f, 0.0f);
 
-    glScalef(model[i].scale, model[i].scale, model[i].scale);
-    glTranslatef(-model[i].center_x,-model[i].center_y,-model[i].center_z);
-    Render3DS(&model[i]); 
+    glScalef(model[i]->scale, model[i]->scale, model[i]->scale);
+    glTranslatef(-model[i]->center_x,-model[i]->center_y,-model[i]->center_z);
+    Render3DS(model[i]); 
     glPopMatrix();
   }
 }
@@ -209,6 +212,10 @@ int main(int argc, char **argv)
   veInit(&argc, argv);
   veSetOption("depth", "1");
 
+  /* the same model is only read once, however many times it is used */
+  for(i=0;i<NOBJS;i++)
+    Prefetch3DS(models[i].dir, models[i].model);
+
 
   veRenderSetupCback(setupwin);
   veRenderCback(display);
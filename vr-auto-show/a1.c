@@ -8,6 +8,7 @@
 
 # include <3ds.h>
 # include <3dsRenderer.h>
+# include <3dsCache.h>
 # include <vem.h>
 
 /* Rotation increment per frame (degrees)
@@ -62,8 +63,9 @@ struct {
 };
 
 
-static struct t3DModel car[NUM_CARS];
-static struct t3DModel light;
+/* shared by every window - see Acquire3DS() */
+static struct t3DModel *car[NUM_CARS];
+static struct t3DModel *light;
 
 /*
  * Setup the window on each processor
@@ -110,18 +112,24 @@ static void setupwin(VeWindow *w)
 
   glEnable(GL_TEXTURE_2D);
 
+	/* the first window loads the models (started in main()), the rest share
+	   them - but each window's context needs buffer objects of its own */
 	for (i=0; i<NUM_CARS;i++)
 	{
-	  if(Import3DS(&car[i], cars[i].dir, cars[i].model)< 0)
+	  if((car[i] = Acquire3DS(cars[i].dir, cars[i].model)) == NULL)
 	    fprintf(stderr,"model load fails\n");
-	  else
+	  else {
+	    Compile3DS(car[i]);
 	    fprintf(stderr, "model loaded\n");
+	  }
 	}
 
-	if (Import3DS(&light, "cars", "fan object.3ds") < 0)
+	if ((light = Acquire3DS("cars", "fan object.3ds")) == NULL)
 		fprintf(stderr, "model load fails\n");
-	else
+	else {
+		Compile3DS(light);
 		fprintf(stderr, "model loaded\n");
+	}
 }
 
 /*
@@ -265,6 +273,8 @@ static void display(VeWindow *w, long tm, VeWallView *wv)
 		glEnd();		
 	 }
 		
+	  if (car[i] == NULL)   // did not load
+	    continue;
 
 	  glPushMatrix();
 
@@ -273,28 +283,28 @@ static void display(VeWindow *w, long tm, VeWallView *wv)
    	  glScalef(cars[i].t.s, cars[i].t.s, cars[i].t.s);
 
 	  glRotatef(cars[i].t.rz, 0.0f, 0.0f, 1.0f);
-          //glRotatef(cars[i].t.rz, 0.0f, 0.0f, car[i].center_z);
+          //glRotatef(cars[i].t.rz, 0.0f, 0.0f, car[i]->center_z);
 	  //glRotatef(cars[i].t.rz, z_rotate_vector[0], z_rotate_vector[1], z_rotate_vector[2]);
 
 	  glRotatef(cars[i].t.ry, 0.0f, 1.0f, 0.0f);
-	  //glRotatef(cars[i].t.ry, 0.0f, car[i].center_y, 0.0f);
+	  //glRotatef(cars[i].t.ry, 0.0f, car[i]->center_y, 0.0f);
    	  //glRotatef(cars[i].t.ry, y_rotate_vector[0], y_rotate_vector[1], y_rotate_vector[2]);
 	
 	  glRotatef(cars[i].t.rx, 1.0f, 0.0f, 0.0f);
-	  //glRotatef(cars[i].t.rx, car[i].center_x, 0.0f, 0.0f); 
+	  //glRotatef(cars[i].t.rx, car[i]->center_x, 0.0f, 0.0f); 
 	  //glRotatef(cars[i].t.rx, x_rotate_vector[0], x_rotate_vector[1], x_rotate_vector[2]);
 	
 
-	  glScalef(car[i].scale, car[i].scale, car[i].scale);
+	  glScalef(car[i]->scale, car[i]->scale, car[i]->scale);
 
  	  //?
- 	  //glTranslatef(-car[i].center_x,-car[i].center_y,-car[i].center_z);	  	  
-	  Render3DS(&car[i]); 
+ 	  //glTranslatef(-car[i]->center_x,-car[i]->center_y,-car[i]->center_z);	  	  
+	  Render3DS(car[i]); 
 	  
 	  glPopMatrix();
 	}
 
-	//Render3DS(&light);
+	//Render3DS(light);
 }
 
 static int exitcback(VeDeviceEvent *e, void *arg) {
@@ -428,10 +438,17 @@ static int stop(VeDeviceEvent *e, void *arg) {
 
 int main(int argc, char **argv)
 {
+  int c;
+
   veInit(&argc, argv);
 
   veSetOption("depth", "1");
 
+  /* start loading the models while everything else starts up */
+  for (c=0; c<NUM_CARS; c++)
+    Prefetch3DS(cars[c].dir, cars[c].model);
+  Prefetch3DS("cars", "fan object.3ds");
+
 
   veRenderSetupCback(setupwin);
   veRenderCback(display);